@@ -6,6 +6,19 @@
  */
 
 #include "fs-utils.h"
+#include "event-log.h"
+#include "metrics.h"
+#include "cgroup-io.h"
+#include "outbox.h"
+#include "job-nodes.h"
+
+#include <fcntl.h>
+#include <sys/wait.h>
+
+/*
+ * Shared with fs-utils.c:
+ */
+const char* __auto_tmpdir_fs_get_hostname(void);
 
 /*
  * All spank plugins must define this macro for the SLURM plugin loader.
@@ -22,6 +35,26 @@ static auto_tmpdir_fs_options_t     auto_tmpdir_options = 0;
  */
 static auto_tmpdir_fs_ref           auto_tmpdir_fs_info = NULL;
 
+/*
+ * Archive file requested by --archive-tmpdir:
+ */
+static const char                   *auto_tmpdir_archive_path = NULL;
+
+/*
+ * Minutes to retain the hierarchy for a follow-on job (--tmpdir-handoff):
+ */
+static uint32_t                     auto_tmpdir_handoff_minutes = 0;
+
+/*
+ * Inodes the job expects to create (--tmp-inodes):
+ */
+static uint64_t                     auto_tmpdir_tmp_inodes = 0;
+
+/*
+ * The state_dir, opened before the step's bind mounts could hide it:
+ */
+static int                          auto_tmpdir_state_dir_fd = -1;
+
 /*
  * Which job step should cleanup?
  */
@@ -44,6 +77,87 @@ static int _opt_no_rm_tmpdir(
     return ESPANK_SUCCESS;
 }
 
+/*
+ * @function _opt_archive_tmpdir
+ *
+ * Parse the --archive-tmpdir option.
+ *
+ */
+static int _opt_archive_tmpdir(
+    int         val,
+    const char  *optarg,
+    int         remote
+)
+{
+    if ( ! optarg || (*optarg != '/') ) {
+        slurm_error("auto_tmpdir:  --archive-tmpdir requires an absolute path");
+        return ESPANK_BAD_ARG;
+    }
+    if ( auto_tmpdir_archive_path ) free((void*)auto_tmpdir_archive_path);
+    auto_tmpdir_archive_path = strdup(optarg);
+    if ( ! auto_tmpdir_archive_path ) return ESPANK_ERROR;
+    slurm_verbose("auto_tmpdir:  will archive temporary directories to `%s`", auto_tmpdir_archive_path);
+    return ESPANK_SUCCESS;
+}
+
+/*
+ * @function _opt_tmpdir_handoff
+ *
+ * Parse the --tmpdir-handoff option.
+ *
+ */
+static int _opt_tmpdir_handoff(
+    int         val,
+    const char  *optarg,
+    int         remote
+)
+{
+    char            *end;
+    unsigned long   minutes;
+
+    if ( ! optarg || ! *optarg ) {
+        slurm_error("auto_tmpdir:  --tmpdir-handoff requires a number of minutes");
+        return ESPANK_BAD_ARG;
+    }
+    minutes = strtoul(optarg, &end, 10);
+    if ( *end || (minutes > UINT32_MAX / 60) ) {
+        slurm_error("auto_tmpdir:  invalid --tmpdir-handoff value: %s", optarg);
+        return ESPANK_BAD_ARG;
+    }
+    auto_tmpdir_handoff_minutes = minutes;
+    slurm_verbose("auto_tmpdir:  will retain temporary directories for %lu minutes for a follow-on job", minutes);
+    return ESPANK_SUCCESS;
+}
+
+/*
+ * @function _opt_tmp_inodes
+ *
+ * Parse the --tmp-inodes option.
+ *
+ */
+static int _opt_tmp_inodes(
+    int         val,
+    const char  *optarg,
+    int         remote
+)
+{
+    char                *end;
+    unsigned long long  inodes;
+
+    if ( ! optarg || ! *optarg ) {
+        slurm_error("auto_tmpdir:  --tmp-inodes requires a number of inodes");
+        return ESPANK_BAD_ARG;
+    }
+    inodes = strtoull(optarg, &end, 10);
+    if ( *end ) {
+        slurm_error("auto_tmpdir:  invalid --tmp-inodes value: %s", optarg);
+        return ESPANK_BAD_ARG;
+    }
+    auto_tmpdir_tmp_inodes = inodes;
+    slurm_verbose("auto_tmpdir:  job expects to create %llu inodes in temporary directories", inodes);
+    return ESPANK_SUCCESS;
+}
+
 #ifdef AUTO_TMPDIR_ENABLE_SHARED_TMPDIR
 /*
  * @function _opt_use_shared_tmpdir
@@ -76,6 +190,239 @@ static int _opt_use_shared_tmpdir(
 }
 #endif
 
+/*
+ * @function _auto_tmpdir_has_arg
+ *
+ * Returns non-zero if a plugstack argument starts with the given prefix.
+ *
+ */
+static int _auto_tmpdir_has_arg(
+    int         argc,
+    char        *argv[],
+    const char  *prefix
+)
+{
+    size_t      prefix_len = strlen(prefix);
+
+    while ( argc-- > 0 ) {
+        if ( strncmp(argv[argc], prefix, prefix_len) == 0 ) return 1;
+    }
+    return 0;
+}
+
+/*
+ * @function _auto_tmpdir_job_is_requeued
+ *
+ * Ask slurmctld whether the job is being requeued rather than ending for
+ * good.  A preempted job is only counted once it is requeued (under
+ * PreemptMode=CANCEL the JOB_PREEMPTED state is final).
+ *
+ */
+static int _auto_tmpdir_job_is_requeued(
+    spank_t     spank_ctxt
+)
+{
+    uint32_t        job_id;
+    job_info_msg_t  *job_info = NULL;
+    int             is_requeued = 0;
+
+    if ( spank_get_item(spank_ctxt, S_JOB_ID, &job_id) != ESPANK_SUCCESS ) return 0;
+    if ( slurm_load_job(&job_info, job_id, SHOW_DETAIL) != SLURM_SUCCESS ) {
+        slurm_info("auto_tmpdir:  unable to load job info for %u to check for requeue", job_id);
+        return 0;
+    }
+    if ( job_info->record_count > 0 ) {
+        uint32_t    job_state = job_info->job_array[0].job_state;
+
+        if ( (job_state & (JOB_REQUEUE | JOB_REQUEUE_HOLD)) ) is_requeued = 1;
+        switch ( job_state & JOB_STATE_BASE ) {
+            case JOB_PENDING:
+                is_requeued = 1;
+                break;
+        }
+        slurm_debug("auto_tmpdir:  job %u state %#x, requeued = %d", job_id, job_state, is_requeued);
+    }
+    slurm_free_job_info_msg(job_info);
+    return is_requeued;
+}
+
+/*
+ * @function _auto_tmpdir_sweep
+ *
+ * Fork a detached process that removes orphaned hierarchies at idle I/O
+ * priority, so slurmd startup doesn't wait on it.
+ *
+ */
+static void _auto_tmpdir_sweep(
+    int         argc,
+    char        *argv[]
+)
+{
+    pid_t       child_pid = fork();
+
+    if ( child_pid < 0 ) {
+        slurm_error("auto_tmpdir::_auto_tmpdir_sweep: unable to fork (%m)");
+        return;
+    }
+    if ( child_pid == 0 ) {
+        job_info_msg_t  *job_info = NULL;
+        auto_tmpdir_job_nodes_t job_nodes;
+        int             n_swept;
+
+        setsid();
+        if ( fork() != 0 ) _exit(0);
+        auto_tmpdir_fs_set_idle_priority();
+
+        /* Without the job list nothing can be known to be orphaned: */
+        if ( slurm_load_jobs(0, &job_info, SHOW_ALL) != SLURM_SUCCESS ) {
+            slurm_error("auto_tmpdir::_auto_tmpdir_sweep: unable to load job info, not sweeping");
+            _exit(1);
+        }
+        auto_tmpdir_job_nodes_init(&job_nodes, argc, argv, job_info);
+        n_swept = auto_tmpdir_fs_sweep_orphans(argc, argv, auto_tmpdir_job_nodes_is_active, &job_nodes);
+        if ( n_swept > 0 ) slurm_info("auto_tmpdir::_auto_tmpdir_sweep: removed %d orphaned hierarchies", n_swept);
+        auto_tmpdir_job_nodes_fini(&job_nodes);
+        slurm_free_job_info_msg(job_info);
+        _exit(0);
+    }
+    waitpid(child_pid, NULL, 0);
+}
+
+/*
+ * @function _auto_tmpdir_job_attrs
+ *
+ * Ask slurmctld for the properties policy rules and the admission check are
+ * matched against, including the job's per-node tmp request (--tmp) in MB.
+ * The strings in attrs point into the returned job info, which the caller
+ * must release with slurm_free_job_info_msg().  If the job info cannot be
+ * loaded, attrs is left zeroed and NULL is returned.
+ *
+ */
+static job_info_msg_t* _auto_tmpdir_job_attrs(
+    spank_t                     spank_ctxt,
+    auto_tmpdir_fs_job_attrs_t  *attrs
+)
+{
+    uint32_t        job_id;
+    job_info_msg_t  *job_info = NULL;
+
+    memset(attrs, 0, sizeof(*attrs));
+    if ( spank_get_item(spank_ctxt, S_JOB_ID, &job_id) != ESPANK_SUCCESS ) return NULL;
+    if ( slurm_load_job(&job_info, job_id, SHOW_DETAIL) != SLURM_SUCCESS ) {
+        slurm_info("auto_tmpdir:  unable to load job info for %u to check its tmp request and policy", job_id);
+        return NULL;
+    }
+    if ( job_info->record_count > 0 ) {
+        slurm_job_info_t    *job = &job_info->job_array[0];
+
+        attrs->partition = job->partition;
+        attrs->qos = job->qos;
+        attrs->account = job->account;
+        attrs->n_nodes = job->num_nodes;
+        attrs->n_cpus = job->num_cpus;
+        if ( job->job_resrcs ) {
+            /* The prolog is run with the node's name in SLURMD_NODENAME: */
+            const char      *node_name = getenv("SLURMD_NODENAME");
+            int             node_cpus = slurm_job_cpus_allocated_on_node(job->job_resrcs, node_name ? node_name : __auto_tmpdir_fs_get_hostname());
+
+            if ( node_cpus > 0 ) attrs->node_cpus = node_cpus;
+        }
+        attrs->tmp_mb = job->pn_min_tmp_disk;
+        if ( job->pn_min_memory & MEM_PER_CPU ) {
+            uint32_t        n_nodes = job->num_nodes ? job->num_nodes : 1;
+
+            attrs->mem_mb = (job->pn_min_memory & ~MEM_PER_CPU) * ((job->num_cpus + n_nodes - 1) / n_nodes);
+        } else {
+            attrs->mem_mb = job->pn_min_memory;
+        }
+        slurm_debug("auto_tmpdir:  job %u partition=%s qos=%s account=%s nodes=%u cpus=%u (%u here) mem=%llu MB tmp=%llu MB", job_id,
+                attrs->partition ? attrs->partition : "", attrs->qos ? attrs->qos : "", attrs->account ? attrs->account : "",
+                attrs->n_nodes, attrs->n_cpus, attrs->node_cpus, (unsigned long long)attrs->mem_mb, (unsigned long long)attrs->tmp_mb);
+    }
+    return job_info;
+}
+
+/*
+ * @function _auto_tmpdir_update_metrics
+ *
+ * If metrics=<path> is configured, sample the node's state and fold the
+ * sample -- and the latency of the prolog/epilog that started at start --
+ * into the Prometheus textfile.
+ *
+ */
+static void _auto_tmpdir_update_metrics(
+    int                     argc,
+    char                    *argv[],
+    int                     phase,
+    struct timespec         *start
+)
+{
+    const char              *prom_path = auto_tmpdir_metrics_path(argc, argv);
+    auto_tmpdir_metrics_t   sample;
+    struct timespec         end;
+
+    if ( ! prom_path ) return;
+    memset(&sample, 0, sizeof(sample));
+    auto_tmpdir_fs_metrics_gauges(argc, argv, &sample);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    sample.phase = phase;
+    sample.duration = (end.tv_sec - start->tv_sec) + 1e-9 * (end.tv_nsec - start->tv_nsec);
+    auto_tmpdir_metrics_update(prom_path, &sample);
+}
+
+/*
+ * @function _auto_tmpdir_prolog_setup
+ *
+ * Create the job's hierarchy (using the arguments chosen by any policy rule)
+ * and serialize it to the state file, along with the job's CPU count on the
+ * node (for scaling I/O limits).  The admission reservation is released
+ * if that fails.  With outbox, the drainer for the job's outbox is started.
+ *
+ */
+static int _auto_tmpdir_prolog_setup(
+    spank_t         spank_ctxt,
+    int             argc,
+    char            *argv[],
+    int             policy_argc,
+    char            **policy_argv,
+    const char      *policy_name,
+    uint64_t        granted_mb,
+    uint32_t        job_cpus
+)
+{
+    int             rc = ESPANK_SUCCESS;
+
+    auto_tmpdir_fs_info = auto_tmpdir_fs_init(spank_ctxt, policy_argc, policy_argv, auto_tmpdir_options);
+    if ( auto_tmpdir_fs_info ) {
+        auto_tmpdir_fs_set_handoff(auto_tmpdir_fs_info, auto_tmpdir_handoff_minutes);
+        auto_tmpdir_fs_set_granted_mb(auto_tmpdir_fs_info, granted_mb);
+        auto_tmpdir_fs_set_job_cpus(auto_tmpdir_fs_info, job_cpus);
+    }
+
+    if ( ! auto_tmpdir_fs_info ) {
+        slurm_error("auto_tmpdir::_auto_tmpdir_prolog_setup: failure to create fs info");
+        rc = ESPANK_ERROR;
+    }
+    else if ( policy_name && (auto_tmpdir_fs_set_policy_name(auto_tmpdir_fs_info, policy_name) != 0) ) {
+        slurm_error("auto_tmpdir::_auto_tmpdir_prolog_setup: failure to set policy name");
+        rc = ESPANK_ERROR;
+    }
+    else if ( auto_tmpdir_archive_path && (auto_tmpdir_fs_set_archive_path(auto_tmpdir_fs_info, auto_tmpdir_archive_path) != 0) ) {
+        slurm_error("auto_tmpdir::_auto_tmpdir_prolog_setup: failure to set archive path");
+        rc = ESPANK_ERROR;
+    }
+    else if ( auto_tmpdir_fs_serialize_to_file(auto_tmpdir_fs_info, spank_ctxt, argc, argv, NULL) != 0 ) {
+        slurm_error("auto_tmpdir::_auto_tmpdir_prolog_setup: failure to serialize fs info");
+        rc = ESPANK_ERROR;
+    }
+    else if ( auto_tmpdir_outbox_is_configured(argc, argv) && (auto_tmpdir_outbox_start(argc, argv, auto_tmpdir_fs_info) != 0) ) {
+        /* The epilog still drains whatever the job leaves in the outbox: */
+        slurm_error("auto_tmpdir::_auto_tmpdir_prolog_setup: failure to start outbox drainer");
+    }
+    if ( rc != ESPANK_SUCCESS ) auto_tmpdir_fs_admit_release(spank_ctxt, argc, argv);
+    return rc;
+}
+
 /*
  * Options available to this spank plugin:
  */
@@ -85,6 +432,18 @@ struct spank_option spank_options[] =
             "Do not automatically remove temporary directories for the job/steps.",
             0, 0, (spank_opt_cb_f) _opt_no_rm_tmpdir },
 
+        { "archive-tmpdir", "<path>",
+            "At job end, write the job's temporary directories to a single zstd-compressed tar file at <path> before they are removed.",
+            1, 0, (spank_opt_cb_f) _opt_archive_tmpdir },
+
+        { "tmpdir-handoff", "<minutes>",
+            "At job end, keep the job's node-local temporary directories for <minutes> so that your next job on the node adopts them.",
+            1, 0, (spank_opt_cb_f) _opt_tmpdir_handoff },
+
+        { "tmp-inodes", "<count>",
+            "The number of files and directories the job expects to create in its temporary directories, checked against the node's free inodes when the job starts.",
+            1, 0, (spank_opt_cb_f) _opt_tmp_inodes },
+
 #ifdef AUTO_TMPDIR_ENABLE_SHARED_TMPDIR
         { "use-shared-tmpdir", NULL,
             "Create temporary directories on shared storage.  Use \"--use-shared-tmpdir=per-node\" to create unique sub-directories for each node allocated to the job (e.g. <base><job-id>/<nodename>).",
@@ -136,6 +495,15 @@ slurm_spank_init(
             if ( spank_getenv(spank_ctxt, "SLURM_SPANK__SLURM_SPANK_OPTION_auto_tmpdir_no_rm_tmpdir", v, sizeof(v)) == ESPANK_SUCCESS ) {
                 rc = _opt_no_rm_tmpdir(0, v, 1);
             }
+            if ( (rc == ESPANK_SUCCESS) && (spank_getenv(spank_ctxt, "SLURM_SPANK__SLURM_SPANK_OPTION_auto_tmpdir_archive_tmpdir", v, sizeof(v)) == ESPANK_SUCCESS) ) {
+                rc = _opt_archive_tmpdir(0, v, 1);
+            }
+            if ( (rc == ESPANK_SUCCESS) && (spank_getenv(spank_ctxt, "SLURM_SPANK__SLURM_SPANK_OPTION_auto_tmpdir_tmpdir_handoff", v, sizeof(v)) == ESPANK_SUCCESS) ) {
+                rc = _opt_tmpdir_handoff(0, v, 1);
+            }
+            if ( (rc == ESPANK_SUCCESS) && (spank_getenv(spank_ctxt, "SLURM_SPANK__SLURM_SPANK_OPTION_auto_tmpdir_tmp_inodes", v, sizeof(v)) == ESPANK_SUCCESS) ) {
+                rc = _opt_tmp_inodes(0, v, 1);
+            }
 #ifdef AUTO_TMPDIR_ENABLE_SHARED_TMPDIR
             if ( (rc == ESPANK_SUCCESS) && (spank_getenv(spank_ctxt, "SLURM_SPANK__SLURM_SPANK_OPTION_auto_tmpdir_use_shared_tmpdir", v, sizeof(v)) == ESPANK_SUCCESS) ) {
                 rc = _opt_use_shared_tmpdir(0, v, 1);
@@ -149,6 +517,26 @@ slurm_spank_init(
 }
 
 
+/*
+ * @function slurm_spank_slurmd_init
+ *
+ * When slurmd starts, sweep away the hierarchies of jobs that never got an
+ * epilog (the node crashed or slurmd was killed) if the sweep directive is
+ * present, and fill the node's pool of pre-formatted zram devices.
+ */
+int
+slurm_spank_slurmd_init(
+    spank_t         spank_ctxt,
+    int             argc,
+    char            *argv[]
+)
+{
+    if ( _auto_tmpdir_has_arg(argc, argv, "sweep") ) _auto_tmpdir_sweep(argc, argv);
+    auto_tmpdir_fs_zram_pool_refill(argc, argv);
+    return ESPANK_SUCCESS;
+}
+
+
 /*
  * @function slurm_spank_job_prolog
  *
@@ -158,6 +546,22 @@ slurm_spank_init(
  *
  * If we're able to create the hierarchy, let's serialize it to a file so we can
  * reconstitute in the job step and later in the epilog context.
+ *
+ * With admission control enabled, the job's tmp request is first checked
+ * against the node's scratch; a job that cannot be accommodated is refused
+ * here rather than failing later with ENOSPC.
+ *
+ * With policy rules, the first rule matching the job's partition, QOS,
+ * account, and size picks the prefix, backend, and size limits used to
+ * create the hierarchy; the state file carries the result (and the rule's
+ * name) to the steps and epilog.
+ *
+ * With async_prolog, the checks above still happen here but the hierarchy
+ * is created by a detached worker so the prolog returns at once; the steps
+ * wait for the worker's state file to appear.
+ *
+ * With ipc_namespace, the job's private IPC namespace is created (and pinned
+ * for the steps to join) here, too.
  */
 int
 slurm_spank_job_prolog(
@@ -170,16 +574,96 @@ slurm_spank_job_prolog(
 
     /* We only want to run in the job_script context: */
     if ( spank_context() == S_CTX_JOB_SCRIPT ) {
-        auto_tmpdir_fs_info = auto_tmpdir_fs_init(spank_ctxt, argc, argv, auto_tmpdir_options);
+        struct timespec             start;
+        uint64_t                    granted_mb = 0;
+        int                         trim_lock_fd;
+        auto_tmpdir_fs_job_attrs_t  job_attrs;
+        job_info_msg_t              *job_info = NULL;
+        int                         policy_argc;
+        char                        **policy_argv;
+        const char                  *policy_name;
+        uint32_t                    job_cpus = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        trim_lock_fd = auto_tmpdir_fs_trim_prolog_enter(argc, argv);
+        auto_tmpdir_event_log_open(spank_ctxt, argc, argv, "prolog");
+        memset(&job_attrs, 0, sizeof(job_attrs));
+        if ( _auto_tmpdir_has_arg(argc, argv, "admission") || _auto_tmpdir_has_arg(argc, argv, "policy=") || auto_tmpdir_cgroup_io_is_configured(argc, argv) ) {
+            job_info = _auto_tmpdir_job_attrs(spank_ctxt, &job_attrs);
+        }
+        if ( job_attrs.node_cpus ) job_cpus = job_attrs.node_cpus;
+        else if ( job_attrs.n_nodes ) job_cpus = (job_attrs.n_cpus + job_attrs.n_nodes - 1) / job_attrs.n_nodes;
 
-        if ( ! auto_tmpdir_fs_info ) {
-            slurm_error("auto_tmpdir::slurm_spank_job_prolog: failure to create fs info");
+        /* A matching policy rule's settings are passed on as extra arguments: */
+        if ( auto_tmpdir_fs_policy_select(argc, argv, &job_attrs, &policy_argc, &policy_argv, &policy_name) < 0 ) {
+            slurm_error("auto_tmpdir::slurm_spank_job_prolog: invalid policy in plugstack configuration");
+            rc = ESPANK_ERROR;
+        }
+        else if ( _auto_tmpdir_has_arg(argc, argv, "admission")
+                && (auto_tmpdir_fs_admit(spank_ctxt, policy_argc, policy_argv, &auto_tmpdir_options, job_attrs.tmp_mb, auto_tmpdir_tmp_inodes, &granted_mb) != 0) ) {
+            slurm_error("auto_tmpdir::slurm_spank_job_prolog: job refused by scratch admission check");
             rc = ESPANK_ERROR;
         }
-        else if ( auto_tmpdir_fs_serialize_to_file(auto_tmpdir_fs_info, spank_ctxt, argc, argv, NULL) != 0 ) {
-            slurm_error("auto_tmpdir::slurm_spank_job_prolog: failure to serialize fs info");
+        else if ( _auto_tmpdir_has_arg(argc, argv, "ipc_namespace") && (auto_tmpdir_fs_ipc_namespace_create(spank_ctxt, argc, argv) != 0) ) {
+            slurm_error("auto_tmpdir::slurm_spank_job_prolog: failure to create IPC namespace");
+            auto_tmpdir_fs_admit_release(spank_ctxt, argc, argv);
             rc = ESPANK_ERROR;
         }
+        if ( rc != ESPANK_SUCCESS ) {
+            if ( policy_argv != argv ) free((void*)policy_argv);
+            if ( job_info ) slurm_free_job_info_msg(job_info);
+            _auto_tmpdir_update_metrics(argc, argv, auto_tmpdir_metrics_phase_prolog, &start);
+            auto_tmpdir_event_log_close();
+            auto_tmpdir_fs_trim_prolog_exit(trim_lock_fd);
+            return rc;
+        }
+        /*
+         * With async_prolog the hierarchy is created by a detached worker and the
+         * steps wait for its state file; if the worker can't be started, do it here:
+         */
+        if ( _auto_tmpdir_has_arg(argc, argv, "async_prolog") ) {
+            pid_t       child_pid;
+            int         worker_lock_fd;
+
+            auto_tmpdir_fs_async_clear(spank_ctxt, argc, argv);
+            worker_lock_fd = auto_tmpdir_fs_async_begin(spank_ctxt, argc, argv);
+            if ( (child_pid = fork()) == 0 ) {
+                setsid();
+                if ( fork() != 0 ) _exit(0);
+                if ( _auto_tmpdir_prolog_setup(spank_ctxt, argc, argv, policy_argc, policy_argv, policy_name, granted_mb, job_cpus) != ESPANK_SUCCESS ) {
+                    auto_tmpdir_fs_async_mark_failed(spank_ctxt, argc, argv);
+                }
+                auto_tmpdir_fs_reap_retained(argc, argv);
+                auto_tmpdir_fs_zram_pool_refill(argc, argv);
+                auto_tmpdir_event_log_close();
+                auto_tmpdir_fs_trim_prolog_exit(trim_lock_fd);
+                _exit(0);
+            }
+            /* Only the worker holds the lock from here on: */
+            if ( worker_lock_fd >= 0 ) close(worker_lock_fd);
+            if ( child_pid > 0 ) {
+                waitpid(child_pid, NULL, 0);
+                if ( policy_argv != argv ) free((void*)policy_argv);
+                if ( job_info ) slurm_free_job_info_msg(job_info);
+                /* The worker still holds the prolog lock, so this only updates the ledger: */
+                auto_tmpdir_fs_trim_prolog_exit(trim_lock_fd);
+                auto_tmpdir_fs_trim(argc, argv);
+                _auto_tmpdir_update_metrics(argc, argv, auto_tmpdir_metrics_phase_prolog, &start);
+                auto_tmpdir_event_log_close();
+                return ESPANK_SUCCESS;
+            }
+            slurm_error("auto_tmpdir::slurm_spank_job_prolog: unable to fork setup worker (%m), creating directories synchronously");
+        }
+        rc = _auto_tmpdir_prolog_setup(spank_ctxt, argc, argv, policy_argc, policy_argv, policy_name, granted_mb, job_cpus);
+        if ( policy_argv != argv ) free((void*)policy_argv);
+        if ( job_info ) slurm_free_job_info_msg(job_info);
+        auto_tmpdir_fs_reap_retained(argc, argv);
+        auto_tmpdir_fs_zram_pool_refill(argc, argv);
+        /* Our own prolog lock would always defer the trim: */
+        auto_tmpdir_fs_trim_prolog_exit(trim_lock_fd);
+        auto_tmpdir_fs_trim(argc, argv);
+        _auto_tmpdir_update_metrics(argc, argv, auto_tmpdir_metrics_phase_prolog, &start);
+        auto_tmpdir_event_log_close();
     }
     return rc;
 }
@@ -189,7 +673,16 @@ slurm_spank_job_prolog(
  *
  * At this point we're in a slurmstepd just prior to transitioning to the user
  * credentials.  Now's the right time to pull the cached bind-mount hierarchy
- * back off disk and do all the bind mounts.
+ * back off disk and do all the bind mounts (first waiting for an asynchronous
+ * prolog's worker to write it).  With per_step_tmpdir, the step's
+ * own subdirectories are created here, too, as are all of the per-task
+ * directories with per_task_tmpdir.  The size granted by the prolog admission
+ * check is exported as AUTO_TMPDIR_GRANTED_MB and the policy rule chosen in
+ * the prolog as AUTO_TMPDIR_POLICY.  With ipc_namespace, the step joins the
+ * job's IPC namespace before any of its tasks are started.  Any io_* limits
+ * are set on the job's cgroup for the device under its hierarchy.  With
+ * outbox, the outbox directory and its destination are exported as
+ * AUTO_TMPDIR_OUTBOX and AUTO_TMPDIR_OUTBOX_DEST.
  */
 int
 slurm_spank_init_post_opt(
@@ -202,26 +695,161 @@ slurm_spank_init_post_opt(
 
     /* We only want to run in the remote context: */
     if ( spank_remote(spank_ctxt) ) {
+        auto_tmpdir_event_log_open(spank_ctxt, argc, argv, "step");
+        if ( _auto_tmpdir_has_arg(argc, argv, "async_prolog") && (auto_tmpdir_fs_async_wait(spank_ctxt, argc, argv) != 0) ) {
+            slurm_error("auto_tmpdir::slurm_spank_init_post_opt: job directories are not ready");
+            auto_tmpdir_event_log_close();
+            return ESPANK_ERROR;
+        }
+        if ( _auto_tmpdir_has_arg(argc, argv, "ipc_namespace") && (auto_tmpdir_fs_ipc_namespace_enter(spank_ctxt, argc, argv) != 0) ) {
+            slurm_error("auto_tmpdir::slurm_spank_init_post_opt: unable to join the job's IPC namespace");
+            auto_tmpdir_event_log_close();
+            return ESPANK_ERROR;
+        }
         auto_tmpdir_fs_info = auto_tmpdir_fs_init_with_file(spank_ctxt, argc, argv, auto_tmpdir_options, NULL, 0);
+        if ( auto_tmpdir_cgroup_io_is_configured(argc, argv) && auto_tmpdir_fs_get_state_dir(argc, argv) ) {
+            auto_tmpdir_state_dir_fd = open(auto_tmpdir_fs_get_state_dir(argc, argv), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        }
 
         rc = ESPANK_ERROR;
-        if ( auto_tmpdir_fs_info && (auto_tmpdir_fs_bind_mount(auto_tmpdir_fs_info) == 0) ) {
+        if ( auto_tmpdir_fs_info && (auto_tmpdir_fs_bind_mount(auto_tmpdir_fs_info) == 0)
+                && (auto_tmpdir_fs_create_step_dirs(auto_tmpdir_fs_info, spank_ctxt) == 0)
+                && (auto_tmpdir_fs_create_task_dirs(auto_tmpdir_fs_info, spank_ctxt) == 0) ) {
             const char      *tmpdir = auto_tmpdir_fs_get_tmpdir(auto_tmpdir_fs_info);
 
             if ( ! tmpdir || ((rc = spank_setenv(spank_ctxt, "TMPDIR", tmpdir, strlen(tmpdir))) != ESPANK_SUCCESS) ) {
                 slurm_error("auto_tmpdir::slurm_spank_init_post_opt: setenv(TMPDIR, \"/tmp\") failed (%m)");
             }
+            else {
+                const char  *policy_name = auto_tmpdir_fs_get_policy_name(auto_tmpdir_fs_info);
+
+                if ( auto_tmpdir_fs_get_granted_mb(auto_tmpdir_fs_info) > 0 ) {
+                    char        granted[24];
+
+                    snprintf(granted, sizeof(granted), "%llu", (unsigned long long)auto_tmpdir_fs_get_granted_mb(auto_tmpdir_fs_info));
+                    if ( (rc = spank_setenv(spank_ctxt, "AUTO_TMPDIR_GRANTED_MB", granted, 1)) != ESPANK_SUCCESS ) {
+                        slurm_error("auto_tmpdir::slurm_spank_init_post_opt: setenv(AUTO_TMPDIR_GRANTED_MB, \"%s\") failed (%m)", granted);
+                    }
+                }
+                if ( (rc == ESPANK_SUCCESS) && policy_name
+                        && ((rc = spank_setenv(spank_ctxt, "AUTO_TMPDIR_POLICY", policy_name, 1)) != ESPANK_SUCCESS) ) {
+                    slurm_error("auto_tmpdir::slurm_spank_init_post_opt: setenv(AUTO_TMPDIR_POLICY, \"%s\") failed (%m)", policy_name);
+                }
+                if ( (rc == ESPANK_SUCCESS) && auto_tmpdir_outbox_is_configured(argc, argv) ) {
+                    const char  *outbox_path = auto_tmpdir_outbox_get_path(auto_tmpdir_fs_info);
+                    const char  *dest_path = auto_tmpdir_outbox_get_dest(argc, argv, auto_tmpdir_fs_get_job_id(auto_tmpdir_fs_info));
+
+                    if ( outbox_path && dest_path ) {
+                        if ( (rc = spank_setenv(spank_ctxt, "AUTO_TMPDIR_OUTBOX", outbox_path, 1)) != ESPANK_SUCCESS ) {
+                            slurm_error("auto_tmpdir::slurm_spank_init_post_opt: setenv(AUTO_TMPDIR_OUTBOX, \"%s\") failed (%m)", outbox_path);
+                        }
+                        else if ( (rc = spank_setenv(spank_ctxt, "AUTO_TMPDIR_OUTBOX_DEST", dest_path, 1)) != ESPANK_SUCCESS ) {
+                            slurm_error("auto_tmpdir::slurm_spank_init_post_opt: setenv(AUTO_TMPDIR_OUTBOX_DEST, \"%s\") failed (%m)", dest_path);
+                        }
+                    }
+                    if ( outbox_path ) free((void*)outbox_path);
+                    if ( dest_path ) free((void*)dest_path);
+                }
+                /*
+                 * The base directory is hidden beneath the bind mounts by now, but TMPDIR
+                 * is on the same device.  A job without I/O limits is better than no job:
+                 */
+                if ( (rc == ESPANK_SUCCESS) && auto_tmpdir_fs_get_base_dir(auto_tmpdir_fs_info)
+                        && (auto_tmpdir_cgroup_io_apply(argc, argv, tmpdir, auto_tmpdir_fs_get_job_id(auto_tmpdir_fs_info), auto_tmpdir_fs_get_job_cpus(auto_tmpdir_fs_info)) != 0) ) {
+                    slurm_error("auto_tmpdir::slurm_spank_init_post_opt: unable to set the job's I/O limits");
+                }
+            }
+        }
+    }
+    return rc;
+}
+
+
+/*
+ * @function slurm_spank_task_init
+ *
+ * Runs in each task just before it execs the user's program.  With
+ * per_task_tmpdir, point the task's TMPDIR at its own directory (created
+ * already in slurm_spank_init_post_opt).
+ */
+int
+slurm_spank_task_init(
+    spank_t         spank_ctxt,
+    int             argc,
+    char            *argv[]
+)
+{
+    int             rc = ESPANK_SUCCESS;
+
+    if ( spank_remote(spank_ctxt) && auto_tmpdir_fs_info ) {
+        int         task_id;
+        char        task_tmpdir[PATH_MAX];
+
+        if ( (spank_get_item(spank_ctxt, S_TASK_ID, &task_id) == ESPANK_SUCCESS)
+                && (auto_tmpdir_fs_get_task_tmpdir(auto_tmpdir_fs_info, (uint32_t)task_id, task_tmpdir, sizeof(task_tmpdir)) == 0) ) {
+            if ( (rc = spank_setenv(spank_ctxt, "TMPDIR", task_tmpdir, 1)) != ESPANK_SUCCESS ) {
+                slurm_error("auto_tmpdir::slurm_spank_task_init: setenv(TMPDIR, \"%s\") failed (%m)", task_tmpdir);
+            }
         }
     }
     return rc;
 }
 
 
+/*
+ * @function slurm_spank_exit
+ *
+ * Once the step's tasks have exited, remove its per-step subdirectories (if
+ * any) so that a long allocation running many steps doesn't accumulate their
+ * scratch files until the epilog.  The job cgroup's I/O counters for the
+ * scratch device are saved for the epilog to report, while the cgroup still
+ * exists.
+ */
+int
+slurm_spank_exit(
+    spank_t         spank_ctxt,
+    int             argc,
+    char            *argv[]
+)
+{
+    int             rc = ESPANK_SUCCESS;
+
+    if ( spank_remote(spank_ctxt) && auto_tmpdir_fs_info ) {
+        if ( (auto_tmpdir_state_dir_fd >= 0) && auto_tmpdir_fs_get_base_dir(auto_tmpdir_fs_info) ) {
+            auto_tmpdir_cgroup_io_snapshot(argc, argv, auto_tmpdir_state_dir_fd, auto_tmpdir_fs_get_tmpdir(auto_tmpdir_fs_info), auto_tmpdir_fs_get_job_id(auto_tmpdir_fs_info));
+        }
+        if ( auto_tmpdir_fs_remove_step_dirs(auto_tmpdir_fs_info) != 0 ) {
+            slurm_error("auto_tmpdir::slurm_spank_exit: failure removing per-step directories");
+            rc = ESPANK_ERROR;
+        }
+        auto_tmpdir_event_log_close();
+    }
+    return rc;
+}
+
+
 /*
  * @function slurm_spank_job_epilog
  *
  * In the epilog we pull the cached bind-mount hierarchy back off disk and
- * destroy all the directories we created.
+ * destroy all the directories we created.  If an archive was requested, the
+ * hierarchy is written to it first; the tree is only kept if that fails.
+ *
+ * If the job is being requeued and retention is configured, the hierarchy is
+ * kept for the job's restart instead.
+ *
+ * The space freed is added to the node's trim ledger, which may start a
+ * background FITRIM of the local scratch filesystem.
+ *
+ * The I/O the job did on its scratch device (io_* directives) is reported
+ * from the snapshot its last step left behind.
+ *
+ * With outbox, the drainer is stopped and the rest of the outbox is copied
+ * to its destination before anything is retained, archived, or removed; if
+ * that fails the hierarchy is kept.
+ *
+ * The job's IPC namespace (ipc_namespace) is unpinned so that the kernel
+ * reclaims its objects once the job's last process is gone.
  */
 int
 slurm_spank_job_epilog(
@@ -233,12 +861,57 @@ slurm_spank_job_epilog(
     int             rc = ESPANK_SUCCESS;
     
     if ( spank_context() == S_CTX_JOB_SCRIPT ) {
+        int             archive_rc = 0;
+        struct timespec start;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        auto_tmpdir_event_log_open(spank_ctxt, argc, argv, "epilog");
+        if ( _auto_tmpdir_has_arg(argc, argv, "ipc_namespace") ) auto_tmpdir_fs_ipc_namespace_release(spank_ctxt, argc, argv);
+        if ( _auto_tmpdir_has_arg(argc, argv, "async_prolog") ) {
+            /* A job cancelled early may end before its setup worker does: */
+            int         async_rc = auto_tmpdir_fs_async_wait(spank_ctxt, argc, argv);
+
+            auto_tmpdir_fs_async_clear(spank_ctxt, argc, argv);
+            if ( async_rc == EIO ) {
+                /* The worker already cleaned up after itself, there's nothing to remove: */
+                auto_tmpdir_fs_admit_release(spank_ctxt, argc, argv);
+                _auto_tmpdir_update_metrics(argc, argv, auto_tmpdir_metrics_phase_epilog, &start);
+                auto_tmpdir_event_log_close();
+                return ESPANK_SUCCESS;
+            }
+        }
+        auto_tmpdir_fs_admit_release(spank_ctxt, argc, argv);
         auto_tmpdir_fs_info = auto_tmpdir_fs_init_with_file(spank_ctxt, argc, argv, auto_tmpdir_options, NULL, 1);
+        if ( auto_tmpdir_fs_info && auto_tmpdir_cgroup_io_is_configured(argc, argv) ) {
+            auto_tmpdir_cgroup_io_report(argc, argv, auto_tmpdir_fs_get_job_id(auto_tmpdir_fs_info), auto_tmpdir_fs_get_owner(auto_tmpdir_fs_info));
+        }
+        if ( auto_tmpdir_fs_info && auto_tmpdir_outbox_is_configured(argc, argv) ) {
+            auto_tmpdir_outbox_flush(argc, argv, auto_tmpdir_fs_info);
+        }
+        if ( auto_tmpdir_fs_info && _auto_tmpdir_has_arg(argc, argv, "requeue_retain_minutes=") && _auto_tmpdir_job_is_requeued(spank_ctxt) ) {
+            if ( auto_tmpdir_fs_retain(auto_tmpdir_fs_info, spank_ctxt, argc, argv) == 0 ) {
+                auto_tmpdir_fs_info = NULL;
+                auto_tmpdir_fs_reap_retained(argc, argv);
+                auto_tmpdir_fs_trim(argc, argv);
+                _auto_tmpdir_update_metrics(argc, argv, auto_tmpdir_metrics_phase_epilog, &start);
+                auto_tmpdir_event_log_close();
+                return ESPANK_SUCCESS;
+            }
+        }
+        if ( auto_tmpdir_fs_info ) {
+            archive_rc = auto_tmpdir_fs_archive(auto_tmpdir_fs_info);
+            auto_tmpdir_fs_record_kept(auto_tmpdir_fs_info, spank_ctxt, argc, argv);
+        }
         
         rc = ESPANK_ERROR;
-        if ( auto_tmpdir_fs_info && (auto_tmpdir_fs_fini(auto_tmpdir_fs_info, 0) == 0) ) {
+        if ( auto_tmpdir_fs_info && (auto_tmpdir_fs_fini(auto_tmpdir_fs_info, 0) == 0) && (archive_rc == 0) ) {
             rc = ESPANK_SUCCESS;
         }
+        auto_tmpdir_fs_reap_retained(argc, argv);
+        auto_tmpdir_fs_zram_pool_refill(argc, argv);
+        auto_tmpdir_fs_trim(argc, argv);
+        _auto_tmpdir_update_metrics(argc, argv, auto_tmpdir_metrics_phase_epilog, &start);
+        auto_tmpdir_event_log_close();
     }
     return rc;
 }
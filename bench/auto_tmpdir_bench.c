@@ -0,0 +1,439 @@
+/*
+ * auto_tmpdir_bench.c
+ *
+ * Drive the fs-utils prolog/step/epilog sequence against synthetic job
+ * trees outside of Slurm and report per-phase latency.
+ *
+ * Must be run as root; all mounts are made in a private mount namespace
+ * that disappears with the process.
+ *
+ */
+
+#include "fs-utils.h"
+#include "spank-shim.h"
+#include "bench-util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/**/
+
+/*
+ * The phases timed for each simulated job.  The prolog runs init and
+ * serialize; the step (a forked child, as slurmstepd would be) runs
+ * deserialize, bind_mount, and populates the synthetic tree; the epilog
+ * runs deserialize and fini.
+ */
+enum {
+    bench_phase_init = 0,
+    bench_phase_serialize,
+    bench_phase_step_deserialize,
+    bench_phase_bind_mount,
+    bench_phase_populate,
+    bench_phase_epilog_deserialize,
+    bench_phase_fini,
+    bench_phase_max
+};
+
+static const char *bench_phase_names[bench_phase_max] = {
+                "init", "serialize", "step_deserialize", "bind_mount", "populate", "epilog_deserialize", "fini"
+            };
+
+/*
+ * Phases that handle the synthetic tree also report files/sec:
+ */
+static const int bench_phase_has_rate[bench_phase_max] = { 0, 0, 0, 0, 1, 0, 1 };
+
+typedef struct bench_sample {
+    int                 rc;
+    double              seconds[bench_phase_max];
+    uint64_t            n_entries;
+} bench_sample_t;
+
+/**/
+
+/*
+ * @function bench_step
+ *
+ * The job step:  in a forked child, reconstitute the fs state, enter the
+ * bind-mounted namespace, and populate the benchmark's mountpoint.  The
+ * child's timings come back over a pipe.
+ */
+static int
+bench_step(
+    int                 argc,
+    char                *argv[],
+    const char          *mountpoint,
+    bench_tree_t        *tree,
+    bench_sample_t      *sample
+)
+{
+    int                 pipe_fds[2], status;
+    pid_t               child;
+
+    if ( pipe(pipe_fds) != 0 ) return -1;
+    if ( (child = fork()) < 0 ) {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return -1;
+    }
+    if ( child == 0 ) {
+        auto_tmpdir_fs_ref  fs_info;
+        double              t0, t1;
+        int64_t             n_created;
+
+        close(pipe_fds[0]);
+        sample->rc = -1;
+        t0 = bench_now();
+        fs_info = auto_tmpdir_fs_init_with_file(NULL, argc, argv, 0, NULL, 0);
+        t1 = bench_now();
+        sample->seconds[bench_phase_step_deserialize] = t1 - t0;
+        if ( fs_info ) {
+            t0 = bench_now();
+            if ( auto_tmpdir_fs_bind_mount(fs_info) == 0 ) {
+                t1 = bench_now();
+                sample->seconds[bench_phase_bind_mount] = t1 - t0;
+
+                t0 = bench_now();
+                n_created = bench_populate(mountpoint, tree);
+                t1 = bench_now();
+                sample->seconds[bench_phase_populate] = t1 - t0;
+                if ( n_created >= 0 ) {
+                    sample->n_entries = n_created;
+                    sample->rc = 0;
+                }
+            }
+            auto_tmpdir_fs_fini(fs_info, 1);
+        }
+        if ( write(pipe_fds[1], sample, sizeof(*sample)) != sizeof(*sample) ) _exit(1);
+        _exit(0);
+    }
+    close(pipe_fds[1]);
+    if ( read(pipe_fds[0], sample, sizeof(*sample)) != sizeof(*sample) ) sample->rc = -1;
+    close(pipe_fds[0]);
+    waitpid(child, &status, 0);
+    return sample->rc;
+}
+
+/**/
+
+/*
+ * @function bench_job
+ *
+ * One simulated job from prolog through epilog.
+ */
+static int
+bench_job(
+    int                 argc,
+    char                *argv[],
+    const char          *mountpoint,
+    bench_tree_t        *tree,
+    bench_sample_t      *sample
+)
+{
+    auto_tmpdir_fs_ref  fs_info;
+    double              t0, t1;
+    int                 rc = 0;
+
+    memset(sample, 0, sizeof(*sample));
+
+    /* Prolog: */
+    t0 = bench_now();
+    fs_info = auto_tmpdir_fs_init(NULL, argc, argv, 0);
+    t1 = bench_now();
+    sample->seconds[bench_phase_init] = t1 - t0;
+    if ( ! fs_info ) return -1;
+    t0 = bench_now();
+    rc = auto_tmpdir_fs_serialize_to_file(fs_info, NULL, argc, argv, NULL);
+    t1 = bench_now();
+    sample->seconds[bench_phase_serialize] = t1 - t0;
+    auto_tmpdir_fs_fini(fs_info, 1);
+    if ( rc != 0 ) return -1;
+
+    /* Step: */
+    if ( bench_step(argc, argv, mountpoint, tree, sample) != 0 ) rc = -1;
+
+    /* Epilog (always run, so a failed step doesn't leave anything behind): */
+    t0 = bench_now();
+    fs_info = auto_tmpdir_fs_init_with_file(NULL, argc, argv, 0, NULL, 1);
+    t1 = bench_now();
+    sample->seconds[bench_phase_epilog_deserialize] = t1 - t0;
+    if ( ! fs_info ) return -1;
+    t0 = bench_now();
+    if ( auto_tmpdir_fs_fini(fs_info, 0) != 0 ) rc = -1;
+    t1 = bench_now();
+    sample->seconds[bench_phase_fini] = t1 - t0;
+    return rc;
+}
+
+/**/
+
+static void
+bench_report(
+    const char          *backend,
+    bench_sample_t      *samples,
+    int                 n_samples
+)
+{
+    double              values[n_samples];
+    int                 phase, i;
+
+    for ( phase = 0; phase < bench_phase_max; phase++ ) {
+        double          total = 0.0;
+        uint64_t        n_entries = 0;
+
+        for ( i = 0; i < n_samples; i++ ) {
+            values[i] = samples[i].seconds[phase];
+            total += values[i];
+            n_entries += samples[i].n_entries;
+        }
+        qsort(values, n_samples, sizeof(double), bench_cmp_double);
+        printf("%-8s %-20s %6d %12.3f %12.3f %12.3f", backend, bench_phase_names[phase], n_samples,
+                1e3 * bench_percentile(values, n_samples, 50),
+                1e3 * bench_percentile(values, n_samples, 99),
+                1e3 * total / n_samples
+            );
+        if ( bench_phase_has_rate[phase] && (total > 0.0) ) {
+            printf(" %12.0f", n_entries / total);
+        } else {
+            printf(" %12s", "-");
+        }
+        printf("\n");
+    }
+}
+
+/**/
+
+static void
+bench_usage(
+    const char          *exe
+)
+{
+    printf(
+            "usage:\n\n"
+            "  %s {options} {-- <plugstack arguments>}\n\n"
+            " options:\n\n"
+            "  -h/--help                  show this information\n"
+            "  -v/--verbose               show plugin messages (repeat for debug)\n"
+            "  -n/--iterations <N>        jobs to simulate per backend (default: 20)\n"
+            "  -f/--files <N>             files in each synthetic tree (default: 1000)\n"
+            "  -s/--size <min>:<max>      file size range, log-uniform; K/M/G suffixes\n"
+            "                             allowed (default: 0:64K)\n"
+            "  -d/--depth <N>             directory levels below TMPDIR (default: 2)\n"
+            "  -F/--fanout <N>            subdirectories per directory (default: 8)\n"
+            "  -C/--compressible          write zero-filled rather than random file content\n"
+            "  -r/--seed <N>              random seed for file sizes and content\n"
+            "  -b/--backends <list>       comma-separated list of backends to run: dir,zram\n"
+            "                             (default: dir)\n"
+            "  -z/--zram-size <size>      zram device size (default: 1G)\n"
+            "  -w/--work-dir <path>       directory under which job directories are created\n"
+            "                             (default: /tmp)\n"
+            "  -u/--owner <uid>:<gid>     job owner (default: 0:0)\n"
+            "  -j/--job-id <N>            first job id (default: 1000000)\n"
+            "\n"
+            " Plugstack arguments (e.g. per_step_tmpdir, event_log) are passed to\n"
+            " every call; local_prefix, state_dir, mount, and zram_size are provided\n"
+            " by the benchmark.\n"
+            "\n",
+            exe
+        );
+}
+
+static struct option bench_options[] = {
+                { "help",           no_argument,        NULL, 'h' },
+                { "verbose",        no_argument,        NULL, 'v' },
+                { "iterations",     required_argument,  NULL, 'n' },
+                { "files",          required_argument,  NULL, 'f' },
+                { "size",           required_argument,  NULL, 's' },
+                { "depth",          required_argument,  NULL, 'd' },
+                { "fanout",         required_argument,  NULL, 'F' },
+                { "compressible",   no_argument,        NULL, 'C' },
+                { "seed",           required_argument,  NULL, 'r' },
+                { "backends",       required_argument,  NULL, 'b' },
+                { "zram-size",      required_argument,  NULL, 'z' },
+                { "work-dir",       required_argument,  NULL, 'w' },
+                { "owner",          required_argument,  NULL, 'u' },
+                { "job-id",         required_argument,  NULL, 'j' },
+                { NULL,             0,                  NULL, 0 }
+            };
+
+int
+main(
+    int                 argc,
+    char                *argv[]
+)
+{
+    bench_tree_t        tree = { .n_files = 1000, .min_size = 0, .max_size = 65536, .depth = 2, .fanout = 8, .is_compressible = 0, .seed = 0 };
+    int                 n_iterations = 20, opt, rc = 0;
+    const char          *backends = "dir", *work_parent = "/tmp";
+    uint64_t            zram_size = 1ULL << 30;
+    uint32_t            first_job_id = 1000000;
+    char                work_dir[PATH_MAX], *end;
+
+    while ( (opt = getopt_long(argc, argv, "hvn:f:s:d:F:Cr:b:z:w:u:j:", bench_options, NULL)) != -1 ) {
+        switch ( opt ) {
+            case 'h':
+                bench_usage(argv[0]);
+                return 0;
+            case 'v':
+                auto_tmpdir_spank_shim.verbosity++;
+                break;
+            case 'n':
+                n_iterations = strtol(optarg, &end, 10);
+                if ( (end == optarg) || (n_iterations < 1) ) {
+                    fprintf(stderr, "ERROR:  invalid iteration count: %s\n", optarg);
+                    return EINVAL;
+                }
+                break;
+            case 'f':
+                tree.n_files = strtoull(optarg, &end, 10);
+                if ( end == optarg ) {
+                    fprintf(stderr, "ERROR:  invalid file count: %s\n", optarg);
+                    return EINVAL;
+                }
+                break;
+            case 's':
+                if ( (bench_parse_size(optarg, &end, &tree.min_size) != 0) || (*end != ':')
+                        || (bench_parse_size(end + 1, &end, &tree.max_size) != 0) || *end
+                        || (tree.max_size < tree.min_size) ) {
+                    fprintf(stderr, "ERROR:  invalid size range: %s\n", optarg);
+                    return EINVAL;
+                }
+                break;
+            case 'd':
+                tree.depth = strtol(optarg, &end, 10);
+                if ( (end == optarg) || (tree.depth < 0) ) {
+                    fprintf(stderr, "ERROR:  invalid depth: %s\n", optarg);
+                    return EINVAL;
+                }
+                break;
+            case 'F':
+                tree.fanout = strtol(optarg, &end, 10);
+                if ( (end == optarg) || (tree.fanout < 1) ) {
+                    fprintf(stderr, "ERROR:  invalid fanout: %s\n", optarg);
+                    return EINVAL;
+                }
+                break;
+            case 'C':
+                tree.is_compressible = 1;
+                break;
+            case 'r':
+                tree.seed = strtoull(optarg, NULL, 0);
+                break;
+            case 'b':
+                backends = optarg;
+                break;
+            case 'z':
+                if ( (bench_parse_size(optarg, &end, &zram_size) != 0) || *end || ! zram_size ) {
+                    fprintf(stderr, "ERROR:  invalid zram size: %s\n", optarg);
+                    return EINVAL;
+                }
+                break;
+            case 'w':
+                work_parent = optarg;
+                break;
+            case 'u': {
+                unsigned long   u, g;
+
+                if ( sscanf(optarg, "%lu:%lu", &u, &g) != 2 ) {
+                    fprintf(stderr, "ERROR:  invalid owner: %s\n", optarg);
+                    return EINVAL;
+                }
+                auto_tmpdir_spank_shim.u_owner = u;
+                auto_tmpdir_spank_shim.g_owner = g;
+                break;
+            }
+            case 'j':
+                first_job_id = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                bench_usage(argv[0]);
+                return EINVAL;
+        }
+    }
+
+    if ( geteuid() != 0 ) {
+        fprintf(stderr, "ERROR:  must be run as root\n");
+        return EPERM;
+    }
+
+    /*
+     * Everything happens in a private mount namespace, so nothing the
+     * plugin mounts is visible outside this process:
+     */
+    if ( (rc = bench_private_namespace()) != 0 ) return rc;
+
+    snprintf(work_dir, sizeof(work_dir), "%s/auto_tmpdir_bench.XXXXXX", work_parent);
+    if ( ! mkdtemp(work_dir) ) {
+        fprintf(stderr, "ERROR:  unable to create work directory under `%s` (%s)\n", work_parent, strerror(errno));
+        return errno;
+    }
+
+    printf("# %llu files, %llu-%llu bytes, depth %d, fanout %d, %s content\n",
+            (unsigned long long)tree.n_files, (unsigned long long)tree.min_size, (unsigned long long)tree.max_size,
+            tree.depth, tree.fanout, tree.is_compressible ? "zero-filled" : "random"
+        );
+    printf("%-8s %-20s %6s %12s %12s %12s %12s\n", "backend", "phase", "n", "p50 (ms)", "p99 (ms)", "mean (ms)", "entries/s");
+
+    while ( *backends ) {
+        size_t          backend_len = strcspn(backends, ",");
+        char            backend[32], mountpoint[PATH_MAX], state_dir[PATH_MAX];
+        char            local_prefix_arg[PATH_MAX], state_dir_arg[PATH_MAX], mount_arg[PATH_MAX], zram_size_arg[64];
+        char            *job_argv[argc - optind + 4];
+        int             job_argc = 0, i, n_ok = 0;
+        bench_sample_t  *samples;
+
+        snprintf(backend, sizeof(backend), "%.*s", (int)backend_len, backends);
+        backends += backend_len + (backends[backend_len] == ',');
+        if ( strcmp(backend, "dir") && strcmp(backend, "zram") ) {
+            fprintf(stderr, "ERROR:  unknown backend `%s`\n", backend);
+            rc = EINVAL;
+            continue;
+        }
+
+        if ( (snprintf(mountpoint, sizeof(mountpoint), "%s/%s", work_dir, backend) >= sizeof(mountpoint))
+                || (snprintf(state_dir, sizeof(state_dir), "%s/%s.state", work_dir, backend) >= sizeof(state_dir))
+                || (snprintf(local_prefix_arg, sizeof(local_prefix_arg), "local_prefix=%s/%s.job-", work_dir, backend) >= sizeof(local_prefix_arg))
+                || (snprintf(state_dir_arg, sizeof(state_dir_arg), "state_dir=%s", state_dir) >= sizeof(state_dir_arg))
+                || (snprintf(mount_arg, sizeof(mount_arg), "mount=%s%s", mountpoint, strcmp(backend, "zram") ? "" : ",backend=zram") >= sizeof(mount_arg)) ) {
+            fprintf(stderr, "ERROR:  work directory path `%s` is too long\n", work_dir);
+            rc = ENAMETOOLONG;
+            break;
+        }
+        if ( (mkdir(mountpoint, 0755) != 0) || (mkdir(state_dir, 0700) != 0) ) {
+            fprintf(stderr, "ERROR:  unable to create directories under `%s` (%s)\n", work_dir, strerror(errno));
+            rc = errno;
+            break;
+        }
+        snprintf(zram_size_arg, sizeof(zram_size_arg), "zram_size=%llu", (unsigned long long)zram_size);
+        job_argv[job_argc++] = local_prefix_arg;
+        job_argv[job_argc++] = state_dir_arg;
+        job_argv[job_argc++] = mount_arg;
+        if ( strcmp(backend, "zram") == 0 ) job_argv[job_argc++] = zram_size_arg;
+        for ( i = optind; i < argc; i++ ) job_argv[job_argc++] = argv[i];
+
+        if ( ! (samples = calloc(n_iterations, sizeof(bench_sample_t))) ) {
+            rc = ENOMEM;
+            break;
+        }
+        for ( i = 0; i < n_iterations; i++ ) {
+            auto_tmpdir_spank_shim.job_id = first_job_id++;
+            if ( bench_job(job_argc, job_argv, mountpoint, &tree, &samples[n_ok]) == 0 ) {
+                n_ok++;
+            } else {
+                fprintf(stderr, "WARNING:  %s job %u failed\n", backend, auto_tmpdir_spank_shim.job_id);
+                rc = 1;
+            }
+        }
+        if ( n_ok ) bench_report(backend, samples, n_ok);
+        free(samples);
+    }
+
+    auto_tmpdir_rmdir_recurse(work_dir, 0);
+    return rc;
+}
@@ -0,0 +1,539 @@
+/*
+ * auto_tmpdir_soak.c
+ *
+ * Concurrency soak test:  many simulated jobs on one node cycling through
+ * prolog, several concurrent steps, and epilog against fs-utils at the
+ * same time.  Reports tail latency per phase, errors, and any job
+ * directories, /dev/shm directories, or state files left behind.
+ *
+ * Must be run as root; all mounts are made in a private mount namespace
+ * that disappears with the process.
+ *
+ */
+
+#include "fs-utils.h"
+#include "spank-shim.h"
+#include "bench-util.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/**/
+
+/*
+ * The phases timed for each simulated job cycle.  step_start covers what
+ * slurmstepd does before launching tasks (deserialize, bind-mount, step
+ * directories); step_end what it does after (step directory removal).
+ */
+enum {
+    soak_phase_prolog = 0,
+    soak_phase_step_start,
+    soak_phase_step_end,
+    soak_phase_epilog,
+    soak_phase_max
+};
+
+static const char *soak_phase_names[soak_phase_max] = { "prolog", "step_start", "step_end", "epilog" };
+
+/*
+ * One timed phase; records live in a shared mapping so every worker and
+ * step process can fill-in its own slots:
+ */
+enum {
+    soak_record_unused = 0,
+    soak_record_ok,
+    soak_record_error
+};
+
+typedef struct soak_record {
+    int                 phase;
+    int                 status;
+    double              seconds;
+} soak_record_t;
+
+typedef struct soak_config {
+    int                 n_jobs, n_cycles, n_steps;
+    bench_tree_t        tree;
+    uint32_t            first_job_id;
+    uid_t               first_uid;
+    const char          *mountpoint;
+    int                 argc;
+    char                **argv;
+    soak_record_t       *records;
+} soak_config_t;
+
+#define SOAK_RECORDS_PER_CYCLE(C)   (2 + 2 * (C)->n_steps)
+
+/**/
+
+static soak_record_t*
+soak_record_slot(
+    soak_config_t       *config,
+    int                 job,
+    int                 cycle
+)
+{
+    return config->records + ((size_t)job * config->n_cycles + cycle) * SOAK_RECORDS_PER_CYCLE(config);
+}
+
+static void
+soak_record(
+    soak_record_t       *record,
+    int                 phase,
+    int                 is_ok,
+    double              t0
+)
+{
+    record->seconds = bench_now() - t0;
+    record->phase = phase;
+    record->status = is_ok ? soak_record_ok : soak_record_error;
+}
+
+/**/
+
+/*
+ * @function soak_step
+ *
+ * One job step, in its own process:  set up as slurmstepd would, run a
+ * "task" as the job owner that writes a small tree under TMPDIR, then tear
+ * down the step.
+ */
+static void
+soak_step(
+    soak_config_t       *config,
+    soak_record_t       *records
+)
+{
+    auto_tmpdir_fs_ref  fs_info;
+    double              t0 = bench_now();
+    int                 is_ok = 0;
+
+    fs_info = auto_tmpdir_fs_init_with_file(NULL, config->argc, config->argv, 0, NULL, 0);
+    if ( fs_info ) {
+        is_ok = (auto_tmpdir_fs_bind_mount(fs_info) == 0) && (auto_tmpdir_fs_create_step_dirs(fs_info, NULL) == 0);
+    }
+    soak_record(&records[0], soak_phase_step_start, is_ok, t0);
+    if ( ! fs_info ) _exit(1);
+
+    if ( is_ok ) {
+        pid_t           task = fork();
+
+        if ( task == 0 ) {
+            char        task_dir[PATH_MAX];
+
+            /* Steps of a job share TMPDIR unless per_step_tmpdir is on, so each writes into its own directory: */
+            snprintf(task_dir, sizeof(task_dir), "%s/soak-step-%u", auto_tmpdir_fs_get_tmpdir(fs_info), auto_tmpdir_spank_shim.step_id);
+            if ( (setgid(auto_tmpdir_spank_shim.g_owner) != 0) || (setuid(auto_tmpdir_spank_shim.u_owner) != 0) ) _exit(1);
+            if ( mkdir(task_dir, 0700) != 0 ) {
+                fprintf(stderr, "ERROR:  unable to create directory `%s` (%s)\n", task_dir, strerror(errno));
+                _exit(1);
+            }
+            _exit( (bench_populate(task_dir, &config->tree) < 0) ? 1 : 0 );
+        }
+        if ( task > 0 ) {
+            int         status;
+
+            waitpid(task, &status, 0);
+            if ( ! WIFEXITED(status) || WEXITSTATUS(status) ) {
+                fprintf(stderr, "WARNING:  task of job %u step %u failed\n", auto_tmpdir_spank_shim.job_id, auto_tmpdir_spank_shim.step_id);
+                is_ok = 0;
+            }
+        } else {
+            is_ok = 0;
+        }
+    }
+
+    t0 = bench_now();
+    soak_record(&records[1], soak_phase_step_end, (auto_tmpdir_fs_remove_step_dirs(fs_info) == 0), t0);
+    auto_tmpdir_fs_fini(fs_info, 1);
+    _exit(is_ok ? 0 : 1);
+}
+
+/**/
+
+/*
+ * @function soak_worker
+ *
+ * One simulated job slot on the node:  waits at the start barrier, then runs
+ * n_cycles jobs back-to-back, each with a distinct job id and all owned by the
+ * slot's uid.
+ */
+static void
+soak_worker(
+    soak_config_t       *config,
+    int                 job,
+    int                 barrier_fd
+)
+{
+    char                c;
+    int                 cycle;
+
+    auto_tmpdir_spank_shim.u_owner = config->first_uid + job;
+    auto_tmpdir_spank_shim.g_owner = config->first_uid + job;
+
+    /* Every worker starts at the same moment: */
+    while ( read(barrier_fd, &c, 1) > 0 );
+    close(barrier_fd);
+
+    for ( cycle = 0; cycle < config->n_cycles; cycle++ ) {
+        soak_record_t       *records = soak_record_slot(config, job, cycle);
+        auto_tmpdir_fs_ref  fs_info;
+        double              t0;
+        int                 step, is_ok;
+
+        auto_tmpdir_spank_shim.job_id = config->first_job_id + cycle * config->n_jobs + job;
+
+        /* Prolog: */
+        t0 = bench_now();
+        fs_info = auto_tmpdir_fs_init(NULL, config->argc, config->argv, 0);
+        is_ok = (fs_info != NULL);
+        if ( fs_info ) {
+            if ( auto_tmpdir_fs_serialize_to_file(fs_info, NULL, config->argc, config->argv, NULL) != 0 ) is_ok = 0;
+            auto_tmpdir_fs_fini(fs_info, ! is_ok ? 0 : 1);
+        }
+        soak_record(&records[0], soak_phase_prolog, is_ok, t0);
+        if ( ! is_ok ) continue;
+
+        /* Steps, all at once: */
+        for ( step = 0; step < config->n_steps; step++ ) {
+            pid_t           child;
+
+            auto_tmpdir_spank_shim.step_id = step;
+            if ( (child = fork()) == 0 ) soak_step(config, records + 1 + 2 * step);
+            if ( child < 0 ) records[1 + 2 * step].status = soak_record_error;
+        }
+        while ( wait(NULL) > 0 );
+
+        /* Epilog: */
+        t0 = bench_now();
+        fs_info = auto_tmpdir_fs_init_with_file(NULL, config->argc, config->argv, 0, NULL, 1);
+        is_ok = (fs_info != NULL);
+        if ( fs_info && (auto_tmpdir_fs_fini(fs_info, 0) != 0) ) is_ok = 0;
+        soak_record(&records[1 + 2 * config->n_steps], soak_phase_epilog, is_ok, t0);
+    }
+    _exit(0);
+}
+
+/**/
+
+/*
+ * @function soak_report
+ *
+ * Print latency percentiles and error counts per phase.
+ */
+static void
+soak_report(
+    soak_config_t       *config
+)
+{
+    size_t              n_records = (size_t)config->n_jobs * config->n_cycles * SOAK_RECORDS_PER_CYCLE(config);
+    double              *values = malloc(n_records * sizeof(double));
+    int                 phase;
+
+    if ( ! values ) return;
+    printf("%-12s %8s %8s %10s %10s %10s %10s %10s\n", "phase", "n", "errors", "p50 (ms)", "p90 (ms)", "p99 (ms)", "p99.9 (ms)", "max (ms)");
+    for ( phase = 0; phase < soak_phase_max; phase++ ) {
+        size_t          i;
+        int             n = 0, n_errors = 0;
+
+        for ( i = 0; i < n_records; i++ ) {
+            if ( (config->records[i].status == soak_record_unused) || (config->records[i].phase != phase) ) continue;
+            if ( config->records[i].status == soak_record_error ) n_errors++;
+            values[n++] = config->records[i].seconds;
+        }
+        if ( n == 0 ) {
+            printf("%-12s %8d %8d\n", soak_phase_names[phase], n, n_errors);
+            continue;
+        }
+        qsort(values, n, sizeof(double), bench_cmp_double);
+        printf("%-12s %8d %8d %10.3f %10.3f %10.3f %10.3f %10.3f\n", soak_phase_names[phase], n, n_errors,
+                1e3 * bench_percentile(values, n, 50),
+                1e3 * bench_percentile(values, n, 90),
+                1e3 * bench_percentile(values, n, 99),
+                1e3 * bench_percentile(values, n, 99.9),
+                1e3 * values[n - 1]
+            );
+    }
+    free(values);
+}
+
+/**/
+
+/*
+ * @function soak_leak_scan
+ *
+ * Count (and unless should_keep, remove) entries of dir_path whose names
+ * start with name_prefix.  If job ids are given, only entries named
+ * <name_prefix><job-id> with a job id in [first_job_id, last_job_id] count,
+ * so unrelated jobs' directories on a live node are ignored.
+ */
+static int
+soak_leak_scan(
+    const char          *what,
+    const char          *dir_path,
+    const char          *name_prefix,
+    uint32_t            first_job_id,
+    uint32_t            last_job_id,
+    int                 should_keep
+)
+{
+    size_t              name_prefix_len = strlen(name_prefix);
+    DIR                 *dir = opendir(dir_path);
+    struct dirent       *dent;
+    int                 n_leaked = 0;
+
+    if ( ! dir ) return 0;
+    while ( (dent = readdir(dir)) ) {
+        char            path[PATH_MAX];
+        struct stat     finfo;
+
+        if ( ! strcmp(dent->d_name, ".") || ! strcmp(dent->d_name, "..") ) continue;
+        if ( strncmp(dent->d_name, name_prefix, name_prefix_len) ) continue;
+        if ( first_job_id || last_job_id ) {
+            char            *end;
+            unsigned long   job_id = strtoul(dent->d_name + name_prefix_len, &end, 10);
+
+            if ( *end || (job_id < first_job_id) || (job_id > last_job_id) ) continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", dir_path, dent->d_name);
+        if ( n_leaked++ < 10 ) printf("LEAKED %s:  %s\n", what, path);
+        if ( ! should_keep ) {
+            if ( (lstat(path, &finfo) == 0) && S_ISDIR(finfo.st_mode) ) {
+                auto_tmpdir_rmdir_recurse(path, 0);
+            } else {
+                unlink(path);
+            }
+        }
+    }
+    closedir(dir);
+    return n_leaked;
+}
+
+/**/
+
+static void
+soak_usage(
+    const char          *exe
+)
+{
+    printf(
+            "usage:\n\n"
+            "  %s {options} {-- <plugstack arguments>}\n\n"
+            " options:\n\n"
+            "  -h/--help                  show this information\n"
+            "  -v/--verbose               show plugin messages (repeat for debug)\n"
+            "  -j/--jobs <N>              concurrent jobs (default: 100)\n"
+            "  -c/--cycles <N>            jobs run back-to-back in each slot (default: 5)\n"
+            "  -s/--steps <N>             concurrent steps per job (default: 4)\n"
+            "  -f/--files <N>             files written by each step (default: 50)\n"
+            "  -z/--max-size <size>       largest file written; K/M/G suffixes allowed\n"
+            "                             (default: 4K)\n"
+            "  -u/--uid <N>               uid (and gid) of the first job slot; each slot\n"
+            "                             gets its own (default: 100000)\n"
+            "  -J/--job-id <N>            first job id (default: 2000000)\n"
+            "  -w/--work-dir <path>       directory under which job directories are created\n"
+            "                             (default: /tmp)\n"
+            "  -k/--keep-leaks            do not remove leaked directories and state files\n"
+            "\n"
+            " Plugstack arguments (e.g. per_step_tmpdir, per_task_tmpdir) are passed to\n"
+            " every call; local_prefix, state_dir, mount, and tmpdir are provided by the\n"
+            " soak test.  Exits non-zero if any phase failed or anything leaked.\n"
+            "\n",
+            exe
+        );
+}
+
+static struct option soak_options[] = {
+                { "help",           no_argument,        NULL, 'h' },
+                { "verbose",        no_argument,        NULL, 'v' },
+                { "jobs",           required_argument,  NULL, 'j' },
+                { "cycles",         required_argument,  NULL, 'c' },
+                { "steps",          required_argument,  NULL, 's' },
+                { "files",          required_argument,  NULL, 'f' },
+                { "max-size",       required_argument,  NULL, 'z' },
+                { "uid",            required_argument,  NULL, 'u' },
+                { "job-id",         required_argument,  NULL, 'J' },
+                { "work-dir",       required_argument,  NULL, 'w' },
+                { "keep-leaks",     no_argument,        NULL, 'k' },
+                { NULL,             0,                  NULL, 0 }
+            };
+
+int
+main(
+    int                 argc,
+    char                *argv[]
+)
+{
+    soak_config_t       config = {
+                                .n_jobs = 100, .n_cycles = 5, .n_steps = 4,
+                                .tree = { .n_files = 50, .min_size = 0, .max_size = 4096, .depth = 0, .fanout = 1, .is_compressible = 0, .seed = 0 },
+                                .first_job_id = 2000000, .first_uid = 100000
+                            };
+    const char          *work_parent = "/tmp";
+    char                work_dir[PATH_MAX], mountpoint[PATH_MAX], state_dir[PATH_MAX], *end;
+    char                local_prefix_arg[PATH_MAX], state_dir_arg[PATH_MAX], mount_arg[PATH_MAX], tmpdir_arg[PATH_MAX];
+    int                 opt, should_keep = 0, barrier[2], job, n_worker_failures = 0, n_errors = 0, n_leaked = 0, rc;
+    size_t              n_records, i;
+    double              t0, elapsed;
+
+    while ( (opt = getopt_long(argc, argv, "hvj:c:s:f:z:u:J:w:k", soak_options, NULL)) != -1 ) {
+        switch ( opt ) {
+            case 'h':
+                soak_usage(argv[0]);
+                return 0;
+            case 'v':
+                auto_tmpdir_spank_shim.verbosity++;
+                break;
+            case 'j':
+            case 'c':
+            case 's': {
+                long        v = strtol(optarg, &end, 10);
+
+                if ( (end == optarg) || *end || (v < ((opt == 's') ? 0 : 1)) ) {
+                    fprintf(stderr, "ERROR:  invalid count: %s\n", optarg);
+                    return EINVAL;
+                }
+                if ( opt == 'j' ) config.n_jobs = v;
+                else if ( opt == 'c' ) config.n_cycles = v;
+                else config.n_steps = v;
+                break;
+            }
+            case 'f':
+                config.tree.n_files = strtoull(optarg, &end, 10);
+                if ( (end == optarg) || *end ) {
+                    fprintf(stderr, "ERROR:  invalid file count: %s\n", optarg);
+                    return EINVAL;
+                }
+                break;
+            case 'z':
+                if ( (bench_parse_size(optarg, &end, &config.tree.max_size) != 0) || *end ) {
+                    fprintf(stderr, "ERROR:  invalid size: %s\n", optarg);
+                    return EINVAL;
+                }
+                break;
+            case 'u':
+                config.first_uid = strtoul(optarg, NULL, 10);
+                break;
+            case 'J':
+                config.first_job_id = strtoul(optarg, NULL, 10);
+                break;
+            case 'w':
+                work_parent = optarg;
+                break;
+            case 'k':
+                should_keep = 1;
+                break;
+            default:
+                soak_usage(argv[0]);
+                return EINVAL;
+        }
+    }
+
+    if ( geteuid() != 0 ) {
+        fprintf(stderr, "ERROR:  must be run as root\n");
+        return EPERM;
+    }
+    if ( (rc = bench_private_namespace()) != 0 ) return rc;
+
+    snprintf(work_dir, sizeof(work_dir), "%s/auto_tmpdir_soak.XXXXXX", work_parent);
+    if ( ! mkdtemp(work_dir) || (chmod(work_dir, 0755) != 0) ) {
+        fprintf(stderr, "ERROR:  unable to create work directory under `%s` (%s)\n", work_parent, strerror(errno));
+        return errno;
+    }
+    if ( (snprintf(mountpoint, sizeof(mountpoint), "%s/tmp", work_dir) >= sizeof(mountpoint))
+            || (snprintf(state_dir, sizeof(state_dir), "%s/state", work_dir) >= sizeof(state_dir))
+            || (snprintf(local_prefix_arg, sizeof(local_prefix_arg), "local_prefix=%s/job-", work_dir) >= sizeof(local_prefix_arg))
+            || (snprintf(state_dir_arg, sizeof(state_dir_arg), "state_dir=%s", state_dir) >= sizeof(state_dir_arg))
+            || (snprintf(mount_arg, sizeof(mount_arg), "mount=%s", mountpoint) >= sizeof(mount_arg))
+            || (snprintf(tmpdir_arg, sizeof(tmpdir_arg), "tmpdir=%s", mountpoint) >= sizeof(tmpdir_arg)) ) {
+        fprintf(stderr, "ERROR:  work directory path `%s` is too long\n", work_dir);
+        rmdir(work_dir);
+        return ENAMETOOLONG;
+    }
+    if ( (mkdir(mountpoint, 01777) != 0) || (mkdir(state_dir, 0700) != 0) ) {
+        fprintf(stderr, "ERROR:  unable to create directories under `%s` (%s)\n", work_dir, strerror(errno));
+        return errno;
+    }
+    config.mountpoint = mountpoint;
+
+    /* Plugstack arguments: */
+    if ( ! (config.argv = calloc(argc - optind + 4, sizeof(char*))) ) return ENOMEM;
+    config.argv[config.argc++] = local_prefix_arg;
+    config.argv[config.argc++] = state_dir_arg;
+    config.argv[config.argc++] = mount_arg;
+    config.argv[config.argc++] = tmpdir_arg;
+    while ( optind < argc ) config.argv[config.argc++] = argv[optind++];
+
+    n_records = (size_t)config.n_jobs * config.n_cycles * SOAK_RECORDS_PER_CYCLE(&config);
+    config.records = mmap(NULL, n_records * sizeof(soak_record_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if ( config.records == MAP_FAILED ) {
+        fprintf(stderr, "ERROR:  unable to map %zu result records (%s)\n", n_records, strerror(errno));
+        return errno;
+    }
+
+    printf("# %d jobs x %d cycles, %d steps per job, %llu files of up to %llu bytes per step\n",
+            config.n_jobs, config.n_cycles, config.n_steps,
+            (unsigned long long)config.tree.n_files, (unsigned long long)config.tree.max_size
+        );
+
+    /*
+     * Fork all the workers, then release them at once by closing the write
+     * end of the barrier pipe:
+     */
+    if ( pipe(barrier) != 0 ) return errno;
+    for ( job = 0; job < config.n_jobs; job++ ) {
+        pid_t           worker = fork();
+
+        if ( worker == 0 ) {
+            close(barrier[1]);
+            soak_worker(&config, job, barrier[0]);
+        }
+        if ( worker < 0 ) {
+            fprintf(stderr, "ERROR:  unable to fork worker %d (%s)\n", job, strerror(errno));
+            n_worker_failures++;
+        }
+    }
+    close(barrier[0]);
+    t0 = bench_now();
+    close(barrier[1]);
+    while ( 1 ) {
+        int             status;
+
+        if ( wait(&status) < 0 ) {
+            if ( errno == EINTR ) continue;
+            break;
+        }
+        if ( ! WIFEXITED(status) || WEXITSTATUS(status) ) n_worker_failures++;
+    }
+    elapsed = bench_now() - t0;
+
+    soak_report(&config);
+    for ( i = 0; i < n_records; i++ ) if ( config.records[i].status == soak_record_error ) n_errors++;
+    printf("# %d job cycles in %.3f s (%.1f jobs/s), %d worker failures\n",
+            config.n_jobs * config.n_cycles, elapsed, (config.n_jobs * config.n_cycles) / elapsed, n_worker_failures
+        );
+
+    /* Anything left behind? */
+    n_leaked += soak_leak_scan("job directory", work_dir, "job-", 0, 0, should_keep);
+    n_leaked += soak_leak_scan("state file", state_dir, "", 0, 0, should_keep);
+    n_leaked += soak_leak_scan("mountpoint content", mountpoint, "", 0, 0, should_keep);
+    if ( *AUTO_TMPDIR_DEV_SHM_PREFIX ) {
+        const char      *shm_base = strrchr(AUTO_TMPDIR_DEV_SHM_PREFIX, '/');
+        char            shm_dir[PATH_MAX];
+
+        snprintf(shm_dir, sizeof(shm_dir), "%.*s", (int)(shm_base - AUTO_TMPDIR_DEV_SHM_PREFIX), AUTO_TMPDIR_DEV_SHM_PREFIX);
+        n_leaked += soak_leak_scan("/dev/shm directory", shm_dir, shm_base + 1,
+                            config.first_job_id, config.first_job_id + config.n_jobs * config.n_cycles - 1, should_keep
+                        );
+    }
+    printf("# %d errors, %d leaked\n", n_errors, n_leaked);
+
+    if ( ! should_keep || ! n_leaked ) auto_tmpdir_rmdir_recurse(work_dir, 0);
+    return (n_errors || n_leaked || n_worker_failures) ? 1 : 0;
+}
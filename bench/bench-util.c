@@ -0,0 +1,184 @@
+/*
+ * bench-util.c
+ *
+ * Helpers shared by the benchmark and soak drivers.
+ *
+ */
+
+#include "bench-util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <sched.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+
+/**/
+
+double
+bench_now(void)
+{
+    struct timespec     t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + 1e-9 * t.tv_nsec;
+}
+
+uint64_t
+bench_xorshift(
+    uint64_t            *state
+)
+{
+    uint64_t            x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return (*state = x);
+}
+
+int
+bench_parse_size(
+    const char          *s,
+    char                **end,
+    uint64_t            *size
+)
+{
+    unsigned long long  v = strtoull(s, end, 10);
+
+    if ( *end == s ) return -1;
+    switch ( toupper(**end) ) {
+        case 'T':
+            v *= 1024;
+            /* fall through */
+        case 'G':
+            v *= 1024;
+            /* fall through */
+        case 'M':
+            v *= 1024;
+            /* fall through */
+        case 'K':
+            v *= 1024;
+            (*end)++;
+            break;
+    }
+    *size = v;
+    return 0;
+}
+
+/**/
+
+int64_t
+bench_populate(
+    const char          *root,
+    bench_tree_t        *tree
+)
+{
+    static char         buffer[65536];
+    uint64_t            rng = tree->seed ? tree->seed : 0x9e3779b97f4a7c15ULL;
+    uint64_t            n_dirs = 1, level_dirs = 1, i;
+    char                **dirs;
+    int64_t             n_created = 0;
+    double              log_min = log((double)tree->min_size + 1), log_max = log((double)tree->max_size + 1);
+
+    for ( i = 0; i < tree->depth; i++ ) {
+        level_dirs *= tree->fanout;
+        n_dirs += level_dirs;
+    }
+    if ( ! (dirs = calloc(n_dirs, sizeof(char*))) ) return -1;
+
+    /* Breadth-first, so dirs[k]'s children are at k * fanout + 1 ... */
+    dirs[0] = strdup(root);
+    for ( i = 1; i < n_dirs; i++ ) {
+        if ( asprintf(&dirs[i], "%s/d%llu", dirs[(i - 1) / tree->fanout], (unsigned long long)((i - 1) % tree->fanout)) < 0 ) {
+            dirs[i] = NULL;
+            n_created = -1;
+            goto early_exit;
+        }
+        if ( mkdir(dirs[i], 0700) != 0 ) {
+            fprintf(stderr, "ERROR:  unable to create directory `%s` (%s)\n", dirs[i], strerror(errno));
+            n_created = -1;
+            goto early_exit;
+        }
+        n_created++;
+    }
+
+    if ( ! tree->is_compressible ) {
+        for ( i = 0; i < sizeof(buffer) / sizeof(uint64_t); i++ ) ((uint64_t*)buffer)[i] = bench_xorshift(&rng);
+    }
+    for ( i = 0; i < tree->n_files; i++ ) {
+        char            path[PATH_MAX];
+        uint64_t        size = (uint64_t)exp(log_min + (log_max - log_min) * (bench_xorshift(&rng) >> 11) * (1.0 / 9007199254740992.0)) - 1;
+        int             fd;
+
+        snprintf(path, sizeof(path), "%s/f%llu", dirs[i % n_dirs], (unsigned long long)i);
+        if ( (fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600)) < 0 ) {
+            fprintf(stderr, "ERROR:  unable to create file `%s` (%s)\n", path, strerror(errno));
+            n_created = -1;
+            goto early_exit;
+        }
+        while ( size > 0 ) {
+            ssize_t     n = write(fd, buffer, (size > sizeof(buffer)) ? sizeof(buffer) : size);
+
+            if ( n <= 0 ) {
+                fprintf(stderr, "ERROR:  unable to write file `%s` (%s)\n", path, strerror(errno));
+                close(fd);
+                n_created = -1;
+                goto early_exit;
+            }
+            size -= n;
+        }
+        close(fd);
+        n_created++;
+    }
+
+early_exit:
+    for ( i = 0; i < n_dirs; i++ ) if ( dirs[i] ) free(dirs[i]);
+    free(dirs);
+    return n_created;
+}
+
+/**/
+
+int
+bench_cmp_double(
+    const void          *a,
+    const void          *b
+)
+{
+    double              da = *(const double*)a, db = *(const double*)b;
+
+    return (da < db) ? -1 : ((da > db) ? 1 : 0);
+}
+
+double
+bench_percentile(
+    double              *sorted,
+    int                 n,
+    double              pct
+)
+{
+    int                 rank = (int)ceil(pct * n / 100.0);
+
+    return sorted[(rank > 0) ? rank - 1 : 0];
+}
+
+/**/
+
+int
+bench_private_namespace(void)
+{
+    if ( unshare(CLONE_NEWNS) != 0 ) {
+        fprintf(stderr, "ERROR:  unable to create mount namespace (%s)\n", strerror(errno));
+        return errno;
+    }
+    if ( mount("none", "/", NULL, MS_REC | MS_PRIVATE, NULL) != 0 ) {
+        fprintf(stderr, "ERROR:  unable to make mounts private (%s)\n", strerror(errno));
+        return errno;
+    }
+    return 0;
+}
@@ -0,0 +1,84 @@
+/*
+ * bench-util.h
+ *
+ * Helpers shared by the benchmark and soak drivers.
+ *
+ */
+
+#ifndef __AUTO_TMPDIR_BENCH_UTIL_H__
+#define __AUTO_TMPDIR_BENCH_UTIL_H__
+
+#include "auto_tmpdir_config.h"
+
+/*
+ * @typedef bench_tree_t
+ *
+ * Shape of a synthetic job tree for bench_populate().
+ */
+typedef struct bench_tree {
+    uint64_t            n_files;
+    uint64_t            min_size, max_size;
+    int                 depth, fanout;
+    int                 is_compressible;
+    uint64_t            seed;
+} bench_tree_t;
+
+/*
+ * @function bench_now
+ *
+ * Seconds on the monotonic clock.
+ */
+double bench_now(void);
+
+/*
+ * @function bench_xorshift
+ *
+ * Next value of a xorshift64 generator; state must be non-zero.
+ */
+uint64_t bench_xorshift(uint64_t *state);
+
+/*
+ * @function bench_parse_size
+ *
+ * Parse a byte count with an optional K/M/G/T suffix; *end is left after the
+ * last character consumed.  Returns 0 on success.
+ */
+int bench_parse_size(const char *s, char **end, uint64_t *size);
+
+/*
+ * @function bench_populate
+ *
+ * Create a synthetic tree under root:  depth levels of fanout directories
+ * each, with the files spread round-robin across root and all directories.
+ * File sizes are log-uniform in [min_size, max_size]; content is random
+ * (incompressible) unless is_compressible.
+ *
+ * Returns the number of files and directories created, or -1 on error.
+ */
+int64_t bench_populate(const char *root, bench_tree_t *tree);
+
+/*
+ * @function bench_cmp_double
+ *
+ * qsort() comparator for doubles.
+ */
+int bench_cmp_double(const void *a, const void *b);
+
+/*
+ * @function bench_percentile
+ *
+ * Nearest-rank percentile (pct in [0, 100]) of n sorted samples.
+ */
+double bench_percentile(double *sorted, int n, double pct);
+
+/*
+ * @function bench_private_namespace
+ *
+ * Move the calling process into a new mount namespace with all mounts
+ * private, so nothing mounted afterwards is visible outside it.
+ *
+ * Returns 0 on success, an errno value otherwise (the error is printed).
+ */
+int bench_private_namespace(void);
+
+#endif /* __AUTO_TMPDIR_BENCH_UTIL_H__ */
@@ -0,0 +1,127 @@
+/*
+ * spank-shim.c
+ *
+ * Stand-in for the SPANK and Slurm logging API that slurmd/slurmstepd
+ * provide to the plugin, so fs-utils can be driven outside of Slurm.
+ *
+ */
+
+#include "spank-shim.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+
+/**/
+
+auto_tmpdir_spank_shim_t auto_tmpdir_spank_shim = {
+                .job_id = 1,
+                .step_id = 0,
+                .local_task_count = 1,
+                .u_owner = 0,
+                .g_owner = 0,
+                .verbosity = 0
+            };
+
+/**/
+
+spank_err_t
+spank_get_item(
+    spank_t         spank_ctxt,
+    spank_item_t    item,
+    ...
+)
+{
+    spank_err_t     rc = ESPANK_SUCCESS;
+    va_list         argv;
+
+    va_start(argv, item);
+    switch ( item ) {
+        case S_JOB_UID:
+            *va_arg(argv, uid_t*) = auto_tmpdir_spank_shim.u_owner;
+            break;
+        case S_JOB_GID:
+            *va_arg(argv, gid_t*) = auto_tmpdir_spank_shim.g_owner;
+            break;
+        case S_JOB_ID:
+            *va_arg(argv, uint32_t*) = auto_tmpdir_spank_shim.job_id;
+            break;
+        case S_JOB_STEPID:
+            *va_arg(argv, uint32_t*) = auto_tmpdir_spank_shim.step_id;
+            break;
+        case S_JOB_LOCAL_TASK_COUNT:
+            *va_arg(argv, uint32_t*) = auto_tmpdir_spank_shim.local_task_count;
+            break;
+        default:
+            rc = ESPANK_NOT_AVAIL;
+            break;
+    }
+    va_end(argv);
+    return rc;
+}
+
+/**/
+
+spank_err_t
+spank_getenv(
+    spank_t         spank_ctxt,
+    const char      *var,
+    char            *buf,
+    int             len
+)
+{
+    const char      *value = getenv(var);
+
+    if ( ! value ) return ESPANK_ENV_NOEXIST;
+    if ( snprintf(buf, len, "%s", value) >= len ) return ESPANK_NOSPACE;
+    return ESPANK_SUCCESS;
+}
+
+spank_err_t
+spank_setenv(
+    spank_t         spank_ctxt,
+    const char      *var,
+    const char      *val,
+    int             overwrite
+)
+{
+    if ( ! overwrite && getenv(var) ) return ESPANK_ENV_EXISTS;
+    return ( setenv(var, val, 1) == 0 ) ? ESPANK_SUCCESS : ESPANK_ERROR;
+}
+
+spank_err_t
+spank_unsetenv(
+    spank_t         spank_ctxt,
+    const char      *var
+)
+{
+    unsetenv(var);
+    return ESPANK_SUCCESS;
+}
+
+/**/
+
+#define AUTO_TMPDIR_SPANK_SHIM_LOG(FN, LEVEL, LABEL) \
+    void \
+    FN( \
+        const char  *format, \
+        ... \
+    ) \
+    { \
+        va_list     argv; \
+        \
+        if ( auto_tmpdir_spank_shim.verbosity < (LEVEL) ) return; \
+        va_start(argv, format); \
+        fprintf(stderr, "%s: ", (LABEL)); \
+        vfprintf(stderr, format, argv); \
+        fputc('\n', stderr); \
+        va_end(argv); \
+    }
+
+AUTO_TMPDIR_SPANK_SHIM_LOG(slurm_error, 0, "error")
+AUTO_TMPDIR_SPANK_SHIM_LOG(slurm_info, 1, "info")
+AUTO_TMPDIR_SPANK_SHIM_LOG(slurm_verbose, 1, "verbose")
+AUTO_TMPDIR_SPANK_SHIM_LOG(slurm_debug, 2, "debug")
+AUTO_TMPDIR_SPANK_SHIM_LOG(slurm_debug2, 3, "debug2")
+AUTO_TMPDIR_SPANK_SHIM_LOG(slurm_debug3, 3, "debug3")
+
+#undef AUTO_TMPDIR_SPANK_SHIM_LOG
@@ -0,0 +1,33 @@
+/*
+ * spank-shim.h
+ *
+ * Stand-in for the SPANK and Slurm logging API that slurmd/slurmstepd
+ * provide to the plugin, so fs-utils can be driven outside of Slurm.
+ *
+ */
+
+#ifndef __AUTO_TMPDIR_SPANK_SHIM_H__
+#define __AUTO_TMPDIR_SPANK_SHIM_H__
+
+#include "auto_tmpdir_config.h"
+
+/*
+ * @typedef auto_tmpdir_spank_shim_t
+ *
+ * The job that spank_get_item() describes.  The caller changes the fields
+ * between simulated jobs.
+ *
+ * verbosity selects which slurm_*() messages reach stderr:  0 = errors,
+ * 1 = + info/verbose, 2 = + debug.
+ */
+typedef struct auto_tmpdir_spank_shim {
+    uint32_t            job_id, step_id;
+    uint32_t            local_task_count;
+    uid_t               u_owner;
+    gid_t               g_owner;
+    int                 verbosity;
+} auto_tmpdir_spank_shim_t;
+
+extern auto_tmpdir_spank_shim_t auto_tmpdir_spank_shim;
+
+#endif /* __AUTO_TMPDIR_SPANK_SHIM_H__ */
@@ -0,0 +1,469 @@
+/*
+ * cgroup-io.c
+ *
+ * Per-job I/O limits on the scratch device via the cgroup v2 io controller.
+ *
+ */
+
+#include "cgroup-io.h"
+#include "fs-utils.h"
+#include "event-log.h"
+
+#include <errno.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+/*
+ * Size parsing (with K/M/G/T suffixes) is shared with fs-utils.c:
+ */
+int __auto_tmpdir_fs_parse_size(const char *str, uint64_t *size);
+
+/*
+ * The io_* directives; zero means unset:
+ */
+typedef struct auto_tmpdir_cgroup_io_config {
+    uint64_t            rbps, wbps, riops, wiops;
+    uint64_t            weight, latency_us;
+    const char          *cgroup_root;
+} auto_tmpdir_cgroup_io_config_t;
+
+/*
+ * Cumulative counters from one line of io.stat:
+ */
+typedef struct auto_tmpdir_cgroup_io_stat {
+    unsigned int        major, minor;
+    uint64_t            rbytes, wbytes, rios, wios;
+} auto_tmpdir_cgroup_io_stat_t;
+
+/**/
+
+static int
+__auto_tmpdir_cgroup_io_config(
+    int                             argc,
+    char                            *argv[],
+    auto_tmpdir_cgroup_io_config_t  *config
+)
+{
+    static const struct {
+        const char      *key;
+        size_t          offset;
+    } values[] = {
+            { "io_rbps=", offsetof(auto_tmpdir_cgroup_io_config_t, rbps) },
+            { "io_wbps=", offsetof(auto_tmpdir_cgroup_io_config_t, wbps) },
+            { "io_riops=", offsetof(auto_tmpdir_cgroup_io_config_t, riops) },
+            { "io_wiops=", offsetof(auto_tmpdir_cgroup_io_config_t, wiops) },
+            { "io_weight=", offsetof(auto_tmpdir_cgroup_io_config_t, weight) },
+            { "io_latency=", offsetof(auto_tmpdir_cgroup_io_config_t, latency_us) },
+            { NULL, 0 }
+        };
+    int                             i, j;
+
+    memset(config, 0, sizeof(*config));
+    config->cgroup_root = "/sys/fs/cgroup";
+    for ( i = 0; i < argc; i++ ) {
+        if ( strncmp(argv[i], "io_cgroup_root=", 15) == 0 ) {
+            if ( argv[i][15] != '/' ) {
+                slurm_error("auto_tmpdir::__auto_tmpdir_cgroup_io_config: invalid io_cgroup_root in plugstack configuration (%s)", argv[i] + 15);
+                return -1;
+            }
+            config->cgroup_root = argv[i] + 15;
+            continue;
+        }
+        for ( j = 0; values[j].key; j++ ) {
+            size_t      key_len = strlen(values[j].key);
+
+            if ( strncmp(argv[i], values[j].key, key_len) == 0 ) {
+                if ( __auto_tmpdir_fs_parse_size(argv[i] + key_len, (uint64_t*)((char*)config + values[j].offset)) != 0 ) {
+                    slurm_error("auto_tmpdir::__auto_tmpdir_cgroup_io_config: invalid %.*s in plugstack configuration (%s)", (int)key_len - 1, values[j].key, argv[i] + key_len);
+                    return -1;
+                }
+                break;
+            }
+        }
+    }
+    if ( config->weight > 10000 ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_cgroup_io_config: io_weight must be between 1 and 10000");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * The whole-disk device number (io.* files take no partitions) of the block
+ * device holding path:
+ */
+static int
+__auto_tmpdir_cgroup_io_device(
+    const char          *path,
+    unsigned int        *major_num,
+    unsigned int        *minor_num
+)
+{
+    struct stat         finfo;
+    char                sysfs_path[64], value[32];
+    int                 fd;
+    ssize_t             n_bytes;
+
+    if ( stat(path, &finfo) != 0 ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_cgroup_io_device: unable to stat `%s` (%m)", path);
+        return -1;
+    }
+    if ( major(finfo.st_dev) == 0 ) {
+        slurm_debug("auto_tmpdir::__auto_tmpdir_cgroup_io_device: `%s` is not on a block device", path);
+        return -1;
+    }
+    *major_num = major(finfo.st_dev);
+    *minor_num = minor(finfo.st_dev);
+
+    snprintf(sysfs_path, sizeof(sysfs_path), "/sys/dev/block/%u:%u/partition", *major_num, *minor_num);
+    if ( access(sysfs_path, F_OK) == 0 ) {
+        snprintf(sysfs_path, sizeof(sysfs_path), "/sys/dev/block/%u:%u/../dev", *major_num, *minor_num);
+        if ( (fd = open(sysfs_path, O_RDONLY)) >= 0 ) {
+            n_bytes = read(fd, value, sizeof(value) - 1);
+            close(fd);
+            if ( n_bytes > 0 ) {
+                value[n_bytes] = '\0';
+                if ( sscanf(value, "%u:%u", major_num, minor_num) != 2 ) return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * The job's cgroup directory:  Slurm's cgroup/v2 plugin puts each step's
+ * processes beneath <root>/.../job_<job-id>/step_<step-id>/:
+ */
+static int
+__auto_tmpdir_cgroup_io_job_cgroup(
+    const char          *cgroup_root,
+    uint32_t            job_id,
+    char                *buffer,
+    size_t              buffer_len
+)
+{
+    FILE                *fptr = fopen("/proc/self/cgroup", "r");
+    char                line[PATH_MAX], component[32];
+    int                 rc = -1;
+
+    if ( ! fptr ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_cgroup_io_job_cgroup: unable to open /proc/self/cgroup (%m)");
+        return -1;
+    }
+    snprintf(component, sizeof(component), "/job_%u", job_id);
+    while ( fgets(line, sizeof(line), fptr) ) {
+        char            *job_component;
+        size_t          component_len = strlen(component);
+
+        if ( strncmp(line, "0::", 3) != 0 ) continue;
+        line[strcspn(line, "\n")] = '\0';
+        job_component = line + 3;
+        while ( (job_component = strstr(job_component, component)) ) {
+            if ( (job_component[component_len] == '/') || (job_component[component_len] == '\0') ) {
+                job_component[component_len] = '\0';
+                if ( snprintf(buffer, buffer_len, "%s%s", cgroup_root, line + 3) < buffer_len ) rc = 0;
+                break;
+            }
+            job_component += component_len;
+        }
+        break;
+    }
+    fclose(fptr);
+    if ( rc != 0 ) slurm_error("auto_tmpdir::__auto_tmpdir_cgroup_io_job_cgroup: no cgroup v2 job_%u cgroup for this process", job_id);
+    return rc;
+}
+
+static int
+__auto_tmpdir_cgroup_io_write(
+    const char          *dir,
+    const char          *file,
+    const char          *value
+)
+{
+    char                path[PATH_MAX];
+    int                 fd, rc = 0;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    if ( (fd = open(path, O_WRONLY | O_CLOEXEC)) < 0 ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_cgroup_io_write: unable to open `%s` (%m)", path);
+        return -1;
+    }
+    if ( write(fd, value, strlen(value)) < 0 ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_cgroup_io_write: unable to write `%s` to `%s` (%m)", value, path);
+        rc = -1;
+    } else {
+        slurm_debug("auto_tmpdir::__auto_tmpdir_cgroup_io_write: `%s` <- `%s`", path, value);
+    }
+    close(fd);
+    return rc;
+}
+
+/*
+ * Make sure the io controller is enabled in the subtree_control of every
+ * cgroup from the root down to the job cgroup's parent:
+ */
+static int
+__auto_tmpdir_cgroup_io_enable(
+    const char          *cgroup_root,
+    const char          *job_cgroup
+)
+{
+    char                dir[PATH_MAX], controllers[256];
+    size_t              dir_len = strlen(cgroup_root);
+    const char          *last_slash = strrchr(job_cgroup, '/');
+
+    while ( job_cgroup + dir_len <= last_slash ) {
+        const char      *next_slash = strchr(job_cgroup + dir_len + 1, '/');
+        char            path[PATH_MAX];
+        FILE            *fptr;
+        int             has_io = 0;
+
+        snprintf(dir, sizeof(dir), "%.*s", (int)dir_len, job_cgroup);
+        if ( snprintf(path, sizeof(path), "%s/cgroup.subtree_control", dir) >= sizeof(path) ) return -1;
+        if ( (fptr = fopen(path, "r")) ) {
+            if ( fgets(controllers, sizeof(controllers), fptr) ) {
+                char    *token, *save;
+
+                for ( token = strtok_r(controllers, " \n", &save); token && ! has_io; token = strtok_r(NULL, " \n", &save) ) has_io = (strcmp(token, "io") == 0);
+            }
+            fclose(fptr);
+        }
+        if ( ! has_io && (__auto_tmpdir_cgroup_io_write(dir, "cgroup.subtree_control", "+io") != 0) ) return -1;
+        if ( ! next_slash ) break;
+        dir_len = next_slash - job_cgroup;
+    }
+    return 0;
+}
+
+/*
+ * Read the line for the device from an io.stat file (or a snapshot of one)
+ * at path, relative to dir_fd:
+ */
+static int
+__auto_tmpdir_cgroup_io_stat_read(
+    int                             dir_fd,
+    const char                      *path,
+    unsigned int                    major_num,
+    unsigned int                    minor_num,
+    auto_tmpdir_cgroup_io_stat_t    *io_stat
+)
+{
+    int                             fd = openat(dir_fd, path, O_RDONLY | O_CLOEXEC);
+    FILE                            *fptr = (fd >= 0) ? fdopen(fd, "r") : NULL;
+    char                            line[512];
+    int                             rc = -1;
+
+    if ( ! fptr ) {
+        if ( fd >= 0 ) close(fd);
+        return -1;
+    }
+    memset(io_stat, 0, sizeof(*io_stat));
+    while ( fgets(line, sizeof(line), fptr) ) {
+        unsigned int                line_major, line_minor;
+        int                         n_chars;
+        char                        *token, *save;
+
+        if ( (sscanf(line, "%u:%u%n", &line_major, &line_minor, &n_chars) != 2) || (line_major != major_num) || (line_minor != minor_num) ) continue;
+        io_stat->major = line_major;
+        io_stat->minor = line_minor;
+        for ( token = strtok_r(line + n_chars, " \n", &save); token; token = strtok_r(NULL, " \n", &save) ) {
+            if ( strncmp(token, "rbytes=", 7) == 0 ) io_stat->rbytes = strtoull(token + 7, NULL, 10);
+            else if ( strncmp(token, "wbytes=", 7) == 0 ) io_stat->wbytes = strtoull(token + 7, NULL, 10);
+            else if ( strncmp(token, "rios=", 5) == 0 ) io_stat->rios = strtoull(token + 5, NULL, 10);
+            else if ( strncmp(token, "wios=", 5) == 0 ) io_stat->wios = strtoull(token + 5, NULL, 10);
+        }
+        rc = 0;
+        break;
+    }
+    fclose(fptr);
+    return rc;
+}
+
+#define AUTO_TMPDIR_CGROUP_IO_SNAPSHOT_FORMAT  "auto_tmpdir_fs-%u.iostat"
+
+/**/
+
+int
+auto_tmpdir_cgroup_io_is_configured(
+    int             argc,
+    char            *argv[]
+)
+{
+    while ( argc-- > 0 ) {
+        if ( (strncmp(argv[argc], "io_", 3) == 0) && strncmp(argv[argc], "io_cgroup_root=", 15) ) return 1;
+    }
+    return 0;
+}
+
+/**/
+
+int
+auto_tmpdir_cgroup_io_apply(
+    int                             argc,
+    char                            *argv[],
+    const char                      *path,
+    uint32_t                        job_id,
+    uint32_t                        job_cpus
+)
+{
+    auto_tmpdir_cgroup_io_config_t  config;
+    unsigned int                    major_num, minor_num;
+    char                            job_cgroup[PATH_MAX], value[256];
+    long                            node_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    double                          share = 1.0;
+    auto_tmpdir_event_t             event;
+    int                             rc = 0;
+
+    if ( __auto_tmpdir_cgroup_io_config(argc, argv, &config) != 0 ) return -1;
+    if ( ! config.rbps && ! config.wbps && ! config.riops && ! config.wiops && ! config.weight && ! config.latency_us ) return 0;
+    if ( ! path || (__auto_tmpdir_cgroup_io_device(path, &major_num, &minor_num) != 0) ) return 0;
+    if ( __auto_tmpdir_cgroup_io_job_cgroup(config.cgroup_root, job_id, job_cgroup, sizeof(job_cgroup)) != 0 ) return -1;
+
+    /* The job gets its CPU share of the node-wide values: */
+    if ( job_cpus && (node_cpus > 0) && (job_cpus < node_cpus) ) share = (double)job_cpus / (double)node_cpus;
+
+    auto_tmpdir_event_start(&event, "cgroup_io", job_cgroup);
+    if ( __auto_tmpdir_cgroup_io_enable(config.cgroup_root, job_cgroup) != 0 ) {
+        rc = -1;
+        goto early_exit;
+    }
+    if ( config.rbps || config.wbps || config.riops || config.wiops ) {
+        char            limit[4][24];
+        uint64_t        limits[4] = { config.rbps, config.wbps, config.riops, config.wiops };
+        int             i;
+
+        for ( i = 0; i < 4; i++ ) {
+            uint64_t    scaled = (uint64_t)(share * limits[i] + 0.5);
+
+            if ( limits[i] ) snprintf(limit[i], sizeof(limit[i]), "%llu", (unsigned long long)(scaled ? scaled : 1));
+            else strcpy(limit[i], "max");
+        }
+        snprintf(value, sizeof(value), "%u:%u rbps=%s wbps=%s riops=%s wiops=%s", major_num, minor_num, limit[0], limit[1], limit[2], limit[3]);
+        if ( __auto_tmpdir_cgroup_io_write(job_cgroup, "io.max", value) != 0 ) rc = -1;
+    }
+    if ( config.weight ) {
+        uint64_t        scaled = (uint64_t)(share * config.weight + 0.5);
+
+        snprintf(value, sizeof(value), "%u:%u %llu", major_num, minor_num, (unsigned long long)(scaled ? scaled : 1));
+        if ( __auto_tmpdir_cgroup_io_write(job_cgroup, "io.weight", value) != 0 ) rc = -1;
+    }
+    if ( config.latency_us ) {
+        snprintf(value, sizeof(value), "%u:%u target=%llu", major_num, minor_num, (unsigned long long)config.latency_us);
+        if ( __auto_tmpdir_cgroup_io_write(job_cgroup, "io.latency", value) != 0 ) rc = -1;
+    }
+early_exit:
+    auto_tmpdir_event_end(&event, (rc == 0), (rc != 0));
+    return rc;
+}
+
+/**/
+
+int
+auto_tmpdir_cgroup_io_snapshot(
+    int                             argc,
+    char                            *argv[],
+    int                             state_dir_fd,
+    const char                      *path,
+    uint32_t                        job_id
+)
+{
+    auto_tmpdir_cgroup_io_config_t  config;
+    auto_tmpdir_cgroup_io_stat_t    io_stat, saved_stat;
+    unsigned int                    major_num, minor_num;
+    char                            job_cgroup[PATH_MAX], stat_path[PATH_MAX], snapshot_name[64], tmp_name[80];
+    FILE                            *fptr;
+    int                             fd;
+
+    if ( __auto_tmpdir_cgroup_io_config(argc, argv, &config) != 0 ) return -1;
+    if ( ! path || (__auto_tmpdir_cgroup_io_device(path, &major_num, &minor_num) != 0) ) return 0;
+    if ( __auto_tmpdir_cgroup_io_job_cgroup(config.cgroup_root, job_id, job_cgroup, sizeof(job_cgroup)) != 0 ) return -1;
+    snprintf(snapshot_name, sizeof(snapshot_name), AUTO_TMPDIR_CGROUP_IO_SNAPSHOT_FORMAT, job_id);
+
+    if ( snprintf(stat_path, sizeof(stat_path), "%s/io.stat", job_cgroup) >= sizeof(stat_path) ) return -1;
+    if ( __auto_tmpdir_cgroup_io_stat_read(AT_FDCWD, stat_path, major_num, minor_num, &io_stat) != 0 ) {
+        /* No line at all means the job did no I/O on the device: */
+        memset(&io_stat, 0, sizeof(io_stat));
+        io_stat.major = major_num;
+        io_stat.minor = minor_num;
+    }
+
+    /* Steps of the job exit in any order, keep the largest counters: */
+    if ( (__auto_tmpdir_cgroup_io_stat_read(state_dir_fd, snapshot_name, major_num, minor_num, &saved_stat) == 0)
+            && (saved_stat.rbytes + saved_stat.wbytes + saved_stat.rios + saved_stat.wios > io_stat.rbytes + io_stat.wbytes + io_stat.rios + io_stat.wios) ) {
+        return 0;
+    }
+    snprintf(tmp_name, sizeof(tmp_name), "%s.%d", snapshot_name, (int)getpid());
+    fd = openat(state_dir_fd, tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if ( (fd < 0) || ! (fptr = fdopen(fd, "w")) ) {
+        slurm_error("auto_tmpdir::auto_tmpdir_cgroup_io_snapshot: unable to create `%s` in state_dir (%m)", tmp_name);
+        if ( fd >= 0 ) close(fd);
+        return -1;
+    }
+    fprintf(fptr, "%u:%u rbytes=%llu wbytes=%llu rios=%llu wios=%llu\n", io_stat.major, io_stat.minor,
+            (unsigned long long)io_stat.rbytes, (unsigned long long)io_stat.wbytes, (unsigned long long)io_stat.rios, (unsigned long long)io_stat.wios);
+    if ( (fclose(fptr) != 0) || (renameat(state_dir_fd, tmp_name, state_dir_fd, snapshot_name) != 0) ) {
+        slurm_error("auto_tmpdir::auto_tmpdir_cgroup_io_snapshot: unable to write `%s` in state_dir (%m)", snapshot_name);
+        unlinkat(state_dir_fd, tmp_name, 0);
+        return -1;
+    }
+    return 0;
+}
+
+/**/
+
+void
+auto_tmpdir_cgroup_io_report(
+    int                             argc,
+    char                            *argv[],
+    uint32_t                        job_id,
+    uid_t                           u_owner
+)
+{
+    auto_tmpdir_cgroup_io_stat_t    io_stat;
+    const char                      *accounting_path;
+    const char                      *state_dir = auto_tmpdir_fs_get_state_dir(argc, argv);
+    char                            snapshot_path[PATH_MAX], line[64];
+    FILE                            *fptr;
+    int                             fd;
+
+    if ( ! state_dir ) return;
+    snprintf(snapshot_path, sizeof(snapshot_path), "%s/" AUTO_TMPDIR_CGROUP_IO_SNAPSHOT_FORMAT, state_dir, job_id);
+    if ( ! (fptr = fopen(snapshot_path, "r")) ) {
+        if ( errno != ENOENT ) slurm_error("auto_tmpdir::auto_tmpdir_cgroup_io_report: unable to open `%s` (%m)", snapshot_path);
+        return;
+    }
+    memset(&io_stat, 0, sizeof(io_stat));
+    if ( ! fgets(line, sizeof(line), fptr) || (sscanf(line, "%u:%u", &io_stat.major, &io_stat.minor) != 2) ) {
+        fclose(fptr);
+        unlink(snapshot_path);
+        return;
+    }
+    fclose(fptr);
+    __auto_tmpdir_cgroup_io_stat_read(AT_FDCWD, snapshot_path, io_stat.major, io_stat.minor, &io_stat);
+    unlink(snapshot_path);
+
+    slurm_info("auto_tmpdir::auto_tmpdir_cgroup_io_report: job %u device %u:%u read %llu bytes in %llu ops, wrote %llu bytes in %llu ops",
+            job_id, io_stat.major, io_stat.minor,
+            (unsigned long long)io_stat.rbytes, (unsigned long long)io_stat.rios, (unsigned long long)io_stat.wbytes, (unsigned long long)io_stat.wios);
+    if ( (accounting_path = auto_tmpdir_fs_get_accounting_path(argc, argv)) ) {
+        if ( (fd = open(accounting_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600)) >= 0 ) {
+            char            record[256];
+            int             n;
+
+            n = snprintf(record, sizeof(record), "{\"time\":%lld,\"job\":%u,\"uid\":%u,\"device\":\"%u:%u\",\"rbytes\":%llu,\"wbytes\":%llu,\"rios\":%llu,\"wios\":%llu}\n",
+                        (long long)time(NULL), job_id, (unsigned int)u_owner, io_stat.major, io_stat.minor,
+                        (unsigned long long)io_stat.rbytes, (unsigned long long)io_stat.wbytes, (unsigned long long)io_stat.rios, (unsigned long long)io_stat.wios);
+            if ( (n > 0) && (n < sizeof(record)) && (write(fd, record, n) != n) ) {
+                slurm_error("auto_tmpdir::auto_tmpdir_cgroup_io_report: failed to write accounting record (%m)");
+            }
+            close(fd);
+        } else {
+            slurm_error("auto_tmpdir::auto_tmpdir_cgroup_io_report: unable to open accounting file `%s` (%m)", accounting_path);
+        }
+        free((void*)accounting_path);
+    }
+}
@@ -0,0 +1,57 @@
+/*
+ * cgroup-io.h
+ *
+ * Per-job I/O limits on the scratch device via the cgroup v2 io controller.
+ *
+ */
+
+#ifndef __AUTO_TMPDIR_CGROUP_IO_H__
+#define __AUTO_TMPDIR_CGROUP_IO_H__
+
+#include "auto_tmpdir_config.h"
+
+/*
+ * @function auto_tmpdir_cgroup_io_is_configured
+ *
+ * Returns non-zero if any io_* directive (limits or io_stat reporting) is
+ * present in the plugin configuration.
+ */
+int auto_tmpdir_cgroup_io_is_configured(int argc, char *argv[]);
+
+/*
+ * @function auto_tmpdir_cgroup_io_apply
+ *
+ * Set io.max, io.weight, and io.latency for the block device holding path on
+ * the job's cgroup (the job_<job-id> ancestor of the calling process's
+ * cgroup), enabling the io controller down to it as needed.  The io_rbps,
+ * io_wbps, io_riops, io_wiops, and io_weight values configured for the whole
+ * node are scaled by job_cpus over the node's CPU count; io_latency is not
+ * scaled.  A job_cpus of zero applies the node-wide values.
+ *
+ * Returns 0 on success (or if no limits are configured or path is not on a
+ * block device).  Any errors will be logged via slurm_error().
+ */
+int auto_tmpdir_cgroup_io_apply(int argc, char *argv[], const char *path, uint32_t job_id, uint32_t job_cpus);
+
+/*
+ * @function auto_tmpdir_cgroup_io_snapshot
+ *
+ * Save the job cgroup's io.stat line for the block device holding path as
+ * auto_tmpdir_fs-<job-id>.iostat in the state_dir open at state_dir_fd (the
+ * step's bind mounts may hide state_dir by name), unless the saved line
+ * already shows more I/O (a step that exited later got there first).
+ *
+ * Returns 0 on success.  Any errors will be logged via slurm_error().
+ */
+int auto_tmpdir_cgroup_io_snapshot(int argc, char *argv[], int state_dir_fd, const char *path, uint32_t job_id);
+
+/*
+ * @function auto_tmpdir_cgroup_io_report
+ *
+ * Report the job's last io.stat snapshot via slurm_info() and, if usage
+ * accounting is enabled, as a line in the accounting file; then remove the
+ * snapshot.
+ */
+void auto_tmpdir_cgroup_io_report(int argc, char *argv[], uint32_t job_id, uid_t u_owner);
+
+#endif /* __AUTO_TMPDIR_CGROUP_IO_H__ */
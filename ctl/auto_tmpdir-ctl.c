@@ -0,0 +1,720 @@
+/*
+ * auto_tmpdir-ctl.c
+ *
+ * Administrative command for the job hierarchies the plugin maintains on a
+ * node:  list them with their usage (scanned in parallel), force-reclaim a
+ * job's hierarchy through the epilog's teardown code, or sweep orphans.
+ *
+ * The plugin's arguments are read from its line in plugstack.conf so the
+ * same state_dir and prefixes are used.
+ *
+ */
+
+#include "fs-utils.h"
+#include "spank-shim.h"
+#include "job-nodes.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <glob.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <slurm/slurm_errno.h>
+
+/**/
+
+#ifndef AUTO_TMPDIR_CTL_PLUGSTACK_CONF
+#   define AUTO_TMPDIR_CTL_PLUGSTACK_CONF "/etc/slurm/plugstack.conf"
+#endif
+
+#define CTL_MAX_ROOTS           16
+#define CTL_MAX_INCLUDE_DEPTH   4
+
+/*
+ * One job hierarchy found in state_dir; the usage counters are summed by
+ * the scanner threads:
+ */
+typedef struct ctl_hierarchy {
+    uint32_t            job_id;
+    uid_t               u_owner;
+    const char          *state;
+    auto_tmpdir_fs_ref  fs_info;
+    const char          *roots[CTL_MAX_ROOTS];
+    int                 n_roots;
+    uint64_t            bytes, inodes;
+} ctl_hierarchy_t;
+
+/*
+ * The parallel scanner's shared queue of directories still to be read:
+ */
+typedef struct ctl_scan_item {
+    struct ctl_scan_item    *link;
+    ctl_hierarchy_t         *owner;
+    char                    path[];
+} ctl_scan_item_t;
+
+typedef struct ctl_scan {
+    pthread_mutex_t     lock;
+    pthread_cond_t      ready;
+    ctl_scan_item_t     *queue;
+    int                 n_outstanding;
+    uint64_t            n_errors;
+} ctl_scan_t;
+
+/*
+ * Plugin arguments gathered from plugstack.conf and the command line:
+ */
+typedef struct ctl_args {
+    int                 argc, capacity;
+    char                **argv;
+} ctl_args_t;
+
+/**/
+
+static int
+ctl_args_append(
+    ctl_args_t          *args,
+    const char          *arg
+)
+{
+    if ( args->argc == args->capacity ) {
+        int             new_capacity = args->capacity ? 2 * args->capacity : 16;
+        char            **new_argv = realloc(args->argv, new_capacity * sizeof(char*));
+
+        if ( ! new_argv ) return -1;
+        args->argv = new_argv;
+        args->capacity = new_capacity;
+    }
+    if ( ! (args->argv[args->argc] = strdup(arg)) ) return -1;
+    args->argc++;
+    return 0;
+}
+
+/*
+ * Pull the arguments from the auto_tmpdir line(s) of a plugstack file,
+ * following include directives:
+ */
+static int
+ctl_plugstack_read(
+    const char          *path,
+    ctl_args_t          *args,
+    int                 depth
+)
+{
+    FILE                *fptr;
+    char                line[8192];
+    int                 rc = 0;
+
+    if ( depth > CTL_MAX_INCLUDE_DEPTH ) return 0;
+    if ( ! (fptr = fopen(path, "r")) ) {
+        if ( depth == 0 ) fprintf(stderr, "ERROR:  unable to open `%s` (%s)\n", path, strerror(errno));
+        return (depth == 0) ? -1 : 0;
+    }
+    while ( (rc == 0) && fgets(line, sizeof(line), fptr) ) {
+        char            *save = NULL, *words[2], *p;
+        int             n_words = 0;
+
+        if ( (p = strchr(line, '#')) ) *p = '\0';
+        while ( (n_words < 2) && (p = strtok_r(n_words ? NULL : line, " \t\r\n", &save)) ) words[n_words++] = p;
+        if ( (n_words >= 2) && (strcmp(words[0], "include") == 0) ) {
+            char        pattern[PATH_MAX], dir_buf[PATH_MAX];
+            glob_t      matches;
+            size_t      i;
+
+            if ( words[1][0] == '/' ) {
+                snprintf(pattern, sizeof(pattern), "%s", words[1]);
+            } else {
+                snprintf(dir_buf, sizeof(dir_buf), "%s", path);
+                snprintf(pattern, sizeof(pattern), "%s/%s", dirname(dir_buf), words[1]);
+            }
+            if ( glob(pattern, 0, NULL, &matches) == 0 ) {
+                for ( i = 0; (rc == 0) && (i < matches.gl_pathc); i++ ) rc = ctl_plugstack_read(matches.gl_pathv[i], args, depth + 1);
+                globfree(&matches);
+            }
+            continue;
+        }
+        if ( (n_words < 2) || (strcmp(words[0], "required") && strcmp(words[0], "optional")) ) continue;
+        if ( strstr(words[1], "auto_tmpdir") == NULL ) continue;
+        while ( (rc == 0) && (p = strtok_r(NULL, " \t\r\n", &save)) ) rc = ctl_args_append(args, p);
+    }
+    fclose(fptr);
+    return rc;
+}
+
+/**/
+
+static ctl_hierarchy_t*
+ctl_hierarchies_load(
+    ctl_args_t          *args,
+    int                 *n_hierarchies
+)
+{
+    const char          *state_dir = auto_tmpdir_fs_get_state_dir(args->argc, args->argv);
+    ctl_hierarchy_t     *hierarchies = NULL;
+    int                 n = 0, capacity = 0;
+    DIR                 *dir;
+    struct dirent       *dent;
+
+    *n_hierarchies = 0;
+    if ( ! state_dir ) return NULL;
+    if ( ! (dir = opendir(state_dir)) ) {
+        fprintf(stderr, "ERROR:  unable to open state directory `%s` (%s)\n", state_dir, strerror(errno));
+        return NULL;
+    }
+    while ( (dent = readdir(dir)) ) {
+        unsigned int        job_id;
+        int                 name_len = 0, i;
+        char                path[PATH_MAX];
+        const char          *state, *bind_this_path, *base_dir;
+        auto_tmpdir_fs_ref  fs_info;
+        ctl_hierarchy_t     *h;
+
+        if ( (sscanf(dent->d_name, "auto_tmpdir_fs-%u.%n", &job_id, &name_len) != 1) || (name_len == 0) ) continue;
+        if ( strcmp(dent->d_name + name_len, "cache") == 0 ) state = "active";
+        else if ( strcmp(dent->d_name + name_len, "retained") == 0 ) state = "retained";
+        else continue;
+        snprintf(path, sizeof(path), "%s/%s", state_dir, dent->d_name);
+        if ( ! (fs_info = auto_tmpdir_fs_init_with_file(NULL, args->argc, args->argv, 0, path, 0)) ) continue;
+
+        if ( n == capacity ) {
+            ctl_hierarchy_t *new_hierarchies = realloc(hierarchies, (capacity ? 2 * capacity : 64) * sizeof(ctl_hierarchy_t));
+
+            if ( ! new_hierarchies ) {
+                auto_tmpdir_fs_fini(fs_info, 1);
+                break;
+            }
+            hierarchies = new_hierarchies;
+            capacity = capacity ? 2 * capacity : 64;
+        }
+        h = &hierarchies[n++];
+        memset(h, 0, sizeof(*h));
+        h->job_id = job_id;
+        h->u_owner = auto_tmpdir_fs_get_owner(fs_info);
+        h->state = state;
+        h->fs_info = fs_info;
+
+        /* Scan the base directory once, plus any bindpoint living outside it: */
+        if ( (base_dir = auto_tmpdir_fs_get_base_dir(fs_info)) ) h->roots[h->n_roots++] = base_dir;
+        for ( i = 0; (h->n_roots < CTL_MAX_ROOTS) && (auto_tmpdir_fs_get_bindpoint(fs_info, i, &bind_this_path, NULL) == 0); i++ ) {
+            size_t      base_dir_len = base_dir ? strlen(base_dir) : 0;
+
+            if ( base_dir && (strncmp(bind_this_path, base_dir, base_dir_len) == 0) && (bind_this_path[base_dir_len] == '/') ) continue;
+            h->roots[h->n_roots++] = bind_this_path;
+        }
+    }
+    closedir(dir);
+    *n_hierarchies = n;
+    return hierarchies;
+}
+
+static void
+ctl_hierarchies_free(
+    ctl_hierarchy_t     *hierarchies,
+    int                 n_hierarchies
+)
+{
+    while ( n_hierarchies-- > 0 ) auto_tmpdir_fs_fini(hierarchies[n_hierarchies].fs_info, 1);
+    free(hierarchies);
+}
+
+/**/
+
+static int
+ctl_scan_push(
+    ctl_scan_t          *scan,
+    ctl_hierarchy_t     *owner,
+    const char          *path,
+    const char          *name
+)
+{
+    size_t              path_len = strlen(path), name_len = name ? strlen(name) : 0;
+    ctl_scan_item_t     *item = malloc(sizeof(ctl_scan_item_t) + path_len + name_len + 2);
+
+    if ( ! item ) return -1;
+    item->owner = owner;
+    memcpy(item->path, path, path_len);
+    if ( name ) {
+        item->path[path_len] = '/';
+        memcpy(item->path + path_len + 1, name, name_len + 1);
+    } else {
+        item->path[path_len] = '\0';
+    }
+    pthread_mutex_lock(&scan->lock);
+    item->link = scan->queue;
+    scan->queue = item;
+    scan->n_outstanding++;
+    pthread_cond_signal(&scan->ready);
+    pthread_mutex_unlock(&scan->lock);
+    return 0;
+}
+
+/*
+ * Each worker takes a directory off the queue, totals the entries in it, and
+ * queues its subdirectories, so a single large hierarchy is spread across
+ * all of the workers:
+ */
+static void*
+ctl_scan_worker(
+    void                *context
+)
+{
+    ctl_scan_t          *scan = (ctl_scan_t*)context;
+
+    while ( 1 ) {
+        ctl_scan_item_t *item;
+        uint64_t        bytes = 0, inodes = 0, n_errors = 0;
+        DIR             *dir;
+        struct dirent   *dent;
+
+        pthread_mutex_lock(&scan->lock);
+        while ( ! scan->queue && (scan->n_outstanding > 0) ) pthread_cond_wait(&scan->ready, &scan->lock);
+        if ( ! scan->queue ) {
+            pthread_mutex_unlock(&scan->lock);
+            break;
+        }
+        item = scan->queue;
+        scan->queue = item->link;
+        pthread_mutex_unlock(&scan->lock);
+
+        if ( (dir = opendir(item->path)) ) {
+            int             dir_fd = dirfd(dir);
+
+            while ( (dent = readdir(dir)) ) {
+                struct stat finfo;
+
+                if ( (dent->d_name[0] == '.') && (! dent->d_name[1] || ((dent->d_name[1] == '.') && ! dent->d_name[2])) ) continue;
+                if ( fstatat(dir_fd, dent->d_name, &finfo, AT_SYMLINK_NOFOLLOW) != 0 ) {
+                    n_errors++;
+                    continue;
+                }
+                bytes += finfo.st_blocks * 512;
+                inodes++;
+                if ( S_ISDIR(finfo.st_mode) && (ctl_scan_push(scan, item->owner, item->path, dent->d_name) != 0) ) n_errors++;
+            }
+            closedir(dir);
+        } else {
+            n_errors++;
+        }
+        __atomic_fetch_add(&item->owner->bytes, bytes, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&item->owner->inodes, inodes, __ATOMIC_RELAXED);
+        free(item);
+
+        pthread_mutex_lock(&scan->lock);
+        scan->n_errors += n_errors;
+        if ( --scan->n_outstanding == 0 ) pthread_cond_broadcast(&scan->ready);
+        pthread_mutex_unlock(&scan->lock);
+    }
+    return NULL;
+}
+
+static int
+ctl_scan_usage(
+    ctl_hierarchy_t     *hierarchies,
+    int                 n_hierarchies,
+    int                 n_threads
+)
+{
+    ctl_scan_t          scan = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, 0 };
+    pthread_t           *threads = calloc(n_threads, sizeof(pthread_t));
+    int                 i, j, n_started = 0;
+
+    if ( ! threads ) return -1;
+    for ( i = 0; i < n_hierarchies; i++ ) {
+        for ( j = 0; j < hierarchies[i].n_roots; j++ ) {
+            struct stat     finfo;
+
+            if ( lstat(hierarchies[i].roots[j], &finfo) != 0 ) continue;
+            hierarchies[i].bytes += finfo.st_blocks * 512;
+            hierarchies[i].inodes++;
+            if ( S_ISDIR(finfo.st_mode) ) ctl_scan_push(&scan, &hierarchies[i], hierarchies[i].roots[j], NULL);
+        }
+    }
+    for ( i = 0; i < n_threads; i++ ) {
+        if ( pthread_create(&threads[i], NULL, ctl_scan_worker, &scan) == 0 ) n_started++;
+    }
+    /* If no thread could be started do the work here: */
+    if ( n_started == 0 ) ctl_scan_worker(&scan);
+    for ( i = 0; i < n_started; i++ ) pthread_join(threads[i], NULL);
+    free(threads);
+    if ( scan.n_errors ) fprintf(stderr, "WARNING:  %llu entries could not be read\n", (unsigned long long)scan.n_errors);
+    return 0;
+}
+
+/**/
+
+static int
+ctl_cmp_bytes(
+    const void          *a,
+    const void          *b
+)
+{
+    const ctl_hierarchy_t   *A = a, *B = b;
+
+    return (A->bytes < B->bytes) ? 1 : ((A->bytes > B->bytes) ? -1 : 0);
+}
+
+static int
+ctl_cmp_inodes(
+    const void          *a,
+    const void          *b
+)
+{
+    const ctl_hierarchy_t   *A = a, *B = b;
+
+    return (A->inodes < B->inodes) ? 1 : ((A->inodes > B->inodes) ? -1 : 0);
+}
+
+static int
+ctl_cmp_job(
+    const void          *a,
+    const void          *b
+)
+{
+    const ctl_hierarchy_t   *A = a, *B = b;
+
+    return (A->job_id > B->job_id) ? 1 : ((A->job_id < B->job_id) ? -1 : 0);
+}
+
+static const char*
+ctl_human_size(
+    uint64_t            bytes,
+    char                *buffer,
+    size_t              buffer_len
+)
+{
+    static const char   *units = "BKMGTP";
+    double              value = bytes;
+    int                 unit = 0;
+
+    while ( (value >= 1024.0) && units[unit + 1] ) {
+        value /= 1024.0;
+        unit++;
+    }
+    if ( unit == 0 ) snprintf(buffer, buffer_len, "%lluB", (unsigned long long)bytes);
+    else snprintf(buffer, buffer_len, "%.1f%c", value, units[unit]);
+    return buffer;
+}
+
+/**/
+
+static int
+ctl_list(
+    ctl_args_t          *args,
+    const char          *sort_by,
+    int                 n_threads,
+    int                 should_scan,
+    int                 is_parseable,
+    int                 is_verbose
+)
+{
+    ctl_hierarchy_t     *hierarchies;
+    int                 n_hierarchies, i, j;
+    uint64_t            total_bytes = 0, total_inodes = 0;
+    struct timespec     start, end;
+
+    hierarchies = ctl_hierarchies_load(args, &n_hierarchies);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if ( should_scan && n_hierarchies ) ctl_scan_usage(hierarchies, n_hierarchies, n_threads);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if ( ! should_scan || (strcmp(sort_by, "job") == 0) ) qsort(hierarchies, n_hierarchies, sizeof(ctl_hierarchy_t), ctl_cmp_job);
+    else if ( strcmp(sort_by, "inodes") == 0 ) qsort(hierarchies, n_hierarchies, sizeof(ctl_hierarchy_t), ctl_cmp_inodes);
+    else qsort(hierarchies, n_hierarchies, sizeof(ctl_hierarchy_t), ctl_cmp_bytes);
+
+    if ( ! is_parseable ) printf("%-10s %-8s %-8s %10s %10s  %s\n", "JOB", "UID", "STATE", "SIZE", "INODES", "BASE_DIR");
+    for ( i = 0; i < n_hierarchies; i++ ) {
+        ctl_hierarchy_t *h = &hierarchies[i];
+        const char      *base_dir = auto_tmpdir_fs_get_base_dir(h->fs_info);
+        const char      *bind_this_path, *to_this_path;
+        char            size_str[32];
+
+        if ( is_parseable ) {
+            printf("%u\t%u\t%s\t%llu\t%llu\t%s\n", h->job_id, (unsigned int)h->u_owner, h->state,
+                    (unsigned long long)h->bytes, (unsigned long long)h->inodes, base_dir ? base_dir : "-");
+        } else {
+            char        inodes_str[24] = "-";
+
+            if ( should_scan ) snprintf(inodes_str, sizeof(inodes_str), "%llu", (unsigned long long)h->inodes);
+            printf("%-10u %-8u %-8s %10s %10s  %s\n", h->job_id, (unsigned int)h->u_owner, h->state,
+                    should_scan ? ctl_human_size(h->bytes, size_str, sizeof(size_str)) : "-",
+                    inodes_str, base_dir ? base_dir : "-");
+        }
+        if ( is_verbose ) {
+            for ( j = 0; auto_tmpdir_fs_get_bindpoint(h->fs_info, j, &bind_this_path, &to_this_path) == 0; j++ ) {
+                if ( is_parseable ) printf("\t\t\t\t\t%s -> %s\n", bind_this_path, to_this_path);
+                else printf("%51s%s -> %s\n", "", bind_this_path, to_this_path);
+            }
+        }
+        total_bytes += h->bytes;
+        total_inodes += h->inodes;
+    }
+    if ( should_scan && ! is_parseable ) {
+        char            size_str[32];
+
+        fprintf(stderr, "%d hierarchies, %s in %llu inodes, scanned in %.3f s with %d threads\n",
+                n_hierarchies, ctl_human_size(total_bytes, size_str, sizeof(size_str)), (unsigned long long)total_inodes,
+                (end.tv_sec - start.tv_sec) + 1e-9 * (end.tv_nsec - start.tv_nsec), n_threads);
+    }
+    ctl_hierarchies_free(hierarchies, n_hierarchies);
+    return 0;
+}
+
+/**/
+
+/*
+ * Returns 1 if slurmctld says the job is still active, 0 if not (or it is
+ * unknown), -1 if slurmctld could not be asked:
+ */
+static int
+ctl_job_is_active(
+    ctl_args_t          *args,
+    uint32_t            job_id
+)
+{
+    job_info_msg_t      *job_info = NULL;
+    auto_tmpdir_job_nodes_t job_nodes;
+    int                 is_active;
+
+    if ( slurm_load_job(&job_info, job_id, SHOW_DETAIL) != SLURM_SUCCESS ) {
+        if ( slurm_get_errno() == ESLURM_INVALID_JOB_ID ) return 0;
+        fprintf(stderr, "ERROR:  unable to load job info for %u (%s)\n", job_id, slurm_strerror(slurm_get_errno()));
+        return -1;
+    }
+    auto_tmpdir_job_nodes_init(&job_nodes, args->argc, args->argv, job_info);
+    is_active = auto_tmpdir_job_nodes_is_active(job_id, &job_nodes);
+    auto_tmpdir_job_nodes_fini(&job_nodes);
+    slurm_free_job_info_msg(job_info);
+    return is_active;
+}
+
+static int
+ctl_reclaim(
+    ctl_args_t          *args,
+    uint32_t            job_id,
+    int                 is_forced
+)
+{
+    const char          *state_dir = auto_tmpdir_fs_get_state_dir(args->argc, args->argv);
+    const char          *suffixes[] = { "cache", "retained", NULL };
+    char                path[PATH_MAX];
+    auto_tmpdir_fs_ref  fs_info = NULL;
+    int                 i, rc;
+
+    if ( ! state_dir ) return EINVAL;
+    if ( ! is_forced ) {
+        int             is_active = ctl_job_is_active(args, job_id);
+
+        if ( is_active ) {
+            if ( is_active > 0 ) fprintf(stderr, "ERROR:  job %u is still active; use --force to reclaim its hierarchy anyway\n", job_id);
+            return EBUSY;
+        }
+    }
+    for ( i = 0; suffixes[i] && ! fs_info; i++ ) {
+        snprintf(path, sizeof(path), "%s/auto_tmpdir_fs-%u.%s", state_dir, job_id, suffixes[i]);
+        if ( access(path, F_OK) == 0 ) fs_info = auto_tmpdir_fs_init_with_file(NULL, args->argc, args->argv, 0, path, 1);
+    }
+    if ( ! fs_info ) {
+        fprintf(stderr, "ERROR:  no state file for job %u in `%s`\n", job_id, state_dir);
+        return ENOENT;
+    }
+
+    /* The same teardown as the epilog, minus any hand-off: */
+    auto_tmpdir_spank_shim.job_id = job_id;
+    auto_tmpdir_fs_admit_release(NULL, args->argc, args->argv);
+    auto_tmpdir_fs_ipc_namespace_release(NULL, args->argc, args->argv);
+    auto_tmpdir_fs_set_handoff(fs_info, 0);
+    rc = auto_tmpdir_fs_fini(fs_info, 0);
+    if ( rc == 0 ) {
+        printf("reclaimed hierarchy of job %u\n", job_id);
+    } else {
+        fprintf(stderr, "ERROR:  failures while removing the hierarchy of job %u\n", job_id);
+    }
+    return rc ? EIO : 0;
+}
+
+static int
+ctl_sweep(
+    ctl_args_t          *args
+)
+{
+    job_info_msg_t      *job_info = NULL;
+    auto_tmpdir_job_nodes_t job_nodes;
+    int                 n_swept;
+
+    if ( slurm_load_jobs(0, &job_info, SHOW_ALL) != SLURM_SUCCESS ) {
+        fprintf(stderr, "ERROR:  unable to load job info (%s), not sweeping\n", slurm_strerror(slurm_get_errno()));
+        return EAGAIN;
+    }
+    auto_tmpdir_fs_set_idle_priority();
+    auto_tmpdir_job_nodes_init(&job_nodes, args->argc, args->argv, job_info);
+    n_swept = auto_tmpdir_fs_sweep_orphans(args->argc, args->argv, auto_tmpdir_job_nodes_is_active, &job_nodes);
+    auto_tmpdir_job_nodes_fini(&job_nodes);
+    slurm_free_job_info_msg(job_info);
+    if ( n_swept < 0 ) return EINVAL;
+    printf("removed %d orphaned hierarchies\n", n_swept);
+    return 0;
+}
+
+/**/
+
+static void
+ctl_usage(
+    const char          *exe
+)
+{
+    printf(
+            "usage:\n\n"
+            "  %s {options} <command> {<args>} {-- <plugstack arguments>}\n\n"
+            " commands:\n\n"
+            "  list                       show the job hierarchies on this node with\n"
+            "                             their usage\n"
+            "  reclaim <job-id> ...       remove the hierarchies of the given jobs as the\n"
+            "                             epilog would\n"
+            "  sweep                      remove the hierarchies of jobs that are no\n"
+            "                             longer running\n"
+            "\n"
+            " options:\n\n"
+            "  -h/--help                  show this information\n"
+            "  -v/--verbose               list bindpoints; repeat to show plugin messages\n"
+            "  -c/--config <path>         plugstack.conf to take the plugin arguments from\n"
+            "                             (default: %s)\n"
+            "  -t/--threads <N>           usage scanner threads (default: 4 per CPU, at\n"
+            "                             most 64)\n"
+            "  -s/--sort <key>            sort list by size, inodes, or job (default: size)\n"
+            "  -n/--no-usage              list without scanning usage\n"
+            "  -p/--parseable             tab-separated output with sizes in bytes\n"
+            "  -f/--force                 reclaim even if slurmctld reports the job active\n"
+            "                             or cannot be reached\n"
+            "\n"
+            " Plugstack arguments after -- are added to those from the configuration\n"
+            " file.\n"
+            "\n",
+            exe, AUTO_TMPDIR_CTL_PLUGSTACK_CONF
+        );
+}
+
+static struct option ctl_options[] = {
+                { "help",           no_argument,        NULL, 'h' },
+                { "verbose",        no_argument,        NULL, 'v' },
+                { "config",         required_argument,  NULL, 'c' },
+                { "threads",        required_argument,  NULL, 't' },
+                { "sort",           required_argument,  NULL, 's' },
+                { "no-usage",       no_argument,        NULL, 'n' },
+                { "parseable",      no_argument,        NULL, 'p' },
+                { "force",          no_argument,        NULL, 'f' },
+                { NULL,             0,                  NULL, 0 }
+            };
+
+int
+main(
+    int                 argc,
+    char                *argv[]
+)
+{
+    const char          *config_path = AUTO_TMPDIR_CTL_PLUGSTACK_CONF, *sort_by = "size", *command;
+    ctl_args_t          args = { 0, 0, NULL };
+    long                n_threads = 4 * sysconf(_SC_NPROCESSORS_ONLN);
+    int                 opt, verbosity = 0, should_scan = 1, is_parseable = 0, is_forced = 0, rc = 0, n_operands, i;
+    char                *end;
+
+    if ( n_threads > 64 ) n_threads = 64;
+    if ( n_threads < 1 ) n_threads = 1;
+    while ( (opt = getopt_long(argc, argv, "+hvc:t:s:npf", ctl_options, NULL)) != -1 ) {
+        switch ( opt ) {
+            case 'h':
+                ctl_usage(argv[0]);
+                return 0;
+            case 'v':
+                verbosity++;
+                break;
+            case 'c':
+                config_path = optarg;
+                break;
+            case 't':
+                n_threads = strtol(optarg, &end, 10);
+                if ( (end == optarg) || *end || (n_threads < 1) ) {
+                    fprintf(stderr, "ERROR:  invalid thread count: %s\n", optarg);
+                    return EINVAL;
+                }
+                break;
+            case 's':
+                if ( strcmp(optarg, "size") && strcmp(optarg, "inodes") && strcmp(optarg, "job") ) {
+                    fprintf(stderr, "ERROR:  invalid sort key: %s\n", optarg);
+                    return EINVAL;
+                }
+                sort_by = optarg;
+                break;
+            case 'n':
+                should_scan = 0;
+                break;
+            case 'p':
+                is_parseable = 1;
+                break;
+            case 'f':
+                is_forced = 1;
+                break;
+            default:
+                ctl_usage(argv[0]);
+                return EINVAL;
+        }
+    }
+    if ( optind >= argc ) {
+        ctl_usage(argv[0]);
+        return EINVAL;
+    }
+    command = argv[optind++];
+    for ( n_operands = 0; (optind + n_operands < argc) && strcmp(argv[optind + n_operands], "--"); n_operands++ );
+
+    /* Plugin messages are only shown from the second -v on: */
+    auto_tmpdir_spank_shim.verbosity = (verbosity > 1) ? verbosity - 1 : 0;
+
+    if ( ctl_plugstack_read(config_path, &args, 0) != 0 ) return ENOENT;
+    for ( i = optind + n_operands + 1; i < argc; i++ ) {
+        if ( ctl_args_append(&args, argv[i]) != 0 ) return ENOMEM;
+    }
+
+    if ( strcmp(command, "list") == 0 ) {
+        rc = ctl_list(&args, sort_by, n_threads, should_scan, is_parseable, verbosity > 0);
+    }
+    else if ( strcmp(command, "reclaim") == 0 ) {
+        if ( n_operands == 0 ) {
+            fprintf(stderr, "ERROR:  reclaim requires at least one job id\n");
+            return EINVAL;
+        }
+        if ( geteuid() != 0 ) {
+            fprintf(stderr, "ERROR:  must be run as root\n");
+            return EPERM;
+        }
+        for ( i = 0; i < n_operands; i++ ) {
+            unsigned long   job_id = strtoul(argv[optind + i], &end, 10);
+            int             local_rc;
+
+            if ( (end == argv[optind + i]) || *end ) {
+                fprintf(stderr, "ERROR:  invalid job id: %s\n", argv[optind + i]);
+                rc = EINVAL;
+                continue;
+            }
+            if ( (local_rc = ctl_reclaim(&args, job_id, is_forced)) != 0 ) rc = local_rc;
+        }
+    }
+    else if ( strcmp(command, "sweep") == 0 ) {
+        if ( geteuid() != 0 ) {
+            fprintf(stderr, "ERROR:  must be run as root\n");
+            return EPERM;
+        }
+        rc = ctl_sweep(&args);
+    }
+    else {
+        fprintf(stderr, "ERROR:  unknown command: %s\n", command);
+        ctl_usage(argv[0]);
+        rc = EINVAL;
+    }
+    return rc;
+}
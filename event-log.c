@@ -0,0 +1,187 @@
+/*
+ * event-log.c
+ *
+ * Phase timing and the append-only JSON-lines event log.
+ *
+ */
+
+#include "event-log.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+/**/
+
+static const char *auto_tmpdir_event_log_default_name = "auto_tmpdir_events.jsonl";
+
+static int auto_tmpdir_event_log_fd = -1;
+static uint32_t auto_tmpdir_event_log_job_id = NO_VAL;
+static const char *auto_tmpdir_event_log_context = "unknown";
+
+/**/
+
+int
+auto_tmpdir_event_log_open(
+    spank_t         spank_ctxt,
+    int             argc,
+    char            *argv[],
+    const char      *context
+)
+{
+    const char      *state_dir = "/tmp", *log_path = NULL;
+    int             is_enabled = 0, i = 0;
+
+    auto_tmpdir_event_log_context = context;
+    if ( auto_tmpdir_event_log_fd >= 0 ) return 0;
+
+    while ( i < argc ) {
+        if ( strcmp(argv[i], "event_log") == 0 ) {
+            is_enabled = 1;
+        }
+        else if ( strncmp(argv[i], "event_log=", 10) == 0 ) {
+            log_path = argv[i] + 10;
+            if ( *log_path != '/' ) {
+                slurm_error("auto_tmpdir::auto_tmpdir_event_log_open: invalid event_log in plugstack configuration (%s)", log_path);
+                return -1;
+            }
+            is_enabled = 1;
+        }
+        else if ( strncmp(argv[i], "state_dir=", 10) == 0 ) {
+            state_dir = argv[i] + 10;
+        }
+        i++;
+    }
+    if ( ! is_enabled ) return 0;
+
+    if ( spank_get_item(spank_ctxt, S_JOB_ID, &auto_tmpdir_event_log_job_id) != ESPANK_SUCCESS ) auto_tmpdir_event_log_job_id = NO_VAL;
+
+    /*
+     * Every record is a single O_APPEND write(), so concurrent prologs, steps,
+     * and epilogs on the node never interleave within a line.  The descriptor
+     * must not leak into the job's tasks:
+     */
+    if ( log_path ) {
+        auto_tmpdir_event_log_fd = open(log_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    } else {
+        char        default_path[PATH_MAX];
+
+        snprintf(default_path, sizeof(default_path), "%s/%s", state_dir, auto_tmpdir_event_log_default_name);
+        auto_tmpdir_event_log_fd = open(default_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    }
+    if ( auto_tmpdir_event_log_fd < 0 ) {
+        slurm_error("auto_tmpdir::auto_tmpdir_event_log_open: unable to open event log (%m)");
+        return -1;
+    }
+    return 0;
+}
+
+/**/
+
+void
+auto_tmpdir_event_log_close(void)
+{
+    if ( auto_tmpdir_event_log_fd >= 0 ) {
+        close(auto_tmpdir_event_log_fd);
+        auto_tmpdir_event_log_fd = -1;
+    }
+}
+
+/**/
+
+void
+auto_tmpdir_event_start(
+    auto_tmpdir_event_t *event,
+    const char          *phase,
+    const char          *path
+)
+{
+    event->phase = phase;
+    event->path = path;
+    if ( auto_tmpdir_event_log_fd >= 0 ) clock_gettime(CLOCK_MONOTONIC, &event->start);
+}
+
+/**/
+
+size_t
+auto_tmpdir_event_json_string(
+    char            *buffer,
+    size_t          buffer_len,
+    size_t          len,
+    const char      *str
+)
+{
+#define JSON_PUTC(C)    { if ( len < buffer_len ) buffer[len] = (C); len++; }
+    JSON_PUTC('"');
+    while ( *str ) {
+        unsigned char   c = (unsigned char)*str++;
+
+        if ( c == '"' || c == '\\' ) {
+            JSON_PUTC('\\'); JSON_PUTC(c);
+        }
+        else if ( c < 0x20 ) {
+            char        escape[8];
+            int         i = 0;
+
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            while ( escape[i] ) JSON_PUTC(escape[i++]);
+        }
+        else {
+            JSON_PUTC(c);
+        }
+    }
+    JSON_PUTC('"');
+#undef JSON_PUTC
+    return len;
+}
+
+/**/
+
+void
+auto_tmpdir_event_end(
+    auto_tmpdir_event_t *event,
+    uint64_t            entries,
+    uint64_t            errors
+)
+{
+    struct timespec     now, wall;
+    char                record[PATH_MAX * 2];
+    size_t              len;
+    int                 n;
+
+    if ( auto_tmpdir_event_log_fd < 0 ) return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    clock_gettime(CLOCK_REALTIME, &wall);
+
+    n = snprintf(record, sizeof(record), "{\"time\":%lld.%06ld,\"job\":%u,\"pid\":%d,\"context\":\"%s\",\"phase\":\"%s\",\"usec\":%lld,\"entries\":%llu,\"errors\":%llu",
+                (long long)wall.tv_sec, wall.tv_nsec / 1000,
+                auto_tmpdir_event_log_job_id,
+                (int)getpid(),
+                auto_tmpdir_event_log_context,
+                event->phase,
+                (long long)(now.tv_sec - event->start.tv_sec) * 1000000LL + (now.tv_nsec - event->start.tv_nsec) / 1000,
+                (unsigned long long)entries,
+                (unsigned long long)errors
+            );
+    if ( (n < 0) || (n >= sizeof(record)) ) return;
+    len = n;
+    if ( event->path ) {
+        const char      *path_key = ",\"path\":";
+
+        if ( len + strlen(path_key) < sizeof(record) ) {
+            strcpy(record + len, path_key);
+            len += strlen(path_key);
+        }
+        len = auto_tmpdir_event_json_string(record, sizeof(record), len, event->path);
+    }
+    if ( len + 2 > sizeof(record) ) {
+        slurm_debug("auto_tmpdir::auto_tmpdir_event_end: record for phase %s too long, not logged", event->phase);
+        return;
+    }
+    record[len++] = '}';
+    record[len++] = '\n';
+    if ( write(auto_tmpdir_event_log_fd, record, len) != len ) {
+        slurm_debug("auto_tmpdir::auto_tmpdir_event_end: failed to write event log record (%m)");
+    }
+}
@@ -0,0 +1,75 @@
+/*
+ * event-log.h
+ *
+ * Phase timing and the append-only JSON-lines event log.
+ *
+ */
+
+#ifndef __AUTO_TMPDIR_EVENT_LOG_H__
+#define __AUTO_TMPDIR_EVENT_LOG_H__
+
+#include "auto_tmpdir_config.h"
+
+#include <time.h>
+
+/*
+ * @typedef auto_tmpdir_event_t
+ *
+ * A phase being timed.  Filled-in by auto_tmpdir_event_start() and consumed
+ * by auto_tmpdir_event_end().
+ */
+typedef struct auto_tmpdir_event {
+    const char          *phase;
+    const char          *path;
+    struct timespec     start;
+} auto_tmpdir_event_t;
+
+/*
+ * @function auto_tmpdir_event_log_open
+ *
+ * If the event_log option is present in the plugin configuration, open the
+ * event log (by default <state_dir>/auto_tmpdir_events.jsonl) for appending.
+ * The context (e.g. "prolog", "step", "epilog") is included in each record
+ * written by this process.  Subsequent calls only update the context.
+ *
+ * Returns 0 if the event log is open or was not requested, -1 on error.
+ */
+int auto_tmpdir_event_log_open(spank_t spank_ctxt, int argc, char *argv[], const char *context);
+
+/*
+ * @function auto_tmpdir_event_log_close
+ *
+ * Close the event log if it was opened.
+ */
+void auto_tmpdir_event_log_close(void);
+
+/*
+ * @function auto_tmpdir_event_start
+ *
+ * Note the start time of a phase.  The phase and path strings must remain
+ * valid until auto_tmpdir_event_end() is called; path may be NULL.
+ */
+void auto_tmpdir_event_start(auto_tmpdir_event_t *event, const char *phase, const char *path);
+
+/*
+ * @function auto_tmpdir_event_end
+ *
+ * Append a record for the phase to the event log (with a single write()):
+ * the elapsed time on the monotonic clock, plus the number of entries the
+ * phase handled (directories created, files removed, bindpoints serialized,
+ * etc.) and the number of errors it encountered.
+ *
+ * Does nothing if the event log is not open.
+ */
+void auto_tmpdir_event_end(auto_tmpdir_event_t *event, uint64_t entries, uint64_t errors);
+
+/*
+ * @function auto_tmpdir_event_json_string
+ *
+ * Append str as a JSON string literal (quoted and escaped) at offset len in
+ * buffer.  Returns the new length, which exceeds buffer_len if the buffer
+ * was too small.
+ */
+size_t auto_tmpdir_event_json_string(char *buffer, size_t buffer_len, size_t len, const char *str);
+
+#endif /* __AUTO_TMPDIR_EVENT_LOG_H__ */
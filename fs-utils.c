@@ -6,6 +6,8 @@
  */
 
 #include "fs-utils.h"
+#include "event-log.h"
+#include "metrics.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -13,22 +15,138 @@
 #include <fcntl.h>
 #include <fts.h>
 #include <sched.h>
+#include <signal.h>
+#include <pwd.h>
+#include <grp.h>
+#include <sys/wait.h>
+#include <sys/file.h>
+#include <sys/statvfs.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sys/xattr.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <fnmatch.h>
+
+/**/
+
+#ifdef AUTO_TMPDIR_ENABLE_USDT
+/*
+ * Semaphores for the USDT probes in this file:
+ */
+AUTO_TMPDIR_PROBE_SEMAPHORE(fs_init__entry);
+AUTO_TMPDIR_PROBE_SEMAPHORE(fs_init__return);
+AUTO_TMPDIR_PROBE_SEMAPHORE(fs_bind_mount__entry);
+AUTO_TMPDIR_PROBE_SEMAPHORE(fs_bind_mount__return);
+AUTO_TMPDIR_PROBE_SEMAPHORE(fs_mount__entry);
+AUTO_TMPDIR_PROBE_SEMAPHORE(fs_mount__return);
+AUTO_TMPDIR_PROBE_SEMAPHORE(fs_init_with_file__entry);
+AUTO_TMPDIR_PROBE_SEMAPHORE(fs_init_with_file__return);
+AUTO_TMPDIR_PROBE_SEMAPHORE(fs_serialize_to_file__entry);
+AUTO_TMPDIR_PROBE_SEMAPHORE(fs_serialize_to_file__return);
+AUTO_TMPDIR_PROBE_SEMAPHORE(rmdir_recurse__entry);
+AUTO_TMPDIR_PROBE_SEMAPHORE(rmdir_recurse__return);
+#endif
 
 /**/
 
 #ifdef AUTO_TMPDIR_NO_GID_CHOWN
 #   define NEEDS_CHOWN(F,U,G) ((F).st_uid != (U)) 
 #   define __auto_tmpdir_chown(P,U,G) (chown((P), (U), -1))
+#   define __auto_tmpdir_fchownat(D,P,U,G) (fchownat((D), (P), (U), -1, AT_SYMLINK_NOFOLLOW))
+#   define __auto_tmpdir_fchown(F,U,G) (fchown((F), (U), -1))
 #else
 #   define NEEDS_CHOWN(F,U,G) (((F).st_uid != (U)) || ((F).st_gid != (G))) 
 #   define __auto_tmpdir_chown(P,U,G) (chown((P), (U), (G)))
+#   define __auto_tmpdir_fchownat(D,P,U,G) (fchownat((D), (P), (U), (G), AT_SYMLINK_NOFOLLOW))
+#   define __auto_tmpdir_fchown(F,U,G) (fchown((F), (U), (G)))
+#endif
+
+/*
+ * What backs the directory that gets bind mounted:
+ */
+enum {
+    auto_tmpdir_fs_backend_dir = 0,     /* a plain directory */
+    auto_tmpdir_fs_backend_zram,        /* a filesystem on a per-job zram device */
+    auto_tmpdir_fs_backend_tmpfs        /* a per-job size-limited tmpfs */
+};
+
+typedef struct auto_tmpdir_fs_zram_config {
+    const char          *algorithm;
+    uint64_t            disk_size, mem_limit;
+} auto_tmpdir_fs_zram_config_t;
+
+/*
+ * The node's pool of pre-formatted zram devices (zram_pool=<N>):  each ready
+ * device has a record named zram<device> in the pool directory holding
+ * "<boot id> <disk size> <algorithm>".  Devices are only returned to the pool
+ * if they match config:
+ */
+typedef struct auto_tmpdir_fs_zram_pool {
+    unsigned int                    size;
+    char                            dir[PATH_MAX];
+    auto_tmpdir_fs_zram_config_t    config;
+} auto_tmpdir_fs_zram_pool_t;
+
+#define AUTO_TMPDIR_FS_ZRAM_POOL_MAX    64
+
+#ifndef BLKDISCARD
+#   define BLKDISCARD   _IO(0x12, 119)
 #endif
 
+static auto_tmpdir_fs_zram_pool_t auto_tmpdir_fs_zram_pool = { 0, "", { NULL, 0, 0 } };
+
+const char* __auto_tmpdir_fs_state_dir(int argc, char* argv[]);
+void __auto_tmpdir_fs_detach(int keep_fd);
+
+/*
+ * Usage totals gathered while walking (and usually removing) a directory:
+ */
+typedef struct auto_tmpdir_fs_usage {
+    uint64_t            bytes, inodes, max_fanout;
+    uint64_t            n_removed, n_errors;
+} auto_tmpdir_fs_usage_t;
+
+int __auto_tmpdir_fs_rmdir_usage(const char *path, int should_remove, int should_remove_children_only, auto_tmpdir_fs_usage_t *usage);
+
+/*
+ * The order in which recursive removal unlinks a directory's entries:  as
+ * readdir() returns them, or sorted by inode number (which keeps inode table
+ * and bitmap updates together on rotational disks).  The default is inode
+ * order only on filesystems whose device reports itself rotational:
+ */
+enum {
+    auto_tmpdir_fs_rmdir_order_auto = 0,
+    auto_tmpdir_fs_rmdir_order_directory,
+    auto_tmpdir_fs_rmdir_order_inode
+};
+
+static int auto_tmpdir_fs_rmdir_order = auto_tmpdir_fs_rmdir_order_auto;
+
+/*
+ * Extended attribute on a hand-off directory holding "<bytes> <inodes>":
+ */
+#define AUTO_TMPDIR_FS_HANDOFF_USAGE_XATTR  "trusted.auto_tmpdir.usage"
+
+/*
+ * Where the final usage of each bindpoint is reported as it is torn down:
+ */
+typedef struct auto_tmpdir_fs_accounting {
+    int                 fd;
+    uint32_t            job_id;
+    uid_t               u_owner;
+} auto_tmpdir_fs_accounting_t;
+
 typedef struct auto_tmpdir_fs_bindpoint {
     struct auto_tmpdir_fs_bindpoint *link, *back_link;
-    int                 is_bind_mounted, should_always_remove;
+    int                 is_bind_mounted, should_always_remove, should_never_remove;
+    int                 backend, device;
     const char          *bind_this_path;
     const char          *to_this_path;
+    const char          *template_path;     /* overlay lower layer, if any */
+    const char          *work_path;         /* overlay work directory */
 } auto_tmpdir_fs_bindpoint_t;
 
 /**/
@@ -37,7 +155,8 @@ auto_tmpdir_fs_bindpoint_t*
 auto_tmpdir_fs_bindpoint_alloc(
     const char      *bind_this_path,
     const char      *to_this_path,
-    int             should_always_remove
+    int             should_always_remove,
+    int             should_never_remove
 )
 {
     auto_tmpdir_fs_bindpoint_t  *new_rec = (auto_tmpdir_fs_bindpoint_t*)malloc(sizeof(auto_tmpdir_fs_bindpoint_t));
@@ -46,8 +165,12 @@ auto_tmpdir_fs_bindpoint_alloc(
         new_rec->link = new_rec->back_link = NULL;
         new_rec->is_bind_mounted = 0;
         new_rec->should_always_remove = should_always_remove;
+        new_rec->should_never_remove = should_never_remove;
         new_rec->bind_this_path = bind_this_path;
         new_rec->to_this_path = to_this_path;
+        new_rec->template_path = new_rec->work_path = NULL;
+        new_rec->backend = auto_tmpdir_fs_backend_dir;
+        new_rec->device = -1;
     }
     return new_rec;
 }
@@ -71,1046 +194,6023 @@ auto_tmpdir_fs_bindpoint_find_to_path(
 /**/
 
 int
-auto_tmpdir_fs_bindpoint_dealloc(
-    auto_tmpdir_fs_bindpoint_t  *bindpoint,
-    int                         should_not_delete,
-    int                         should_dealloc_only
+__auto_tmpdir_fs_parse_size(
+    const char      *str,
+    uint64_t        *size
 )
 {
-    int             rc = 0;
+    char            *end;
+    uint64_t        value = strtoull(str, &end, 10);
 
-    while ( bindpoint) {
-        auto_tmpdir_fs_bindpoint_t  *next = bindpoint->link;
-        int                         is_okay = 1;
+    if ( end == str ) return -1;
+    switch ( toupper(*end) ) {
+        case 'P':   value <<= 10;   /* fall through */
+        case 'T':   value <<= 10;   /* fall through */
+        case 'G':   value <<= 10;   /* fall through */
+        case 'M':   value <<= 10;   /* fall through */
+        case 'K':   value <<= 10;
+                    end++;
+                    if ( toupper(*end) == 'I' ) end++;
+                    if ( toupper(*end) == 'B' ) end++;
+                    /* fall through */
+        case '\0':  break;
+        default:    return -1;
+    }
+    if ( *end ) return -1;
+    *size = value;
+    return 0;
+}
 
-        slurm_debug("auto_tmpdir::auto_tmpdir_fs_bindpoint_dealloc: `%s` -> `%s` (%d|%d) %p", bindpoint->bind_this_path, bindpoint->to_this_path, bindpoint->is_bind_mounted, bindpoint->should_always_remove, next);
-        if ( ! should_dealloc_only ) {
-            if ( bindpoint->is_bind_mounted ) {
-                if ( umount2(bindpoint->to_this_path, MNT_FORCE) != 0 ) {
-                    slurm_info("auto_tmpdir::auto_tmpdir_fs_bindpoint_dealloc: unable to unmount bind point `%s` -> `%s`", bindpoint->to_this_path, bindpoint->bind_this_path);
-                    rc = -1;
-                    is_okay = 0;
-                    /*  Attempt to remove the bound path itself to drop all content: */
-                    if ( ! should_dealloc_only && (bindpoint->should_always_remove || ! should_not_delete) ) {
-                        slurm_debug("auto_tmpdir::auto_tmpdir_fs_bindpoint_dealloc: failed to unmount, removing content of directory `%s`", bindpoint->to_this_path);
-                        auto_tmpdir_rmdir_recurse(bindpoint->to_this_path, 1);
-                    }
-                } else {
-                    bindpoint->is_bind_mounted = 0;
-                }
-            }
-            if ( is_okay ) {
-                /* Remove the directory being bind mounted: */
-                if ( bindpoint->should_always_remove || ! should_not_delete ) {
-                    struct stat         finfo;
+/*
+ * A plain decimal count (seconds, minutes, devices) without size suffixes:
+ */
+int
+__auto_tmpdir_fs_parse_count(
+    const char      *str,
+    uint64_t        *count
+)
+{
+    char            *end;
+    unsigned long   value;
 
-                    if ( stat(bindpoint->bind_this_path, &finfo) == 0 ) {
-                        slurm_debug("auto_tmpdir::auto_tmpdir_fs_bindpoint_dealloc: removing directory `%s`", bindpoint->bind_this_path);
-                        if ( auto_tmpdir_rmdir_recurse(bindpoint->bind_this_path, 0) != 0 ) rc = -1;
-                    } else {
-                        slurm_debug("auto_tmpdir::auto_tmpdir_fs_bindpoint_dealloc: directory `%s` no longer exists", bindpoint->bind_this_path);
-                    }
-                }
-            }
-        }
-        
-        /* Deallocate this node: */
-        free((void*)bindpoint->bind_this_path);
-        free((void*)bindpoint->to_this_path);
-        free((void*)bindpoint);
+    if ( ! isdigit(*str) ) return -1;
+    errno = 0;
+    value = strtoul(str, &end, 10);
+    if ( *end || (errno == ERANGE) ) return -1;
+    *count = value;
+    return 0;
+}
 
-        slurm_debug("auto_tmpdir::auto_tmpdir_fs_bindpoint_dealloc: moving to next directory %p", next);
-        bindpoint = next;
+/**/
+
+int
+__auto_tmpdir_fs_usage(
+    const char      *path,
+    uint64_t        *bytes,
+    uint64_t        *inodes
+)
+{
+    char            *path_argv[2] = { (char*)path, NULL };
+    FTS             *ftsPtr = fts_open(path_argv, FTS_NOCHDIR | FTS_PHYSICAL | FTS_XDEV, NULL);
+    FTSENT          *ftsItem;
+
+    *bytes = *inodes = 0;
+    if ( ! ftsPtr ) return -1;
+    while ( (ftsItem = fts_read(ftsPtr)) ) {
+        switch ( ftsItem->fts_info ) {
+            case FTS_DP:
+            case FTS_NS:
+            case FTS_DNR:
+            case FTS_ERR:
+                break;
+            default:
+                *bytes += ftsItem->fts_statp->st_blocks * 512;
+                *inodes += 1;
+                break;
+        }
     }
-    return rc;
+    fts_close(ftsPtr);
+    return 0;
 }
 
 /**/
 
-typedef struct auto_tmpdir_fs {
-    auto_tmpdir_fs_options_t    options;
-    const char                  *tmpdir;
-    const char                  *base_dir, *base_dir_parent;
-    auto_tmpdir_fs_bindpoint_t  *bind_mounts, *bind_mounts_tail;
-} auto_tmpdir_fs;
+/*
+ * Each per-user cache directory <cache_prefix><uid> has a sidecar file
+ * <cache_prefix><uid>.usage holding the number of active jobs using it and its
+ * size as of the last job's epilog:
+ *
+ *     <active> <bytes> <inodes>
+ *
+ * The sidecar's mtime is the cache's last-use time for LRU eviction.  All
+ * updates are made with an exclusive flock() held on the sidecar.
+ *
+ * The jobs using a cache are tracked as marker files in the root-owned
+ * directory <cache_prefix><uid>.jobs, one named for each job id.  The <active>
+ * field is only a snapshot of their number:  a marker left behind by a job
+ * whose epilog never ran is removed by the slurmd sweep, whereas a bare
+ * counter would pin the cache forever.
+ */
+typedef struct {
+    uid_t           uid;
+    int             active;
+    uint64_t        bytes, inodes;
+    time_t          last_use;
+} auto_tmpdir_fs_cache_usage_t;
 
-/**/
+static int
+__auto_tmpdir_fs_cache_usage_read(
+    int                             fd,
+    auto_tmpdir_fs_cache_usage_t    *usage
+)
+{
+    char                    buffer[96];
+    ssize_t                 n = pread(fd, buffer, sizeof(buffer) - 1, 0);
+    unsigned long long      bytes = 0, inodes = 0;
 
-const char*
-__auto_tmpdir_fs_get_hostname(void)
+    usage->active = 0;
+    usage->bytes = usage->inodes = 0;
+    if ( n <= 0 ) return 0;
+    buffer[n] = '\0';
+    if ( sscanf(buffer, "%d %llu %llu", &usage->active, &bytes, &inodes) != 3 ) return -1;
+    usage->bytes = bytes;
+    usage->inodes = inodes;
+    return 0;
+}
+
+static int
+__auto_tmpdir_fs_cache_usage_write(
+    int                             fd,
+    auto_tmpdir_fs_cache_usage_t    *usage
+)
 {
-    static int      is_inited = 0;
-    static char     hostname[64];
+    char                    buffer[96];
+    int                     n = snprintf(buffer, sizeof(buffer), "%d %llu %llu\n", usage->active, (unsigned long long)usage->bytes, (unsigned long long)usage->inodes);
 
-    if ( ! is_inited ) {
-        int         i = 0;
+    if ( ftruncate(fd, 0) != 0 || pwrite(fd, buffer, n, 0) != n ) return -1;
+    return 0;
+}
 
-        /* 64 characters should be plenty -- DNS label length maxes at 63 */
-        gethostname(hostname, sizeof(hostname));
+/*
+ * Add (active_delta > 0) or remove (active_delta < 0) the marker for job_id
+ * and return the number of markers left, or -1 on error.  Must be called with
+ * the sidecar locked.
+ */
+static int
+__auto_tmpdir_fs_cache_jobs(
+    const char      *cache_dir,
+    uint32_t        job_id,
+    int             active_delta
+)
+{
+    char            jobs_path[PATH_MAX], marker[16];
+    int             dir_fd, n_active = 0;
+    DIR             *dir;
+    struct dirent   *dent;
 
-        /* Find the first dot (.) and NUL-terminate there (or at the end of the buffer): */
-        while ( (i < sizeof(hostname)) && (hostname[i] && (hostname[i] != '.')) ) i++;
-        hostname[i] = '\0';
-        is_inited = 1;
+    if ( snprintf(jobs_path, sizeof(jobs_path), "%s.jobs", cache_dir) >= sizeof(jobs_path) ) return -1;
+    if ( (active_delta > 0) && (mkdir(jobs_path, 0700) != 0) && (errno != EEXIST) ) return -1;
+    if ( (dir_fd = open(jobs_path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0 ) return (errno == ENOENT) ? 0 : -1;
+    snprintf(marker, sizeof(marker), "%u", job_id);
+    if ( active_delta > 0 ) {
+        int         fd = openat(dir_fd, marker, O_WRONLY | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0600);
+
+        if ( fd < 0 ) {
+            close(dir_fd);
+            return -1;
+        }
+        close(fd);
     }
-    return hostname;
+    else if ( active_delta < 0 ) {
+        unlinkat(dir_fd, marker, 0);
+    }
+    if ( ! (dir = fdopendir(dir_fd)) ) {
+        close(dir_fd);
+        return -1;
+    }
+    while ( (dent = readdir(dir)) ) if ( isdigit(dent->d_name[0]) ) n_active++;
+    closedir(dir);
+    return n_active;
 }
 
-/**/
-
-const char*
-__auto_tmpdir_fs_path_create(
-    const char                  *prefix,
-    auto_tmpdir_fs_options_t    options,
-    uint32_t                    job_id
+int
+__auto_tmpdir_fs_cache_update(
+    const char      *cache_dir,
+    uint32_t        job_id,
+    int             active_delta,
+    int             should_measure
 )
 {
-    const char      *hostname = "";
-    size_t          out_path_len = strlen(prefix) + 10 + 1;
-    char            *out_path;
-    int             has_hostname = 0;
+    char                            usage_path[PATH_MAX];
+    int                             fd, n_active;
+    auto_tmpdir_fs_cache_usage_t    usage;
 
-    if ( (options & auto_tmpdir_fs_options_should_use_per_host) == auto_tmpdir_fs_options_should_use_per_host ) {
-        hostname = __auto_tmpdir_fs_get_hostname();
-        out_path_len += strlen(hostname) + 1;
-        has_hostname = 1;
+    if ( snprintf(usage_path, sizeof(usage_path), "%s.usage", cache_dir) >= sizeof(usage_path) ) {
+        slurm_info("auto_tmpdir::__auto_tmpdir_fs_cache_update: sidecar path for `%s` is too long", cache_dir);
+        return -1;
     }
-    out_path = malloc(out_path_len);
-    if ( ! out_path ) {
-        slurm_info("auto_tmpdir: unable to allocate job path relative to `%s`", prefix);
-        return NULL;
+    if ( (fd = open(usage_path, O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0600)) < 0 ) {
+        slurm_info("auto_tmpdir::__auto_tmpdir_fs_cache_update: unable to open `%s` (%m)", usage_path);
+        return -1;
     }
-    if ( has_hostname ) {
-        snprintf(out_path, out_path_len, "%1$s%2$u/%3$s", prefix, job_id, hostname);
-    } else {
-        snprintf(out_path, out_path_len, "%1$s%2$u", prefix, job_id);
+    if ( flock(fd, LOCK_EX) != 0 ) {
+        slurm_info("auto_tmpdir::__auto_tmpdir_fs_cache_update: unable to lock `%s` (%m)", usage_path);
+        close(fd);
+        return -1;
     }
-    return out_path;
+    __auto_tmpdir_fs_cache_usage_read(fd, &usage);
+    if ( (n_active = __auto_tmpdir_fs_cache_jobs(cache_dir, job_id, active_delta)) < 0 ) {
+        slurm_info("auto_tmpdir::__auto_tmpdir_fs_cache_update: unable to update job markers of `%s` (%m)", cache_dir);
+        if ( active_delta > 0 ) {
+            close(fd);
+            return -1;
+        }
+        n_active = 0;
+    }
+    usage.active = n_active;
+    if ( should_measure ) __auto_tmpdir_fs_usage(cache_dir, &usage.bytes, &usage.inodes);
+    if ( __auto_tmpdir_fs_cache_usage_write(fd, &usage) != 0 ) {
+        slurm_info("auto_tmpdir::__auto_tmpdir_fs_cache_update: unable to update `%s` (%m)", usage_path);
+    }
+    slurm_debug("auto_tmpdir::__auto_tmpdir_fs_cache_update: `%s` active=%d bytes=%llu inodes=%llu", cache_dir, usage.active, (unsigned long long)usage.bytes, (unsigned long long)usage.inodes);
+    close(fd);
+    return 0;
 }
 
-/**/
+static int
+__auto_tmpdir_fs_cache_usage_cmp(
+    const void      *a,
+    const void      *b
+)
+{
+    time_t          ta = ((const auto_tmpdir_fs_cache_usage_t*)a)->last_use;
+    time_t          tb = ((const auto_tmpdir_fs_cache_usage_t*)b)->last_use;
 
-int
-__auto_tmpdir_fs_create_bindpoint(
-    auto_tmpdir_fs      *fs_info,
-    const char          *bind_this_path,
-    const char          *to_this_path,
-    int                 should_always_remove,
-    int                 force_head_of_list,
-    uid_t               u_owner,
-    gid_t               g_owner
+    return (ta < tb) ? -1 : ((ta > tb) ? 1 : 0);
+}
+
+void
+__auto_tmpdir_fs_cache_evict(
+    const char      *cache_prefix,
+    uid_t           u_owner,
+    uint64_t        max_bytes,
+    uint64_t        max_inodes
 )
 {
-    struct stat         finfo;
+    char                            prefix_dir[PATH_MAX];
+    const char                      *prefix_base = strrchr(cache_prefix, '/') + 1;
+    size_t                          prefix_base_len = strlen(prefix_base);
+    auto_tmpdir_fs_cache_usage_t    *caches = NULL;
+    size_t                          n_caches = 0, n_caches_max = 0, i;
+    uint64_t                        total_bytes = 0, total_inodes = 0;
+    DIR                             *dir;
+    struct dirent                   *dent;
+    int                             dir_fd;
+
+    if ( ! max_bytes && ! max_inodes ) return;
+
+    snprintf(prefix_dir, sizeof(prefix_dir), "%.*s", (int)(prefix_base - cache_prefix), cache_prefix);
+    if ( ! (dir = opendir(prefix_dir)) ) return;
+    dir_fd = dirfd(dir);
 
     /*
-     * If the directory exists, no need to create it:
+     * Survey all sidecar files -- <prefix_base><uid>.usage:
      */
-    if ( lstat(bind_this_path, &finfo) != 0 ) {
-        /*
-         * Create the directory:
-         */
-force_mkdir:
-        if ( mkdir(bind_this_path, S_IRWXU) != 0 ) {
-            slurm_error("auto_tmpdir::__auto_tmpdir_fs_create_bindpoint: unable to create directory `%s` (%m)", bind_this_path);
-            return -1;
-        }
-        slurm_debug("auto_tmpdir::__auto_tmpdir_fs_create_bindpoint: created directory `%s`", bind_this_path);
+    while ( (dent = readdir(dir)) ) {
+        auto_tmpdir_fs_cache_usage_t    usage;
+        struct stat                     finfo;
+        char                            *end;
+        int                             fd;
 
-        /*
-         * Fixup ownership:
-         */
-force_chown:
-        if ( __auto_tmpdir_chown(bind_this_path, u_owner, g_owner) ) {
-            slurm_error("auto_tmpdir::__auto_tmpdir_fs_create_bindpoint: unable to fixup ownership on directory `%s` (%m)", bind_this_path);
-            auto_tmpdir_rmdir_recurse(bind_this_path, 0);
-            return -1;
-        }
-        slurm_debug("auto_tmpdir::__auto_tmpdir_fs_create_bindpoint: set ownership %d:%d on directory `%s`", u_owner, g_owner, bind_this_path);
-    } else if ( ! S_ISDIR(finfo.st_mode) ) {
-        slurm_info("auto_tmpdir::__auto_tmpdir_fs_create_bindpoint: path `%s` exists but is not a directory", bind_this_path);
+        if ( strncmp(dent->d_name, prefix_base, prefix_base_len) || ! isdigit(dent->d_name[prefix_base_len]) ) continue;
+        usage.uid = strtoul(dent->d_name + prefix_base_len, &end, 10);
+        if ( strcmp(end, ".usage") ) continue;
+        if ( (fd = openat(dir_fd, dent->d_name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW)) < 0 ) continue;
+        if ( fstat(fd, &finfo) == 0 && __auto_tmpdir_fs_cache_usage_read(fd, &usage) == 0 ) {
+            char                        cache_dir[PATH_MAX];
 
-        /*
-         * Attempt to remove the offending file, socket, whatever:
-         */
-        if ( unlink(bind_this_path) != 0 ) {
-            slurm_error("auto_tmpdir::__auto_tmpdir_fs_create_bindpoint: path `%s` is not a directory and could not be removed (%m)", bind_this_path);
-            return -1;
-        }
+            if ( snprintf(cache_dir, sizeof(cache_dir), "%s%u", cache_prefix, usage.uid) >= sizeof(cache_dir) ) {
+                close(fd);
+                continue;
+            }
+            usage.active = __auto_tmpdir_fs_cache_jobs(cache_dir, 0, 0);
+            usage.last_use = finfo.st_mtime;
+            if ( n_caches == n_caches_max ) {
+                auto_tmpdir_fs_cache_usage_t    *new_caches = realloc(caches, (n_caches_max + 32) * sizeof(*caches));
 
-        /*
-         * Now go back and try to create the directory:
-         */
-        goto force_mkdir;
-    } else if ( NEEDS_CHOWN(finfo, u_owner, g_owner) ) {
-        /*
-         * Go back and try to change ownership:
-         */
-        goto force_chown;
+                if ( ! new_caches ) {
+                    close(fd);
+                    break;
+                }
+                caches = new_caches;
+                n_caches_max += 32;
+            }
+            caches[n_caches++] = usage;
+            total_bytes += usage.bytes;
+            total_inodes += usage.inodes;
+        }
+        close(fd);
     }
+    closedir(dir);
+    slurm_debug("auto_tmpdir::__auto_tmpdir_fs_cache_evict: %zu caches under `%s` using %llu bytes, %llu inodes", n_caches, cache_prefix, (unsigned long long)total_bytes, (unsigned long long)total_inodes);
 
     /*
-     * Create the bind mount record:
+     * Evict least-recently-used caches that are not in use until we're under
+     * budget:
      */
-    auto_tmpdir_fs_bindpoint_t      *bindpoint = auto_tmpdir_fs_bindpoint_alloc(bind_this_path, to_this_path, should_always_remove);
+    qsort(caches, n_caches, sizeof(*caches), __auto_tmpdir_fs_cache_usage_cmp);
+    for ( i = 0; i < n_caches; i++ ) {
+        char                            cache_dir[PATH_MAX], usage_path[PATH_MAX];
+        auto_tmpdir_fs_cache_usage_t    usage;
+        int                             fd;
 
-    if ( ! bindpoint ) {
-        slurm_error("auto_tmpdir::__auto_tmpdir_fs_create_bindpoint: unable to create bind mount record for `%s`", bind_this_path);
-        auto_tmpdir_rmdir_recurse(bind_this_path, 0);
-        return -1;
-    }
-    slurm_debug("auto_tmpdir::__auto_tmpdir_fs_create_bindpoint: added bindpoint `%s` -> `%s`", bind_this_path, to_this_path);
+        if ( ! ((max_bytes && (total_bytes > max_bytes)) || (max_inodes && (total_inodes > max_inodes))) ) break;
+        if ( caches[i].uid == u_owner || caches[i].active ) continue;
 
-    if ( force_head_of_list || (fs_info->base_dir_parent && (strcmp(fs_info->base_dir_parent, to_this_path) == 0)) ) {
-        /*
-         * Add this bind point at the FRONT of the list, so that it's mounted LAST and unmounted FIRST:
-         */
-        if ( fs_info->bind_mounts ) {
-            bindpoint->link = fs_info->bind_mounts;
-            fs_info->bind_mounts->back_link = bindpoint;
-            fs_info->bind_mounts = bindpoint;
-        } else {
-            fs_info->bind_mounts = fs_info->bind_mounts_tail = bindpoint;
+        if ( snprintf(cache_dir, sizeof(cache_dir), "%s%u", cache_prefix, caches[i].uid) >= sizeof(cache_dir) ) continue;
+        if ( snprintf(usage_path, sizeof(usage_path), "%s.usage", cache_dir) >= sizeof(usage_path) ) continue;
+        if ( (fd = open(usage_path, O_RDWR | O_CLOEXEC | O_NOFOLLOW)) < 0 ) continue;
+        if ( flock(fd, LOCK_EX) == 0 && __auto_tmpdir_fs_cache_usage_read(fd, &usage) == 0 && __auto_tmpdir_fs_cache_jobs(cache_dir, 0, 0) == 0 ) {
+            usage.active = 0;
+            slurm_info("auto_tmpdir::__auto_tmpdir_fs_cache_evict: evicting cache `%s` (%llu bytes, %llu inodes)", cache_dir, (unsigned long long)usage.bytes, (unsigned long long)usage.inodes);
+            auto_tmpdir_rmdir_recurse(cache_dir, 0);
+            total_bytes -= (usage.bytes < total_bytes) ? usage.bytes : total_bytes;
+            total_inodes -= (usage.inodes < total_inodes) ? usage.inodes : total_inodes;
+            usage.bytes = usage.inodes = 0;
+            __auto_tmpdir_fs_cache_usage_write(fd, &usage);
         }
-    } else {
-        if ( fs_info->bind_mounts_tail ) {
-            fs_info->bind_mounts_tail->link = bindpoint;
-            bindpoint->back_link = fs_info->bind_mounts_tail;
-            fs_info->bind_mounts_tail = bindpoint;
-        } else {
-            fs_info->bind_mounts = fs_info->bind_mounts_tail = bindpoint;
+        close(fd);
+    }
+    if ( caches ) free((void*)caches);
+}
+
+/*
+ * Drop the markers of jobs that are no longer active from every cache under
+ * the prefix; returns the number of markers removed.
+ */
+static int
+__auto_tmpdir_fs_cache_sweep_jobs(
+    const char                      *cache_prefix,
+    auto_tmpdir_fs_job_is_active_f  is_active,
+    void                            *context
+)
+{
+    char                            prefix_dir[PATH_MAX];
+    const char                      *prefix_base = strrchr(cache_prefix, '/') + 1;
+    size_t                          prefix_base_len = strlen(prefix_base);
+    DIR                             *dir;
+    struct dirent                   *dent;
+    int                             n_swept = 0;
+
+    snprintf(prefix_dir, sizeof(prefix_dir), "%.*s", (int)(prefix_base - cache_prefix), cache_prefix);
+    if ( ! (dir = opendir(prefix_dir)) ) return 0;
+    while ( (dent = readdir(dir)) ) {
+        char                        cache_dir[PATH_MAX], usage_path[PATH_MAX];
+        auto_tmpdir_fs_cache_usage_t usage;
+        DIR                         *jobs_dir;
+        struct dirent               *job_dent;
+        int                         fd, jobs_fd;
+        char                        *end;
+
+        if ( strncmp(dent->d_name, prefix_base, prefix_base_len) || ! isdigit(dent->d_name[prefix_base_len]) ) continue;
+        usage.uid = strtoul(dent->d_name + prefix_base_len, &end, 10);
+        if ( strcmp(end, ".jobs") ) continue;
+        if ( snprintf(cache_dir, sizeof(cache_dir), "%s%u", cache_prefix, usage.uid) >= sizeof(cache_dir) ) continue;
+        if ( snprintf(usage_path, sizeof(usage_path), "%s.usage", cache_dir) >= sizeof(usage_path) ) continue;
+        if ( (fd = open(usage_path, O_RDWR | O_CLOEXEC | O_NOFOLLOW)) < 0 ) continue;
+        if ( flock(fd, LOCK_EX) != 0 || __auto_tmpdir_fs_cache_usage_read(fd, &usage) != 0 ) {
+            close(fd);
+            continue;
+        }
+        if ( (jobs_fd = openat(dirfd(dir), dent->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) >= 0 ) {
+            if ( (jobs_dir = fdopendir(jobs_fd)) ) {
+                while ( (job_dent = readdir(jobs_dir)) ) {
+                    unsigned long   job_id;
+
+                    if ( ! isdigit(job_dent->d_name[0]) ) continue;
+                    job_id = strtoul(job_dent->d_name, &end, 10);
+                    if ( *end || is_active(job_id, context) ) continue;
+                    slurm_info("auto_tmpdir::__auto_tmpdir_fs_cache_sweep_jobs: job %lu no longer uses cache `%s`", job_id, cache_dir);
+                    if ( unlinkat(jobs_fd, job_dent->d_name, 0) == 0 ) n_swept++;
+                }
+                closedir(jobs_dir);
+            } else {
+                close(jobs_fd);
+            }
         }
+        if ( (usage.active = __auto_tmpdir_fs_cache_jobs(cache_dir, 0, 0)) < 0 ) usage.active = 0;
+        __auto_tmpdir_fs_cache_usage_write(fd, &usage);
+        close(fd);
     }
-    return 0;
+    closedir(dir);
+    return n_swept;
 }
 
 /**/
 
-static const char *auto_tmpdir_fs_dev_shm = AUTO_TMPDIR_DEV_SHM;
-static const char *auto_tmpdir_fs_dev_shm_prefix = AUTO_TMPDIR_DEV_SHM_PREFIX;
-static const char *auto_tmpdir_fs_default_local_prefix = AUTO_TMPDIR_DEFAULT_LOCAL_PREFIX;
-static const char *auto_tmpdir_fs_default_shared_prefix = AUTO_TMPDIR_DEFAULT_SHARED_PREFIX;
+static int
+__auto_tmpdir_fs_sysfs_write(
+    const char      *path,
+    const char      *value
+)
+{
+    int             fd = open(path, O_WRONLY), rc = 0;
+
+    if ( fd < 0 ) return -1;
+    if ( write(fd, value, strlen(value)) < 0 ) rc = -1;
+    close(fd);
+    return rc;
+}
 
 /**/
 
-auto_tmpdir_fs_ref
-auto_tmpdir_fs_init(
-    spank_t                     spank_ctxt,
-    int                         argc,
-    char*                       argv[],
-    auto_tmpdir_fs_options_t    options
+static int
+__auto_tmpdir_fs_sysfs_read(
+    const char      *path,
+    char            *buffer,
+    size_t          buffer_len
 )
 {
-    auto_tmpdir_fs              *new_fs;
-    int                         should_check_bind_order = 1, i;
-    uint32_t                    job_id = NO_VAL;
-    uid_t                       u_owner;
-    gid_t                       g_owner;
-    const char                  *local_prefix = auto_tmpdir_fs_default_local_prefix, *shared_prefix = auto_tmpdir_fs_default_shared_prefix;
-    const char                  *tmpdir = NULL;
-    int                         rc;
-    size_t                      prefix_len;
+    int             fd = open(path, O_RDONLY);
+    ssize_t         n_bytes;
 
-    /* What user should we function as? */
-    if ((rc = spank_get_item (spank_ctxt, S_JOB_UID, &u_owner)) != ESPANK_SUCCESS) {
-        slurm_error ("auto_tmpdir: auto_tmpdir_fs_init: unable to get job's user id");
-        return NULL;
+    if ( fd < 0 ) return -1;
+    n_bytes = read(fd, buffer, buffer_len - 1);
+    close(fd);
+    if ( n_bytes < 0 ) return -1;
+    buffer[n_bytes] = '\0';
+    return 0;
+}
+
+/**/
+
+/*
+ * Reset a zram device (dropping its content) and hot-remove it:
+ */
+static int
+__auto_tmpdir_fs_zram_remove(
+    int                         device
+)
+{
+    char                        sysfs_path[64], value[32];
+    int                         rc = 0;
+
+    snprintf(sysfs_path, sizeof(sysfs_path), "/sys/block/zram%d/reset", device);
+    if ( __auto_tmpdir_fs_sysfs_write(sysfs_path, "1") != 0 ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_fs_zram_remove: unable to reset /dev/zram%d (%m)", device);
+        rc = -1;
     }
-    
-#ifndef AUTO_TMPDIR_NO_GID_CHOWN
-    if ((rc = spank_get_item (spank_ctxt, S_JOB_GID, &g_owner)) != ESPANK_SUCCESS) {
-        slurm_error ("auto_tmpdir: auto_tmpdir_fs_init: unable to get job's group id");
-        return NULL;
+    snprintf(value, sizeof(value), "%d", device);
+    if ( __auto_tmpdir_fs_sysfs_write("/sys/class/zram-control/hot_remove", value) != 0 ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_fs_zram_remove: unable to remove /dev/zram%d (%m)", device);
+        rc = -1;
+    } else {
+        slurm_debug("auto_tmpdir::__auto_tmpdir_fs_zram_remove: removed /dev/zram%d", device);
     }
-#else
-    g_owner = -1;
-#endif
+    return rc;
+}
 
-    /* Get the base job id: */
-    if ( (rc = spank_get_item(spank_ctxt, S_JOB_ID, &job_id)) != ESPANK_SUCCESS ) {
-        slurm_error("auto_tmpdir: auto_tmpdir_fs_init: no job id associated with job??");
-        return NULL;
+/*
+ * Build an empty filesystem on a zram device -- no journal (the content is
+ * disposable) and no reserved blocks:
+ */
+static int
+__auto_tmpdir_fs_zram_mkfs(
+    int                         device
+)
+{
+    char                        device_path[32];
+    pid_t                       mkfs_pid;
+    int                         mkfs_status;
+
+    snprintf(device_path, sizeof(device_path), "/dev/zram%d", device);
+    mkfs_pid = fork();
+    if ( mkfs_pid == 0 ) {
+        int         devnull = open("/dev/null", O_RDWR);
+
+        if ( devnull >= 0 ) {
+            dup2(devnull, STDIN_FILENO);
+            dup2(devnull, STDOUT_FILENO);
+            dup2(devnull, STDERR_FILENO);
+        }
+        execl(AUTO_TMPDIR_MKFS_PATH, AUTO_TMPDIR_MKFS_PATH, "-q", "-F", "-m", "0", "-O", "^has_journal", "-E", "nodiscard", device_path, NULL);
+        _exit(127);
     }
+    if ( (mkfs_pid < 0) || (waitpid(mkfs_pid, &mkfs_status, 0) != mkfs_pid) || ! WIFEXITED(mkfs_status) || (WEXITSTATUS(mkfs_status) != 0) ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_fs_zram_mkfs: unable to create filesystem on %s", device_path);
+        return -1;
+    }
+    return 0;
+}
 
-    slurm_debug("auto_tmpdir::auto_tmpdir_fs_init: %u for owner %d:%d", job_id, u_owner, g_owner);
+/*
+ * Hot-add a zram device configured per zram_config and format it.  Returns
+ * the device number, or -1 (with nothing left behind) on failure:
+ */
+static int
+__auto_tmpdir_fs_zram_create(
+    auto_tmpdir_fs_zram_config_t    *zram_config
+)
+{
+    char                            sysfs_path[64], value[32];
+    int                             device;
 
-    /*
-     * First pass through the arguments to the plugin -- pull the local and/or shared prefix if present:
-     */
-    i = 0;
-    while ( i < argc ) {
-        if ( strncmp(argv[i], "local_prefix=", 13) == 0 ) {
-            local_prefix = argv[i] + 13;
-            if ( *local_prefix != '/' ) {
-                slurm_error("auto_tmpdir::auto_tmpdir_fs_init: invalid local_prefix in plugstack configuration (%s)", local_prefix);
-                return NULL;
-            }
+    if ( (__auto_tmpdir_fs_sysfs_read("/sys/class/zram-control/hot_add", value, sizeof(value)) != 0) || (sscanf(value, "%d", &device) != 1) ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_fs_zram_create: unable to add a zram device (%m)");
+        return -1;
+    }
+
+    /* The compression algorithm and memory limit must be set before the size: */
+    if ( zram_config->algorithm ) {
+        snprintf(sysfs_path, sizeof(sysfs_path), "/sys/block/zram%d/comp_algorithm", device);
+        if ( __auto_tmpdir_fs_sysfs_write(sysfs_path, zram_config->algorithm) != 0 ) {
+            slurm_error("auto_tmpdir::__auto_tmpdir_fs_zram_create: unable to set compression algorithm `%s` on /dev/zram%d (%m)", zram_config->algorithm, device);
+            goto error_out;
         }
-        else if ( strncmp(argv[i], "shared_prefix=", 14) == 0 ) {
-            shared_prefix = argv[i] + 14;
-            if ( *shared_prefix != '/' ) {
-                slurm_error("auto_tmpdir::auto_tmpdir_fs_init: invalid shared_prefix in plugstack configuration (%s)", shared_prefix);
-                return NULL;
-            }
+    }
+    if ( zram_config->mem_limit ) {
+        snprintf(sysfs_path, sizeof(sysfs_path), "/sys/block/zram%d/mem_limit", device);
+        snprintf(value, sizeof(value), "%llu", (unsigned long long)zram_config->mem_limit);
+        if ( __auto_tmpdir_fs_sysfs_write(sysfs_path, value) != 0 ) {
+            slurm_error("auto_tmpdir::__auto_tmpdir_fs_zram_create: unable to set memory limit on /dev/zram%d (%m)", device);
+            goto error_out;
         }
-        else if ( strncmp(argv[i], "tmpdir=", 7) == 0 ) {
-            tmpdir = argv[i] + 7;
-            if ( *tmpdir != '/' ) {
-                slurm_error("auto_tmpdir::auto_tmpdir_fs_init: invalid tmpdir in plugstack configuration (%s)", tmpdir);
-                return NULL;
+    }
+    snprintf(sysfs_path, sizeof(sysfs_path), "/sys/block/zram%d/disksize", device);
+    snprintf(value, sizeof(value), "%llu", (unsigned long long)zram_config->disk_size);
+    if ( __auto_tmpdir_fs_sysfs_write(sysfs_path, value) != 0 ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_fs_zram_create: unable to set size of /dev/zram%d (%m)", device);
+        goto error_out;
+    }
+    if ( __auto_tmpdir_fs_zram_mkfs(device) != 0 ) goto error_out;
+    return device;
+
+error_out:
+    __auto_tmpdir_fs_zram_remove(device);
+    return -1;
+}
+
+/**/
+
+/*
+ * Read the pool settings (zram_pool, zram_size, zram_algorithm) from the
+ * plugin arguments.  Returns the pool size, -1 on a configuration error:
+ */
+static int
+__auto_tmpdir_fs_zram_pool_config(
+    int                         argc,
+    char*                       argv[],
+    auto_tmpdir_fs_zram_pool_t  *pool
+)
+{
+    const char                  *state_dir;
+    uint64_t                    size = 0;
+    int                         i = 0;
+
+    pool->size = 0;
+    pool->dir[0] = '\0';
+    pool->config.algorithm = NULL;
+    pool->config.disk_size = pool->config.mem_limit = 0;
+    while ( i < argc ) {
+        if ( strncmp(argv[i], "zram_pool=", 10) == 0 ) {
+            if ( (__auto_tmpdir_fs_parse_count(argv[i] + 10, &size) != 0) || (size > AUTO_TMPDIR_FS_ZRAM_POOL_MAX) ) {
+                slurm_error("auto_tmpdir::__auto_tmpdir_fs_zram_pool_config: invalid zram_pool in plugstack configuration (%s)", argv[i] + 10);
+                return -1;
             }
         }
-        else if ( strcmp(argv[i], "no_dev_shm") == 0 ) {
-                slurm_debug("auto_tmpdir::auto_tmpdir_fs_init: no_dev_shm set, will not add /dev/shm bind mounts");
-            options |= auto_tmpdir_fs_options_should_not_map_dev_shm;
-        }
-        else if ( strcmp(argv[i], "no_rm_shared_only") == 0 ) {
-            if ( (options & auto_tmpdir_fs_options_should_use_shared) != auto_tmpdir_fs_options_should_use_shared ) {
-                slurm_debug("auto_tmpdir::auto_tmpdir_fs_init: no_rm_shared_only set, ensuring no should_not_delete bit in options");
-                options &= ~auto_tmpdir_fs_options_should_not_delete;
+        else if ( strncmp(argv[i], "zram_size=", 10) == 0 ) {
+            if ( __auto_tmpdir_fs_parse_size(argv[i] + 10, &pool->config.disk_size) != 0 ) {
+                slurm_error("auto_tmpdir::__auto_tmpdir_fs_zram_pool_config: invalid zram_size in plugstack configuration (%s)", argv[i] + 10);
+                return -1;
             }
         }
-        else if ( strcmp(argv[i], "no_bind_order_check") == 0 ) {
-            slurm_debug("auto_tmpdir::auto_tmpdir_fs_init: no_bind_order_check set, will not check bind mount order");
-            should_check_bind_order = 0;
+        else if ( strncmp(argv[i], "zram_algorithm=", 15) == 0 ) {
+            pool->config.algorithm = argv[i] + 15;
         }
         i++;
     }
+    if ( ! (state_dir = __auto_tmpdir_fs_state_dir(argc, argv)) ) return -1;
+    if ( snprintf(pool->dir, sizeof(pool->dir), "%s/auto_tmpdir_zram_pool", state_dir) >= sizeof(pool->dir) ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_fs_zram_pool_config: state_dir path too long (%s)", state_dir);
+        pool->dir[0] = '\0';
+        return -1;
+    }
+    if ( size && ! pool->config.disk_size ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_fs_zram_pool_config: zram_pool requires zram_size in plugstack configuration");
+        return -1;
+    }
+    pool->size = size;
+    return pool->size;
+}
 
-    slurm_debug("auto_tmpdir::auto_tmpdir_fs_init: local_prefix=%s", local_prefix);
-    if ( shared_prefix ) slurm_debug("auto_tmpdir::auto_tmpdir_fs_init: shared_prefix=%s", shared_prefix);
-    if ( tmpdir ) slurm_debug("auto_tmpdir::auto_tmpdir_fs_init: tmpdir=%s", tmpdir);
+/*
+ * The kernel's boot id, which tells a pool record written since the node
+ * last booted from a stale one whose device number may have been reused:
+ */
+static int
+__auto_tmpdir_fs_boot_id(
+    char                        *boot_id,
+    size_t                      boot_id_len
+)
+{
+    char                        *eol;
 
-    /*
-     * All set:
-     */
-    if ( (new_fs = (auto_tmpdir_fs*)malloc(sizeof(auto_tmpdir_fs))) ) {
-        new_fs->options = options;
-        new_fs->tmpdir = tmpdir ? strdup(tmpdir) : NULL;
-        new_fs->base_dir = new_fs->base_dir_parent = NULL;
-        new_fs->bind_mounts = new_fs->bind_mounts_tail = NULL;
+    if ( __auto_tmpdir_fs_sysfs_read("/proc/sys/kernel/random/boot_id", boot_id, boot_id_len) != 0 ) return -1;
+    if ( (eol = strchr(boot_id, '\n')) ) *eol = '\0';
+    return 0;
+}
 
-        /*
-         * Go through the config arguments and create each mount point specified:
-         */
-        i = 0;
-        while ( i < argc ) {
-            if ( strncmp(argv[i], "mount=", 6) == 0 ) {
-                const char      *bind_to = argv[i] + 6;
-                size_t          bind_to_len = strlen(bind_to);
-                
-                if ( *bind_to != '/' ) {
-                    slurm_error("auto_tmpdir::auto_tmpdir_fs_init: invalid mount in plugstack configuration (%s)", bind_to);
-                    goto error_out;
-                }
-                while ( bind_to_len && (bind_to[bind_to_len - 1] == '/') ) bind_to_len--;
-                if ( bind_to_len == 0 ) {
-                    slurm_error("auto_tmpdir::auto_tmpdir_fs_init: invalid mount in plugstack configuration (%s)", bind_to);
-                    goto error_out;
-                }
-                
-                /*
-                 * Make sure we haven't already registered it:
-                 */
-                if ( auto_tmpdir_fs_bindpoint_find_to_path(new_fs->bind_mounts, bind_to, bind_to_len) ) {
-                    slurm_info("auto_tmpdir::auto_tmpdir_fs_init: ignoring repeated mount in plugstack configuration (%s)", bind_to);
-                    i++;
-                    continue;
-                }
+/*
+ * The compression algorithm in use on a zram device (the bracketed entry of
+ * its comp_algorithm list):
+ */
+static int
+__auto_tmpdir_fs_zram_algorithm(
+    int                         device,
+    char                        *algorithm,
+    size_t                      algorithm_len
+)
+{
+    char                        sysfs_path[64], value[256];
+    char                        *start, *end;
 
-                /*
-                 * First time through we need to pick a prefix path and get the parent directory for all
-                 * bind mounts created:
-                 */
-                if ( ! new_fs->base_dir ) {
-                    const char      *prefix = local_prefix;
+    snprintf(sysfs_path, sizeof(sysfs_path), "/sys/block/zram%d/comp_algorithm", device);
+    if ( __auto_tmpdir_fs_sysfs_read(sysfs_path, value, sizeof(value)) != 0 ) return -1;
+    if ( ! (start = strchr(value, '[')) || ! (end = strchr(++start, ']')) || (end - start >= algorithm_len) ) return -1;
+    memcpy(algorithm, start, end - start);
+    algorithm[end - start] = '\0';
+    return 0;
+}
 
-                    if ( (options & auto_tmpdir_fs_options_should_use_shared) == auto_tmpdir_fs_options_should_use_shared ) {
-                        if ( ! shared_prefix ) {
-                            slurm_error("auto_tmpdir::auto_tmpdir_fs_init: shared tmp directory requested but not configured");
-                            goto error_out;
-                        }
-                        prefix = shared_prefix;
-                    }
-                    
-                    /*
-                     * Find the parent directory of the base_dir:
-                     */
-                    if ( should_check_bind_order ) {
-                        const char          *end = prefix + strlen(prefix);
-                        char                *base_dir_parent;
-                        
-                        while ( (end > prefix) ) {
-                            if ( *(--end) == '/' ) break;
-                        }
-                        if ( end <= prefix ) {
-                            slurm_error("auto_tmpdir::auto_tmpdir_fs_init: using the root directory is not supported");
-                            goto error_out;
-                        }
-                        base_dir_parent = (char*)malloc(end - prefix + 1);
-                        if ( ! base_dir_parent ) {
-                            slurm_error("auto_tmpdir::auto_tmpdir_fs_init: unable to allocate base directory parent");
-                            goto error_out;
-                        }
-                        strncpy(base_dir_parent, prefix, (end - prefix));
-                        base_dir_parent[end - prefix] = '\0';
-                        new_fs->base_dir_parent = (const char*)base_dir_parent;
-                    }
-                    new_fs->base_dir = __auto_tmpdir_fs_path_create(
-                                                            prefix,
-                                                            options,
-                                                            job_id
-                                                        );
-                    if ( ! new_fs->base_dir ) {
-                        slurm_error("auto_tmpdir::auto_tmpdir_fs_init: unable to allocate base directory");
-                        goto error_out;
-                    }
-                    prefix_len = strlen(new_fs->base_dir);
+/*
+ * Parse a pool record's name and content.  Returns 0 if it describes a
+ * device formatted since the node last booted:
+ */
+static int
+__auto_tmpdir_fs_zram_pool_read(
+    auto_tmpdir_fs_zram_pool_t  *pool,
+    const char                  *name,
+    const char                  *boot_id,
+    int                         *device,
+    unsigned long long          *disk_size,
+    char                        *algorithm
+)
+{
+    char                        record_path[PATH_MAX], record_boot_id[64];
+    int                         name_len = 0, rc = -1;
+    FILE                        *fptr;
 
-                    /* Create the parent tmp directory: */
-                    if ( auto_tmpdir_mkdir_recurse(new_fs->base_dir, 0700, 1, u_owner, g_owner) ) {
-                        slurm_error("auto_tmpdir::auto_tmpdir_fs_init: unable to create base directory `%s`", new_fs->base_dir);
-                        goto error_out;
-                    }
-                }
-                
-                /*
-                 * Make a copy of the mountpoint (to dir):
-                 */
-                char                    *to_dir = (char*)malloc(bind_to_len + 1);
-                
-                if ( ! to_dir ) {
-                    slurm_error("auto_tmpdir::auto_tmpdir_fs_init: unable to allocate copy of mountpoint for `%s`", bind_to);
-                    goto error_out;
-                }
+    if ( (sscanf(name, "zram%d%n", device, &name_len) != 1) || name[name_len] ) return -1;
+    if ( snprintf(record_path, sizeof(record_path), "%s/%s", pool->dir, name) >= sizeof(record_path) ) return -1;
+    if ( (fptr = fopen(record_path, "r")) ) {
+        if ( (fscanf(fptr, "%63s %llu %63s", record_boot_id, disk_size, algorithm) == 3) && (strcmp(record_boot_id, boot_id) == 0) ) rc = 0;
+        fclose(fptr);
+    }
+    return rc;
+}
 
-                /*
-                 * Create a temp directory under the base_dir to hold the bind mountpoint (note that
-                 * bind_to leads with a slash, which we'll discard in the directory name we map bind_to
-                 * to, so that slash becomes the NUL character in the final path length):
-                 */
-                char                    *dir_path = (char*)malloc(prefix_len + 1 + bind_to_len);
+/*
+ * Count the pool's records of devices formatted since the node last booted
+ * that match the pool's configuration:
+ */
+static unsigned int
+__auto_tmpdir_fs_zram_pool_count(
+    auto_tmpdir_fs_zram_pool_t  *pool
+)
+{
+    char                        boot_id[64], algorithm[64];
+    unsigned long long          disk_size;
+    unsigned int                n_ready = 0;
+    int                         device;
+    DIR                         *dir;
+    struct dirent               *dent;
 
-                if ( ! dir_path ) {
-                    slurm_error("auto_tmpdir::auto_tmpdir_fs_init: unable to allocate tmp path template for `%s`", bind_to);
-                    free((void*)to_dir);
-                    goto error_out;
-                }
-                strncpy(dir_path, new_fs->base_dir, prefix_len);
-                dir_path[prefix_len] = '/';
+    if ( ! pool->dir[0] || (__auto_tmpdir_fs_boot_id(boot_id, sizeof(boot_id)) != 0) || ! (dir = opendir(pool->dir)) ) return 0;
+    while ( (dent = readdir(dir)) ) {
+        if ( (__auto_tmpdir_fs_zram_pool_read(pool, dent->d_name, boot_id, &device, &disk_size, algorithm) == 0)
+                && (disk_size == pool->config.disk_size)
+                && (! pool->config.algorithm || (strcmp(algorithm, pool->config.algorithm) == 0)) ) n_ready++;
+    }
+    closedir(dir);
+    return n_ready;
+}
 
-                int                     i_bind_to = 1, i_dir_path = prefix_len + 1;
+/*
+ * Write the pool record for a formatted device; the record is renamed into
+ * place so that claims never see it half-written:
+ */
+static int
+__auto_tmpdir_fs_zram_pool_add(
+    auto_tmpdir_fs_zram_pool_t  *pool,
+    int                         device
+)
+{
+    char                        boot_id[64], algorithm[64], sysfs_path[64], value[32];
+    char                        record_path[PATH_MAX], tmp_path[PATH_MAX];
+    unsigned long long          disk_size;
+    FILE                        *fptr;
 
-                /*
-                 * Map any slashes to underscores to flatten the bind_to path to a single name as we
-                 * fill-in the rest of dir_path:
-                 */
-                to_dir[0] = bind_to[0];
-                while ( i_bind_to < bind_to_len ) {
-                    char        c = bind_to[i_bind_to];
-                    to_dir[i_bind_to++] = c;
-                    dir_path[i_dir_path++] = ((c == '/') ? '_' : c);
-                }
-                to_dir[i_bind_to] = '\0';
-                dir_path[i_dir_path] = '\0';
+    snprintf(sysfs_path, sizeof(sysfs_path), "/sys/block/zram%d/disksize", device);
+    if ( (__auto_tmpdir_fs_boot_id(boot_id, sizeof(boot_id)) != 0)
+            || (__auto_tmpdir_fs_zram_algorithm(device, algorithm, sizeof(algorithm)) != 0)
+            || (__auto_tmpdir_fs_sysfs_read(sysfs_path, value, sizeof(value)) != 0)
+            || (sscanf(value, "%llu", &disk_size) != 1) ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_fs_zram_pool_add: unable to describe /dev/zram%d", device);
+        return -1;
+    }
+    if ( (snprintf(record_path, sizeof(record_path), "%s/zram%d", pool->dir, device) >= sizeof(record_path))
+            || (snprintf(tmp_path, sizeof(tmp_path), "%s/.zram%d", pool->dir, device) >= sizeof(tmp_path)) ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_fs_zram_pool_add: pool directory path too long (%s)", pool->dir);
+        return -1;
+    }
+    if ( ! (fptr = fopen(tmp_path, "w")) ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_fs_zram_pool_add: unable to create `%s` (%m)", tmp_path);
+        return -1;
+    }
+    fprintf(fptr, "%s %llu %s\n", boot_id, disk_size, algorithm);
+    if ( (fclose(fptr) != 0) || (rename(tmp_path, record_path) != 0) ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_fs_zram_pool_add: unable to write `%s` (%m)", record_path);
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
 
-                /*
-                 * Add the mountpoint:
-                 */
-                if ( __auto_tmpdir_fs_create_bindpoint(new_fs, dir_path, to_dir, 0, 0, u_owner, g_owner) != 0 ) {
-                    free((void*)dir_path);
-                    free((void*)to_dir);
-                    goto error_out;
-                }
-            }
-            i++;
-        }
+/*
+ * Take a ready device matching zram_config out of the pool.  Returns the
+ * device number, -1 if the pool has none:
+ */
+static int
+__auto_tmpdir_fs_zram_pool_claim(
+    auto_tmpdir_fs_zram_config_t    *zram_config
+)
+{
+    auto_tmpdir_fs_zram_pool_t      *pool = &auto_tmpdir_fs_zram_pool;
+    char                            boot_id[64], algorithm[64], path[PATH_MAX];
+    unsigned long long              disk_size;
+    int                             device, claimed = -1, fd;
+    DIR                             *dir;
+    struct dirent                   *dent;
 
-        /*
-         * Attempt to setup a mapped /dev/shm if desired:
-         */
-        if ( (options & auto_tmpdir_fs_options_should_not_map_dev_shm) != auto_tmpdir_fs_options_should_not_map_dev_shm ) {
-            struct stat             finfo;
+    if ( ! pool->size || (__auto_tmpdir_fs_boot_id(boot_id, sizeof(boot_id)) != 0) || ! (dir = opendir(pool->dir)) ) return -1;
+    while ( (claimed < 0) && (dent = readdir(dir)) ) {
+        if ( (__auto_tmpdir_fs_zram_pool_read(pool, dent->d_name, boot_id, &device, &disk_size, algorithm) != 0)
+                || (disk_size != zram_config->disk_size)
+                || (zram_config->algorithm && (strcmp(algorithm, zram_config->algorithm) != 0)) ) continue;
 
-            if ( stat(auto_tmpdir_fs_dev_shm, &finfo) == 0 ) {
-                /*
-                 * Create our own /dev/shm space:
-                 */
-                const char          *dev_shm_dir = __auto_tmpdir_fs_path_create(
-                                                            auto_tmpdir_fs_dev_shm_prefix,
-                                                            (options & ~auto_tmpdir_fs_options_should_use_per_host),
-                                                            job_id
-                                                        );
-                const char          *to_dir = strdup(auto_tmpdir_fs_dev_shm);
-                
-                if ( ! dev_shm_dir ) goto error_out;
-                if ( ! to_dir ) {
-                    slurm_error("auto_tmpdir::auto_tmpdir_fs_init: unable to allocate copy of to path `%s`", auto_tmpdir_fs_dev_shm);
-                    goto error_out;
-                }
+        /* Whoever removes the record owns the device: */
+        if ( (snprintf(path, sizeof(path), "%s/%s", pool->dir, dent->d_name) >= sizeof(path)) || (unlink(path) != 0) ) continue;
+        snprintf(path, sizeof(path), "/dev/zram%d", device);
+        if ( (fd = open(path, O_RDONLY | O_EXCL | O_CLOEXEC)) < 0 ) {
+            int                     open_errno = errno;
 
-                /*
-                 * Add the moundpoint:
-                 */
-                if ( __auto_tmpdir_fs_create_bindpoint(new_fs, dev_shm_dir, to_dir, 1, 1, u_owner, g_owner) != 0 ) {
-                    free((void*)dev_shm_dir);
-                    free((void*)to_dir);
-                    goto error_out;
-                }
-            } else {
-                slurm_info("auto_tmpdir::auto_tmpdir_fs_init: shm base directory `%s` does not exist", auto_tmpdir_fs_dev_shm);
-                goto error_out;
-            }
-        }
-    }
-    return new_fs;
+            slurm_info("auto_tmpdir::__auto_tmpdir_fs_zram_pool_claim: pooled %s is not usable (%m), skipping it", path);
 
-error_out:
-    if ( new_fs ) {
-        if ( new_fs->bind_mounts ) {
-            auto_tmpdir_fs_bindpoint_dealloc(
-                    new_fs->bind_mounts,
-                    ((new_fs->options & auto_tmpdir_fs_options_should_not_delete) == auto_tmpdir_fs_options_should_not_delete),
-                    0
-                );
-        }
-        if ( new_fs->base_dir ) {
-            if ( (new_fs->options & auto_tmpdir_fs_options_should_not_delete) != auto_tmpdir_fs_options_should_not_delete ) auto_tmpdir_rmdir_recurse(new_fs->base_dir, 0);
-            free((void*)new_fs->base_dir);
+            /* With its record gone nothing else would release it -- unless it's mounted, it's not the pool's: */
+            if ( (open_errno != ENOENT) && (open_errno != EBUSY) ) __auto_tmpdir_fs_zram_remove(device);
+            continue;
         }
-        if ( new_fs->base_dir_parent ) free((void*)new_fs->base_dir_parent);
-        if ( new_fs->tmpdir ) free((void*)new_fs->tmpdir);
-        free((void*)new_fs);
+        close(fd);
+        claimed = device;
     }
-    return NULL;
+    closedir(dir);
+    return claimed;
 }
 
-
-int
-auto_tmpdir_fs_bind_mount(
-    auto_tmpdir_fs_ref  fs_info
+/*
+ * Wipe an unmounted device and put it back in the pool if the pool has room
+ * and the device matches the pool's configuration.  Discarding the whole
+ * device drops everything the job wrote (and frees its memory) before the
+ * fresh filesystem is built.  Returns 0 if the device was pooled:
+ */
+static int
+__auto_tmpdir_fs_zram_pool_return(
+    int                             device
 )
 {
-    int                         rc = 0;
-    auto_tmpdir_fs_bindpoint_t  *bindpoint = fs_info->bind_mounts;
-    
-    if ( bindpoint ) {
-        /*
-         * Skip ahead to the end, then go in reverse order:
-         */
-        while ( bindpoint->link ) bindpoint = bindpoint->link;
-
-        /*
-         * Allow mount points to be shared into a child namespace:
-         */
-        if ( mount("", "/", "dontcare", MS_REC | MS_SHARED, "") != 0 ) {
-		    slurm_error("auto_tmpdir::auto_tmpdir_fs_bind_mount: failed to mark mountpoints for sharing (%m)");
-		    return -1;
-		}
+    auto_tmpdir_fs_zram_pool_t      *pool = &auto_tmpdir_fs_zram_pool;
+    char                            sysfs_path[64], value[32], algorithm[64];
+    unsigned long long              disk_size;
+    uint64_t                        range[2];
+    int                             fd;
 
-		/*
-		 * Create a new mount namespace:
-		 */
-		if ( unshare(CLONE_NEWNS) != 0 ) {
-		    slurm_error("auto_tmpdir::auto_tmpdir_fs_bind_mount: failed to create new mount namespace (%m)");
-		    return -1;
-		}
+    if ( ! pool->size || (__auto_tmpdir_fs_zram_pool_count(pool) >= pool->size) ) return -1;
+    snprintf(sysfs_path, sizeof(sysfs_path), "/sys/block/zram%d/disksize", device);
+    if ( (__auto_tmpdir_fs_sysfs_read(sysfs_path, value, sizeof(value)) != 0) || (sscanf(value, "%llu", &disk_size) != 1)
+            || (disk_size != pool->config.disk_size) ) return -1;
+    if ( pool->config.algorithm
+            && ((__auto_tmpdir_fs_zram_algorithm(device, algorithm, sizeof(algorithm)) != 0) || (strcmp(algorithm, pool->config.algorithm) != 0)) ) return -1;
 
-		/*
-		 * Copy parent namespace mounts into this namespace:
-		 */
-		if ( mount("", "/", "dontcare", MS_REC | MS_SLAVE, "") != 0 ) {
-		    slurm_error("auto_tmpdir::auto_tmpdir_fs_bind_mount: failed to copy parent mountpoints into new mount namespace (%m)");
-		    return -1;
-		}
+    snprintf(sysfs_path, sizeof(sysfs_path), "/dev/zram%d", device);
+    if ( (fd = open(sysfs_path, O_RDWR | O_EXCL | O_CLOEXEC)) < 0 ) return -1;
+    range[0] = 0;
+    range[1] = disk_size;
+    if ( ioctl(fd, BLKDISCARD, range) != 0 ) {
+        slurm_info("auto_tmpdir::__auto_tmpdir_fs_zram_pool_return: unable to discard %s (%m)", sysfs_path);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    if ( __auto_tmpdir_fs_zram_mkfs(device) != 0 ) return -1;
 
-	    /*
-	     * Loop over all our bind mount points:
-	     */
-	    while ( (rc == 0) && bindpoint ) {
-	        if ( ! bindpoint->is_bind_mounted ) {
-                slurm_debug("auto_tmpdir::auto_tmpdir_fs_bind_mount: bind-mounting `%s` -> `%s` (pid %d)", bindpoint->bind_this_path, bindpoint->to_this_path, getpid());
-                if ( mount(bindpoint->bind_this_path, bindpoint->to_this_path, "none", MS_BIND, NULL) != 0 ) {
-                    slurm_error("auto_tmpdir::auto_tmpdir_fs_bind_mount: failed to bind-mount `%s` -> `%s` (%m)", bindpoint->bind_this_path, bindpoint->to_this_path);
-                    rc = -1;
-                } else {
-                    bindpoint->is_bind_mounted = 1;
-                }
-	        }
-	        bindpoint = bindpoint->back_link;
-	    }
-	}
-	return rc;
+    /* A claim sets the next job's memory limit: */
+    snprintf(sysfs_path, sizeof(sysfs_path), "/sys/block/zram%d/mem_limit", device);
+    __auto_tmpdir_fs_sysfs_write(sysfs_path, "0");
+    if ( __auto_tmpdir_fs_zram_pool_add(pool, device) != 0 ) return -1;
+    slurm_debug("auto_tmpdir::__auto_tmpdir_fs_zram_pool_return: returned /dev/zram%d to the pool", device);
+    return 0;
 }
 
+/**/
 
-const char*
-auto_tmpdir_fs_get_tmpdir(
-    auto_tmpdir_fs_ref  fs_info
+/*
+ * Release the zram device backing a bindpoint, optionally reporting how well
+ * the job's data compressed.  The device's filesystem is unmounted from the backing
+ * directory (which is left empty) and the device is returned to the pool or
+ * hot-removed.
+ */
+int
+__auto_tmpdir_fs_zram_release(
+    auto_tmpdir_fs_bindpoint_t  *bindpoint,
+    int                         should_report
 )
 {
-    return fs_info->tmpdir ? fs_info->tmpdir : "/tmp";
-}
+    char                        sysfs_path[64], value[256];
+    unsigned long long          orig_data_size, compr_data_size, mem_used_total, mem_limit, mem_used_max;
+    int                         rc = 0, is_unmounted = 0;
 
+    snprintf(sysfs_path, sizeof(sysfs_path), "/sys/block/zram%d/mm_stat", bindpoint->device);
+    if ( should_report && (__auto_tmpdir_fs_sysfs_read(sysfs_path, value, sizeof(value)) == 0)
+            && (sscanf(value, "%llu %llu %llu %llu %llu", &orig_data_size, &compr_data_size, &mem_used_total, &mem_limit, &mem_used_max) == 5) ) {
+        slurm_info("auto_tmpdir::__auto_tmpdir_fs_zram_release: /dev/zram%d for `%s`: %llu bytes stored compressed to %llu bytes (%llu bytes of memory used, peak %llu)",
+                bindpoint->device, bindpoint->to_this_path, orig_data_size, compr_data_size, mem_used_total, mem_used_max);
+    }
+    if ( umount2(bindpoint->bind_this_path, 0) == 0 ) {
+        is_unmounted = 1;
+    }
+    else if ( errno != EINVAL ) {
+        slurm_info("auto_tmpdir::__auto_tmpdir_fs_zram_release: unable to unmount `%s` (%m), detaching", bindpoint->bind_this_path);
+        umount2(bindpoint->bind_this_path, MNT_DETACH);
+    }
+    if ( ! is_unmounted || (__auto_tmpdir_fs_zram_pool_return(bindpoint->device) != 0) ) {
+        if ( __auto_tmpdir_fs_zram_remove(bindpoint->device) != 0 ) rc = -1;
+    }
+    bindpoint->backend = auto_tmpdir_fs_backend_dir;
+    bindpoint->device = -1;
+    return rc;
+}
 
+/*
+ * Unmount the tmpfs backing a bindpoint (its content goes with it), leaving
+ * the backing directory empty:
+ */
 int
-auto_tmpdir_fs_fini(
-    auto_tmpdir_fs_ref  fs_info,
-     int                should_dealloc_only
+__auto_tmpdir_fs_tmpfs_release(
+    auto_tmpdir_fs_bindpoint_t  *bindpoint
 )
 {
-    int     rc = 0;
-
-    if ( fs_info ) {
-        if ( fs_info->bind_mounts ) {
-            int     local_rc = auto_tmpdir_fs_bindpoint_dealloc(
-                                        fs_info->bind_mounts,
-                                        ((fs_info->options & auto_tmpdir_fs_options_should_not_delete) == auto_tmpdir_fs_options_should_not_delete),
-                                        should_dealloc_only
-                                    );
-            if ( local_rc != 0 ) rc = local_rc;
-        }
-        if ( fs_info->base_dir ) {
-            if ( ! should_dealloc_only && (fs_info->options & auto_tmpdir_fs_options_should_not_delete) != auto_tmpdir_fs_options_should_not_delete ) {
-                int local_rc;
+    int                         rc = 0;
 
-                slurm_debug("auto_tmpdir::auto_tmpdir_fs_bindpoint_dealloc: removing directory `%s`", fs_info->base_dir);
-                local_rc = auto_tmpdir_rmdir_recurse(fs_info->base_dir, 0);
-                if ( local_rc != 0 ) rc = local_rc;
-            }
-            free((void*)fs_info->base_dir);
-        }
-        if ( fs_info->base_dir_parent ) free((void*)fs_info->base_dir_parent);
-        if ( fs_info->tmpdir ) free((void*)fs_info->tmpdir);
-        free((void*)fs_info);
+    if ( (umount2(bindpoint->bind_this_path, 0) != 0) && (errno != EINVAL) && (errno != ENOENT) ) {
+        slurm_info("auto_tmpdir::__auto_tmpdir_fs_tmpfs_release: unable to unmount `%s` (%m), detaching", bindpoint->bind_this_path);
+        if ( umount2(bindpoint->bind_this_path, MNT_DETACH) != 0 ) rc = -1;
+    } else {
+        slurm_debug("auto_tmpdir::__auto_tmpdir_fs_tmpfs_release: unmounted tmpfs from `%s`", bindpoint->bind_this_path);
     }
+    bindpoint->backend = auto_tmpdir_fs_backend_dir;
     return rc;
 }
 
+/*
+ * The overlay is mounted once, in the prolog, on <bind_this_path>.merged;
+ * each step then bind-mounts the merged directory.  All of the job's steps
+ * thus share a single overlay mount of the upper and work directories.
+ */
+static int
+__auto_tmpdir_fs_overlay_merged_path(
+    auto_tmpdir_fs_bindpoint_t  *bindpoint,
+    char                        *merged_path,
+    size_t                      merged_path_len
+)
+{
+    return (snprintf(merged_path, merged_path_len, "%s.merged", bindpoint->bind_this_path) >= merged_path_len) ? -1 : 0;
+}
 
 /*
- * @function auto_tmpdir_mkdir_recurse
- *
- * Recursively create all directories in a path.
+ * Unmount a bindpoint's overlay from its merged directory (the upper and
+ * work directories are left for the caller to keep or remove):
  */
-int
-auto_tmpdir_mkdir_recurse(
-    const char  *path,
-    mode_t      mode,
-    int         should_set_owner,
-    uid_t       u_owner,
-    gid_t       g_owner
+static int
+__auto_tmpdir_fs_overlay_release(
+    auto_tmpdir_fs_bindpoint_t  *bindpoint
 )
 {
-    struct stat     finfo;
+    char                        merged_path[PATH_MAX];
+    int                         rc = 0;
 
-    if ( ! path || ! *path ) {
-        slurm_info("auto_tmpdir::auto_tmpdir_mkdir_recurse: cannot mkdir an empty path");
-        return -1;
+    if ( __auto_tmpdir_fs_overlay_merged_path(bindpoint, merged_path, sizeof(merged_path)) != 0 ) return -1;
+    if ( (umount2(merged_path, 0) != 0) && (errno != EINVAL) && (errno != ENOENT) ) {
+        slurm_info("auto_tmpdir::__auto_tmpdir_fs_overlay_release: unable to unmount `%s` (%m), detaching", merged_path);
+        if ( umount2(merged_path, MNT_DETACH) != 0 ) rc = -1;
+    } else {
+        slurm_debug("auto_tmpdir::__auto_tmpdir_fs_overlay_release: unmounted overlay from `%s`", merged_path);
     }
-    if ( stat(path, &finfo) != 0 ) {
-        /* There's at least one directory we need to create: */
-        size_t      path_len = strlen(path);
-        char        local_path[path_len + 1];
-        int         i = 1;
+    rmdir(merged_path);
+    return rc;
+}
 
-        local_path[0] = path[0];
-        while ( i < path_len ) {
-            /* Find next '/' in path, copying the partial path into another
-             * buffer that we can use to check existence and create missing
-             * directories as we go:
-             */
-            while ( (i < path_len) && path[i] && (path[i] != '/') ) {
-                local_path[i] = path[i];
-                i++;
-            }
-            local_path[i] = '\0';
+/**/
 
-            /* Does this partial path exist? */
-            if ( stat(local_path, &finfo) ) {
-                if ( mkdir(local_path, mode) ) {
-                    slurm_info("auto_tmpdir::auto_tmpdir_mkdir_recurse: unable to create directory `%s` (%m)", local_path);
-                    return -1;
-                }
-                if ( should_set_owner ) {
-                    if ( __auto_tmpdir_chown(local_path, u_owner, g_owner) ) {
-                        slurm_info("auto_tmpdir::auto_tmpdir_mkdir_recurse: unable to chown directory `%s` (%m)", local_path);
-                        return -1;
-                    }
-                }
-            } else if ( ! S_ISDIR(finfo.st_mode) ) {
-                slurm_info("auto_tmpdir::auto_tmpdir_mkdir_recurse: not a directory: `%s`", local_path);
-                return -1;
-            }
+/*
+ * Report the final usage of a bindpoint via slurm_info() and, if configured,
+ * as a line in the accounting file.
+ */
+void
+__auto_tmpdir_fs_account(
+    auto_tmpdir_fs_accounting_t *accounting,
+    const char                  *to_this_path,
+    auto_tmpdir_fs_usage_t      *usage
+)
+{
+    slurm_info("auto_tmpdir::auto_tmpdir_fs_bindpoint_dealloc: job %u `%s` final usage %llu bytes, %llu inodes, largest directory %llu entries",
+            accounting->job_id, to_this_path,
+            (unsigned long long)usage->bytes, (unsigned long long)usage->inodes, (unsigned long long)usage->max_fanout);
+    if ( accounting->fd >= 0 ) {
+        char        record[PATH_MAX * 2];
+        size_t      len;
+        int         n;
 
-            while ( (i < path_len) && (path[i] == '/') ) {
-                local_path[i] = path[i];
-                i++;
-            }
+        n = snprintf(record, sizeof(record), "{\"time\":%lld,\"job\":%u,\"uid\":%u,\"bytes\":%llu,\"inodes\":%llu,\"max_fanout\":%llu,\"path\":",
+                    (long long)time(NULL), accounting->job_id, (unsigned int)accounting->u_owner,
+                    (unsigned long long)usage->bytes, (unsigned long long)usage->inodes, (unsigned long long)usage->max_fanout);
+        if ( (n < 0) || (n >= sizeof(record)) ) return;
+        len = auto_tmpdir_event_json_string(record, sizeof(record), n, to_this_path);
+        if ( len + 2 > sizeof(record) ) return;
+        record[len++] = '}';
+        record[len++] = '\n';
+        if ( write(accounting->fd, record, len) != len ) {
+            slurm_error("auto_tmpdir::__auto_tmpdir_fs_account: failed to write accounting record (%m)");
         }
-    } else if ( ! S_ISDIR(finfo.st_mode) ) {
-        slurm_info("auto_tmpdir::auto_tmpdir_mkdir_recurse: not a directory: `%s`", path);
-        return -1;
     }
-    return 0;
 }
 
-
 /*
- * @function _rmdir_recurse
- *
- * Recursively remove a file path.
- *
- * Privileges must have been dropped prior to this function's being called.
- *
+ * Append the accounting record of a hierarchy renamed aside for hand-off:
  */
-int
-auto_tmpdir_rmdir_recurse(
-    const char      *path,
-    int             should_remove_children_only
+void
+__auto_tmpdir_fs_account_handoff(
+    auto_tmpdir_fs_accounting_t *accounting,
+    const char                  *handoff_path,
+    uint64_t                    bytes,
+    uint64_t                    inodes,
+    long long                   expiry
 )
 {
-    int             rc = 0;
-
-    char            *path_argv[2] = { (char*)path, NULL };
-
-    /* FTS_NOCHDIR  - Avoid changing cwd, which could cause unexpected behavior
-     *                in multithreaded programs
-     * FTS_PHYSICAL - Don't follow symlinks. Prevents deletion of files outside
-     *                of the specified directory
-     * FTS_XDEV     - Don't cross filesystem boundaries
-     */
-    FTS             *ftsPtr = fts_open(path_argv, FTS_NOCHDIR | FTS_PHYSICAL | FTS_XDEV, NULL);
-    FTSENT          *ftsItem;
+    char        record[PATH_MAX * 2];
+    size_t      len;
+    int         n;
 
-    if ( ! ftsPtr ) {
-        slurm_info("auto_tmpdir::auto_tmpdir_rmdir_recurse: failed to open file traversal context on `%s` (%m)", path);
-        return (-1);
+    n = snprintf(record, sizeof(record), "{\"time\":%lld,\"job\":%u,\"uid\":%u,\"bytes\":%llu,\"inodes\":%llu,\"handoff_until\":%lld,\"path\":",
+                (long long)time(NULL), accounting->job_id, (unsigned int)accounting->u_owner,
+                (unsigned long long)bytes, (unsigned long long)inodes, expiry);
+    if ( (n < 0) || (n >= sizeof(record)) ) return;
+    len = auto_tmpdir_event_json_string(record, sizeof(record), n, handoff_path);
+    if ( len + 2 > sizeof(record) ) return;
+    record[len++] = '}';
+    record[len++] = '\n';
+    if ( write(accounting->fd, record, len) != len ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_fs_account_handoff: failed to write accounting record (%m)");
     }
-    if ( (ftsItem = fts_read(ftsPtr)) ) {
-        switch ( ftsItem->fts_info ) {
-            case FTS_NS:
-            case FTS_DNR:
-            case FTS_ERR: {
-                slurm_info("auto_tmpdir::auto_tmpdir_rmdir_recurse: directory `%s` does not exist", path);
-                break;
-            }
-            case FTS_D: {
-                /*
-                 * We're entering a directory -- exactly what we want!
-                 */
-                while ( (ftsItem = fts_read(ftsPtr)) ) {
-                    switch ( ftsItem->fts_info ) {
-                        case FTS_NS:
-                        case FTS_DNR:
-                        case FTS_ERR:
-                            slurm_info("auto_tmpdir::auto_tmpdir_rmdir_recurse: error in fts_read() of `%s` (%s)\n", ftsItem->fts_accpath, strerror(ftsItem->fts_errno));
-                            rc = -1;
-                            break;
+}
 
-                        case FTS_DC:
-                        case FTS_DOT:
-                        case FTS_NSOK:
-                            /* Not reached unless FTS_LOGICAL, FTS_SEEDOT, or FTS_NOSTAT were
-                             * passed to fts_open()
-                             */
-                            break;
+/**/
 
-                        case FTS_D:
-                            /* Do nothing. Need depth-first search, so directories are deleted
-                             * in FTS_DP
-                             */
-                            break;
+int
+auto_tmpdir_fs_bindpoint_dealloc(
+    auto_tmpdir_fs_bindpoint_t  *bindpoint,
+    uint32_t                    job_id,
+    int                         should_not_delete,
+    int                         should_dealloc_only,
+    auto_tmpdir_fs_accounting_t *accounting
+)
+{
+    int             rc = 0;
 
-                        case FTS_DP:
-                            /* Remove the directory on post-order traversal (should be empty now): */
-                            if ( should_remove_children_only && (strcmp(ftsItem->fts_accpath, path) == 0) ) break;
-                            if ( rmdir(ftsItem->fts_accpath) < 0 ) {
-                                slurm_info("auto_tmpdir::auto_tmpdir_rmdir_recurse: failed to remove directory `%s` (%s)\n", ftsItem->fts_accpath, strerror(ftsItem->fts_errno));
-                                rc = -1;
-                            }
-                            break;
+    while ( bindpoint) {
+        auto_tmpdir_fs_bindpoint_t  *next = bindpoint->link;
+        int                         is_okay = 1;
 
-                        case FTS_F:
-                        case FTS_SL:
-                        case FTS_SLNONE:
-                        case FTS_DEFAULT:
-                            /* Remove a non-directory item: */
-                            if ( unlink(ftsItem->fts_accpath) < 0 ) {
-                                slurm_info("auto_tmpdir::auto_tmpdir_rmdir_recurse: failed to remove `%s` (%s)", ftsItem->fts_accpath, strerror(ftsItem->fts_errno));
-                                rc = -1;
-                            }
-                            break;
+        slurm_debug("auto_tmpdir::auto_tmpdir_fs_bindpoint_dealloc: `%s` -> `%s` (%d|%d|%d) %p", bindpoint->bind_this_path, bindpoint->to_this_path, bindpoint->is_bind_mounted, bindpoint->should_always_remove, bindpoint->should_never_remove, next);
+        if ( ! should_dealloc_only && bindpoint->should_never_remove ) {
+            /* Persistent cache directory -- unmount and release, but never remove: */
+            if ( bindpoint->is_bind_mounted && (umount2(bindpoint->to_this_path, MNT_FORCE) != 0) ) {
+                slurm_info("auto_tmpdir::auto_tmpdir_fs_bindpoint_dealloc: unable to unmount bind point `%s` -> `%s`", bindpoint->to_this_path, bindpoint->bind_this_path);
+                rc = -1;
+            }
+            __auto_tmpdir_fs_cache_update(bindpoint->bind_this_path, job_id, -1, 1);
+        }
+        else if ( ! should_dealloc_only ) {
+            int                     should_remove = bindpoint->should_always_remove || ! should_not_delete;
+            int                     is_measured = 0;
+            auto_tmpdir_fs_usage_t  usage = { 0, 0, 0, 0, 0 };
+            
+            if ( bindpoint->is_bind_mounted ) {
+                if ( umount2(bindpoint->to_this_path, MNT_FORCE) != 0 ) {
+                    slurm_info("auto_tmpdir::auto_tmpdir_fs_bindpoint_dealloc: unable to unmount bind point `%s` -> `%s`", bindpoint->to_this_path, bindpoint->bind_this_path);
+                    rc = -1;
+                    is_okay = 0;
+                    /*  Attempt to remove the bound path itself to drop all content: */
+                    if ( ! should_dealloc_only && (bindpoint->should_always_remove || ! should_not_delete) ) {
+                        slurm_debug("auto_tmpdir::auto_tmpdir_fs_bindpoint_dealloc: failed to unmount, removing content of directory `%s`", bindpoint->to_this_path);
+                        auto_tmpdir_rmdir_recurse(bindpoint->to_this_path, 1);
+                    }
+                } else {
+                    bindpoint->is_bind_mounted = 0;
+                }
+            }
+            /* The overlay goes with the job even if its upper directory is kept: */
+            if ( bindpoint->template_path && bindpoint->work_path && (__auto_tmpdir_fs_overlay_release(bindpoint) != 0) ) rc = -1;
+            /*
+             * Content that won't be removed by a walk below (it's kept, or it's about to vanish
+             * with its zram device) has to be measured separately -- only worth the extra walk if
+             * an accounting file is being written:
+             */
+            if ( accounting && (accounting->fd >= 0) && is_okay && (! should_remove || (bindpoint->backend != auto_tmpdir_fs_backend_dir)) ) {
+                __auto_tmpdir_fs_rmdir_usage(bindpoint->bind_this_path, 0, 0, &usage);
+                is_measured = 1;
+            }
+            /* A zram device or tmpfs is always released, its content can't outlive the job: */
+            if ( bindpoint->backend == auto_tmpdir_fs_backend_zram ) {
+                if ( __auto_tmpdir_fs_zram_release(bindpoint, 1) != 0 ) rc = -1;
+            }
+            else if ( bindpoint->backend == auto_tmpdir_fs_backend_tmpfs ) {
+                if ( __auto_tmpdir_fs_tmpfs_release(bindpoint) != 0 ) rc = -1;
+            }
+            if ( is_okay ) {
+                /* Remove the directory being bind mounted: */
+                if ( should_remove ) {
+                    struct stat         finfo;
+
+                    if ( stat(bindpoint->bind_this_path, &finfo) == 0 ) {
+                        slurm_debug("auto_tmpdir::auto_tmpdir_fs_bindpoint_dealloc: removing directory `%s`", bindpoint->bind_this_path);
+                        if ( is_measured ) {
+                            if ( auto_tmpdir_rmdir_recurse(bindpoint->bind_this_path, 0) != 0 ) rc = -1;
+                        } else {
+                            /* The deletion walk doubles as the measurement: */
+                            if ( __auto_tmpdir_fs_rmdir_usage(bindpoint->bind_this_path, 1, 0, &usage) != 0 ) rc = -1;
+                            is_measured = 1;
+                        }
+                    } else {
+                        slurm_debug("auto_tmpdir::auto_tmpdir_fs_bindpoint_dealloc: directory `%s` no longer exists", bindpoint->bind_this_path);
+                    }
+                    if ( bindpoint->work_path && (stat(bindpoint->work_path, &finfo) == 0) ) {
+                        slurm_debug("auto_tmpdir::auto_tmpdir_fs_bindpoint_dealloc: removing overlay work directory `%s`", bindpoint->work_path);
+                        if ( auto_tmpdir_rmdir_recurse(bindpoint->work_path, 0) != 0 ) rc = -1;
                     }
                 }
-                break;
             }
+            if ( accounting && is_measured ) __auto_tmpdir_fs_account(accounting, bindpoint->to_this_path, &usage);
         }
+        
+        /* Deallocate this node: */
+        free((void*)bindpoint->bind_this_path);
+        free((void*)bindpoint->to_this_path);
+        if ( bindpoint->template_path ) free((void*)bindpoint->template_path);
+        if ( bindpoint->work_path ) free((void*)bindpoint->work_path);
+        free((void*)bindpoint);
+
+        slurm_debug("auto_tmpdir::auto_tmpdir_fs_bindpoint_dealloc: moving to next directory %p", next);
+        bindpoint = next;
     }
-    fts_close(ftsPtr);
     return rc;
 }
 
 /**/
 
+typedef struct auto_tmpdir_fs {
+    auto_tmpdir_fs_options_t    options;
+    uint32_t                    job_id;
+    uid_t                       u_owner;
+    gid_t                       g_owner;
+    const char                  *tmpdir;
+    const char                  *base_dir, *base_dir_parent;
+    const char                  *archive_path;
+    uint32_t                    handoff_minutes;
+    time_t                      retain_until;
+    uint64_t                    granted_mb;
+    const char                  *policy_name;
+    uint32_t                    job_cpus;
+    auto_tmpdir_fs_bindpoint_t  *bind_mounts, *bind_mounts_tail;
+    /* Per-step state, never serialized: */
+    const char                  *step_tmpdir;
+    const char                  **step_dirs;
+    int                         n_step_dirs;
+    const char                  *task_tmpdir_base;
+    const char                  *accounting_path;
+} auto_tmpdir_fs;
+
+/*
+ * Internal routines defined further down:
+ */
+const char* __auto_tmpdir_fs_retained_state_file(spank_t spank_ctxt, int argc, char* argv[]);
+const char* __auto_tmpdir_fs_retained_claim(spank_t spank_ctxt, int argc, char* argv[]);
+
+/**/
+
 const char*
-__auto_tmpdir_fs_default_state_file(
-    spank_t             spank_ctxt,
-    int                 argc,
-    char*               argv[]
-)
+__auto_tmpdir_fs_get_hostname(void)
 {
-    static char         *state_file = NULL;
-    
-    if ( ! state_file ) {
-        int             i;
-        uint32_t        job_id = NO_VAL;
-        const char      *state_dir = "/tmp";
-        int             rc;
-
-        /* Get the base job id: */
-        if ( (rc = spank_get_item(spank_ctxt, S_JOB_ID, &job_id)) != ESPANK_SUCCESS ) {
-            slurm_error("auto_tmpdir: __auto_tmpdir_fs_default_state_file: no job id associated with job??");
-            return NULL;
-        }
+    static int      is_inited = 0;
+    static char     hostname[64];
 
-        slurm_debug("auto_tmpdir::__auto_tmpdir_fs_default_state_file: %u", job_id);
+    if ( ! is_inited ) {
+        int         i = 0;
 
-        /*
-         * First pass through the arguments to the plugin -- pull the state_dir if present:
-         */
-        i = 0;
-        while ( i < argc ) {
-            if ( strncmp(argv[i], "state_dir=", 10) == 0 ) {
-                state_dir = argv[i] + 10;
-                if ( *state_dir != '/' ) {
-                    slurm_error("auto_tmpdir::__auto_tmpdir_fs_default_state_file: invalid state_dir in plugstack configuration (%s)", state_dir);
-                    return NULL;
-                }
-                break;
-            }
-            i++;
-        }
+        /* 64 characters should be plenty -- DNS label length maxes at 63 */
+        gethostname(hostname, sizeof(hostname));
 
-        slurm_debug("auto_tmpdir::__auto_tmpdir_fs_default_state_file: state_dir=%s", state_dir);
-        
-        /*
-         * Path should be <state_dir>/auto_tmpdir_fs-<job-id>{_<job-task-id>}.cache
-         */
-        rc = snprintf(NULL, 0, "%s/auto_tmpdir_fs-%u.cache", state_dir, job_id);
-        if ( rc > 0 ) {
-            state_file = malloc(rc + 1);
-            if ( state_file ) {
-                snprintf(state_file, rc + 1, "%s/auto_tmpdir_fs-%u.cache", state_dir, job_id);
-            }
-        }
+        /* Find the first dot (.) and NUL-terminate there (or at the end of the buffer): */
+        while ( (i < sizeof(hostname)) && (hostname[i] && (hostname[i] != '.')) ) i++;
+        hostname[i] = '\0';
+        is_inited = 1;
     }
-    return state_file;
+    return hostname;
 }
 
-#define AUTO_TMPDIR_FS_SERIALIZE(FIELD) \
-            out_bytes += write(state_file_fd, (void*)&(FIELD), sizeof(FIELD)); expect_bytes += sizeof(FIELD); \
-            if ( out_bytes != expect_bytes ) { \
-                slurm_error("auto_tmpdir::auto_tmpdir_fs_serialize_to_file: failed to write %s to `%s` (errno = %d)", #FIELD, filepath, errno); \
-                goto early_exit; \
-            }
-#define AUTO_TMPDIR_FS_SERIALIZE_CSTR(FIELD) \
-            size_bytes = (FIELD) ? strlen(FIELD) : 0; \
-            out_bytes += write(state_file_fd, (void*)&size_bytes, sizeof(size_bytes)); expect_bytes += sizeof(size_bytes); \
-            if ( out_bytes != expect_bytes ) { \
-                slurm_error("auto_tmpdir::auto_tmpdir_fs_serialize_to_file: failed to write %s string length to `%s` (errno = %d)", #FIELD, filepath, errno); \
-                goto early_exit; \
-            } \
-            if ( FIELD ) { out_bytes += write(state_file_fd, (void*)FIELD, size_bytes);  expect_bytes += size_bytes; } \
-            if ( out_bytes != expect_bytes ) { \
-                slurm_error("auto_tmpdir::auto_tmpdir_fs_serialize_to_file: failed to write %s string to `%s` (errno = %d)", #FIELD, filepath, errno); \
-                goto early_exit; \
-            }
+/**/
 
-int
-auto_tmpdir_fs_serialize_to_file(
-    auto_tmpdir_fs_ref  fs_info,
-    spank_t             spank_ctxt,
-    int                 argc,
-    char*               argv[],
-    const char          *filepath
+const char*
+__auto_tmpdir_fs_path_create(
+    const char                  *prefix,
+    auto_tmpdir_fs_options_t    options,
+    uint32_t                    job_id
 )
 {
-    int                 rc, state_file_fd;
-    
-    if ( ! filepath ) {
-        filepath = __auto_tmpdir_fs_default_state_file(spank_ctxt, argc, argv);
-        if ( ! filepath ) {
-            slurm_error("auto_tmpdir::auto_tmpdir_fs_serialize_to_file: unable to get default state file path");
-            return ENOMEM;
-        }
+    const char      *hostname = "";
+    size_t          out_path_len = strlen(prefix) + 10 + 1;
+    char            *out_path;
+    int             has_hostname = 0;
+
+    if ( (options & auto_tmpdir_fs_options_should_use_per_host) == auto_tmpdir_fs_options_should_use_per_host ) {
+        hostname = __auto_tmpdir_fs_get_hostname();
+        out_path_len += strlen(hostname) + 1;
+        has_hostname = 1;
     }
-    
-    /* Attempt to open the file: */
-    state_file_fd = open(filepath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
-    if ( state_file_fd >= 0 ) {
-        ssize_t     out_bytes = 0, expect_bytes = 0;
-        size_t      size_bytes = 0;
-        
+    out_path = malloc(out_path_len);
+    if ( ! out_path ) {
+        slurm_info("auto_tmpdir: unable to allocate job path relative to `%s`", prefix);
+        return NULL;
+    }
+    if ( has_hostname ) {
+        snprintf(out_path, out_path_len, "%1$s%2$u/%3$s", prefix, job_id, hostname);
+    } else {
+        snprintf(out_path, out_path_len, "%1$s%2$u", prefix, job_id);
+    }
+    return out_path;
+}
+
+/**/
+
+int
+__auto_tmpdir_fs_overlay_setup(
+    auto_tmpdir_fs_bindpoint_t  *bindpoint,
+    const char                  *template_path,
+    size_t                      template_path_len
+)
+{
+    struct stat                 finfo;
+    char                        *work_path, merged_path[PATH_MAX];
+    int                         work_path_len = strlen(bindpoint->bind_this_path) + 6, overlay_opts_len;
+
+    if ( ! (bindpoint->template_path = strndup(template_path, template_path_len)) ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_fs_overlay_setup: unable to allocate template path");
+        return -1;
+    }
+    if ( (stat(bindpoint->template_path, &finfo) != 0) || ! S_ISDIR(finfo.st_mode) ) {
+        slurm_info("auto_tmpdir::__auto_tmpdir_fs_overlay_setup: template `%s` is not a directory, `%s` will not be pre-populated", bindpoint->template_path, bindpoint->to_this_path);
+        goto no_overlay;
+    }
+    if ( __auto_tmpdir_fs_overlay_merged_path(bindpoint, merged_path, sizeof(merged_path)) != 0 ) {
+        slurm_info("auto_tmpdir::__auto_tmpdir_fs_overlay_setup: overlay path for `%s` is too long, `%s` will not be pre-populated", bindpoint->bind_this_path, bindpoint->to_this_path);
+        goto no_overlay;
+    }
+
+    /*
+     * The overlay work directory must be on the same filesystem as the upper
+     * layer, so it sits alongside it in the base_dir:
+     */
+    if ( ! (work_path = malloc(work_path_len + 1)) ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_fs_overlay_setup: unable to allocate work path");
+        return -1;
+    }
+    snprintf(work_path, work_path_len + 1, "%s.work", bindpoint->bind_this_path);
+    if ( (mkdir(work_path, S_IRWXU) != 0) && (errno != EEXIST) ) {
+        slurm_info("auto_tmpdir::__auto_tmpdir_fs_overlay_setup: unable to create overlay work directory `%s` (%m), `%s` will not be pre-populated", work_path, bindpoint->to_this_path);
+        free((void*)work_path);
+        goto no_overlay;
+    }
+    if ( (mkdir(merged_path, S_IRWXU) != 0) && (errno != EEXIST) ) {
+        slurm_info("auto_tmpdir::__auto_tmpdir_fs_overlay_setup: unable to create overlay directory `%s` (%m), `%s` will not be pre-populated", merged_path, bindpoint->to_this_path);
+        goto no_overlay_mount;
+    }
+
+    overlay_opts_len = snprintf(NULL, 0, "lowerdir=%s,upperdir=%s,workdir=%s", bindpoint->template_path, bindpoint->bind_this_path, work_path);
+    {
+        char                    overlay_opts[overlay_opts_len + 1];
+
+        snprintf(overlay_opts, sizeof(overlay_opts), "lowerdir=%s,upperdir=%s,workdir=%s", bindpoint->template_path, bindpoint->bind_this_path, work_path);
+        slurm_debug("auto_tmpdir::__auto_tmpdir_fs_overlay_setup: overlay-mounting `%s` (%s)", merged_path, overlay_opts);
+        if ( mount("overlay", merged_path, "overlay", 0, overlay_opts) != 0 ) {
+            slurm_info("auto_tmpdir::__auto_tmpdir_fs_overlay_setup: unable to mount overlay on `%s` (%m), `%s` will not be pre-populated", merged_path, bindpoint->to_this_path);
+            rmdir(merged_path);
+            goto no_overlay_mount;
+        }
+    }
+    bindpoint->work_path = work_path;
+    slurm_debug("auto_tmpdir::__auto_tmpdir_fs_overlay_setup: `%s` will be an overlay of `%s` (work directory `%s`)", bindpoint->to_this_path, bindpoint->template_path, work_path);
+    return 0;
+
+no_overlay_mount:
+    rmdir(work_path);
+    free((void*)work_path);
+no_overlay:
+    free((void*)bindpoint->template_path);
+    bindpoint->template_path = NULL;
+    return 0;
+}
+
+
+/**/
+
+/*
+ * Claim a pre-formatted zram device from the pool (or hot-add and format a
+ * new one) and mount it on the bindpoint's directory.  Any failure leaves the
+ * bindpoint as a plain directory.
+ */
+int
+__auto_tmpdir_fs_zram_setup(
+    auto_tmpdir_fs_bindpoint_t      *bindpoint,
+    auto_tmpdir_fs_zram_config_t    *zram_config,
+    uid_t                           u_owner,
+    gid_t                           g_owner
+)
+{
+    char                            sysfs_path[64], value[32], device_path[32];
+    int                             device;
+
+    if ( (device = __auto_tmpdir_fs_zram_pool_claim(zram_config)) >= 0 ) {
+        /* Only the memory limit can still be changed on a formatted device: */
+        snprintf(sysfs_path, sizeof(sysfs_path), "/sys/block/zram%d/mem_limit", device);
+        snprintf(value, sizeof(value), "%llu", (unsigned long long)zram_config->mem_limit);
+        if ( __auto_tmpdir_fs_sysfs_write(sysfs_path, value) != 0 ) {
+            slurm_error("auto_tmpdir::__auto_tmpdir_fs_zram_setup: unable to set memory limit on /dev/zram%d (%m)", device);
+            __auto_tmpdir_fs_zram_remove(device);
+            device = -1;
+        } else {
+            slurm_debug("auto_tmpdir::__auto_tmpdir_fs_zram_setup: claimed pooled /dev/zram%d for `%s`", device, bindpoint->to_this_path);
+        }
+    }
+    if ( (device < 0) && ((device = __auto_tmpdir_fs_zram_create(zram_config)) < 0) ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_fs_zram_setup: using a plain directory for `%s`", bindpoint->to_this_path);
+        return 0;
+    }
+    bindpoint->backend = auto_tmpdir_fs_backend_zram;
+    bindpoint->device = device;
+
+    snprintf(device_path, sizeof(device_path), "/dev/zram%d", device);
+    if ( mount(device_path, bindpoint->bind_this_path, "ext4", MS_NOSUID | MS_NODEV, "discard") != 0 ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_fs_zram_setup: unable to mount %s on `%s` (%m)", device_path, bindpoint->bind_this_path);
+        goto error_out;
+    }
+    snprintf(sysfs_path, sizeof(sysfs_path), "%s/lost+found", bindpoint->bind_this_path);
+    rmdir(sysfs_path);
+    if ( (__auto_tmpdir_chown(bindpoint->bind_this_path, u_owner, g_owner) != 0) || (chmod(bindpoint->bind_this_path, S_IRWXU) != 0) ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_fs_zram_setup: unable to fixup ownership on `%s` (%m)", bindpoint->bind_this_path);
+        goto error_out;
+    }
+    slurm_debug("auto_tmpdir::__auto_tmpdir_fs_zram_setup: mounted %s on `%s`", device_path, bindpoint->bind_this_path);
+    return 0;
+
+error_out:
+    slurm_error("auto_tmpdir::__auto_tmpdir_fs_zram_setup: using a plain directory for `%s`", bindpoint->to_this_path);
+    __auto_tmpdir_fs_zram_release(bindpoint, 0);
+    return 0;
+}
+
+/**/
+
+/*
+ * Mount a tmpfs limited to size bytes (zero for the kernel default of half
+ * of RAM) on the bindpoint's directory.  Any failure leaves the bindpoint
+ * as a plain directory.
+ */
+int
+__auto_tmpdir_fs_tmpfs_setup(
+    auto_tmpdir_fs_bindpoint_t      *bindpoint,
+    uint64_t                        size,
+    uid_t                           u_owner,
+    gid_t                           g_owner
+)
+{
+    char                            mount_opts[96];
+    int                             mount_opts_len;
+
+    mount_opts_len = snprintf(mount_opts, sizeof(mount_opts), "mode=0700,uid=%u", (unsigned int)u_owner);
+    if ( g_owner != (gid_t)-1 ) mount_opts_len += snprintf(mount_opts + mount_opts_len, sizeof(mount_opts) - mount_opts_len, ",gid=%u", (unsigned int)g_owner);
+    if ( size ) snprintf(mount_opts + mount_opts_len, sizeof(mount_opts) - mount_opts_len, ",size=%llu", (unsigned long long)size);
+    if ( mount("tmpfs", bindpoint->bind_this_path, "tmpfs", MS_NOSUID | MS_NODEV, mount_opts) != 0 ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_fs_tmpfs_setup: unable to mount tmpfs on `%s` (%m), using a plain directory for `%s`", bindpoint->bind_this_path, bindpoint->to_this_path);
+        return 0;
+    }
+    bindpoint->backend = auto_tmpdir_fs_backend_tmpfs;
+    slurm_debug("auto_tmpdir::__auto_tmpdir_fs_tmpfs_setup: mounted tmpfs (%s) on `%s`", mount_opts, bindpoint->bind_this_path);
+    return 0;
+}
+
+/**/
+
+int
+__auto_tmpdir_fs_create_bindpoint(
+    auto_tmpdir_fs      *fs_info,
+    const char          *bind_this_path,
+    const char          *to_this_path,
+    int                 should_always_remove,
+    int                 should_never_remove,
+    int                 force_head_of_list,
+    uid_t               u_owner,
+    gid_t               g_owner
+)
+{
+    struct stat         finfo;
+    auto_tmpdir_event_t event;
+
+    auto_tmpdir_event_start(&event, "create_bindpoint", to_this_path);
+
+    /*
+     * If the directory exists, no need to create it:
+     */
+    if ( lstat(bind_this_path, &finfo) != 0 ) {
         /*
-         * Write the header fields:
+         * Create the directory:
          */
-        AUTO_TMPDIR_FS_SERIALIZE(fs_info->options);
-        AUTO_TMPDIR_FS_SERIALIZE_CSTR(fs_info->tmpdir);
-        AUTO_TMPDIR_FS_SERIALIZE_CSTR(fs_info->base_dir);
-        AUTO_TMPDIR_FS_SERIALIZE_CSTR(fs_info->base_dir_parent);
-        
-        auto_tmpdir_fs_bindpoint_t  *bindpoint_node = fs_info->bind_mounts_tail;
-        
-        while ( bindpoint_node ) {
-            /* State flags: */
-            AUTO_TMPDIR_FS_SERIALIZE(bindpoint_node->is_bind_mounted);
-            AUTO_TMPDIR_FS_SERIALIZE(bindpoint_node->should_always_remove);
-            AUTO_TMPDIR_FS_SERIALIZE_CSTR(bindpoint_node->bind_this_path);
-            AUTO_TMPDIR_FS_SERIALIZE_CSTR(bindpoint_node->to_this_path);
-            
-            /* Move to previous node: */
-            bindpoint_node = bindpoint_node->back_link;
+force_mkdir:
+        if ( mkdir(bind_this_path, S_IRWXU) != 0 ) {
+            slurm_error("auto_tmpdir::__auto_tmpdir_fs_create_bindpoint: unable to create directory `%s` (%m)", bind_this_path);
+            goto error_out;
+        }
+        slurm_debug("auto_tmpdir::__auto_tmpdir_fs_create_bindpoint: created directory `%s`", bind_this_path);
+
+        /*
+         * Fixup ownership:
+         */
+force_chown:
+        if ( __auto_tmpdir_chown(bind_this_path, u_owner, g_owner) ) {
+            slurm_error("auto_tmpdir::__auto_tmpdir_fs_create_bindpoint: unable to fixup ownership on directory `%s` (%m)", bind_this_path);
+            if ( ! should_never_remove ) auto_tmpdir_rmdir_recurse(bind_this_path, 0);
+            goto error_out;
+        }
+        slurm_debug("auto_tmpdir::__auto_tmpdir_fs_create_bindpoint: set ownership %d:%d on directory `%s`", u_owner, g_owner, bind_this_path);
+    } else if ( ! S_ISDIR(finfo.st_mode) ) {
+        slurm_info("auto_tmpdir::__auto_tmpdir_fs_create_bindpoint: path `%s` exists but is not a directory", bind_this_path);
+
+        /*
+         * Attempt to remove the offending file, socket, whatever:
+         */
+        if ( unlink(bind_this_path) != 0 ) {
+            slurm_error("auto_tmpdir::__auto_tmpdir_fs_create_bindpoint: path `%s` is not a directory and could not be removed (%m)", bind_this_path);
+            goto error_out;
+        }
+
+        /*
+         * Now go back and try to create the directory:
+         */
+        goto force_mkdir;
+    } else if ( NEEDS_CHOWN(finfo, u_owner, g_owner) ) {
+        /*
+         * Go back and try to change ownership:
+         */
+        goto force_chown;
+    }
+
+    /*
+     * Create the bind mount record:
+     */
+    auto_tmpdir_fs_bindpoint_t      *bindpoint = auto_tmpdir_fs_bindpoint_alloc(bind_this_path, to_this_path, should_always_remove, should_never_remove);
+
+    if ( ! bindpoint ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_fs_create_bindpoint: unable to create bind mount record for `%s`", bind_this_path);
+        if ( ! should_never_remove ) auto_tmpdir_rmdir_recurse(bind_this_path, 0);
+        goto error_out;
+    }
+    slurm_debug("auto_tmpdir::__auto_tmpdir_fs_create_bindpoint: added bindpoint `%s` -> `%s`", bind_this_path, to_this_path);
+
+    if ( force_head_of_list || (fs_info->base_dir_parent && (strcmp(fs_info->base_dir_parent, to_this_path) == 0)) ) {
+        /*
+         * Add this bind point at the FRONT of the list, so that it's mounted LAST and unmounted FIRST:
+         */
+        if ( fs_info->bind_mounts ) {
+            bindpoint->link = fs_info->bind_mounts;
+            fs_info->bind_mounts->back_link = bindpoint;
+            fs_info->bind_mounts = bindpoint;
+        } else {
+            fs_info->bind_mounts = fs_info->bind_mounts_tail = bindpoint;
         }
-        slurm_debug("auto_tmpdir::auto_tmpdir_fs_serialize_to_file: serialized to `%s`", filepath);
-        
-early_exit:
-        close(state_file_fd);
-        rc =  ( out_bytes == expect_bytes ) ? 0 : errno;
     } else {
-        slurm_error("auto_tmpdir::auto_tmpdir_fs_serialize_to_file: unable to open state file `%s` (errno = %d)", filepath, errno);
-        rc = errno;
+        if ( fs_info->bind_mounts_tail ) {
+            fs_info->bind_mounts_tail->link = bindpoint;
+            bindpoint->back_link = fs_info->bind_mounts_tail;
+            fs_info->bind_mounts_tail = bindpoint;
+        } else {
+            fs_info->bind_mounts = fs_info->bind_mounts_tail = bindpoint;
+        }
+    }
+    auto_tmpdir_event_end(&event, 1, 0);
+    return 0;
+
+error_out:
+    auto_tmpdir_event_end(&event, 0, 1);
+    return -1;
+}
+
+/**/
+
+int
+__auto_tmpdir_fs_cache_setup(
+    auto_tmpdir_fs      *fs_info,
+    const char          *cache_mount,
+    const char          *cache_prefix,
+    uint64_t            max_bytes,
+    uint64_t            max_inodes,
+    uid_t               u_owner,
+    gid_t               g_owner
+)
+{
+    size_t                      cache_mount_len = strlen(cache_mount);
+    char                        *cache_dir = NULL, *to_dir = NULL, *parent_dir;
+    auto_tmpdir_fs_bindpoint_t  *covering_bindpoint = fs_info->bind_mounts;
+    size_t                      covering_len = 0;
+    int                         rc;
+
+    while ( cache_mount_len && (cache_mount[cache_mount_len - 1] == '/') ) cache_mount_len--;
+    if ( cache_mount_len == 0 ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_fs_cache_setup: invalid cache_mount in plugstack configuration (%s)", cache_mount);
+        return -1;
+    }
+    to_dir = strndup(cache_mount, cache_mount_len);
+    rc = snprintf(NULL, 0, "%s%u", cache_prefix, u_owner);
+    if ( ! to_dir || ! (cache_dir = malloc(rc + 1)) ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_fs_cache_setup: unable to allocate cache paths");
+        goto error_out;
+    }
+    snprintf(cache_dir, rc + 1, "%s%u", cache_prefix, u_owner);
+
+    /* The directory holding all per-user caches belongs to root: */
+    if ( (parent_dir = strdup(cache_dir)) ) {
+        rc = auto_tmpdir_mkdir_recurse(dirname(parent_dir), 0755, 0, 0, 0);
+        free((void*)parent_dir);
+        if ( rc ) {
+            slurm_error("auto_tmpdir::__auto_tmpdir_fs_cache_setup: unable to create cache parent directory for `%s`", cache_dir);
+            goto error_out;
+        }
+    }
+
+    /* Make room if the node-wide budget has been exceeded: */
+    __auto_tmpdir_fs_cache_evict(cache_prefix, u_owner, max_bytes, max_inodes);
+
+    /* Mark the cache as in use (and recently used): */
+    if ( __auto_tmpdir_fs_cache_update(cache_dir, fs_info->job_id, 1, 0) != 0 ) goto error_out;
+
+    /*
+     * If the cache is mounted inside one of the other bindpoints it must be
+     * mounted after that bindpoint, and its mountpoint must exist in the
+     * directory bound there:
+     */
+    while ( covering_bindpoint ) {
+        covering_len = strlen(covering_bindpoint->to_this_path);
+        if ( (strncmp(covering_bindpoint->to_this_path, to_dir, covering_len) == 0) && (to_dir[covering_len] == '/') ) break;
+        covering_bindpoint = covering_bindpoint->link;
+    }
+    if ( covering_bindpoint ) {
+        char            mountpoint[PATH_MAX];
+
+        snprintf(mountpoint, sizeof(mountpoint), "%s%s", covering_bindpoint->bind_this_path, to_dir + covering_len);
+        if ( auto_tmpdir_mkdir_recurse(mountpoint, 0700, 1, u_owner, g_owner) ) {
+            slurm_error("auto_tmpdir::__auto_tmpdir_fs_cache_setup: unable to create cache mountpoint `%s`", mountpoint);
+            __auto_tmpdir_fs_cache_update(cache_dir, fs_info->job_id, -1, 0);
+            goto error_out;
+        }
+    }
+    if ( __auto_tmpdir_fs_create_bindpoint(fs_info, cache_dir, to_dir, 0, 1, (covering_bindpoint != NULL), u_owner, g_owner) != 0 ) {
+        __auto_tmpdir_fs_cache_update(cache_dir, fs_info->job_id, -1, 0);
+        goto error_out;
+    }
+    return 0;
+
+error_out:
+    if ( cache_dir ) free((void*)cache_dir);
+    if ( to_dir ) free((void*)to_dir);
+    return -1;
+}
+
+/**/
+
+/*
+ * A hierarchy retained for hand-off to a follow-on job is renamed from its
+ * base_dir (<prefix><job-id>) to
+ *
+ *     <prefix>handoff.<uid>.<expiry>.<job-id>
+ *
+ * in the same parent directory, where <expiry> is the epoch time after which
+ * it will be reaped instead of adopted.
+ */
+int
+__auto_tmpdir_fs_handoff_scan(
+    const char      *prefix,
+    uid_t           u_owner,
+    const char      *adopt_to_path
+)
+{
+    char            prefix_dir[PATH_MAX], adopt_path[PATH_MAX];
+    const char      *prefix_base = strrchr(prefix, '/') + 1;
+    size_t          prefix_base_len = strlen(prefix_base);
+    time_t          now = time(NULL), adopt_expiry = 0;
+    DIR             *dir;
+    struct dirent   *dent;
+
+    snprintf(prefix_dir, sizeof(prefix_dir), "%.*s", (int)(prefix_base - prefix), prefix);
+    if ( ! (dir = opendir(prefix_dir)) ) return 0;
+    while ( (dent = readdir(dir)) ) {
+        unsigned long       uid, job_id;
+        long long           expiry;
+        int                 name_len = 0;
+        char                path[PATH_MAX];
+        struct stat         finfo;
+
+        if ( strncmp(dent->d_name, prefix_base, prefix_base_len) ) continue;
+        if ( sscanf(dent->d_name + prefix_base_len, "handoff.%lu.%lld.%lu%n", &uid, &expiry, &job_id, &name_len) != 3 ) continue;
+        if ( dent->d_name[prefix_base_len + name_len] ) continue;
+
+        if ( snprintf(path, sizeof(path), "%s%s", prefix_dir, dent->d_name) >= sizeof(path) ) continue;
+        if ( expiry <= now ) {
+            slurm_info("auto_tmpdir::__auto_tmpdir_fs_handoff_scan: reaping expired hand-off directory `%s`", path);
+            auto_tmpdir_rmdir_recurse(path, 0);
+        }
+        else if ( adopt_to_path && (uid == u_owner) && (expiry > adopt_expiry) && (lstat(path, &finfo) == 0) && S_ISDIR(finfo.st_mode) && (finfo.st_uid == u_owner) ) {
+            /* The most recently handed-off hierarchy wins: */
+            snprintf(adopt_path, sizeof(adopt_path), "%s", path);
+            adopt_expiry = expiry;
+        }
+    }
+    closedir(dir);
+
+    if ( adopt_expiry ) {
+        if ( rename(adopt_path, adopt_to_path) == 0 ) {
+            removexattr(adopt_to_path, AUTO_TMPDIR_FS_HANDOFF_USAGE_XATTR);
+            slurm_info("auto_tmpdir::__auto_tmpdir_fs_handoff_scan: adopted hand-off directory `%s` as `%s`", adopt_path, adopt_to_path);
+            return 1;
+        }
+        slurm_info("auto_tmpdir::__auto_tmpdir_fs_handoff_scan: unable to adopt hand-off directory `%s` (%m)", adopt_path);
+    }
+    return 0;
+}
+
+int
+__auto_tmpdir_fs_base_dir_prefix(
+    auto_tmpdir_fs      *fs_info,
+    char                *prefix,
+    size_t              prefix_size
+)
+{
+    char                job_id_str[16];
+    size_t              prefix_len = strlen(fs_info->base_dir);
+    int                 job_id_len = snprintf(job_id_str, sizeof(job_id_str), "%u", fs_info->job_id);
+
+    /* Strip the job id from a (non-per-host) base_dir to recover the prefix: */
+    if ( (prefix_len <= job_id_len) || strcmp(fs_info->base_dir + prefix_len - job_id_len, job_id_str) ) return -1;
+    prefix_len -= job_id_len;
+    if ( prefix_len >= prefix_size ) return -1;
+    snprintf(prefix, prefix_size, "%.*s", (int)prefix_len, fs_info->base_dir);
+    return 0;
+}
+
+int
+__auto_tmpdir_fs_handoff(
+    auto_tmpdir_fs      *fs_info
+)
+{
+    char                prefix[PATH_MAX], handoff_path[PATH_MAX], value[48];
+    long long           expiry = (long long)time(NULL) + 60 * (long long)fs_info->handoff_minutes;
+    uint64_t            bytes = 0, inodes = 0;
+    int                 value_len;
+
+    if ( __auto_tmpdir_fs_base_dir_prefix(fs_info, prefix, sizeof(prefix)) != 0 ) return -1;
+    if ( snprintf(handoff_path, sizeof(handoff_path), "%shandoff.%u.%lld.%u", prefix, fs_info->u_owner, expiry, fs_info->job_id) >= sizeof(handoff_path) ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_fs_handoff: hand-off path for `%s` is too long", fs_info->base_dir);
+        return -1;
+    }
+    if ( rename(fs_info->base_dir, handoff_path) != 0 ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_fs_handoff: unable to rename `%s` to `%s` (%m)", fs_info->base_dir, handoff_path);
+        return -1;
+    }
+    slurm_info("auto_tmpdir::__auto_tmpdir_fs_handoff: retained `%s` as `%s` for %u minutes", fs_info->base_dir, handoff_path, fs_info->handoff_minutes);
+
+    /*
+     * Record what the hierarchy holds on the directory itself, where the
+     * metrics gauges can find it for as long as it waits for adoption:
+     */
+    if ( __auto_tmpdir_fs_usage(handoff_path, &bytes, &inodes) == 0 ) {
+        value_len = snprintf(value, sizeof(value), "%llu %llu", (unsigned long long)bytes, (unsigned long long)inodes);
+        if ( setxattr(handoff_path, AUTO_TMPDIR_FS_HANDOFF_USAGE_XATTR, value, value_len, 0) != 0 ) {
+            slurm_debug("auto_tmpdir::__auto_tmpdir_fs_handoff: unable to record usage on `%s` (%m)", handoff_path);
+        }
+        slurm_info("auto_tmpdir::__auto_tmpdir_fs_handoff: job %u `%s` handed off with %llu bytes, %llu inodes", fs_info->job_id, handoff_path, (unsigned long long)bytes, (unsigned long long)inodes);
+        if ( fs_info->accounting_path ) {
+            auto_tmpdir_fs_accounting_t accounting = { -1, fs_info->job_id, fs_info->u_owner };
+
+            if ( (accounting.fd = open(fs_info->accounting_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600)) >= 0 ) {
+                __auto_tmpdir_fs_account_handoff(&accounting, handoff_path, bytes, inodes, expiry);
+                close(accounting.fd);
+            } else {
+                slurm_error("auto_tmpdir::__auto_tmpdir_fs_handoff: unable to open accounting file `%s` (%m)", fs_info->accounting_path);
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Fetch the usage recorded on a hand-off directory; returns 0 on success:
+ */
+static int
+__auto_tmpdir_fs_handoff_usage(
+    const char          *handoff_path,
+    uint64_t            *bytes,
+    uint64_t            *inodes
+)
+{
+    char                value[48];
+    ssize_t             value_len = getxattr(handoff_path, AUTO_TMPDIR_FS_HANDOFF_USAGE_XATTR, value, sizeof(value) - 1);
+    unsigned long long  b, i;
+
+    if ( value_len <= 0 ) return -1;
+    value[value_len] = '\0';
+    if ( sscanf(value, "%llu %llu", &b, &i) != 2 ) return -1;
+    *bytes = b;
+    *inodes = i;
+    return 0;
+}
+
+/**/
+
+static const char *auto_tmpdir_fs_dev_shm = AUTO_TMPDIR_DEV_SHM;
+static const char *auto_tmpdir_fs_dev_shm_prefix = AUTO_TMPDIR_DEV_SHM_PREFIX;
+static const char *auto_tmpdir_fs_default_local_prefix = AUTO_TMPDIR_DEFAULT_LOCAL_PREFIX;
+static const char *auto_tmpdir_fs_default_shared_prefix = AUTO_TMPDIR_DEFAULT_SHARED_PREFIX;
+static const char *auto_tmpdir_fs_default_cache_prefix = AUTO_TMPDIR_DEFAULT_CACHE_PREFIX;
+
+/**/
+
+/*
+ * Map a backend name (not necessarily NUL-terminated) to its enum value:
+ */
+static int
+__auto_tmpdir_fs_parse_backend(
+    const char                  *name,
+    size_t                      name_len,
+    int                         *backend
+)
+{
+    if ( (name_len == 3) && (strncmp(name, "dir", 3) == 0) ) *backend = auto_tmpdir_fs_backend_dir;
+    else if ( (name_len == 4) && (strncmp(name, "zram", 4) == 0) ) *backend = auto_tmpdir_fs_backend_zram;
+    else if ( (name_len == 5) && (strncmp(name, "tmpfs", 5) == 0) ) *backend = auto_tmpdir_fs_backend_tmpfs;
+    else return -1;
+    return 0;
+}
+
+/*
+ * Set the recursive removal order from an rmdir_order= value:
+ */
+static int
+__auto_tmpdir_fs_parse_rmdir_order(
+    const char                  *name
+)
+{
+    if ( strcmp(name, "auto") == 0 ) auto_tmpdir_fs_rmdir_order = auto_tmpdir_fs_rmdir_order_auto;
+    else if ( strcmp(name, "directory") == 0 ) auto_tmpdir_fs_rmdir_order = auto_tmpdir_fs_rmdir_order_directory;
+    else if ( strcmp(name, "inode") == 0 ) auto_tmpdir_fs_rmdir_order = auto_tmpdir_fs_rmdir_order_inode;
+    else return -1;
+    return 0;
+}
+
+/**/
+
+static auto_tmpdir_fs_ref
+__auto_tmpdir_fs_init(
+    spank_t                     spank_ctxt,
+    int                         argc,
+    char*                       argv[],
+    auto_tmpdir_fs_options_t    options
+)
+{
+    auto_tmpdir_fs              *new_fs;
+    int                         should_check_bind_order = 1, i;
+    uint32_t                    job_id = NO_VAL;
+    uid_t                       u_owner;
+    gid_t                       g_owner;
+    const char                  *local_prefix = auto_tmpdir_fs_default_local_prefix, *shared_prefix = auto_tmpdir_fs_default_shared_prefix;
+    const char                  *tmpdir = NULL;
+    const char                  *cache_mount = NULL, *cache_prefix = auto_tmpdir_fs_default_cache_prefix;
+    const char                  *retained_base_dir = NULL;
+    uint64_t                    cache_max_bytes = 0, cache_max_inodes = 0;
+    auto_tmpdir_fs_zram_config_t zram_config = { NULL, 0, 0 };
+    int                         default_backend = auto_tmpdir_fs_backend_dir, dev_shm_backend = auto_tmpdir_fs_backend_dir;
+    uint64_t                    tmpfs_size = 0, dev_shm_size = 0;
+    int                         has_dev_shm_size = 0;
+    int                         rc;
+    size_t                      prefix_len;
+    auto_tmpdir_event_t         event;
+
+    /* What user should we function as? */
+    if ((rc = spank_get_item (spank_ctxt, S_JOB_UID, &u_owner)) != ESPANK_SUCCESS) {
+        slurm_error ("auto_tmpdir: auto_tmpdir_fs_init: unable to get job's user id");
+        return NULL;
+    }
+    
+#ifndef AUTO_TMPDIR_NO_GID_CHOWN
+    if ((rc = spank_get_item (spank_ctxt, S_JOB_GID, &g_owner)) != ESPANK_SUCCESS) {
+        slurm_error ("auto_tmpdir: auto_tmpdir_fs_init: unable to get job's group id");
+        return NULL;
+    }
+#else
+    g_owner = -1;
+#endif
+
+    /* Get the base job id: */
+    if ( (rc = spank_get_item(spank_ctxt, S_JOB_ID, &job_id)) != ESPANK_SUCCESS ) {
+        slurm_error("auto_tmpdir: auto_tmpdir_fs_init: no job id associated with job??");
+        return NULL;
+    }
+
+    slurm_debug("auto_tmpdir::auto_tmpdir_fs_init: %u for owner %d:%d", job_id, u_owner, g_owner);
+
+    /*
+     * First pass through the arguments to the plugin -- pull the local and/or shared prefix if present:
+     */
+    auto_tmpdir_event_start(&event, "config_parse", NULL);
+    i = 0;
+    while ( i < argc ) {
+        if ( strncmp(argv[i], "local_prefix=", 13) == 0 ) {
+            local_prefix = argv[i] + 13;
+            if ( *local_prefix != '/' ) {
+                slurm_error("auto_tmpdir::auto_tmpdir_fs_init: invalid local_prefix in plugstack configuration (%s)", local_prefix);
+                goto config_error;
+            }
+        }
+        else if ( strncmp(argv[i], "shared_prefix=", 14) == 0 ) {
+            shared_prefix = argv[i] + 14;
+            if ( *shared_prefix != '/' ) {
+                slurm_error("auto_tmpdir::auto_tmpdir_fs_init: invalid shared_prefix in plugstack configuration (%s)", shared_prefix);
+                goto config_error;
+            }
+        }
+        else if ( strncmp(argv[i], "tmpdir=", 7) == 0 ) {
+            tmpdir = argv[i] + 7;
+            if ( *tmpdir != '/' ) {
+                slurm_error("auto_tmpdir::auto_tmpdir_fs_init: invalid tmpdir in plugstack configuration (%s)", tmpdir);
+                goto config_error;
+            }
+        }
+        else if ( strncmp(argv[i], "cache_mount=", 12) == 0 ) {
+            cache_mount = argv[i] + 12;
+            if ( *cache_mount != '/' ) {
+                slurm_error("auto_tmpdir::auto_tmpdir_fs_init: invalid cache_mount in plugstack configuration (%s)", cache_mount);
+                goto config_error;
+            }
+        }
+        else if ( strncmp(argv[i], "cache_prefix=", 13) == 0 ) {
+            cache_prefix = argv[i] + 13;
+            if ( *cache_prefix != '/' ) {
+                slurm_error("auto_tmpdir::auto_tmpdir_fs_init: invalid cache_prefix in plugstack configuration (%s)", cache_prefix);
+                goto config_error;
+            }
+        }
+        else if ( strncmp(argv[i], "cache_max_bytes=", 16) == 0 ) {
+            if ( __auto_tmpdir_fs_parse_size(argv[i] + 16, &cache_max_bytes) != 0 ) {
+                slurm_error("auto_tmpdir::auto_tmpdir_fs_init: invalid cache_max_bytes in plugstack configuration (%s)", argv[i] + 16);
+                goto config_error;
+            }
+        }
+        else if ( strncmp(argv[i], "cache_max_inodes=", 17) == 0 ) {
+            if ( __auto_tmpdir_fs_parse_size(argv[i] + 17, &cache_max_inodes) != 0 ) {
+                slurm_error("auto_tmpdir::auto_tmpdir_fs_init: invalid cache_max_inodes in plugstack configuration (%s)", argv[i] + 17);
+                goto config_error;
+            }
+        }
+        else if ( strncmp(argv[i], "zram_algorithm=", 15) == 0 ) {
+            zram_config.algorithm = argv[i] + 15;
+        }
+        else if ( strncmp(argv[i], "zram_size=", 10) == 0 ) {
+            if ( __auto_tmpdir_fs_parse_size(argv[i] + 10, &zram_config.disk_size) != 0 ) {
+                slurm_error("auto_tmpdir::auto_tmpdir_fs_init: invalid zram_size in plugstack configuration (%s)", argv[i] + 10);
+                goto config_error;
+            }
+        }
+        else if ( strncmp(argv[i], "zram_mem_limit=", 15) == 0 ) {
+            if ( __auto_tmpdir_fs_parse_size(argv[i] + 15, &zram_config.mem_limit) != 0 ) {
+                slurm_error("auto_tmpdir::auto_tmpdir_fs_init: invalid zram_mem_limit in plugstack configuration (%s)", argv[i] + 15);
+                goto config_error;
+            }
+        }
+        else if ( strncmp(argv[i], "tmpfs_size=", 11) == 0 ) {
+            if ( __auto_tmpdir_fs_parse_size(argv[i] + 11, &tmpfs_size) != 0 ) {
+                slurm_error("auto_tmpdir::auto_tmpdir_fs_init: invalid tmpfs_size in plugstack configuration (%s)", argv[i] + 11);
+                goto config_error;
+            }
+        }
+        else if ( strncmp(argv[i], "dev_shm_size=", 13) == 0 ) {
+            if ( __auto_tmpdir_fs_parse_size(argv[i] + 13, &dev_shm_size) != 0 ) {
+                slurm_error("auto_tmpdir::auto_tmpdir_fs_init: invalid dev_shm_size in plugstack configuration (%s)", argv[i] + 13);
+                goto config_error;
+            }
+            has_dev_shm_size = 1;
+        }
+        else if ( strncmp(argv[i], "backend=", 8) == 0 ) {
+            if ( __auto_tmpdir_fs_parse_backend(argv[i] + 8, strlen(argv[i] + 8), &default_backend) != 0 ) {
+                slurm_error("auto_tmpdir::auto_tmpdir_fs_init: invalid backend in plugstack configuration (%s)", argv[i] + 8);
+                goto config_error;
+            }
+        }
+        else if ( strncmp(argv[i], "dev_shm_backend=", 16) == 0 ) {
+            if ( __auto_tmpdir_fs_parse_backend(argv[i] + 16, strlen(argv[i] + 16), &dev_shm_backend) != 0 ) {
+                slurm_error("auto_tmpdir::auto_tmpdir_fs_init: invalid dev_shm_backend in plugstack configuration (%s)", argv[i] + 16);
+                goto config_error;
+            }
+        }
+        else if ( strcmp(argv[i], "no_dev_shm") == 0 ) {
+                slurm_debug("auto_tmpdir::auto_tmpdir_fs_init: no_dev_shm set, will not add /dev/shm bind mounts");
+            options |= auto_tmpdir_fs_options_should_not_map_dev_shm;
+        }
+        else if ( strcmp(argv[i], "per_step_tmpdir") == 0 ) {
+            slurm_debug("auto_tmpdir::auto_tmpdir_fs_init: per_step_tmpdir set, will create per-step subdirectories");
+            options |= auto_tmpdir_fs_options_should_use_per_step;
+        }
+        else if ( strcmp(argv[i], "per_task_tmpdir") == 0 ) {
+            slurm_debug("auto_tmpdir::auto_tmpdir_fs_init: per_task_tmpdir set, will create per-task subdirectories");
+            options |= auto_tmpdir_fs_options_should_use_per_task;
+        }
+        else if ( strcmp(argv[i], "no_rm_shared_only") == 0 ) {
+            if ( (options & auto_tmpdir_fs_options_should_use_shared) != auto_tmpdir_fs_options_should_use_shared ) {
+                slurm_debug("auto_tmpdir::auto_tmpdir_fs_init: no_rm_shared_only set, ensuring no should_not_delete bit in options");
+                options &= ~auto_tmpdir_fs_options_should_not_delete;
+            }
+        }
+        else if ( strncmp(argv[i], "rmdir_order=", 12) == 0 ) {
+            if ( __auto_tmpdir_fs_parse_rmdir_order(argv[i] + 12) != 0 ) {
+                slurm_error("auto_tmpdir::auto_tmpdir_fs_init: invalid rmdir_order in plugstack configuration (%s)", argv[i] + 12);
+                goto config_error;
+            }
+        }
+        else if ( strcmp(argv[i], "no_bind_order_check") == 0 ) {
+            slurm_debug("auto_tmpdir::auto_tmpdir_fs_init: no_bind_order_check set, will not check bind mount order");
+            should_check_bind_order = 0;
+        }
+        i++;
+    }
+    if ( (dev_shm_backend == auto_tmpdir_fs_backend_zram) && ! zram_config.disk_size ) {
+        slurm_error("auto_tmpdir::auto_tmpdir_fs_init: dev_shm_backend=zram requires zram_size in plugstack configuration");
+        goto config_error;
+    }
+    if ( (default_backend == auto_tmpdir_fs_backend_zram) && ! zram_config.disk_size ) {
+        slurm_error("auto_tmpdir::auto_tmpdir_fs_init: backend=zram requires zram_size in plugstack configuration");
+        goto config_error;
+    }
+    if ( __auto_tmpdir_fs_zram_pool_config(argc, argv, &auto_tmpdir_fs_zram_pool) < 0 ) goto config_error;
+    if ( ! has_dev_shm_size ) dev_shm_size = tmpfs_size;
+    auto_tmpdir_event_end(&event, argc, 0);
+
+    slurm_debug("auto_tmpdir::auto_tmpdir_fs_init: local_prefix=%s", local_prefix);
+    if ( shared_prefix ) slurm_debug("auto_tmpdir::auto_tmpdir_fs_init: shared_prefix=%s", shared_prefix);
+    if ( tmpdir ) slurm_debug("auto_tmpdir::auto_tmpdir_fs_init: tmpdir=%s", tmpdir);
+    if ( cache_mount ) slurm_debug("auto_tmpdir::auto_tmpdir_fs_init: cache_mount=%s cache_prefix=%s", cache_mount, cache_prefix);
+
+    /*
+     * If this job was requeued on this node and its hierarchy retained, take
+     * ownership of it again:
+     */
+    retained_base_dir = __auto_tmpdir_fs_retained_claim(spank_ctxt, argc, argv);
+
+    /*
+     * All set:
+     */
+    if ( (new_fs = (auto_tmpdir_fs*)malloc(sizeof(auto_tmpdir_fs))) ) {
+        new_fs->options = options;
+        new_fs->job_id = job_id;
+        new_fs->u_owner = u_owner;
+        new_fs->g_owner = g_owner;
+        new_fs->tmpdir = tmpdir ? strdup(tmpdir) : NULL;
+        new_fs->base_dir = new_fs->base_dir_parent = NULL;
+        new_fs->archive_path = NULL;
+        new_fs->handoff_minutes = 0;
+        new_fs->retain_until = 0;
+        new_fs->granted_mb = 0;
+        new_fs->policy_name = NULL;
+        new_fs->job_cpus = 0;
+        new_fs->step_tmpdir = NULL;
+        new_fs->step_dirs = NULL;
+        new_fs->n_step_dirs = 0;
+        new_fs->task_tmpdir_base = NULL;
+        new_fs->accounting_path = NULL;
+        new_fs->bind_mounts = new_fs->bind_mounts_tail = NULL;
+
+        /*
+         * Go through the config arguments and create each mount point specified:
+         */
+        i = 0;
+        while ( i < argc ) {
+            if ( strncmp(argv[i], "mount=", 6) == 0 ) {
+                const char      *bind_to = argv[i] + 6;
+                size_t          bind_to_len = strcspn(bind_to, ",");
+                const char      *attrs = bind_to + bind_to_len;
+                const char      *template_path = NULL;
+                size_t          template_path_len = 0;
+                int             backend = default_backend, has_backend = 0;
+                
+                /*
+                 * Any comma-separated attributes follow the path:
+                 */
+                while ( *attrs == ',' ) {
+                    const char  *attr = ++attrs;
+                    size_t      attr_len = strcspn(attr, ",");
+
+                    if ( strncmp(attr, "template=", 9) == 0 ) {
+                        template_path = attr + 9;
+                        template_path_len = attr_len - 9;
+                        if ( (*template_path != '/') || memchr(template_path, ':', template_path_len) ) {
+                            slurm_error("auto_tmpdir::auto_tmpdir_fs_init: invalid template in plugstack configuration (%s)", argv[i]);
+                            goto error_out;
+                        }
+                    } else if ( (strncmp(attr, "backend=", 8) == 0) && (__auto_tmpdir_fs_parse_backend(attr + 8, attr_len - 8, &backend) == 0) ) {
+                        if ( (backend == auto_tmpdir_fs_backend_zram) && ! zram_config.disk_size ) {
+                            slurm_error("auto_tmpdir::auto_tmpdir_fs_init: backend=zram requires zram_size in plugstack configuration (%s)", argv[i]);
+                            goto error_out;
+                        }
+                        has_backend = 1;
+                    } else {
+                        slurm_error("auto_tmpdir::auto_tmpdir_fs_init: invalid mount attribute in plugstack configuration (%.*s)", (int)attr_len, attr);
+                        goto error_out;
+                    }
+                    attrs += attr_len;
+                }
+                if ( template_path && (backend != auto_tmpdir_fs_backend_dir) ) {
+                    /* The overlay work directory could not be on the same filesystem as the upper layer: */
+                    if ( has_backend ) {
+                        slurm_error("auto_tmpdir::auto_tmpdir_fs_init: template cannot be combined with backend in plugstack configuration (%s)", argv[i]);
+                        goto error_out;
+                    }
+                    backend = auto_tmpdir_fs_backend_dir;
+                }
+                if ( *bind_to != '/' ) {
+                    slurm_error("auto_tmpdir::auto_tmpdir_fs_init: invalid mount in plugstack configuration (%s)", bind_to);
+                    goto error_out;
+                }
+                while ( bind_to_len && (bind_to[bind_to_len - 1] == '/') ) bind_to_len--;
+                if ( bind_to_len == 0 ) {
+                    slurm_error("auto_tmpdir::auto_tmpdir_fs_init: invalid mount in plugstack configuration (%s)", bind_to);
+                    goto error_out;
+                }
+                
+                /*
+                 * Make sure we haven't already registered it:
+                 */
+                if ( auto_tmpdir_fs_bindpoint_find_to_path(new_fs->bind_mounts, bind_to, bind_to_len) ) {
+                    slurm_info("auto_tmpdir::auto_tmpdir_fs_init: ignoring repeated mount in plugstack configuration (%s)", bind_to);
+                    i++;
+                    continue;
+                }
+
+                /*
+                 * First time through we need to pick a prefix path and get the parent directory for all
+                 * bind mounts created:
+                 */
+                if ( ! new_fs->base_dir ) {
+                    const char      *prefix = local_prefix;
+
+                    if ( (options & auto_tmpdir_fs_options_should_use_shared) == auto_tmpdir_fs_options_should_use_shared ) {
+                        if ( ! shared_prefix ) {
+                            slurm_error("auto_tmpdir::auto_tmpdir_fs_init: shared tmp directory requested but not configured");
+                            goto error_out;
+                        }
+                        prefix = shared_prefix;
+                    }
+                    
+                    /*
+                     * Find the parent directory of the base_dir:
+                     */
+                    if ( should_check_bind_order ) {
+                        const char          *end = prefix + strlen(prefix);
+                        char                *base_dir_parent;
+                        
+                        while ( (end > prefix) ) {
+                            if ( *(--end) == '/' ) break;
+                        }
+                        if ( end <= prefix ) {
+                            slurm_error("auto_tmpdir::auto_tmpdir_fs_init: using the root directory is not supported");
+                            goto error_out;
+                        }
+                        base_dir_parent = (char*)malloc(end - prefix + 1);
+                        if ( ! base_dir_parent ) {
+                            slurm_error("auto_tmpdir::auto_tmpdir_fs_init: unable to allocate base directory parent");
+                            goto error_out;
+                        }
+                        strncpy(base_dir_parent, prefix, (end - prefix));
+                        base_dir_parent[end - prefix] = '\0';
+                        new_fs->base_dir_parent = (const char*)base_dir_parent;
+                    }
+                    new_fs->base_dir = __auto_tmpdir_fs_path_create(
+                                                            prefix,
+                                                            options,
+                                                            job_id
+                                                        );
+                    if ( ! new_fs->base_dir ) {
+                        slurm_error("auto_tmpdir::auto_tmpdir_fs_init: unable to allocate base directory");
+                        goto error_out;
+                    }
+                    prefix_len = strlen(new_fs->base_dir);
+
+                    /* Reap expired hand-off directories and adopt one of ours if present: */
+                    if ( (options & (auto_tmpdir_fs_options_should_use_shared | auto_tmpdir_fs_options_should_use_per_host)) == 0 ) {
+                        __auto_tmpdir_fs_handoff_scan(prefix, u_owner, new_fs->base_dir);
+                    }
+
+                    /* Create the parent tmp directory: */
+                    if ( auto_tmpdir_mkdir_recurse(new_fs->base_dir, 0700, 1, u_owner, g_owner) ) {
+                        slurm_error("auto_tmpdir::auto_tmpdir_fs_init: unable to create base directory `%s`", new_fs->base_dir);
+                        goto error_out;
+                    }
+                }
+                
+                /*
+                 * Make a copy of the mountpoint (to dir):
+                 */
+                char                    *to_dir = (char*)malloc(bind_to_len + 1);
+                
+                if ( ! to_dir ) {
+                    slurm_error("auto_tmpdir::auto_tmpdir_fs_init: unable to allocate copy of mountpoint for `%s`", bind_to);
+                    goto error_out;
+                }
+
+                /*
+                 * Create a temp directory under the base_dir to hold the bind mountpoint (note that
+                 * bind_to leads with a slash, which we'll discard in the directory name we map bind_to
+                 * to, so that slash becomes the NUL character in the final path length):
+                 */
+                char                    *dir_path = (char*)malloc(prefix_len + 1 + bind_to_len);
+
+                if ( ! dir_path ) {
+                    slurm_error("auto_tmpdir::auto_tmpdir_fs_init: unable to allocate tmp path template for `%s`", bind_to);
+                    free((void*)to_dir);
+                    goto error_out;
+                }
+                strncpy(dir_path, new_fs->base_dir, prefix_len);
+                dir_path[prefix_len] = '/';
+
+                int                     i_bind_to = 1, i_dir_path = prefix_len + 1;
+
+                /*
+                 * Map any slashes to underscores to flatten the bind_to path to a single name as we
+                 * fill-in the rest of dir_path:
+                 */
+                to_dir[0] = bind_to[0];
+                while ( i_bind_to < bind_to_len ) {
+                    char        c = bind_to[i_bind_to];
+                    to_dir[i_bind_to++] = c;
+                    dir_path[i_dir_path++] = ((c == '/') ? '_' : c);
+                }
+                to_dir[i_bind_to] = '\0';
+                dir_path[i_dir_path] = '\0';
+
+                /*
+                 * Add the mountpoint:
+                 */
+                if ( __auto_tmpdir_fs_create_bindpoint(new_fs, dir_path, to_dir, 0, 0, 0, u_owner, g_owner) != 0 ) {
+                    free((void*)dir_path);
+                    free((void*)to_dir);
+                    goto error_out;
+                }
+
+                /*
+                 * A template turns the bind mount into an overlay (with our directory as the
+                 * upper layer); overlayfs cannot use network filesystems as its upper layer, though:
+                 */
+                if ( template_path ) {
+                    if ( (options & auto_tmpdir_fs_options_should_use_shared) == auto_tmpdir_fs_options_should_use_shared ) {
+                        slurm_info("auto_tmpdir::auto_tmpdir_fs_init: template ignored for shared tmp directory (%s)", argv[i]);
+                    }
+                    else if ( __auto_tmpdir_fs_overlay_setup(auto_tmpdir_fs_bindpoint_find_to_path(new_fs->bind_mounts, to_dir, bind_to_len + 1), template_path, template_path_len) != 0 ) {
+                        goto error_out;
+                    }
+                }
+                if ( backend == auto_tmpdir_fs_backend_zram ) {
+                    __auto_tmpdir_fs_zram_setup(auto_tmpdir_fs_bindpoint_find_to_path(new_fs->bind_mounts, to_dir, bind_to_len + 1), &zram_config, u_owner, g_owner);
+                }
+                else if ( backend == auto_tmpdir_fs_backend_tmpfs ) {
+                    __auto_tmpdir_fs_tmpfs_setup(auto_tmpdir_fs_bindpoint_find_to_path(new_fs->bind_mounts, to_dir, bind_to_len + 1), tmpfs_size, u_owner, g_owner);
+                }
+            }
+            i++;
+        }
+
+        /*
+         * Attempt to setup the per-user persistent cache if desired:
+         */
+        if ( cache_mount && (__auto_tmpdir_fs_cache_setup(new_fs, cache_mount, cache_prefix, cache_max_bytes, cache_max_inodes, u_owner, g_owner) != 0) ) {
+            goto error_out;
+        }
+
+        /*
+         * Attempt to setup a mapped /dev/shm if desired:
+         */
+        if ( (options & auto_tmpdir_fs_options_should_not_map_dev_shm) != auto_tmpdir_fs_options_should_not_map_dev_shm ) {
+            struct stat             finfo;
+
+            if ( stat(auto_tmpdir_fs_dev_shm, &finfo) == 0 ) {
+                /*
+                 * Create our own /dev/shm space:
+                 */
+                const char          *dev_shm_dir = __auto_tmpdir_fs_path_create(
+                                                            auto_tmpdir_fs_dev_shm_prefix,
+                                                            (options & ~auto_tmpdir_fs_options_should_use_per_host),
+                                                            job_id
+                                                        );
+                const char          *to_dir = strdup(auto_tmpdir_fs_dev_shm);
+                
+                if ( ! dev_shm_dir ) goto error_out;
+                if ( ! to_dir ) {
+                    slurm_error("auto_tmpdir::auto_tmpdir_fs_init: unable to allocate copy of to path `%s`", auto_tmpdir_fs_dev_shm);
+                    goto error_out;
+                }
+
+                /*
+                 * Add the moundpoint:
+                 */
+                if ( __auto_tmpdir_fs_create_bindpoint(new_fs, dev_shm_dir, to_dir, 1, 0, 1, u_owner, g_owner) != 0 ) {
+                    free((void*)dev_shm_dir);
+                    free((void*)to_dir);
+                    goto error_out;
+                }
+                if ( dev_shm_backend == auto_tmpdir_fs_backend_zram ) {
+                    __auto_tmpdir_fs_zram_setup(new_fs->bind_mounts, &zram_config, u_owner, g_owner);
+                }
+                else if ( dev_shm_backend == auto_tmpdir_fs_backend_tmpfs ) {
+                    __auto_tmpdir_fs_tmpfs_setup(new_fs->bind_mounts, dev_shm_size, u_owner, g_owner);
+                }
+            } else {
+                slurm_info("auto_tmpdir::auto_tmpdir_fs_init: shm base directory `%s` does not exist", auto_tmpdir_fs_dev_shm);
+                goto error_out;
+            }
+        }
+    }
+    if ( retained_base_dir ) {
+        if ( new_fs && new_fs->base_dir && (strcmp(new_fs->base_dir, retained_base_dir) == 0) ) {
+            slurm_info("auto_tmpdir::auto_tmpdir_fs_init: reusing retained directory `%s`", retained_base_dir);
+        } else {
+            slurm_info("auto_tmpdir::auto_tmpdir_fs_init: removing retained directory `%s` that is no longer used", retained_base_dir);
+            auto_tmpdir_rmdir_recurse(retained_base_dir, 0);
+        }
+        free((void*)retained_base_dir);
+    }
+    return new_fs;
+
+config_error:
+    auto_tmpdir_event_end(&event, argc, 1);
+    return NULL;
+
+error_out:
+    if ( new_fs ) {
+        if ( new_fs->bind_mounts ) {
+            auto_tmpdir_fs_bindpoint_dealloc(
+                    new_fs->bind_mounts,
+                    new_fs->job_id,
+                    ((new_fs->options & auto_tmpdir_fs_options_should_not_delete) == auto_tmpdir_fs_options_should_not_delete),
+                    0,
+                    NULL
+                );
+        }
+        if ( new_fs->base_dir ) {
+            if ( (new_fs->options & auto_tmpdir_fs_options_should_not_delete) != auto_tmpdir_fs_options_should_not_delete ) auto_tmpdir_rmdir_recurse(new_fs->base_dir, 0);
+            free((void*)new_fs->base_dir);
+        }
+        if ( new_fs->base_dir_parent ) free((void*)new_fs->base_dir_parent);
+        if ( new_fs->archive_path ) free((void*)new_fs->archive_path);
+        if ( new_fs->tmpdir ) free((void*)new_fs->tmpdir);
+        free((void*)new_fs);
+    }
+    if ( retained_base_dir ) free((void*)retained_base_dir);
+    return NULL;
+}
+
+#ifdef AUTO_TMPDIR_ENABLE_USDT
+/*
+ * Count the bindpoints in a list (for tracepoint arguments):
+ */
+static int
+__auto_tmpdir_fs_bindpoint_count(
+    auto_tmpdir_fs_bindpoint_t  *bindpoint
+)
+{
+    int                         n = 0;
+
+    while ( bindpoint ) {
+        n++;
+        bindpoint = bindpoint->link;
+    }
+    return n;
+}
+#endif
+
+auto_tmpdir_fs_ref
+auto_tmpdir_fs_init(
+    spank_t                     spank_ctxt,
+    int                         argc,
+    char*                       argv[],
+    auto_tmpdir_fs_options_t    options
+)
+{
+    auto_tmpdir_fs_ref          new_fs;
+
+    AUTO_TMPDIR_PROBE2(fs_init__entry, argc, (int)options);
+    new_fs = __auto_tmpdir_fs_init(spank_ctxt, argc, argv, options);
+    AUTO_TMPDIR_PROBE3(fs_init__return, (new_fs != NULL), (new_fs && new_fs->base_dir) ? new_fs->base_dir : "", new_fs ? __auto_tmpdir_fs_bindpoint_count(new_fs->bind_mounts) : 0);
+    return new_fs;
+}
+
+/**/
+
+/*
+ * Directives a policy rule may set; those ending in '=' take a value:
+ */
+static const char *auto_tmpdir_fs_policy_settings[] = {
+                    "local_prefix=", "shared_prefix=", "tmpdir=",
+                    "backend=", "dev_shm_backend=", "tmpfs_size=", "dev_shm_size=",
+                    "zram_size=", "zram_mem_limit=", "zram_algorithm=",
+                    "no_dev_shm", "name=",
+                    NULL
+                };
+
+static int
+__auto_tmpdir_fs_policy_is_setting(
+    const char          *setting,
+    size_t              setting_len
+)
+{
+    const char          **allowed = auto_tmpdir_fs_policy_settings;
+
+    while ( *allowed ) {
+        size_t          allowed_len = strlen(*allowed);
+
+        if ( (*allowed)[allowed_len - 1] == '=' ) {
+            if ( (setting_len > allowed_len) && (strncmp(setting, *allowed, allowed_len) == 0) ) return 1;
+        } else if ( (setting_len == allowed_len) && (strncmp(setting, *allowed, allowed_len) == 0) ) {
+            return 1;
+        }
+        allowed++;
+    }
+    return 0;
+}
+
+/*
+ * Evaluate a single <key><op><value> condition against the job.  Returns 1
+ * if it holds, 0 if not, -1 if it is malformed.
+ */
+static int
+__auto_tmpdir_fs_policy_condition(
+    const char                          *condition,
+    size_t                              condition_len,
+    const auto_tmpdir_fs_job_attrs_t    *job
+)
+{
+    static const char   *ops[] = { "!=", "<=", ">=", "=", "<", ">", NULL };
+    char                value[256], *alternative, *save = NULL;
+    size_t              key_len = 0, op_len;
+    int                 op = 0, is_match = 0;
+
+    while ( (key_len < condition_len) && islower(condition[key_len]) ) key_len++;
+    while ( ops[op] ) {
+        op_len = strlen(ops[op]);
+        if ( (condition_len - key_len >= op_len) && (strncmp(condition + key_len, ops[op], op_len) == 0) ) break;
+        op++;
+    }
+    if ( ! ops[op] || (key_len == 0) || (condition_len - key_len - op_len >= sizeof(value)) ) return -1;
+    snprintf(value, sizeof(value), "%.*s", (int)(condition_len - key_len - op_len), condition + key_len + op_len);
+    if ( ! *value ) return -1;
+
+#define AUTO_TMPDIR_FS_POLICY_KEY(K) ((key_len == sizeof(K) - 1) && (strncmp(condition, K, key_len) == 0))
+
+    if ( AUTO_TMPDIR_FS_POLICY_KEY("partition") || AUTO_TMPDIR_FS_POLICY_KEY("qos") || AUTO_TMPDIR_FS_POLICY_KEY("account") ) {
+        const char      *job_value = AUTO_TMPDIR_FS_POLICY_KEY("partition") ? job->partition : (AUTO_TMPDIR_FS_POLICY_KEY("qos") ? job->qos : job->account);
+
+        /* Equality only, against any of the |-separated glob patterns: */
+        if ( (op != 0) && (op != 3) ) return -1;
+        if ( ! job_value ) return 0;
+        for ( alternative = strtok_r(value, "|", &save); alternative && ! is_match; alternative = strtok_r(NULL, "|", &save) ) {
+            if ( fnmatch(alternative, job_value, 0) == 0 ) is_match = 1;
+        }
+        return (op == 0) ? ! is_match : is_match;
+    }
+    else {
+        uint64_t        job_value, limit;
+        char            *end;
+
+        if ( AUTO_TMPDIR_FS_POLICY_KEY("nodes") ) job_value = job->n_nodes;
+        else if ( AUTO_TMPDIR_FS_POLICY_KEY("cpus") ) job_value = job->n_cpus;
+        else if ( AUTO_TMPDIR_FS_POLICY_KEY("mem") ) job_value = job->mem_mb;
+        else if ( AUTO_TMPDIR_FS_POLICY_KEY("tmp") ) job_value = job->tmp_mb;
+        else return -1;
+
+        /* Sizes without a unit are in MB, as in Slurm: */
+        limit = strtoull(value, &end, 10);
+        if ( end == value ) return -1;
+        if ( *end ) {
+            if ( ! (AUTO_TMPDIR_FS_POLICY_KEY("mem") || AUTO_TMPDIR_FS_POLICY_KEY("tmp")) || (__auto_tmpdir_fs_parse_size(value, &limit) != 0) ) return -1;
+            limit >>= 20;
+        }
+        switch ( op ) {
+            case 0: return (job_value != limit);
+            case 1: return (job_value <= limit);
+            case 2: return (job_value >= limit);
+            case 3: return (job_value == limit);
+            case 4: return (job_value < limit);
+            case 5: return (job_value > limit);
+        }
+    }
+
+#undef AUTO_TMPDIR_FS_POLICY_KEY
+
+    return -1;
+}
+
+int
+auto_tmpdir_fs_policy_select(
+    int                                 argc,
+    char*                               argv[],
+    const auto_tmpdir_fs_job_attrs_t    *job,
+    int                                 *policy_argc,
+    char                                ***policy_argv,
+    const char                          **policy_name
+)
+{
+    const char                          *match = NULL;
+    int                                 i, n_rules = 0, match_index = 0;
+
+    *policy_argc = argc;
+    *policy_argv = argv;
+    *policy_name = NULL;
+
+    /*
+     * Every rule is checked for errors, the first whose conditions all hold
+     * is the one chosen:
+     */
+    for ( i = 0; i < argc; i++ ) {
+        const char      *rule, *settings, *item;
+        int             is_match = 1;
+
+        if ( strncmp(argv[i], "policy=", 7) != 0 ) continue;
+        rule = argv[i] + 7;
+        n_rules++;
+        if ( ! (settings = strchr(rule, ':')) || (settings == rule) || ! settings[1] ) {
+            slurm_error("auto_tmpdir::auto_tmpdir_fs_policy_select: invalid policy in plugstack configuration (%s)", argv[i]);
+            return -1;
+        }
+        settings++;
+        if ( strncmp(rule, "*:", 2) != 0 ) {
+            for ( item = rule; item < settings; ) {
+                size_t  item_len = strcspn(item, ",:");
+                int     holds = __auto_tmpdir_fs_policy_condition(item, item_len, job);
+
+                if ( holds < 0 ) {
+                    slurm_error("auto_tmpdir::auto_tmpdir_fs_policy_select: invalid policy condition in plugstack configuration (%.*s)", (int)item_len, item);
+                    return -1;
+                }
+                if ( ! holds ) is_match = 0;
+                item += item_len + 1;
+            }
+        }
+        for ( item = settings; *item; ) {
+            size_t      item_len = strcspn(item, ",");
+
+            if ( ! __auto_tmpdir_fs_policy_is_setting(item, item_len) ) {
+                slurm_error("auto_tmpdir::auto_tmpdir_fs_policy_select: invalid policy setting in plugstack configuration (%.*s)", (int)item_len, item);
+                return -1;
+            }
+            item += item_len;
+            if ( *item ) item++;
+        }
+        if ( is_match && ! match ) {
+            match = settings;
+            match_index = n_rules;
+        }
+    }
+
+    if ( match ) {
+        /*
+         * The chosen settings follow the plugin's own arguments so they take
+         * precedence; the array and the strings are a single allocation:
+         */
+        size_t          match_len = strlen(match), n_settings = 1;
+        char            **new_argv, *strings, *setting, *save = NULL;
+
+        for ( i = 0; i < match_len; i++ ) if ( match[i] == ',' ) n_settings++;
+        /* Room for the pointers, the settings, and a default "rule-<N>" name: */
+        new_argv = (char**)malloc((argc + n_settings + 1) * sizeof(char*) + match_len + 1 + 16);
+        if ( ! new_argv ) {
+            slurm_error("auto_tmpdir::auto_tmpdir_fs_policy_select: unable to allocate policy arguments");
+            return -1;
+        }
+        memcpy(new_argv, argv, argc * sizeof(char*));
+        strings = (char*)(new_argv + argc + n_settings + 1);
+        memcpy(strings, match, match_len + 1);
+        snprintf(strings + match_len + 1, 16, "rule-%d", match_index);
+        *policy_name = strings + match_len + 1;
+        *policy_argc = argc;
+        for ( setting = strtok_r(strings, ",", &save); setting; setting = strtok_r(NULL, ",", &save) ) {
+            if ( strncmp(setting, "name=", 5) == 0 ) *policy_name = setting + 5;
+            else new_argv[(*policy_argc)++] = setting;
+        }
+        new_argv[*policy_argc] = NULL;
+        *policy_argv = new_argv;
+        slurm_debug("auto_tmpdir::auto_tmpdir_fs_policy_select: job matches policy %s (%s)", *policy_name, match);
+    } else if ( n_rules ) {
+        slurm_debug("auto_tmpdir::auto_tmpdir_fs_policy_select: job matches none of %d policies", n_rules);
+    }
+    return match_index;
+}
+
+
+static int
+__auto_tmpdir_fs_bind_mount(
+    auto_tmpdir_fs_ref  fs_info
+)
+{
+    int                         rc = 0;
+    auto_tmpdir_fs_bindpoint_t  *bindpoint = fs_info->bind_mounts;
+    auto_tmpdir_event_t         event;
+    
+    if ( bindpoint ) {
+        /*
+         * Skip ahead to the end, then go in reverse order:
+         */
+        while ( bindpoint->link ) bindpoint = bindpoint->link;
+
+        /*
+         * Allow mount points to be shared into a child namespace:
+         */
+        if ( mount("", "/", "dontcare", MS_REC | MS_SHARED, "") != 0 ) {
+		    slurm_error("auto_tmpdir::auto_tmpdir_fs_bind_mount: failed to mark mountpoints for sharing (%m)");
+		    return -1;
+		}
+
+		/*
+		 * Create a new mount namespace:
+		 */
+		auto_tmpdir_event_start(&event, "unshare", NULL);
+		if ( unshare(CLONE_NEWNS) != 0 ) {
+		    slurm_error("auto_tmpdir::auto_tmpdir_fs_bind_mount: failed to create new mount namespace (%m)");
+		    auto_tmpdir_event_end(&event, 0, 1);
+		    return -1;
+		}
+		auto_tmpdir_event_end(&event, 1, 0);
+
+		/*
+		 * Copy parent namespace mounts into this namespace:
+		 */
+		if ( mount("", "/", "dontcare", MS_REC | MS_SLAVE, "") != 0 ) {
+		    slurm_error("auto_tmpdir::auto_tmpdir_fs_bind_mount: failed to copy parent mountpoints into new mount namespace (%m)");
+		    return -1;
+		}
+
+	    /*
+	     * Loop over all our bind mount points:
+	     */
+	    while ( (rc == 0) && bindpoint ) {
+	        if ( ! bindpoint->is_bind_mounted ) {
+                auto_tmpdir_event_start(&event, "mount", bindpoint->to_this_path);
+                AUTO_TMPDIR_PROBE2(fs_mount__entry, bindpoint->bind_this_path, bindpoint->to_this_path);
+                if ( bindpoint->template_path && bindpoint->work_path ) {
+                    char        merged_path[PATH_MAX];
+
+                    /* The prolog mounted the overlay, just bind its merged directory: */
+                    if ( __auto_tmpdir_fs_overlay_merged_path(bindpoint, merged_path, sizeof(merged_path)) != 0 ) {
+                        slurm_error("auto_tmpdir::auto_tmpdir_fs_bind_mount: overlay path for `%s` is too long", bindpoint->bind_this_path);
+                        rc = -1;
+                    } else {
+                        slurm_debug("auto_tmpdir::auto_tmpdir_fs_bind_mount: bind-mounting overlay `%s` -> `%s` (pid %d)", merged_path, bindpoint->to_this_path, getpid());
+                        if ( mount(merged_path, bindpoint->to_this_path, "none", MS_BIND, NULL) != 0 ) {
+                            slurm_error("auto_tmpdir::auto_tmpdir_fs_bind_mount: failed to bind-mount overlay `%s` -> `%s` (%m)", merged_path, bindpoint->to_this_path);
+                            rc = -1;
+                        } else {
+                            bindpoint->is_bind_mounted = 1;
+                        }
+                    }
+                } else {
+                    slurm_debug("auto_tmpdir::auto_tmpdir_fs_bind_mount: bind-mounting `%s` -> `%s` (pid %d)", bindpoint->bind_this_path, bindpoint->to_this_path, getpid());
+                    if ( mount(bindpoint->bind_this_path, bindpoint->to_this_path, "none", MS_BIND, NULL) != 0 ) {
+                        slurm_error("auto_tmpdir::auto_tmpdir_fs_bind_mount: failed to bind-mount `%s` -> `%s` (%m)", bindpoint->bind_this_path, bindpoint->to_this_path);
+                        rc = -1;
+                    } else {
+                        bindpoint->is_bind_mounted = 1;
+                    }
+                }
+                auto_tmpdir_event_end(&event, bindpoint->is_bind_mounted, ! bindpoint->is_bind_mounted);
+                AUTO_TMPDIR_PROBE2(fs_mount__return, bindpoint->to_this_path, bindpoint->is_bind_mounted);
+	        }
+	        bindpoint = bindpoint->back_link;
+	    }
+	}
+	return rc;
+}
+
+int
+auto_tmpdir_fs_bind_mount(
+    auto_tmpdir_fs_ref  fs_info
+)
+{
+    int                 rc;
+
+    AUTO_TMPDIR_PROBE1(fs_bind_mount__entry, __auto_tmpdir_fs_bindpoint_count(fs_info->bind_mounts));
+    rc = __auto_tmpdir_fs_bind_mount(fs_info);
+    AUTO_TMPDIR_PROBE1(fs_bind_mount__return, rc);
+    return rc;
+}
+
+
+const char*
+auto_tmpdir_fs_get_tmpdir(
+    auto_tmpdir_fs_ref  fs_info
+)
+{
+    if ( fs_info->step_tmpdir ) return fs_info->step_tmpdir;
+    return fs_info->tmpdir ? fs_info->tmpdir : "/tmp";
+}
+
+
+/*
+ * Create (or accept an existing) step directory in parent_dir as the job
+ * owner.  The job owner can write to parent_dir, so the entry may already
+ * exist (left by an earlier step with the same id) or have been planted as a
+ * symlink:  never follow a link, and only accept an existing entry that is a
+ * directory belonging to the job owner.
+ */
+static int
+__auto_tmpdir_fs_create_step_dir(
+    const char          *parent_dir,
+    const char          *step_name,
+    const char          *step_dir,
+    uid_t               u_owner,
+    gid_t               g_owner
+)
+{
+    int                 dir_fd, step_fd = -1, is_created = 1, rc = -1;
+    struct stat         finfo;
+
+    if ( (dir_fd = open(parent_dir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0 ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_fs_create_step_dir: unable to open directory `%s` (%m)", parent_dir);
+        return -1;
+    }
+    if ( mkdirat(dir_fd, step_name, S_IRWXU) != 0 ) {
+        if ( errno != EEXIST ) {
+            slurm_error("auto_tmpdir::__auto_tmpdir_fs_create_step_dir: unable to create directory `%s` (%m)", step_dir);
+            goto early_exit;
+        }
+        is_created = 0;
+    }
+    if ( (step_fd = openat(dir_fd, step_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0 ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_fs_create_step_dir: `%s` is not a directory (%m)", step_dir);
+        goto early_exit;
+    }
+    if ( ! is_created && ((fstat(step_fd, &finfo) != 0) || (finfo.st_uid != u_owner)) ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_fs_create_step_dir: existing directory `%s` is not owned by the job owner", step_dir);
+        goto early_exit;
+    }
+    if ( __auto_tmpdir_fchown(step_fd, u_owner, g_owner) != 0 ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_fs_create_step_dir: unable to fixup ownership on directory `%s` (%m)", step_dir);
+        goto early_exit;
+    }
+    rc = 0;
+
+early_exit:
+    if ( step_fd >= 0 ) close(step_fd);
+    if ( rc && is_created ) unlinkat(dir_fd, step_name, AT_REMOVEDIR);
+    close(dir_fd);
+    return rc;
+}
+
+int
+auto_tmpdir_fs_create_step_dirs(
+    auto_tmpdir_fs_ref  fs_info,
+    spank_t             spank_ctxt
+)
+{
+    auto_tmpdir_fs_bindpoint_t  *bindpoint = fs_info->bind_mounts;
+    const char                  *tmpdir = fs_info->tmpdir ? fs_info->tmpdir : "/tmp";
+    uint32_t                    step_id;
+    char                        step_name[32];
+    int                         n_bindpoints = 0;
+
+    if ( (fs_info->options & auto_tmpdir_fs_options_should_use_per_step) != auto_tmpdir_fs_options_should_use_per_step ) return 0;
+
+    if ( spank_get_item(spank_ctxt, S_JOB_STEPID, &step_id) != ESPANK_SUCCESS ) {
+        slurm_error("auto_tmpdir::auto_tmpdir_fs_create_step_dirs: unable to get job step id");
+        return -1;
+    }
+    switch ( step_id ) {
+        case SLURM_BATCH_SCRIPT:
+            strcpy(step_name, "step-batch");
+            break;
+        case SLURM_EXTERN_CONT:
+            strcpy(step_name, "step-extern");
+            break;
+#ifdef SLURM_INTERACTIVE_STEP
+        case SLURM_INTERACTIVE_STEP:
+            strcpy(step_name, "step-interactive");
+            break;
+#endif
+        default:
+            snprintf(step_name, sizeof(step_name), "step-%u", step_id);
+            break;
+    }
+
+    while ( bindpoint ) {
+        n_bindpoints++;
+        bindpoint = bindpoint->link;
+    }
+    if ( ! (fs_info->step_dirs = calloc(n_bindpoints, sizeof(const char*))) ) {
+        slurm_error("auto_tmpdir::auto_tmpdir_fs_create_step_dirs: unable to allocate step directory list");
+        return -1;
+    }
+
+    /*
+     * Only the job's scratch bindpoints get step directories -- not /dev/shm
+     * (shm_open() ignores subdirectories) and not the persistent cache.  The
+     * bind mounts are in place by now, so work through the paths as the step
+     * sees them; the source paths may well be hidden beneath them:
+     */
+    bindpoint = fs_info->bind_mounts;
+    while ( bindpoint ) {
+        if ( ! bindpoint->should_always_remove && ! bindpoint->should_never_remove ) {
+            char        *step_dir;
+            int         step_dir_len = snprintf(NULL, 0, "%s/%s", bindpoint->to_this_path, step_name);
+
+            if ( ! (step_dir = malloc(step_dir_len + 1)) ) {
+                slurm_error("auto_tmpdir::auto_tmpdir_fs_create_step_dirs: unable to allocate step directory path");
+                return -1;
+            }
+            snprintf(step_dir, step_dir_len + 1, "%s/%s", bindpoint->to_this_path, step_name);
+            if ( __auto_tmpdir_fs_create_step_dir(bindpoint->to_this_path, step_name, step_dir, fs_info->u_owner, fs_info->g_owner) != 0 ) {
+                free((void*)step_dir);
+                return -1;
+            }
+            fs_info->step_dirs[fs_info->n_step_dirs++] = step_dir;
+            slurm_debug("auto_tmpdir::auto_tmpdir_fs_create_step_dirs: created directory `%s`", step_dir);
+
+            if ( ! fs_info->step_tmpdir && (strcmp(bindpoint->to_this_path, tmpdir) == 0) ) fs_info->step_tmpdir = strdup(step_dir);
+        }
+        bindpoint = bindpoint->link;
+    }
+    return 0;
+}
+
+
+int
+auto_tmpdir_fs_create_task_dirs(
+    auto_tmpdir_fs_ref  fs_info,
+    spank_t             spank_ctxt
+)
+{
+    auto_tmpdir_fs_bindpoint_t  *bindpoint = fs_info->bind_mounts;
+    const char                  *tmpdir = fs_info->tmpdir ? fs_info->tmpdir : "/tmp";
+    uint32_t                    task_count, task_id;
+    int                         dir_fd;
+
+    if ( (fs_info->options & auto_tmpdir_fs_options_should_use_per_task) != auto_tmpdir_fs_options_should_use_per_task ) return 0;
+
+    /*
+     * Only subdivide TMPDIR if it's one of the job's own scratch directories;
+     * we don't want task directories appearing in the node's real /tmp:
+     */
+    while ( bindpoint ) {
+        if ( ! bindpoint->should_always_remove && ! bindpoint->should_never_remove && (strcmp(bindpoint->to_this_path, tmpdir) == 0) ) break;
+        bindpoint = bindpoint->link;
+    }
+    if ( ! bindpoint ) {
+        slurm_info("auto_tmpdir::auto_tmpdir_fs_create_task_dirs: TMPDIR `%s` is not a job directory, no per-task directories created", tmpdir);
+        return 0;
+    }
+    tmpdir = auto_tmpdir_fs_get_tmpdir(fs_info);
+
+    if ( spank_get_item(spank_ctxt, S_JOB_LOCAL_TASK_COUNT, &task_count) != ESPANK_SUCCESS ) {
+        slurm_error("auto_tmpdir::auto_tmpdir_fs_create_task_dirs: unable to get local task count");
+        return -1;
+    }
+    if ( (dir_fd = open(tmpdir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW)) < 0 ) {
+        slurm_error("auto_tmpdir::auto_tmpdir_fs_create_task_dirs: unable to open directory `%s` (%m)", tmpdir);
+        return -1;
+    }
+    for ( task_id = 0; task_id < task_count; task_id++ ) {
+        char            task_dir[32];
+
+        snprintf(task_dir, sizeof(task_dir), "task-%u", task_id);
+        if ( (mkdirat(dir_fd, task_dir, S_IRWXU) != 0) && (errno != EEXIST) ) {
+            slurm_error("auto_tmpdir::auto_tmpdir_fs_create_task_dirs: unable to create directory `%s/%s` (%m)", tmpdir, task_dir);
+            break;
+        }
+        if ( __auto_tmpdir_fchownat(dir_fd, task_dir, fs_info->u_owner, fs_info->g_owner) != 0 ) {
+            slurm_error("auto_tmpdir::auto_tmpdir_fs_create_task_dirs: unable to fixup ownership on directory `%s/%s` (%m)", tmpdir, task_dir);
+            break;
+        }
+    }
+    close(dir_fd);
+    if ( task_id < task_count ) return -1;
+    slurm_debug("auto_tmpdir::auto_tmpdir_fs_create_task_dirs: created %u task directories in `%s`", task_count, tmpdir);
+    fs_info->task_tmpdir_base = strdup(tmpdir);
+    return 0;
+}
+
+
+int
+auto_tmpdir_fs_get_task_tmpdir(
+    auto_tmpdir_fs_ref  fs_info,
+    uint32_t            task_id,
+    char                *buffer,
+    size_t              buffer_len
+)
+{
+    if ( ! fs_info->task_tmpdir_base ) return -1;
+    if ( snprintf(buffer, buffer_len, "%s/task-%u", fs_info->task_tmpdir_base, task_id) >= buffer_len ) return -1;
+    return 0;
+}
+
+
+int
+auto_tmpdir_fs_remove_step_dirs(
+    auto_tmpdir_fs_ref  fs_info
+)
+{
+    int                 rc = 0;
+
+    while ( fs_info->n_step_dirs > 0 ) {
+        const char      *step_dir = fs_info->step_dirs[--fs_info->n_step_dirs];
+
+        slurm_debug("auto_tmpdir::auto_tmpdir_fs_remove_step_dirs: removing directory `%s`", step_dir);
+        if ( auto_tmpdir_rmdir_recurse(step_dir, 0) != 0 ) rc = -1;
+        free((void*)step_dir);
+    }
+    return rc;
+}
+
+
+int
+auto_tmpdir_fs_fini(
+    auto_tmpdir_fs_ref  fs_info,
+     int                should_dealloc_only
+)
+{
+    int     rc = 0;
+
+    if ( fs_info ) {
+        int should_not_delete = ((fs_info->options & auto_tmpdir_fs_options_should_not_delete) == auto_tmpdir_fs_options_should_not_delete);
+        int should_handoff = 0;
+
+        /*
+         * A hand-off only applies to a node-local hierarchy:
+         */
+        if ( ! should_dealloc_only && fs_info->handoff_minutes && fs_info->base_dir && ! should_not_delete ) {
+            if ( (fs_info->options & (auto_tmpdir_fs_options_should_use_shared | auto_tmpdir_fs_options_should_use_per_host)) == 0 ) {
+                should_handoff = 1;
+            } else {
+                slurm_info("auto_tmpdir::auto_tmpdir_fs_fini: hand-off is not supported for shared temporary directories");
+            }
+        }
+        if ( fs_info->bind_mounts ) {
+            auto_tmpdir_fs_accounting_t accounting = { -1, fs_info->job_id, fs_info->u_owner };
+            int                         local_rc;
+
+            if ( ! should_dealloc_only && fs_info->accounting_path ) {
+                accounting.fd = open(fs_info->accounting_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+                if ( accounting.fd < 0 ) slurm_error("auto_tmpdir::auto_tmpdir_fs_fini: unable to open accounting file `%s` (%m)", fs_info->accounting_path);
+            }
+            local_rc = auto_tmpdir_fs_bindpoint_dealloc(
+                                        fs_info->bind_mounts,
+                                        fs_info->job_id,
+                                        should_not_delete || should_handoff,
+                                        should_dealloc_only,
+                                        should_dealloc_only ? NULL : &accounting
+                                    );
+            if ( accounting.fd >= 0 ) close(accounting.fd);
+            if ( local_rc != 0 ) rc = local_rc;
+        }
+        if ( fs_info->base_dir ) {
+            if ( should_handoff && (__auto_tmpdir_fs_handoff(fs_info) == 0) ) {
+                /* Hierarchy retained for a follow-on job */
+            }
+            else if ( ! should_dealloc_only && ! should_not_delete ) {
+                int local_rc;
+
+                slurm_debug("auto_tmpdir::auto_tmpdir_fs_bindpoint_dealloc: removing directory `%s`", fs_info->base_dir);
+                local_rc = auto_tmpdir_rmdir_recurse(fs_info->base_dir, 0);
+                if ( local_rc != 0 ) rc = local_rc;
+            }
+            if ( ! should_dealloc_only && ((fs_info->options & (auto_tmpdir_fs_options_should_use_shared | auto_tmpdir_fs_options_should_use_per_host)) == 0) ) {
+                char    prefix[PATH_MAX];
+
+                /* Reap any expired hand-off directories: */
+                if ( __auto_tmpdir_fs_base_dir_prefix(fs_info, prefix, sizeof(prefix)) == 0 ) __auto_tmpdir_fs_handoff_scan(prefix, fs_info->u_owner, NULL);
+            }
+            free((void*)fs_info->base_dir);
+        }
+        if ( fs_info->base_dir_parent ) free((void*)fs_info->base_dir_parent);
+        if ( fs_info->archive_path ) free((void*)fs_info->archive_path);
+        if ( fs_info->policy_name ) free((void*)fs_info->policy_name);
+        if ( fs_info->tmpdir ) free((void*)fs_info->tmpdir);
+        if ( fs_info->step_tmpdir ) free((void*)fs_info->step_tmpdir);
+        if ( fs_info->task_tmpdir_base ) free((void*)fs_info->task_tmpdir_base);
+        if ( fs_info->accounting_path ) free((void*)fs_info->accounting_path);
+        if ( fs_info->step_dirs ) {
+            while ( fs_info->n_step_dirs > 0 ) free((void*)fs_info->step_dirs[--fs_info->n_step_dirs]);
+            free((void*)fs_info->step_dirs);
+        }
+        free((void*)fs_info);
+    }
+    return rc;
+}
+
+int
+auto_tmpdir_fs_set_archive_path(
+    auto_tmpdir_fs_ref  fs_info,
+    const char          *archive_path
+)
+{
+    const char          *new_path = NULL;
+
+    if ( archive_path ) {
+        if ( *archive_path != '/' ) {
+            slurm_error("auto_tmpdir::auto_tmpdir_fs_set_archive_path: archive path must be absolute (%s)", archive_path);
+            return -1;
+        }
+        if ( ! (new_path = strdup(archive_path)) ) {
+            slurm_error("auto_tmpdir::auto_tmpdir_fs_set_archive_path: unable to allocate copy of archive path `%s`", archive_path);
+            return -1;
+        }
+    }
+    if ( fs_info->archive_path ) free((void*)fs_info->archive_path);
+    fs_info->archive_path = new_path;
+    return 0;
+}
+
+/**/
+
+void
+auto_tmpdir_fs_set_handoff(
+    auto_tmpdir_fs_ref  fs_info,
+    uint32_t            handoff_minutes
+)
+{
+    fs_info->handoff_minutes = handoff_minutes;
+}
+
+/**/
+
+void
+auto_tmpdir_fs_set_granted_mb(
+    auto_tmpdir_fs_ref  fs_info,
+    uint64_t            granted_mb
+)
+{
+    fs_info->granted_mb = granted_mb;
+}
+
+uint64_t
+auto_tmpdir_fs_get_granted_mb(
+    auto_tmpdir_fs_ref  fs_info
+)
+{
+    return fs_info->granted_mb;
+}
+
+void
+auto_tmpdir_fs_set_job_cpus(
+    auto_tmpdir_fs_ref  fs_info,
+    uint32_t            job_cpus
+)
+{
+    fs_info->job_cpus = job_cpus;
+}
+
+uint32_t
+auto_tmpdir_fs_get_job_cpus(
+    auto_tmpdir_fs_ref  fs_info
+)
+{
+    return fs_info->job_cpus;
+}
+
+int
+auto_tmpdir_fs_set_policy_name(
+    auto_tmpdir_fs_ref  fs_info,
+    const char          *policy_name
+)
+{
+    const char          *new_name = NULL;
+
+    if ( policy_name && ! (new_name = strdup(policy_name)) ) {
+        slurm_error("auto_tmpdir::auto_tmpdir_fs_set_policy_name: unable to allocate copy of policy name `%s`", policy_name);
+        return ENOMEM;
+    }
+    if ( fs_info->policy_name ) free((void*)fs_info->policy_name);
+    fs_info->policy_name = new_name;
+    return 0;
+}
+
+const char*
+auto_tmpdir_fs_get_policy_name(
+    auto_tmpdir_fs_ref  fs_info
+)
+{
+    return fs_info->policy_name;
+}
+
+/**/
+
+uint32_t
+auto_tmpdir_fs_get_job_id(
+    auto_tmpdir_fs_ref  fs_info
+)
+{
+    return fs_info->job_id;
+}
+
+uid_t
+auto_tmpdir_fs_get_owner(
+    auto_tmpdir_fs_ref  fs_info
+)
+{
+    return fs_info->u_owner;
+}
+
+gid_t
+auto_tmpdir_fs_get_group(
+    auto_tmpdir_fs_ref  fs_info
+)
+{
+    return fs_info->g_owner;
+}
+
+void
+auto_tmpdir_fs_set_no_delete(
+    auto_tmpdir_fs_ref  fs_info
+)
+{
+    fs_info->options |= auto_tmpdir_fs_options_should_not_delete;
+}
+
+const char*
+auto_tmpdir_fs_get_base_dir(
+    auto_tmpdir_fs_ref  fs_info
+)
+{
+    return fs_info->base_dir;
+}
+
+int
+auto_tmpdir_fs_get_bindpoint(
+    auto_tmpdir_fs_ref          fs_info,
+    int                         index,
+    const char                  **bind_this_path,
+    const char                  **to_this_path
+)
+{
+    auto_tmpdir_fs_bindpoint_t  *bindpoint = fs_info->bind_mounts;
+
+    while ( bindpoint && (index-- > 0) ) bindpoint = bindpoint->link;
+    if ( ! bindpoint ) return -1;
+    if ( bind_this_path ) *bind_this_path = bindpoint->bind_this_path;
+    if ( to_this_path ) *to_this_path = bindpoint->to_this_path;
+    return 0;
+}
+
+int
+auto_tmpdir_fs_get_tmpdir_bindpoint(
+    auto_tmpdir_fs_ref          fs_info,
+    const char                  **bind_this_path,
+    const char                  **to_this_path
+)
+{
+    const char                  *tmpdir = fs_info->tmpdir ? fs_info->tmpdir : "/tmp";
+    auto_tmpdir_fs_bindpoint_t  *bindpoint = fs_info->bind_mounts;
+
+    while ( bindpoint && strcmp(bindpoint->to_this_path, tmpdir) ) bindpoint = bindpoint->link;
+    if ( ! bindpoint ) return -1;
+    if ( bind_this_path ) *bind_this_path = bindpoint->bind_this_path;
+    if ( to_this_path ) *to_this_path = bindpoint->to_this_path;
+    return 0;
+}
+
+/**/
+
+int
+__auto_tmpdir_fs_drop_privileges(
+    uid_t               u_owner,
+    gid_t               g_owner
+)
+{
+    if ( g_owner == (gid_t)-1 ) {
+        struct passwd   *pw = getpwuid(u_owner);
+
+        if ( ! pw ) return -1;
+        g_owner = pw->pw_gid;
+    }
+    if ( setgroups(0, NULL) != 0 ) return -1;
+    if ( setgid(g_owner) != 0 ) return -1;
+    if ( setuid(u_owner) != 0 ) return -1;
+    return 0;
+}
+
+/**/
+
+/*
+ * The archive is a POSIX ustar stream (with GNU long-name records for paths
+ * that do not fit the 100-character name field) fed through a pipe to the
+ * compressor.  File content is moved from the page cache into the pipe with
+ * splice(2) so it never crosses into our address space.
+ */
+#define AUTO_TMPDIR_TAR_BLOCK   512
+
+typedef struct {
+    char    name[100];
+    char    mode[8];
+    char    uid[8];
+    char    gid[8];
+    char    size[12];
+    char    mtime[12];
+    char    chksum[8];
+    char    typeflag;
+    char    linkname[100];
+    char    magic[6];
+    char    version[2];
+    char    uname[32];
+    char    gname[32];
+    char    devmajor[8];
+    char    devminor[8];
+    char    prefix[155];
+    char    pad[12];
+} auto_tmpdir_tar_header_t;
+
+static void
+__auto_tmpdir_tar_octal(
+    char        *field,
+    size_t      field_len,
+    uint64_t    value
+)
+{
+    /*
+     * Values that will not fit in field_len - 1 octal digits use the GNU
+     * base-256 encoding:
+     */
+    if ( value >> (3 * (field_len - 1)) ) {
+        size_t  i = field_len;
+
+        while ( i-- > 1 ) {
+            field[i] = (char)(value & 0xff);
+            value >>= 8;
+        }
+        field[0] = (char)0x80;
+    } else {
+        snprintf(field, field_len, "%0*llo", (int)(field_len - 1), (unsigned long long)value);
+    }
+}
+
+static int
+__auto_tmpdir_tar_write(
+    int         fd,
+    const void  *buffer,
+    size_t      buffer_len
+)
+{
+    while ( buffer_len ) {
+        ssize_t n = write(fd, buffer, buffer_len);
+
+        if ( n < 0 ) {
+            if ( errno == EINTR ) continue;
+            return -1;
+        }
+        buffer = (const char*)buffer + n;
+        buffer_len -= n;
+    }
+    return 0;
+}
+
+static int
+__auto_tmpdir_tar_pad(
+    int         fd,
+    uint64_t    size
+)
+{
+    static const char   zeroes[AUTO_TMPDIR_TAR_BLOCK] = { 0 };
+    size_t              remainder = size % AUTO_TMPDIR_TAR_BLOCK;
+
+    return remainder ? __auto_tmpdir_tar_write(fd, zeroes, AUTO_TMPDIR_TAR_BLOCK - remainder) : 0;
+}
+
+static int
+__auto_tmpdir_tar_header(
+    int             fd,
+    const char      *name,
+    char            typeflag,
+    const char      *linkname,
+    struct stat     *finfo,
+    uint64_t        size
+)
+{
+    auto_tmpdir_tar_header_t    header;
+    unsigned int                chksum = 0;
+    size_t                      name_len = strlen(name), i;
+
+    /*
+     * Names (or link targets) that are too long get a preceding GNU long-name
+     * record holding the full string:
+     */
+    if ( name_len >= sizeof(header.name) && typeflag != 'L' && typeflag != 'K' ) {
+        if ( __auto_tmpdir_tar_header(fd, "././@LongLink", 'L', NULL, finfo, name_len + 1) ) return -1;
+        if ( __auto_tmpdir_tar_write(fd, name, name_len + 1) || __auto_tmpdir_tar_pad(fd, name_len + 1) ) return -1;
+    }
+    if ( linkname && strlen(linkname) >= sizeof(header.linkname) ) {
+        if ( __auto_tmpdir_tar_header(fd, "././@LongLink", 'K', NULL, finfo, strlen(linkname) + 1) ) return -1;
+        if ( __auto_tmpdir_tar_write(fd, linkname, strlen(linkname) + 1) || __auto_tmpdir_tar_pad(fd, strlen(linkname) + 1) ) return -1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    /* Fields filled to the brim are not NUL-terminated: */
+    memcpy(header.name, name, (name_len < sizeof(header.name)) ? name_len : sizeof(header.name));
+    if ( linkname ) memcpy(header.linkname, linkname, (strlen(linkname) < sizeof(header.linkname)) ? strlen(linkname) : sizeof(header.linkname));
+    __auto_tmpdir_tar_octal(header.mode, sizeof(header.mode), finfo->st_mode & 07777);
+    __auto_tmpdir_tar_octal(header.uid, sizeof(header.uid), finfo->st_uid);
+    __auto_tmpdir_tar_octal(header.gid, sizeof(header.gid), finfo->st_gid);
+    __auto_tmpdir_tar_octal(header.size, sizeof(header.size), size);
+    __auto_tmpdir_tar_octal(header.mtime, sizeof(header.mtime), finfo->st_mtime);
+    header.typeflag = typeflag;
+    memcpy(header.magic, "ustar", 6);
+    memcpy(header.version, "00", 2);
+
+    memset(header.chksum, ' ', sizeof(header.chksum));
+    for ( i = 0; i < sizeof(header); i++ ) chksum += ((unsigned char*)&header)[i];
+    snprintf(header.chksum, sizeof(header.chksum), "%06o", chksum);
+
+    return __auto_tmpdir_tar_write(fd, &header, sizeof(header));
+}
+
+static int
+__auto_tmpdir_tar_file_content(
+    int             fd,
+    int             in_fd,
+    uint64_t        size
+)
+{
+    uint64_t        remaining = size;
+    int             use_splice = 1;
+    char            buffer[65536];
+
+    while ( remaining ) {
+        ssize_t     n;
+
+        if ( use_splice ) {
+            n = splice(in_fd, NULL, fd, NULL, (remaining > (1 << 20)) ? (1 << 20) : remaining, SPLICE_F_MORE | SPLICE_F_MOVE);
+            if ( n < 0 && errno == EINVAL ) {
+                /* Source filesystem can't splice, fall back to read/write: */
+                use_splice = 0;
+                continue;
+            }
+        } else {
+            n = read(in_fd, buffer, (remaining > sizeof(buffer)) ? sizeof(buffer) : remaining);
+            if ( n > 0 && __auto_tmpdir_tar_write(fd, buffer, n) ) n = -1;
+        }
+        if ( n < 0 ) {
+            if ( errno == EINTR ) continue;
+            close(in_fd);
+            return -1;
+        }
+        if ( n == 0 ) break;
+        remaining -= n;
+    }
+    close(in_fd);
+
+    /* The file shrank underneath us -- fill out the size promised in the header: */
+    while ( remaining ) {
+        size_t      n = (remaining > sizeof(buffer)) ? sizeof(buffer) : remaining;
+
+        memset(buffer, 0, n);
+        if ( __auto_tmpdir_tar_write(fd, buffer, n) ) return -1;
+        remaining -= n;
+    }
+    return __auto_tmpdir_tar_pad(fd, size);
+}
+
+/*
+ * Write the tar stream for base_dir to out_fd.  This runs in a child with the
+ * job owner's credentials:  the tree is writable by the owner, who could swap
+ * a directory for a symlink mid-walk and have anything root can read streamed
+ * into the archive otherwise.
+ */
+static int
+__auto_tmpdir_fs_archive_stream(
+    const char          *base_dir,
+    int                 out_fd
+)
+{
+    int                 rc = 0;
+    size_t              base_dir_len = strlen(base_dir);
+    char                *path_argv[2];
+    FTS                 *ftsPtr;
+    FTSENT              *ftsItem;
+
+    path_argv[0] = (char*)base_dir;
+    path_argv[1] = NULL;
+    ftsPtr = fts_open(path_argv, FTS_NOCHDIR | FTS_PHYSICAL | FTS_XDEV, NULL);
+    if ( ! ftsPtr ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_fs_archive_stream: failed to open file traversal context on `%s` (%m)", base_dir);
+        return -1;
+    }
+    while ( (rc == 0) && (ftsItem = fts_read(ftsPtr)) ) {
+        char        name[PATH_MAX + 2];
+
+        /* Member names are relative to base_dir: */
+        if ( snprintf(name, sizeof(name), ".%s%s", ftsItem->fts_path + base_dir_len, (ftsItem->fts_info == FTS_D) ? "/" : "") >= sizeof(name) ) {
+            slurm_info("auto_tmpdir::__auto_tmpdir_fs_archive_stream: skipping `%s` (path too long)", ftsItem->fts_path);
+            continue;
+        }
+        switch ( ftsItem->fts_info ) {
+            case FTS_D:
+                rc = __auto_tmpdir_tar_header(out_fd, name, '5', NULL, ftsItem->fts_statp, 0);
+                break;
+
+            case FTS_F: {
+                int         in_fd = open(ftsItem->fts_accpath, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+
+                if ( in_fd < 0 ) {
+                    slurm_info("auto_tmpdir::__auto_tmpdir_fs_archive_stream: skipping `%s` (%m)", ftsItem->fts_accpath);
+                    break;
+                }
+                rc = __auto_tmpdir_tar_header(out_fd, name, '0', NULL, ftsItem->fts_statp, ftsItem->fts_statp->st_size);
+                if ( rc == 0 ) {
+                    rc = __auto_tmpdir_tar_file_content(out_fd, in_fd, ftsItem->fts_statp->st_size);
+                } else {
+                    close(in_fd);
+                }
+                break;
+            }
+
+            case FTS_SL:
+            case FTS_SLNONE: {
+                char        target[PATH_MAX];
+                ssize_t     target_len = readlink(ftsItem->fts_accpath, target, sizeof(target) - 1);
+
+                if ( target_len >= 0 ) {
+                    target[target_len] = '\0';
+                    rc = __auto_tmpdir_tar_header(out_fd, name, '2', target, ftsItem->fts_statp, 0);
+                }
+                break;
+            }
+
+            case FTS_NS:
+            case FTS_DNR:
+            case FTS_ERR:
+                slurm_info("auto_tmpdir::__auto_tmpdir_fs_archive_stream: skipping `%s` (%s)", ftsItem->fts_accpath, strerror(ftsItem->fts_errno));
+                break;
+
+            default:
+                /* Sockets, fifos, device nodes are not archived */
+                break;
+        }
+    }
+    fts_close(ftsPtr);
+    if ( rc != 0 ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_fs_archive_stream: failed writing archive stream for `%s` (%m)", base_dir);
+    } else {
+        /* End-of-archive marker is two zero blocks: */
+        static const char   zeroes[2 * AUTO_TMPDIR_TAR_BLOCK] = { 0 };
+
+        rc = __auto_tmpdir_tar_write(out_fd, zeroes, sizeof(zeroes));
+    }
+    return rc;
+}
+
+/*
+ * Wait for one of the archive's children, returning non-zero unless it
+ * exited successfully:
+ */
+static int
+__auto_tmpdir_fs_archive_wait(
+    pid_t               child_pid
+)
+{
+    int                 child_status;
+
+    while ( waitpid(child_pid, &child_status, 0) < 0 ) {
+        if ( errno != EINTR ) return -1;
+    }
+    return ( WIFEXITED(child_status) && (WEXITSTATUS(child_status) == 0) ) ? 0 : child_status;
+}
+
+int
+auto_tmpdir_fs_archive(
+    auto_tmpdir_fs_ref  fs_info
+)
+{
+    int                 rc = 0, pipe_fds[2], child_status;
+    pid_t               compressor_pid, walker_pid;
+
+    if ( ! fs_info->archive_path || ! fs_info->base_dir ) return 0;
+
+    if ( pipe2(pipe_fds, O_CLOEXEC) != 0 ) {
+        slurm_error("auto_tmpdir::auto_tmpdir_fs_archive: unable to create pipe (%m)");
+        return -1;
+    }
+
+    /*
+     * The compressor runs with the job owner's credentials so the archive can
+     * only be written where the owner could have written it:
+     */
+    compressor_pid = fork();
+    if ( compressor_pid < 0 ) {
+        slurm_error("auto_tmpdir::auto_tmpdir_fs_archive: unable to fork compressor (%m)");
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return -1;
+    }
+    if ( compressor_pid == 0 ) {
+        if ( dup2(pipe_fds[0], STDIN_FILENO) < 0 ) _exit(127);
+        if ( __auto_tmpdir_fs_drop_privileges(fs_info->u_owner, fs_info->g_owner) != 0 ) _exit(126);
+        execl(AUTO_TMPDIR_ZSTD_PATH, AUTO_TMPDIR_ZSTD_PATH, "-q", "-T0", "-o", fs_info->archive_path, (char*)NULL);
+        _exit(127);
+    }
+    close(pipe_fds[0]);
+
+    slurm_debug("auto_tmpdir::auto_tmpdir_fs_archive: archiving `%s` to `%s` (pid %d)", fs_info->base_dir, fs_info->archive_path, compressor_pid);
+
+    /*
+     * ...and so does the walk that reads the tree:
+     */
+    walker_pid = fork();
+    if ( walker_pid == 0 ) {
+        /* A compressor that dies early should produce an error, not kill us: */
+        signal(SIGPIPE, SIG_IGN);
+        if ( __auto_tmpdir_fs_drop_privileges(fs_info->u_owner, fs_info->g_owner) != 0 ) {
+            slurm_error("auto_tmpdir::auto_tmpdir_fs_archive: unable to drop privileges to uid %u (%m)", (unsigned int)fs_info->u_owner);
+            _exit(126);
+        }
+        _exit(__auto_tmpdir_fs_archive_stream(fs_info->base_dir, pipe_fds[1]) ? 1 : 0);
+    }
+    close(pipe_fds[1]);
+    if ( walker_pid < 0 ) {
+        slurm_error("auto_tmpdir::auto_tmpdir_fs_archive: unable to fork archive walker (%m)");
+        rc = -1;
+    }
+    else if ( (child_status = __auto_tmpdir_fs_archive_wait(walker_pid)) != 0 ) {
+        slurm_error("auto_tmpdir::auto_tmpdir_fs_archive: failed reading `%s` (status %d)", fs_info->base_dir, child_status);
+        rc = -1;
+    }
+    if ( (child_status = __auto_tmpdir_fs_archive_wait(compressor_pid)) != 0 ) {
+        slurm_error("auto_tmpdir::auto_tmpdir_fs_archive: compressor failed writing `%s` (status %d)", fs_info->archive_path, child_status);
+        rc = -1;
+    }
+    if ( rc == 0 ) {
+        /* The archive replaces the tree, even if --no-rm-tmpdir was requested: */
+        slurm_info("auto_tmpdir::auto_tmpdir_fs_archive: archived `%s` to `%s`", fs_info->base_dir, fs_info->archive_path);
+        fs_info->options &= ~auto_tmpdir_fs_options_should_not_delete;
+    } else {
+        /* Don't lose the job's data if the archive could not be written: */
+        fs_info->options |= auto_tmpdir_fs_options_should_not_delete;
+    }
+    return rc;
+}
+
+
+/*
+ * @function __auto_tmpdir_mkdir_recurse
+ *
+ * Recursively create all directories in a path, counting the directories
+ * created.
+ */
+static int
+__auto_tmpdir_mkdir_recurse(
+    const char  *path,
+    mode_t      mode,
+    int         should_set_owner,
+    uid_t       u_owner,
+    gid_t       g_owner,
+    uint64_t    *n_created
+)
+{
+    struct stat     finfo;
+
+    if ( ! path || ! *path ) {
+        slurm_info("auto_tmpdir::auto_tmpdir_mkdir_recurse: cannot mkdir an empty path");
+        return -1;
+    }
+    if ( stat(path, &finfo) != 0 ) {
+        /* There's at least one directory we need to create: */
+        size_t      path_len = strlen(path);
+        char        local_path[path_len + 1];
+        int         i = 1;
+
+        local_path[0] = path[0];
+        while ( i < path_len ) {
+            /* Find next '/' in path, copying the partial path into another
+             * buffer that we can use to check existence and create missing
+             * directories as we go:
+             */
+            while ( (i < path_len) && path[i] && (path[i] != '/') ) {
+                local_path[i] = path[i];
+                i++;
+            }
+            local_path[i] = '\0';
+
+            /* Does this partial path exist? */
+            if ( stat(local_path, &finfo) ) {
+                if ( mkdir(local_path, mode) ) {
+                    slurm_info("auto_tmpdir::auto_tmpdir_mkdir_recurse: unable to create directory `%s` (%m)", local_path);
+                    return -1;
+                }
+                (*n_created)++;
+                if ( should_set_owner ) {
+                    if ( __auto_tmpdir_chown(local_path, u_owner, g_owner) ) {
+                        slurm_info("auto_tmpdir::auto_tmpdir_mkdir_recurse: unable to chown directory `%s` (%m)", local_path);
+                        return -1;
+                    }
+                }
+            } else if ( ! S_ISDIR(finfo.st_mode) ) {
+                slurm_info("auto_tmpdir::auto_tmpdir_mkdir_recurse: not a directory: `%s`", local_path);
+                return -1;
+            }
+
+            while ( (i < path_len) && (path[i] == '/') ) {
+                local_path[i] = path[i];
+                i++;
+            }
+        }
+    } else if ( ! S_ISDIR(finfo.st_mode) ) {
+        slurm_info("auto_tmpdir::auto_tmpdir_mkdir_recurse: not a directory: `%s`", path);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * @function auto_tmpdir_mkdir_recurse
+ *
+ * Recursively create all directories in a path.
+ */
+int
+auto_tmpdir_mkdir_recurse(
+    const char          *path,
+    mode_t              mode,
+    int                 should_set_owner,
+    uid_t               u_owner,
+    gid_t               g_owner
+)
+{
+    auto_tmpdir_event_t event;
+    uint64_t            n_created = 0;
+    int                 rc;
+
+    auto_tmpdir_event_start(&event, "mkdir_recurse", path);
+    rc = __auto_tmpdir_mkdir_recurse(path, mode, should_set_owner, u_owner, g_owner, &n_created);
+    auto_tmpdir_event_end(&event, n_created, (rc != 0));
+    return rc;
+}
+
+
+/*
+ * @function __auto_tmpdir_rmdir_walk
+ *
+ * Walk a file path depth-first, removing everything in it if should_remove
+ * is set.  Either way, the allocated bytes, inode count, and largest number
+ * of entries in a single directory are accumulated in usage.
+ *
+ */
+static int
+__auto_tmpdir_rmdir_walk(
+    const char              *path,
+    int                     should_remove,
+    int                     should_remove_children_only,
+    auto_tmpdir_fs_usage_t  *usage
+)
+{
+    int             rc = 0;
+
+    char            *path_argv[2] = { (char*)path, NULL };
+
+    /* FTS_NOCHDIR  - Avoid changing cwd, which could cause unexpected behavior
+     *                in multithreaded programs
+     * FTS_PHYSICAL - Don't follow symlinks. Prevents deletion of files outside
+     *                of the specified directory
+     * FTS_XDEV     - Don't cross filesystem boundaries
+     */
+    FTS             *ftsPtr = fts_open(path_argv, FTS_NOCHDIR | FTS_PHYSICAL | FTS_XDEV, NULL);
+    FTSENT          *ftsItem;
+
+    /* Per-depth count of entries in the directory being traversed at that depth: */
+    uint64_t        *fanout = NULL;
+    int             fanout_depth = 0;
+
+    if ( ! ftsPtr ) {
+        slurm_info("auto_tmpdir::auto_tmpdir_rmdir_recurse: failed to open file traversal context on `%s` (%m)", path);
+        usage->n_errors++;
+        return (-1);
+    }
+    if ( (ftsItem = fts_read(ftsPtr)) ) {
+        switch ( ftsItem->fts_info ) {
+            case FTS_NS:
+            case FTS_DNR:
+            case FTS_ERR: {
+                slurm_info("auto_tmpdir::auto_tmpdir_rmdir_recurse: directory `%s` does not exist", path);
+                break;
+            }
+            case FTS_D: {
+                /*
+                 * We're entering a directory -- exactly what we want!
+                 */
+                usage->bytes += ftsItem->fts_statp->st_blocks * 512;
+                usage->inodes++;
+                if ( (fanout = calloc(16, sizeof(uint64_t))) ) fanout_depth = 16;
+                
+                while ( (ftsItem = fts_read(ftsPtr)) ) {
+                    /* Count each entry against its parent directory: */
+                    if ( (ftsItem->fts_info != FTS_DP) && (ftsItem->fts_level > 0) && (ftsItem->fts_level <= fanout_depth) ) fanout[ftsItem->fts_level - 1]++;
+                    
+                    switch ( ftsItem->fts_info ) {
+                        case FTS_NS:
+                        case FTS_DNR:
+                        case FTS_ERR:
+                            slurm_info("auto_tmpdir::auto_tmpdir_rmdir_recurse: error in fts_read() of `%s` (%s)\n", ftsItem->fts_accpath, strerror(ftsItem->fts_errno));
+                            usage->n_errors++;
+                            rc = -1;
+                            break;
+
+                        case FTS_DC:
+                        case FTS_DOT:
+                        case FTS_NSOK:
+                            /* Not reached unless FTS_LOGICAL, FTS_SEEDOT, or FTS_NOSTAT were
+                             * passed to fts_open()
+                             */
+                            break;
+
+                        case FTS_D:
+                            /* Do nothing. Need depth-first search, so directories are deleted
+                             * in FTS_DP
+                             */
+                            usage->bytes += ftsItem->fts_statp->st_blocks * 512;
+                            usage->inodes++;
+                            if ( ftsItem->fts_level >= fanout_depth ) {
+                                uint64_t    *new_fanout = realloc(fanout, 2 * (ftsItem->fts_level + 1) * sizeof(uint64_t));
+
+                                if ( new_fanout ) {
+                                    fanout = new_fanout;
+                                    fanout_depth = 2 * (ftsItem->fts_level + 1);
+                                }
+                            }
+                            if ( ftsItem->fts_level < fanout_depth ) fanout[ftsItem->fts_level] = 0;
+                            break;
+
+                        case FTS_DP:
+                            if ( (ftsItem->fts_level < fanout_depth) && (fanout[ftsItem->fts_level] > usage->max_fanout) ) usage->max_fanout = fanout[ftsItem->fts_level];
+                            if ( ! should_remove ) break;
+                            
+                            /* Remove the directory on post-order traversal (should be empty now): */
+                            if ( should_remove_children_only && (strcmp(ftsItem->fts_accpath, path) == 0) ) break;
+                            if ( rmdir(ftsItem->fts_accpath) < 0 ) {
+                                slurm_info("auto_tmpdir::auto_tmpdir_rmdir_recurse: failed to remove directory `%s` (%s)\n", ftsItem->fts_accpath, strerror(ftsItem->fts_errno));
+                                usage->n_errors++;
+                                rc = -1;
+                            } else {
+                                usage->n_removed++;
+                            }
+                            break;
+
+                        case FTS_F:
+                        case FTS_SL:
+                        case FTS_SLNONE:
+                        case FTS_DEFAULT:
+                            usage->bytes += ftsItem->fts_statp->st_blocks * 512;
+                            usage->inodes++;
+                            if ( ! should_remove ) break;
+                            
+                            /* Remove a non-directory item: */
+                            if ( unlink(ftsItem->fts_accpath) < 0 ) {
+                                slurm_info("auto_tmpdir::auto_tmpdir_rmdir_recurse: failed to remove `%s` (%s)", ftsItem->fts_accpath, strerror(ftsItem->fts_errno));
+                                usage->n_errors++;
+                                rc = -1;
+                            } else {
+                                usage->n_removed++;
+                            }
+                            break;
+                    }
+                }
+                break;
+            }
+        }
+    }
+    fts_close(ftsPtr);
+    if ( fanout ) free((void*)fanout);
+    return rc;
+}
+
+/*
+ * Entries read per batch by the inode-ordered walk, which bounds its memory
+ * use on directories with millions of entries:
+ */
+#define AUTO_TMPDIR_FS_RMDIR_CHUNK      4096
+
+/*
+ * Directories the inode-ordered walk holds open at once; deeper subtrees are
+ * left to fts, which only needs a few descriptors:
+ */
+#define AUTO_TMPDIR_FS_RMDIR_MAX_OPEN   64
+
+typedef struct auto_tmpdir_fs_rmdir_entry {
+    ino_t                   ino;
+    char                    *name;
+} auto_tmpdir_fs_rmdir_entry_t;
+
+static int
+__auto_tmpdir_fs_rmdir_entry_cmp(
+    const void              *e1,
+    const void              *e2
+)
+{
+    ino_t                   i1 = ((const auto_tmpdir_fs_rmdir_entry_t*)e1)->ino, i2 = ((const auto_tmpdir_fs_rmdir_entry_t*)e2)->ino;
+
+    return (i1 < i2) ? -1 : ((i1 > i2) ? 1 : 0);
+}
+
+/*
+ * One directory being walked by __auto_tmpdir_rmdir_walk_inode_order(); name
+ * is relative to the directory below it on the stack, path is for messages:
+ */
+typedef struct auto_tmpdir_fs_rmdir_frame {
+    DIR                             *dir;
+    char                            *name, *path;
+    auto_tmpdir_fs_rmdir_entry_t    *entries;
+    int                             n_entries, n_entries_max, next_entry, is_eof;
+    uint64_t                        fanout;
+} auto_tmpdir_fs_rmdir_frame_t;
+
+/*
+ * Open the directory name (relative to dir_fd) as a new frame on top of the
+ * stack; the frame takes over name and path.  Returns 1 if out of file
+ * descriptors, -1 on any other error (name and path are then still the
+ * caller's):
+ */
+static int
+__auto_tmpdir_fs_rmdir_push(
+    auto_tmpdir_fs_rmdir_frame_t    **frames,
+    int                             *n_frames,
+    int                             *n_frames_max,
+    int                             dir_fd,
+    char                            *name,
+    char                            *path,
+    auto_tmpdir_fs_usage_t          *usage
+)
+{
+    auto_tmpdir_fs_rmdir_frame_t    *frame;
+    struct stat                     finfo;
+    DIR                             *dir;
+    int                             fd;
+
+    if ( *n_frames == *n_frames_max ) {
+        int                             new_max = *n_frames_max ? 2 * *n_frames_max : 16;
+        auto_tmpdir_fs_rmdir_frame_t    *new_frames = realloc(*frames, new_max * sizeof(auto_tmpdir_fs_rmdir_frame_t));
+
+        if ( ! new_frames ) {
+            slurm_info("auto_tmpdir::auto_tmpdir_rmdir_recurse: unable to allocate directory stack for `%s`", path);
+            usage->n_errors++;
+            return -1;
+        }
+        *frames = new_frames;
+        *n_frames_max = new_max;
+    }
+    fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if ( (fd < 0) && ((errno == EMFILE) || (errno == ENFILE)) ) return 1;
+    if ( (fd < 0) || (fstat(fd, &finfo) != 0) || ! (dir = fdopendir(fd)) ) {
+        slurm_info("auto_tmpdir::auto_tmpdir_rmdir_recurse: unable to open directory `%s` (%m)", path);
+        if ( fd >= 0 ) close(fd);
+        usage->n_errors++;
+        return -1;
+    }
+    usage->bytes += finfo.st_blocks * 512;
+    usage->inodes++;
+
+    frame = &(*frames)[(*n_frames)++];
+    memset(frame, 0, sizeof(*frame));
+    frame->dir = dir;
+    frame->name = name;
+    frame->path = path;
+    return 0;
+}
+
+/*
+ * Read the next chunk of a frame's entries and sort it by inode number:
+ */
+static int
+__auto_tmpdir_fs_rmdir_read_chunk(
+    auto_tmpdir_fs_rmdir_frame_t    *frame,
+    auto_tmpdir_fs_usage_t          *usage
+)
+{
+    struct dirent                   *dent;
+    int                             rc = 0;
+
+    frame->n_entries = frame->next_entry = 0;
+    while ( frame->n_entries < AUTO_TMPDIR_FS_RMDIR_CHUNK ) {
+        errno = 0;
+        if ( ! (dent = readdir(frame->dir)) ) {
+            if ( errno ) {
+                slurm_info("auto_tmpdir::auto_tmpdir_rmdir_recurse: error reading directory `%s` (%m)", frame->path);
+                usage->n_errors++;
+                rc = -1;
+            }
+            frame->is_eof = 1;
+            break;
+        }
+        if ( (strcmp(dent->d_name, ".") == 0) || (strcmp(dent->d_name, "..") == 0) ) continue;
+        if ( frame->n_entries == frame->n_entries_max ) {
+            int                             new_max = frame->n_entries_max ? 2 * frame->n_entries_max : 64;
+            auto_tmpdir_fs_rmdir_entry_t    *new_entries = realloc(frame->entries, new_max * sizeof(auto_tmpdir_fs_rmdir_entry_t));
+
+            if ( ! new_entries ) {
+                slurm_info("auto_tmpdir::auto_tmpdir_rmdir_recurse: unable to allocate entry list for `%s`", frame->path);
+                usage->n_errors++;
+                rc = -1;
+                frame->is_eof = 1;
+                break;
+            }
+            frame->entries = new_entries;
+            frame->n_entries_max = new_max;
+        }
+        frame->entries[frame->n_entries].ino = dent->d_ino;
+        if ( ! (frame->entries[frame->n_entries].name = strdup(dent->d_name)) ) {
+            usage->n_errors++;
+            rc = -1;
+            continue;
+        }
+        frame->n_entries++;
+    }
+    frame->fanout += frame->n_entries;
+    qsort(frame->entries, frame->n_entries, sizeof(auto_tmpdir_fs_rmdir_entry_t), __auto_tmpdir_fs_rmdir_entry_cmp);
+    return rc;
+}
+
+/*
+ * @function __auto_tmpdir_rmdir_walk_inode_order
+ *
+ * Remove everything under the directory name (relative to dir_fd), and the
+ * directory itself if should_remove_self is set, accumulating usage as
+ * __auto_tmpdir_rmdir_walk() does.  Each directory is read in chunks of
+ * AUTO_TMPDIR_FS_RMDIR_CHUNK entries; each chunk is sorted by inode number
+ * before its entries are stat'ed and unlinked.  Subdirectories on another
+ * filesystem are not descended into.
+ *
+ * The directories being walked are kept on a stack on the heap rather than
+ * by recursion, so a deep tree can't overflow the caller's stack; subtrees
+ * below AUTO_TMPDIR_FS_RMDIR_MAX_OPEN levels (or once descriptors run out)
+ * are left to __auto_tmpdir_rmdir_walk().
+ *
+ */
+static int
+__auto_tmpdir_rmdir_walk_inode_order(
+    int                             dir_fd,
+    const char                      *name,
+    const char                      *path,
+    dev_t                           root_dev,
+    int                             should_remove_self,
+    auto_tmpdir_fs_usage_t          *usage
+)
+{
+    auto_tmpdir_fs_rmdir_frame_t    *frames = NULL, *top;
+    int                             n_frames = 0, n_frames_max = 0, local_rc, rc = 0;
+    char                            *root_name = strdup(name), *root_path = strdup(path);
+
+    if ( ! root_name || ! root_path ) {
+        slurm_info("auto_tmpdir::auto_tmpdir_rmdir_recurse: unable to allocate path for `%s`", path);
+        if ( root_name ) free((void*)root_name);
+        if ( root_path ) free((void*)root_path);
+        usage->n_errors++;
+        return -1;
+    }
+    if ( (local_rc = __auto_tmpdir_fs_rmdir_push(&frames, &n_frames, &n_frames_max, dir_fd, root_name, root_path, usage)) != 0 ) {
+        free((void*)root_name);
+        free((void*)root_path);
+        if ( frames ) free((void*)frames);
+        return (local_rc > 0) ? __auto_tmpdir_rmdir_walk(path, 1, ! should_remove_self, usage) : -1;
+    }
+
+    while ( n_frames > 0 ) {
+        top = &frames[n_frames - 1];
+        if ( top->next_entry < top->n_entries ) {
+            auto_tmpdir_fs_rmdir_entry_t    *entry = &top->entries[top->next_entry++];
+            size_t                          child_path_len = strlen(top->path) + strlen(entry->name) + 2;
+            char                            *child_path = malloc(child_path_len);
+            struct stat                     finfo;
+
+            if ( ! child_path ) {
+                slurm_info("auto_tmpdir::auto_tmpdir_rmdir_recurse: unable to allocate path for `%s` in `%s`", entry->name, top->path);
+                usage->n_errors++;
+                rc = -1;
+                free((void*)entry->name);
+                continue;
+            }
+            snprintf(child_path, child_path_len, "%s/%s", top->path, entry->name);
+            if ( fstatat(dirfd(top->dir), entry->name, &finfo, AT_SYMLINK_NOFOLLOW) != 0 ) {
+                slurm_info("auto_tmpdir::auto_tmpdir_rmdir_recurse: unable to stat `%s` (%m)", child_path);
+                usage->n_errors++;
+                rc = -1;
+            }
+            else if ( S_ISDIR(finfo.st_mode) && (finfo.st_dev == root_dev) ) {
+                /* Descend; the new frame takes over the name and path: */
+                if ( n_frames < AUTO_TMPDIR_FS_RMDIR_MAX_OPEN ) {
+                    local_rc = __auto_tmpdir_fs_rmdir_push(&frames, &n_frames, &n_frames_max, dirfd(top->dir), entry->name, child_path, usage);
+                    if ( local_rc == 0 ) continue;
+                } else {
+                    local_rc = 1;
+                }
+                if ( local_rc > 0 ) {
+                    /* Too deep to hold a descriptor per level, let fts have the rest: */
+                    if ( __auto_tmpdir_rmdir_walk(child_path, 1, 0, usage) != 0 ) rc = -1;
+                } else {
+                    rc = -1;
+                }
+            }
+            else {
+                usage->bytes += finfo.st_blocks * 512;
+                usage->inodes++;
+                if ( unlinkat(dirfd(top->dir), entry->name, S_ISDIR(finfo.st_mode) ? AT_REMOVEDIR : 0) < 0 ) {
+                    slurm_info("auto_tmpdir::auto_tmpdir_rmdir_recurse: failed to remove `%s` (%m)", child_path);
+                    usage->n_errors++;
+                    rc = -1;
+                } else {
+                    usage->n_removed++;
+                }
+            }
+            free((void*)child_path);
+            free((void*)entry->name);
+        }
+        else if ( ! top->is_eof ) {
+            if ( __auto_tmpdir_fs_rmdir_read_chunk(top, usage) != 0 ) rc = -1;
+        }
+        else {
+            /* Finished with this directory, remove it from its parent: */
+            int                             parent_fd = (n_frames > 1) ? dirfd(frames[n_frames - 2].dir) : dir_fd;
+
+            closedir(top->dir);
+            if ( top->fanout > usage->max_fanout ) usage->max_fanout = top->fanout;
+            if ( (n_frames > 1) || should_remove_self ) {
+                if ( unlinkat(parent_fd, top->name, AT_REMOVEDIR) < 0 ) {
+                    slurm_info("auto_tmpdir::auto_tmpdir_rmdir_recurse: failed to remove directory `%s` (%m)", top->path);
+                    usage->n_errors++;
+                    rc = -1;
+                } else {
+                    usage->n_removed++;
+                }
+            }
+            if ( top->entries ) free((void*)top->entries);
+            free((void*)top->name);
+            free((void*)top->path);
+            n_frames--;
+        }
+    }
+    if ( frames ) free((void*)frames);
+    return rc;
+}
+
+/*
+ * Returns non-zero if the block device behind dev reports itself rotational;
+ * devices without one (tmpfs, zram, overlay) are not.  Answers are cached
+ * since the same few filesystems are asked about over and over:
+ */
+#define AUTO_TMPDIR_FS_ROTATIONAL_MAX_DEVS  8
+
+static int
+__auto_tmpdir_fs_is_rotational(
+    dev_t               dev
+)
+{
+    static struct {
+        dev_t           dev;
+        int             is_rotational;
+    } known[AUTO_TMPDIR_FS_ROTATIONAL_MAX_DEVS];
+    static int          n_known = 0;
+    char                sysfs_path[64], value[8];
+    int                 i, is_rotational = 0;
+
+    for ( i = 0; i < n_known; i++ ) if ( known[i].dev == dev ) return known[i].is_rotational;
+    if ( major(dev) != 0 ) {
+        /* A partition has no queue of its own, its parent disk does: */
+        snprintf(sysfs_path, sizeof(sysfs_path), "/sys/dev/block/%u:%u/queue/rotational", major(dev), minor(dev));
+        if ( __auto_tmpdir_fs_sysfs_read(sysfs_path, value, sizeof(value)) != 0 ) {
+            snprintf(sysfs_path, sizeof(sysfs_path), "/sys/dev/block/%u:%u/../queue/rotational", major(dev), minor(dev));
+            if ( __auto_tmpdir_fs_sysfs_read(sysfs_path, value, sizeof(value)) != 0 ) *value = '\0';
+        }
+        is_rotational = (*value == '1');
+    }
+    if ( n_known < AUTO_TMPDIR_FS_ROTATIONAL_MAX_DEVS ) {
+        known[n_known].dev = dev;
+        known[n_known++].is_rotational = is_rotational;
+    }
+    slurm_debug("auto_tmpdir::__auto_tmpdir_fs_is_rotational: device %u:%u rotational = %d", major(dev), minor(dev), is_rotational);
+    return is_rotational;
+}
+
+/**/
+
+/*
+ * Bytes freed by removals in this process, by filesystem, for the trim
+ * ledger (see auto_tmpdir_fs_trim()):
+ */
+#define AUTO_TMPDIR_FS_FREED_MAX_DEVS   8
+
+static struct {
+    dev_t               dev;
+    uint64_t            bytes;
+} auto_tmpdir_fs_freed[AUTO_TMPDIR_FS_FREED_MAX_DEVS];
+static int auto_tmpdir_fs_freed_count = 0;
+
+static void
+__auto_tmpdir_fs_note_freed(
+    dev_t               dev,
+    uint64_t            bytes
+)
+{
+    int                 i;
+
+    for ( i = 0; i < auto_tmpdir_fs_freed_count; i++ ) {
+        if ( auto_tmpdir_fs_freed[i].dev == dev ) {
+            auto_tmpdir_fs_freed[i].bytes += bytes;
+            return;
+        }
+    }
+    if ( auto_tmpdir_fs_freed_count < AUTO_TMPDIR_FS_FREED_MAX_DEVS ) {
+        auto_tmpdir_fs_freed[auto_tmpdir_fs_freed_count].dev = dev;
+        auto_tmpdir_fs_freed[auto_tmpdir_fs_freed_count++].bytes = bytes;
+    }
+}
+
+/*
+ * Timed wrapper around __auto_tmpdir_rmdir_walk():
+ */
+int
+__auto_tmpdir_fs_rmdir_usage(
+    const char              *path,
+    int                     should_remove,
+    int                     should_remove_children_only,
+    auto_tmpdir_fs_usage_t  *usage
+)
+{
+    auto_tmpdir_event_t     event;
+    int                     rc;
+    struct stat             finfo;
+    uint64_t                bytes_before = usage->bytes;
+    struct timespec         start, end;
+
+    if ( should_remove && (lstat(path, &finfo) != 0) ) finfo.st_dev = 0;
+    auto_tmpdir_event_start(&event, should_remove ? "rmdir_recurse" : "measure", path);
+    AUTO_TMPDIR_PROBE2(rmdir_recurse__entry, path, should_remove);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if ( should_remove && finfo.st_dev && S_ISDIR(finfo.st_mode)
+            && ((auto_tmpdir_fs_rmdir_order == auto_tmpdir_fs_rmdir_order_inode)
+                || ((auto_tmpdir_fs_rmdir_order == auto_tmpdir_fs_rmdir_order_auto) && __auto_tmpdir_fs_is_rotational(finfo.st_dev))) ) {
+        rc = __auto_tmpdir_rmdir_walk_inode_order(AT_FDCWD, path, path, finfo.st_dev, ! should_remove_children_only, usage);
+    } else {
+        rc = __auto_tmpdir_rmdir_walk(path, should_remove, should_remove_children_only, usage);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    auto_tmpdir_event_end(&event, should_remove ? usage->n_removed : usage->inodes, usage->n_errors + ((rc != 0) && ! usage->n_errors));
+    AUTO_TMPDIR_PROBE4(rmdir_recurse__return, path, rc, usage->inodes, usage->bytes);
+    if ( should_remove ) {
+        auto_tmpdir_metrics_note_cleanup(usage->bytes, usage->n_removed, (end.tv_sec - start.tv_sec) + 1e-9 * (end.tv_nsec - start.tv_nsec));
+        if ( finfo.st_dev ) __auto_tmpdir_fs_note_freed(finfo.st_dev, usage->bytes - bytes_before);
+    }
+    return rc;
+}
+
+/*
+ * @function auto_tmpdir_rmdir_recurse
+ *
+ * Recursively remove a file path.
+ *
+ * Privileges must have been dropped prior to this function's being called.
+ *
+ */
+int
+auto_tmpdir_rmdir_recurse(
+    const char          *path,
+    int                 should_remove_children_only
+)
+{
+    auto_tmpdir_fs_usage_t  usage = { 0, 0, 0, 0, 0 };
+
+    return __auto_tmpdir_fs_rmdir_usage(path, 1, should_remove_children_only, &usage);
+}
+
+/**/
+
+const char*
+__auto_tmpdir_fs_state_dir(
+    int                 argc,
+    char*               argv[]
+)
+{
+    const char          *state_dir = "/tmp";
+    int                 i = 0;
+
+    /*
+     * Pass through the arguments to the plugin -- pull the state_dir if present:
+     */
+    while ( i < argc ) {
+        if ( strncmp(argv[i], "state_dir=", 10) == 0 ) {
+            state_dir = argv[i] + 10;
+            if ( *state_dir != '/' ) {
+                slurm_error("auto_tmpdir::__auto_tmpdir_fs_state_dir: invalid state_dir in plugstack configuration (%s)", state_dir);
+                return NULL;
+            }
+            break;
+        }
+        i++;
+    }
+    return state_dir;
+}
+
+const char*
+auto_tmpdir_fs_get_state_dir(
+    int                 argc,
+    char*               argv[]
+)
+{
+    return __auto_tmpdir_fs_state_dir(argc, argv);
+}
+
+/**/
+
+/*
+ * If usage accounting is enabled (accounting or accounting=<path> in the
+ * plugin configuration) return the path of the node's accounting file,
+ * by default <state_dir>/auto_tmpdir_accounting.jsonl.
+ */
+const char*
+__auto_tmpdir_fs_accounting_path(
+    int                 argc,
+    char*               argv[]
+)
+{
+    const char          *state_dir;
+    char                *accounting_path = NULL;
+    int                 i = 0, rc;
+
+    while ( i < argc ) {
+        if ( strncmp(argv[i], "accounting=", 11) == 0 ) {
+            if ( argv[i][11] != '/' ) {
+                slurm_error("auto_tmpdir::__auto_tmpdir_fs_accounting_path: invalid accounting in plugstack configuration (%s)", argv[i] + 11);
+                return NULL;
+            }
+            return strdup(argv[i] + 11);
+        }
+        if ( strcmp(argv[i], "accounting") == 0 ) break;
+        i++;
+    }
+    if ( (i == argc) || ! (state_dir = __auto_tmpdir_fs_state_dir(argc, argv)) ) return NULL;
+    rc = snprintf(NULL, 0, "%s/auto_tmpdir_accounting.jsonl", state_dir);
+    if ( (rc > 0) && (accounting_path = malloc(rc + 1)) ) {
+        snprintf(accounting_path, rc + 1, "%s/auto_tmpdir_accounting.jsonl", state_dir);
+    }
+    return accounting_path;
+}
+
+const char*
+auto_tmpdir_fs_get_accounting_path(
+    int                 argc,
+    char*               argv[]
+)
+{
+    return __auto_tmpdir_fs_accounting_path(argc, argv);
+}
+
+/**/
+
+const char*
+__auto_tmpdir_fs_job_state_file(
+    spank_t             spank_ctxt,
+    int                 argc,
+    char*               argv[],
+    const char          *suffix
+)
+{
+    uint32_t            job_id = NO_VAL;
+    const char          *state_dir;
+    char                *state_file = NULL;
+    int                 rc;
+
+    /* Get the base job id: */
+    if ( (rc = spank_get_item(spank_ctxt, S_JOB_ID, &job_id)) != ESPANK_SUCCESS ) {
+        slurm_error("auto_tmpdir: __auto_tmpdir_fs_job_state_file: no job id associated with job??");
+        return NULL;
+    }
+
+    slurm_debug("auto_tmpdir::__auto_tmpdir_fs_job_state_file: %u", job_id);
+
+    if ( ! (state_dir = __auto_tmpdir_fs_state_dir(argc, argv)) ) return NULL;
+
+    slurm_debug("auto_tmpdir::__auto_tmpdir_fs_job_state_file: state_dir=%s", state_dir);
+    
+    /*
+     * Path should be <state_dir>/auto_tmpdir_fs-<job-id>{_<job-task-id>}.<suffix>
+     */
+    rc = snprintf(NULL, 0, "%s/auto_tmpdir_fs-%u.%s", state_dir, job_id, suffix);
+    if ( rc > 0 ) {
+        state_file = malloc(rc + 1);
+        if ( state_file ) {
+            snprintf(state_file, rc + 1, "%s/auto_tmpdir_fs-%u.%s", state_dir, job_id, suffix);
+        }
+    }
+    return state_file;
+}
+
+/**/
+
+const char*
+__auto_tmpdir_fs_default_state_file(
+    spank_t             spank_ctxt,
+    int                 argc,
+    char*               argv[]
+)
+{
+    static const char   *state_file = NULL;
+    
+    if ( ! state_file ) state_file = __auto_tmpdir_fs_job_state_file(spank_ctxt, argc, argv, "cache");
+    return state_file;
+}
+
+/**/
+
+const char*
+__auto_tmpdir_fs_retained_state_file(
+    spank_t             spank_ctxt,
+    int                 argc,
+    char*               argv[]
+)
+{
+    static const char   *state_file = NULL;
+    
+    if ( ! state_file ) state_file = __auto_tmpdir_fs_job_state_file(spank_ctxt, argc, argv, "retained");
+    return state_file;
+}
+
+/**/
+
+void
+auto_tmpdir_fs_async_mark_failed(
+    spank_t             spank_ctxt,
+    int                 argc,
+    char*               argv[]
+)
+{
+    const char          *failed_file = __auto_tmpdir_fs_job_state_file(spank_ctxt, argc, argv, "failed");
+    int                 fd;
+
+    if ( ! failed_file ) return;
+    if ( (fd = open(failed_file, O_WRONLY | O_CREAT | O_TRUNC, 0600)) >= 0 ) {
+        close(fd);
+    } else {
+        slurm_error("auto_tmpdir::auto_tmpdir_fs_async_mark_failed: unable to create `%s` (%m)", failed_file);
+    }
+    free((void*)failed_file);
+}
+
+/**/
+
+int
+auto_tmpdir_fs_async_begin(
+    spank_t             spank_ctxt,
+    int                 argc,
+    char*               argv[]
+)
+{
+    const char          *worker_file = __auto_tmpdir_fs_job_state_file(spank_ctxt, argc, argv, "async");
+    int                 fd;
+
+    if ( ! worker_file ) return -1;
+    if ( (fd = open(worker_file, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) >= 0 ) {
+        if ( flock(fd, LOCK_EX | LOCK_NB) != 0 ) {
+            slurm_error("auto_tmpdir::auto_tmpdir_fs_async_begin: unable to lock `%s` (%m)", worker_file);
+            close(fd);
+            fd = -1;
+        }
+    } else {
+        slurm_error("auto_tmpdir::auto_tmpdir_fs_async_begin: unable to create `%s` (%m)", worker_file);
+    }
+    free((void*)worker_file);
+    return fd;
+}
+
+/*
+ * The setup worker holds an exclusive lock on its lock file for as long as it
+ * runs; if the lock can be had, the worker is gone.  Without a lock file (e.g.
+ * the prolog couldn't create it) nothing can be known, so keep waiting:
+ */
+static int
+__auto_tmpdir_fs_async_worker_is_gone(
+    const char          *worker_file
+)
+{
+    int                 fd = open(worker_file, O_RDONLY | O_CLOEXEC), is_gone = 0;
+
+    if ( fd >= 0 ) {
+        is_gone = (flock(fd, LOCK_SH | LOCK_NB) == 0);
+        close(fd);
+    }
+    return is_gone;
+}
+
+int
+auto_tmpdir_fs_async_wait(
+    spank_t             spank_ctxt,
+    int                 argc,
+    char*               argv[]
+)
+{
+    const char          *state_file = __auto_tmpdir_fs_default_state_file(spank_ctxt, argc, argv);
+    const char          *failed_file = __auto_tmpdir_fs_job_state_file(spank_ctxt, argc, argv, "failed");
+    const char          *worker_file = __auto_tmpdir_fs_job_state_file(spank_ctxt, argc, argv, "async");
+    uint64_t            timeout = 300, n_polls = 0;
+    struct timespec     now, deadline, delay = { 0, 1000000 };
+    auto_tmpdir_event_t event;
+    int                 i = 0, rc = ETIMEDOUT;
+
+    while ( i < argc ) {
+        if ( strncmp(argv[i], "async_prolog_timeout=", 21) == 0 ) {
+            if ( __auto_tmpdir_fs_parse_count(argv[i] + 21, &timeout) != 0 ) {
+                slurm_error("auto_tmpdir::auto_tmpdir_fs_async_wait: invalid async_prolog_timeout in plugstack configuration (%s)", argv[i] + 21);
+            }
+        }
+        i++;
+    }
+    if ( ! state_file || ! failed_file || ! worker_file ) {
+        if ( failed_file ) free((void*)failed_file);
+        if ( worker_file ) free((void*)worker_file);
+        return EIO;
+    }
+
+    /*
+     * The worker renames the finished state file into place; poll for it
+     * with a backoff from 1 ms up to 100 ms:
+     */
+    auto_tmpdir_event_start(&event, "async_wait", state_file);
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout;
+    while ( 1 ) {
+        if ( access(state_file, F_OK) == 0 ) {
+            rc = 0;
+            break;
+        }
+        if ( access(failed_file, F_OK) == 0 ) {
+            slurm_error("auto_tmpdir::auto_tmpdir_fs_async_wait: asynchronous prolog failed to create the job's directories");
+            rc = EIO;
+            break;
+        }
+        if ( __auto_tmpdir_fs_async_worker_is_gone(worker_file) ) {
+            /* It may have finished between the checks above and releasing its lock: */
+            if ( access(state_file, F_OK) == 0 ) {
+                rc = 0;
+            } else if ( access(failed_file, F_OK) == 0 ) {
+                slurm_error("auto_tmpdir::auto_tmpdir_fs_async_wait: asynchronous prolog failed to create the job's directories");
+                rc = EIO;
+            } else {
+                slurm_error("auto_tmpdir::auto_tmpdir_fs_async_wait: asynchronous prolog exited without creating the job's directories");
+                rc = ECHILD;
+            }
+            break;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ( (now.tv_sec > deadline.tv_sec) || ((now.tv_sec == deadline.tv_sec) && (now.tv_nsec >= deadline.tv_nsec)) ) {
+            slurm_error("auto_tmpdir::auto_tmpdir_fs_async_wait: timed out after %llu seconds waiting for `%s`", (unsigned long long)timeout, state_file);
+            break;
+        }
+        nanosleep(&delay, NULL);
+        n_polls++;
+        if ( delay.tv_nsec < 100000000 ) delay.tv_nsec = (delay.tv_nsec * 2 > 100000000) ? 100000000 : delay.tv_nsec * 2;
+    }
+    auto_tmpdir_event_end(&event, n_polls, (rc != 0));
+    if ( n_polls ) slurm_debug("auto_tmpdir::auto_tmpdir_fs_async_wait: waited %llu polls for `%s` (rc = %d)", (unsigned long long)n_polls, state_file, rc);
+    free((void*)failed_file);
+    free((void*)worker_file);
+    return rc;
+}
+
+/**/
+
+void
+auto_tmpdir_fs_async_clear(
+    spank_t             spank_ctxt,
+    int                 argc,
+    char*               argv[]
+)
+{
+    const char          *failed_file = __auto_tmpdir_fs_job_state_file(spank_ctxt, argc, argv, "failed");
+    const char          *worker_file = __auto_tmpdir_fs_job_state_file(spank_ctxt, argc, argv, "async");
+
+    if ( failed_file ) {
+        unlink(failed_file);
+        free((void*)failed_file);
+    }
+    if ( worker_file ) {
+        unlink(worker_file);
+        free((void*)worker_file);
+    }
+}
+
+/*
+ * State files start with a magic number and a format version; bump the
+ * version whenever fields are added, removed, or reordered.  Files written
+ * before the header existed start directly with the options word and hold
+ * only the original fields -- they are read as version 0:
+ */
+#define AUTO_TMPDIR_FS_STATE_MAGIC      0x504d5441      /* "ATMP" */
+#define AUTO_TMPDIR_FS_STATE_VERSION    1
+
+#define AUTO_TMPDIR_FS_SERIALIZE(FIELD) \
+            out_bytes += write(state_file_fd, (void*)&(FIELD), sizeof(FIELD)); expect_bytes += sizeof(FIELD); \
+            if ( out_bytes != expect_bytes ) { \
+                slurm_error("auto_tmpdir::auto_tmpdir_fs_serialize_to_file: failed to write %s to `%s` (errno = %d)", #FIELD, filepath, errno); \
+                goto early_exit; \
+            }
+#define AUTO_TMPDIR_FS_SERIALIZE_CSTR(FIELD) \
+            size_bytes = (FIELD) ? strlen(FIELD) : 0; \
+            out_bytes += write(state_file_fd, (void*)&size_bytes, sizeof(size_bytes)); expect_bytes += sizeof(size_bytes); \
+            if ( out_bytes != expect_bytes ) { \
+                slurm_error("auto_tmpdir::auto_tmpdir_fs_serialize_to_file: failed to write %s string length to `%s` (errno = %d)", #FIELD, filepath, errno); \
+                goto early_exit; \
+            } \
+            if ( FIELD ) { out_bytes += write(state_file_fd, (void*)FIELD, size_bytes);  expect_bytes += size_bytes; } \
+            if ( out_bytes != expect_bytes ) { \
+                slurm_error("auto_tmpdir::auto_tmpdir_fs_serialize_to_file: failed to write %s string to `%s` (errno = %d)", #FIELD, filepath, errno); \
+                goto early_exit; \
+            }
+
+int
+auto_tmpdir_fs_serialize_to_file(
+    auto_tmpdir_fs_ref  fs_info,
+    spank_t             spank_ctxt,
+    int                 argc,
+    char*               argv[],
+    const char          *filepath
+)
+{
+    int                 rc, state_file_fd;
+    uint64_t            n_bindpoints = 0;
+    auto_tmpdir_event_t event;
+    char                tmp_filepath[PATH_MAX];
+    
+    if ( ! filepath ) {
+        filepath = __auto_tmpdir_fs_default_state_file(spank_ctxt, argc, argv);
+        if ( ! filepath ) {
+            slurm_error("auto_tmpdir::auto_tmpdir_fs_serialize_to_file: unable to get default state file path");
+            return ENOMEM;
+        }
+    }
+    
+    /*
+     * The file is written alongside and renamed into place, so a reader (e.g. a step
+     * waiting on an asynchronous prolog) never sees it partially written:
+     */
+    if ( snprintf(tmp_filepath, sizeof(tmp_filepath), "%s.tmp", filepath) >= sizeof(tmp_filepath) ) {
+        slurm_error("auto_tmpdir::auto_tmpdir_fs_serialize_to_file: state file path too long `%s`", filepath);
+        return ENAMETOOLONG;
+    }
+    
+    /* Attempt to open the file: */
+    auto_tmpdir_event_start(&event, "serialize", filepath);
+    AUTO_TMPDIR_PROBE1(fs_serialize_to_file__entry, filepath);
+    state_file_fd = open(tmp_filepath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if ( state_file_fd >= 0 ) {
+        ssize_t     out_bytes = 0, expect_bytes = 0;
+        size_t      size_bytes = 0;
+        uint32_t    magic = AUTO_TMPDIR_FS_STATE_MAGIC, version = AUTO_TMPDIR_FS_STATE_VERSION;
+        
+        /*
+         * Write the header fields:
+         */
+        AUTO_TMPDIR_FS_SERIALIZE(magic);
+        AUTO_TMPDIR_FS_SERIALIZE(version);
+        AUTO_TMPDIR_FS_SERIALIZE(fs_info->options);
+        AUTO_TMPDIR_FS_SERIALIZE_CSTR(fs_info->tmpdir);
+        AUTO_TMPDIR_FS_SERIALIZE_CSTR(fs_info->base_dir);
+        AUTO_TMPDIR_FS_SERIALIZE_CSTR(fs_info->base_dir_parent);
+        AUTO_TMPDIR_FS_SERIALIZE(fs_info->job_id);
+        AUTO_TMPDIR_FS_SERIALIZE(fs_info->u_owner);
+        AUTO_TMPDIR_FS_SERIALIZE(fs_info->g_owner);
+        AUTO_TMPDIR_FS_SERIALIZE_CSTR(fs_info->archive_path);
+        AUTO_TMPDIR_FS_SERIALIZE(fs_info->handoff_minutes);
+        AUTO_TMPDIR_FS_SERIALIZE(fs_info->retain_until);
+        AUTO_TMPDIR_FS_SERIALIZE(fs_info->granted_mb);
+        AUTO_TMPDIR_FS_SERIALIZE_CSTR(fs_info->policy_name);
+        AUTO_TMPDIR_FS_SERIALIZE(fs_info->job_cpus);
+        
+        auto_tmpdir_fs_bindpoint_t  *bindpoint_node = fs_info->bind_mounts_tail;
+        
+        while ( bindpoint_node ) {
+            /* State flags: */
+            AUTO_TMPDIR_FS_SERIALIZE(bindpoint_node->is_bind_mounted);
+            AUTO_TMPDIR_FS_SERIALIZE(bindpoint_node->should_always_remove);
+            AUTO_TMPDIR_FS_SERIALIZE(bindpoint_node->should_never_remove);
+            AUTO_TMPDIR_FS_SERIALIZE(bindpoint_node->backend);
+            AUTO_TMPDIR_FS_SERIALIZE(bindpoint_node->device);
+            AUTO_TMPDIR_FS_SERIALIZE_CSTR(bindpoint_node->bind_this_path);
+            AUTO_TMPDIR_FS_SERIALIZE_CSTR(bindpoint_node->to_this_path);
+            AUTO_TMPDIR_FS_SERIALIZE_CSTR(bindpoint_node->template_path);
+            AUTO_TMPDIR_FS_SERIALIZE_CSTR(bindpoint_node->work_path);
+            n_bindpoints++;
+            
+            /* Move to previous node: */
+            bindpoint_node = bindpoint_node->back_link;
+        }
+        slurm_debug("auto_tmpdir::auto_tmpdir_fs_serialize_to_file: serialized to `%s`", filepath);
+        
+early_exit:
+        close(state_file_fd);
+        rc =  ( out_bytes == expect_bytes ) ? 0 : (errno ? errno : EIO);
+        if ( (rc == 0) && (rename(tmp_filepath, filepath) != 0) ) {
+            rc = errno;
+            slurm_error("auto_tmpdir::auto_tmpdir_fs_serialize_to_file: unable to rename `%s` to `%s` (%m)", tmp_filepath, filepath);
+        }
+        if ( rc != 0 ) unlink(tmp_filepath);
+    } else {
+        slurm_error("auto_tmpdir::auto_tmpdir_fs_serialize_to_file: unable to open state file `%s` (errno = %d)", filepath, errno);
+        rc = errno;
+    }
+    auto_tmpdir_event_end(&event, n_bindpoints, (rc != 0));
+    AUTO_TMPDIR_PROBE3(fs_serialize_to_file__return, filepath, rc, n_bindpoints);
+    return rc;
+}
+
+#define AUTO_TMPDIR_FS_UNSERIALIZE(FIELD) \
+            in_bytes += read(state_file_fd, (void*)&(FIELD), sizeof(FIELD)); expect_bytes += sizeof(FIELD); \
+            if ( in_bytes != expect_bytes ) { \
+                slurm_error("auto_tmpdir::auto_tmpdir_fs_init_with_file: failed to read %s from `%s` (errno = %d)", #FIELD, filepath, errno); \
+                rc = 1; goto early_exit; \
+            }
+#define AUTO_TMPDIR_FS_UNSERIALIZE_CSTR(FIELD) \
+            in_bytes += read(state_file_fd, (void*)&size_bytes, sizeof(size_bytes)); expect_bytes += sizeof(size_bytes); \
+            if ( in_bytes != expect_bytes ) { \
+                slurm_error("auto_tmpdir::auto_tmpdir_fs_init_with_file: failed to read %s string length from `%s` (errno = %d)", #FIELD, filepath, errno); \
+                rc = 1; goto early_exit; \
+            } \
+            if ( size_bytes ) { \
+                FIELD = malloc(size_bytes + 1); \
+                if ( ! FIELD ) { \
+                    slurm_error("auto_tmpdir::auto_tmpdir_fs_init_with_file: failed to allocate %s string (errno = %d)", #FIELD, errno); \
+                    rc = 1; goto early_exit; \
+                } \
+                in_bytes += read(state_file_fd, (void*)FIELD, size_bytes); expect_bytes += size_bytes; \
+                if ( in_bytes != expect_bytes ) { \
+                    slurm_error("auto_tmpdir::auto_tmpdir_fs_serialize_to_file: failed to write %s string to `%s` (errno = %d)", #FIELD, filepath, errno); \
+                    rc = 1; goto early_exit; \
+                } \
+                ((char*)FIELD)[size_bytes] = '\0'; \
+            } else { \
+                FIELD = NULL; \
+            }
+
+
+auto_tmpdir_fs_ref
+auto_tmpdir_fs_init_with_file(
+    spank_t                     spank_ctxt,
+    int                         argc,
+    char*                       argv[],
+    auto_tmpdir_fs_options_t    options,
+    const char                  *filepath,
+    int                         remove_state_file
+)
+{
+    auto_tmpdir_fs              *new_fs = NULL;
+    int                         state_file_fd, rc = 0, i;
+    uint64_t                    n_bindpoints = 0;
+    auto_tmpdir_event_t         event;
+    
+    /* The teardown of the hierarchy honors the removal order, too: */
+    for ( i = 0; i < argc; i++ ) {
+        if ( (strncmp(argv[i], "rmdir_order=", 12) == 0) && (__auto_tmpdir_fs_parse_rmdir_order(argv[i] + 12) != 0) ) {
+            slurm_error("auto_tmpdir::auto_tmpdir_fs_init_with_file: invalid rmdir_order in plugstack configuration (%s)", argv[i] + 12);
+        }
+    }
+    /* Released zram devices may go back to the pool: */
+    __auto_tmpdir_fs_zram_pool_config(argc, argv, &auto_tmpdir_fs_zram_pool);
+    if ( ! filepath ) {
+        filepath = __auto_tmpdir_fs_default_state_file(spank_ctxt, argc, argv);
+        if ( ! filepath ) {
+            slurm_error("auto_tmpdir::auto_tmpdir_fs_init_with_file: unable to get default state file path");
+            return NULL;
+        }
+    }
+    
+    /* Attempt to open the file: */
+    auto_tmpdir_event_start(&event, "deserialize", filepath);
+    AUTO_TMPDIR_PROBE1(fs_init_with_file__entry, filepath);
+    state_file_fd = open(filepath, O_RDONLY);
+    if ( state_file_fd >= 0 ) {
+        ssize_t     in_bytes = 0, expect_bytes = 0;
+        size_t      size_bytes = 0;
+        uint32_t    magic, version = 0;
+        
+        new_fs = calloc(1, sizeof(auto_tmpdir_fs));
+        if ( new_fs ) {
+            /* Read the header: */
+            AUTO_TMPDIR_FS_UNSERIALIZE(magic);
+            if ( magic == AUTO_TMPDIR_FS_STATE_MAGIC ) {
+                AUTO_TMPDIR_FS_UNSERIALIZE(version);
+                if ( version != AUTO_TMPDIR_FS_STATE_VERSION ) {
+                    slurm_error("auto_tmpdir::auto_tmpdir_fs_init_with_file: `%s` has unsupported format version %u (expected %u)", filepath, version, AUTO_TMPDIR_FS_STATE_VERSION);
+                    rc = 1; goto early_exit;
+                }
+                AUTO_TMPDIR_FS_UNSERIALIZE(new_fs->options);
+            } else {
+                /* No header, the first word was the options: */
+                slurm_info("auto_tmpdir::auto_tmpdir_fs_init_with_file: `%s` predates state file versioning, reading it as version 0", filepath);
+                new_fs->options = (auto_tmpdir_fs_options_t)magic;
+            }
+            AUTO_TMPDIR_FS_UNSERIALIZE_CSTR(new_fs->tmpdir);
+            AUTO_TMPDIR_FS_UNSERIALIZE_CSTR(new_fs->base_dir);
+            AUTO_TMPDIR_FS_UNSERIALIZE_CSTR(new_fs->base_dir_parent);
+            if ( version >= 1 ) {
+                AUTO_TMPDIR_FS_UNSERIALIZE(new_fs->job_id);
+                AUTO_TMPDIR_FS_UNSERIALIZE(new_fs->u_owner);
+                AUTO_TMPDIR_FS_UNSERIALIZE(new_fs->g_owner);
+                AUTO_TMPDIR_FS_UNSERIALIZE_CSTR(new_fs->archive_path);
+                AUTO_TMPDIR_FS_UNSERIALIZE(new_fs->handoff_minutes);
+                AUTO_TMPDIR_FS_UNSERIALIZE(new_fs->retain_until);
+                AUTO_TMPDIR_FS_UNSERIALIZE(new_fs->granted_mb);
+                AUTO_TMPDIR_FS_UNSERIALIZE_CSTR(new_fs->policy_name);
+                AUTO_TMPDIR_FS_UNSERIALIZE(new_fs->job_cpus);
+            } else {
+                struct stat     finfo;
+                const char      *file_base = strrchr(filepath, '/');
+                
+                /* The job and its owner were never recorded; recover them from the hierarchy: */
+                if ( ! spank_ctxt || (spank_get_item(spank_ctxt, S_JOB_ID, &new_fs->job_id) != ESPANK_SUCCESS) ) {
+                    if ( ! file_base || (sscanf(file_base, "/auto_tmpdir_fs-%u.", &new_fs->job_id) != 1) ) new_fs->job_id = 0;
+                }
+                if ( new_fs->base_dir && (stat(new_fs->base_dir, &finfo) == 0) ) {
+                    new_fs->u_owner = finfo.st_uid;
+                    new_fs->g_owner = finfo.st_gid;
+                }
+            }
+            
+            while ( 1 ) {
+                int         is_bind_mounted;
+                ssize_t     initial_in_bytes;
+                
+                /* Try to read an int to see if we have a record present: */
+                initial_in_bytes = read(state_file_fd, &is_bind_mounted, sizeof(is_bind_mounted));
+                if ( initial_in_bytes == 0 ) break;
+                in_bytes += initial_in_bytes; expect_bytes += sizeof(is_bind_mounted);
+                
+                /* Allocate a node: */
+                auto_tmpdir_fs_bindpoint_t  *bindpoint_node = calloc(1, sizeof(auto_tmpdir_fs_bindpoint_t));
+                if ( ! bindpoint_node ) {
+                    slurm_error("auto_tmpdir::auto_tmpdir_fs_init_with_file: failed to allocate auto_tmpdir_fs bindpoint node");
+                    rc = 1; goto early_exit;
+                }
+                
+                /* Read the rest of the fields: */
+                bindpoint_node->is_bind_mounted = is_bind_mounted;
+                bindpoint_node->device = -1;
+                AUTO_TMPDIR_FS_UNSERIALIZE(bindpoint_node->should_always_remove);
+                if ( version >= 1 ) {
+                    AUTO_TMPDIR_FS_UNSERIALIZE(bindpoint_node->should_never_remove);
+                    AUTO_TMPDIR_FS_UNSERIALIZE(bindpoint_node->backend);
+                    AUTO_TMPDIR_FS_UNSERIALIZE(bindpoint_node->device);
+                }
+                AUTO_TMPDIR_FS_UNSERIALIZE_CSTR(bindpoint_node->bind_this_path);
+                AUTO_TMPDIR_FS_UNSERIALIZE_CSTR(bindpoint_node->to_this_path);
+                if ( version >= 1 ) {
+                    AUTO_TMPDIR_FS_UNSERIALIZE_CSTR(bindpoint_node->template_path);
+                    AUTO_TMPDIR_FS_UNSERIALIZE_CSTR(bindpoint_node->work_path);
+                }
+                bindpoint_node->link = bindpoint_node->back_link = NULL;
+                
+                if ( ! new_fs->bind_mounts_tail ) new_fs->bind_mounts_tail = bindpoint_node;
+                if ( new_fs->bind_mounts ) new_fs->bind_mounts->back_link = bindpoint_node;
+                bindpoint_node->link = new_fs->bind_mounts;
+                new_fs->bind_mounts = bindpoint_node;
+                n_bindpoints++;
+            }
+            
+        } else {
+            slurm_error("auto_tmpdir::auto_tmpdir_fs_init_with_file: failed to allocate auto_tmpdir_fs");
+            goto early_exit;
+        }
+        
+early_exit:
+        close(state_file_fd);
+        if ( rc ) {
+            /* Dispose of new_fs: */
+            if ( new_fs ) {
+                auto_tmpdir_fs_bindpoint_t  *bindpoint_node = new_fs->bind_mounts;
+                
+                while ( bindpoint_node ) {
+                    auto_tmpdir_fs_bindpoint_t  *next = bindpoint_node->link;
+                    
+                    if ( bindpoint_node->bind_this_path ) free((void*)bindpoint_node->bind_this_path);
+                    if ( bindpoint_node->to_this_path ) free((void*)bindpoint_node->to_this_path);
+                    if ( bindpoint_node->template_path ) free((void*)bindpoint_node->template_path);
+                    if ( bindpoint_node->work_path ) free((void*)bindpoint_node->work_path);
+                    free((void*)bindpoint_node);
+                    bindpoint_node = next;
+                }
+                if ( new_fs->tmpdir ) free((void*)new_fs->tmpdir);
+                if ( new_fs->base_dir ) free((void*)new_fs->base_dir);
+                if ( new_fs->base_dir_parent ) free((void*)new_fs->base_dir_parent);
+                if ( new_fs->archive_path ) free((void*)new_fs->archive_path);
+                if ( new_fs->policy_name ) free((void*)new_fs->policy_name);
+                free((void*)new_fs);
+                new_fs = NULL;
+            }
+        }
+    } else {
+        slurm_error("auto_tmpdir::auto_tmpdir_fs_init_with_file: unable to open state file `%s` (errno = %d)", filepath, errno);
+    }
+    auto_tmpdir_event_end(&event, n_bindpoints, (new_fs == NULL));
+    AUTO_TMPDIR_PROBE3(fs_init_with_file__return, filepath, (new_fs != NULL), n_bindpoints);
+    if ( new_fs ) new_fs->accounting_path = __auto_tmpdir_fs_accounting_path(argc, argv);
+    
+    if ( remove_state_file && filepath ) {
+        unlink(filepath);
+    }
+    
+    return new_fs;
+}
+
+/**/
+
+int
+auto_tmpdir_fs_retain(
+    auto_tmpdir_fs_ref  fs_info,
+    spank_t             spank_ctxt,
+    int                 argc,
+    char*               argv[]
+)
+{
+    uint64_t            retain_minutes = 0, retain_max_bytes = 0;
+    const char          *retained_state_file;
+    int                 i = 0;
+
+    while ( i < argc ) {
+        if ( strncmp(argv[i], "requeue_retain_minutes=", 23) == 0 ) {
+            if ( __auto_tmpdir_fs_parse_count(argv[i] + 23, &retain_minutes) != 0 ) {
+                slurm_error("auto_tmpdir::auto_tmpdir_fs_retain: invalid requeue_retain_minutes in plugstack configuration (%s)", argv[i] + 23);
+                return -1;
+            }
+        }
+        else if ( strncmp(argv[i], "requeue_retain_max_bytes=", 25) == 0 ) {
+            if ( __auto_tmpdir_fs_parse_size(argv[i] + 25, &retain_max_bytes) != 0 ) {
+                slurm_error("auto_tmpdir::auto_tmpdir_fs_retain: invalid requeue_retain_max_bytes in plugstack configuration (%s)", argv[i] + 25);
+                return -1;
+            }
+        }
+        i++;
+    }
+    if ( ! retain_minutes || ! fs_info->base_dir ) return -1;
+
+    if ( retain_max_bytes ) {
+        uint64_t        bytes, inodes;
+
+        if ( __auto_tmpdir_fs_usage(fs_info->base_dir, &bytes, &inodes) != 0 ) return -1;
+        if ( bytes > retain_max_bytes ) {
+            slurm_info("auto_tmpdir::auto_tmpdir_fs_retain: `%s` holds %llu bytes, exceeding requeue_retain_max_bytes", fs_info->base_dir, (unsigned long long)bytes);
+            return -1;
+        }
+    }
+
+    retained_state_file = __auto_tmpdir_fs_retained_state_file(spank_ctxt, argc, argv);
+    if ( ! retained_state_file ) return -1;
+    fs_info->retain_until = time(NULL) + 60 * retain_minutes;
+    if ( auto_tmpdir_fs_serialize_to_file(fs_info, spank_ctxt, argc, argv, retained_state_file) != 0 ) {
+        unlink(retained_state_file);
+        fs_info->retain_until = 0;
+        return -1;
+    }
+    slurm_info("auto_tmpdir::auto_tmpdir_fs_retain: retaining `%s` for %llu minutes for the requeued job", fs_info->base_dir, (unsigned long long)retain_minutes);
+
+    /*
+     * Everything but the base_dir hierarchy (e.g. /dev/shm) is still removed:
+     */
+    fs_info->options |= auto_tmpdir_fs_options_should_not_delete;
+    fs_info->handoff_minutes = 0;
+    auto_tmpdir_fs_fini(fs_info, 0);
+    return 0;
+}
+
+/**/
+
+/*
+ * Remove an expired retained hierarchy and release its record.  Everything
+ * else the job held (cache use, zram devices, /dev/shm) was released when the
+ * hierarchy was retained, so only the directory itself goes -- the record's
+ * device numbers may since have been handed to another job, and its hand-off
+ * setting must not rename the directory aside.
+ */
+static void
+__auto_tmpdir_fs_retained_remove(
+    auto_tmpdir_fs_ref  retained_fs
+)
+{
+    if ( retained_fs->base_dir && (auto_tmpdir_rmdir_recurse(retained_fs->base_dir, 0) != 0) ) {
+        slurm_info("auto_tmpdir::__auto_tmpdir_fs_retained_remove: unable to fully remove `%s`", retained_fs->base_dir);
+    }
+    auto_tmpdir_fs_fini(retained_fs, 1);
+}
+
+const char*
+__auto_tmpdir_fs_retained_claim(
+    spank_t             spank_ctxt,
+    int                 argc,
+    char*               argv[]
+)
+{
+    const char          *retained_state_file = __auto_tmpdir_fs_retained_state_file(spank_ctxt, argc, argv);
+    const char          *retained_base_dir = NULL;
+    auto_tmpdir_fs_ref  retained_fs;
+
+    if ( ! retained_state_file || (access(retained_state_file, F_OK) != 0) ) return NULL;
+
+    retained_fs = auto_tmpdir_fs_init_with_file(spank_ctxt, argc, argv, 0, retained_state_file, 1);
+    if ( retained_fs ) {
+        if ( retained_fs->retain_until > time(NULL) && retained_fs->base_dir ) {
+            /* Keep the hierarchy, drop the record: */
+            retained_base_dir = retained_fs->base_dir;
+            retained_fs->base_dir = NULL;
+            auto_tmpdir_fs_fini(retained_fs, 1);
+        } else {
+            slurm_info("auto_tmpdir::__auto_tmpdir_fs_retained_claim: retention of `%s` has expired", retained_fs->base_dir);
+            __auto_tmpdir_fs_retained_remove(retained_fs);
+        }
+    }
+    return retained_base_dir;
+}
+
+/**/
+
+int
+auto_tmpdir_fs_reap_retained(
+    int                 argc,
+    char*               argv[]
+)
+{
+    const char          *state_dir = __auto_tmpdir_fs_state_dir(argc, argv);
+    DIR                 *dir;
+    struct dirent       *dent;
+    time_t              now = time(NULL);
+    int                 n_reaped = 0;
+
+    if ( ! state_dir || ! (dir = opendir(state_dir)) ) return 0;
+    while ( (dent = readdir(dir)) ) {
+        unsigned int        job_id;
+        int                 name_len = 0;
+        char                path[PATH_MAX];
+        auto_tmpdir_fs_ref  retained_fs;
+
+        if ( (sscanf(dent->d_name, "auto_tmpdir_fs-%u.retained%n", &job_id, &name_len) != 1) || (name_len == 0) || dent->d_name[name_len] ) continue;
+        if ( snprintf(path, sizeof(path), "%s/%s", state_dir, dent->d_name) >= sizeof(path) ) continue;
+        if ( ! (retained_fs = auto_tmpdir_fs_init_with_file(NULL, argc, argv, 0, path, 0)) ) continue;
+        if ( retained_fs->retain_until <= now ) {
+            slurm_info("auto_tmpdir::auto_tmpdir_fs_reap_retained: retention of `%s` for job %u has expired", retained_fs->base_dir, job_id);
+            __auto_tmpdir_fs_retained_remove(retained_fs);
+            unlink(path);
+            n_reaped++;
+        } else {
+            auto_tmpdir_fs_fini(retained_fs, 1);
+        }
+    }
+    closedir(dir);
+    return n_reaped;
+}
+
+/**/
+
+int
+auto_tmpdir_fs_record_kept(
+    auto_tmpdir_fs_ref  fs_info,
+    spank_t             spank_ctxt,
+    int                 argc,
+    char*               argv[]
+)
+{
+    const char          *kept_state_file;
+    int                 rc;
+
+    if ( (fs_info->options & auto_tmpdir_fs_options_should_not_delete) != auto_tmpdir_fs_options_should_not_delete ) return 0;
+    if ( ! (kept_state_file = __auto_tmpdir_fs_job_state_file(spank_ctxt, argc, argv, "kept")) ) return -1;
+    rc = auto_tmpdir_fs_serialize_to_file(fs_info, spank_ctxt, argc, argv, kept_state_file);
+    if ( rc != 0 ) {
+        slurm_error("auto_tmpdir::auto_tmpdir_fs_record_kept: unable to record kept hierarchy in `%s`", kept_state_file);
+        unlink(kept_state_file);
+    }
+    free((void*)kept_state_file);
+    return rc;
+}
+
+/*
+ * A kept record is only needed while any of the directories it describes are
+ * still present:
+ */
+static int
+__auto_tmpdir_fs_kept_is_present(
+    int                         argc,
+    char*                       argv[],
+    const char                  *kept_state_file
+)
+{
+    auto_tmpdir_fs_ref          kept_fs = auto_tmpdir_fs_init_with_file(NULL, argc, argv, 0, kept_state_file, 0);
+    auto_tmpdir_fs_bindpoint_t  *bindpoint;
+    struct stat                 finfo;
+    int                         is_present = 0;
+
+    if ( ! kept_fs ) return 0;
+    if ( kept_fs->base_dir && (lstat(kept_fs->base_dir, &finfo) == 0) ) is_present = 1;
+    for ( bindpoint = kept_fs->bind_mounts; bindpoint && ! is_present; bindpoint = bindpoint->link ) {
+        if ( bindpoint->should_always_remove || bindpoint->should_never_remove ) continue;
+        if ( lstat(bindpoint->bind_this_path, &finfo) == 0 ) is_present = 1;
+    }
+    auto_tmpdir_fs_fini(kept_fs, 1);
+    return is_present;
+}
+
+/**/
+
+/*
+ * The local and shared prefixes from the plugin arguments:
+ */
+static void
+__auto_tmpdir_fs_prefixes(
+    int                     argc,
+    char*                   argv[],
+    const char              **local_prefix,
+    const char              **shared_prefix
+)
+{
+    int                     i = 0;
+
+    *local_prefix = auto_tmpdir_fs_default_local_prefix;
+    *shared_prefix = auto_tmpdir_fs_default_shared_prefix;
+    while ( i < argc ) {
+        if ( strncmp(argv[i], "local_prefix=", 13) == 0 ) *local_prefix = argv[i] + 13;
+        else if ( strncmp(argv[i], "shared_prefix=", 14) == 0 ) *shared_prefix = argv[i] + 14;
+        i++;
+    }
+    if ( *local_prefix && (**local_prefix != '/') ) *local_prefix = NULL;
+    if ( *shared_prefix && (**shared_prefix != '/') ) *shared_prefix = NULL;
+}
+
+/*
+ * statvfs() the filesystem holding a directory prefix (e.g. /tmp/job- lives
+ * on the filesystem of /tmp); the directory is copied to prefix_dir:
+ */
+static int
+__auto_tmpdir_fs_prefix_statvfs(
+    const char              *prefix,
+    char                    *prefix_dir,
+    size_t                  prefix_dir_len,
+    struct statvfs          *fsinfo
+)
+{
+    const char              *prefix_base = strrchr(prefix, '/');
+
+    snprintf(prefix_dir, prefix_dir_len, "%.*s", (prefix_base > prefix) ? (int)(prefix_base - prefix) : 1, prefix);
+    if ( statvfs(prefix_dir, fsinfo) != 0 ) {
+        slurm_debug("auto_tmpdir::__auto_tmpdir_fs_prefix_statvfs: unable to statvfs `%s` (%m)", prefix_dir);
+        return -1;
+    }
+    return 0;
+}
+
+static void
+__auto_tmpdir_fs_metrics_statvfs(
+    auto_tmpdir_metrics_t   *sample,
+    int                     which,
+    const char              *prefix,
+    char                    *prefix_dir,
+    size_t                  prefix_dir_len
+)
+{
+    struct statvfs          fsinfo;
+
+    if ( __auto_tmpdir_fs_prefix_statvfs(prefix, prefix_dir, prefix_dir_len, &fsinfo) != 0 ) return;
+    sample->prefix[which].path = prefix_dir;
+    sample->prefix[which].used_bytes = (uint64_t)(fsinfo.f_blocks - fsinfo.f_bfree) * fsinfo.f_frsize;
+    sample->prefix[which].avail_bytes = (uint64_t)fsinfo.f_bavail * fsinfo.f_frsize;
+    sample->prefix[which].used_inodes = (uint64_t)(fsinfo.f_files - fsinfo.f_ffree);
+    sample->prefix[which].avail_inodes = (uint64_t)fsinfo.f_favail;
+}
+
+void
+auto_tmpdir_fs_metrics_gauges(
+    int                     argc,
+    char*                   argv[],
+    auto_tmpdir_metrics_t   *sample
+)
+{
+    static char             prefix_dirs[auto_tmpdir_metrics_prefix_max][PATH_MAX];
+    const char              *local_prefix, *shared_prefix;
+    const char              *state_dir = __auto_tmpdir_fs_state_dir(argc, argv);
+    DIR                     *dir;
+    struct dirent           *dent;
+
+    __auto_tmpdir_fs_prefixes(argc, argv, &local_prefix, &shared_prefix);
+
+    /* Job hierarchies in use and retained are tracked by their state files: */
+    if ( state_dir && (dir = opendir(state_dir)) ) {
+        while ( (dent = readdir(dir)) ) {
+            unsigned int    job_id;
+            int             name_len = 0;
+
+            if ( sscanf(dent->d_name, "auto_tmpdir_fs-%u.%n", &job_id, &name_len) != 1 || (name_len == 0) ) continue;
+            if ( strcmp(dent->d_name + name_len, "cache") == 0 ) sample->active_hierarchies++;
+            else if ( strcmp(dent->d_name + name_len, "retained") == 0 ) sample->retained_hierarchies++;
+        }
+        closedir(dir);
+    }
+
+    /* Hand-off hierarchies are renamed in place under the local prefix: */
+    if ( local_prefix ) {
+        const char          *prefix_base = strrchr(local_prefix, '/') + 1;
+        size_t              prefix_base_len = strlen(prefix_base);
+
+        __auto_tmpdir_fs_metrics_statvfs(sample, auto_tmpdir_metrics_prefix_local, local_prefix, prefix_dirs[auto_tmpdir_metrics_prefix_local], PATH_MAX);
+        if ( (dir = opendir(prefix_dirs[auto_tmpdir_metrics_prefix_local])) ) {
+            while ( (dent = readdir(dir)) ) {
+                char        path[PATH_MAX];
+                uint64_t    bytes, inodes;
+
+                if ( strncmp(dent->d_name, prefix_base, prefix_base_len) || strncmp(dent->d_name + prefix_base_len, "handoff.", 8) ) continue;
+                sample->handoff_hierarchies++;
+                if ( snprintf(path, sizeof(path), "%s/%s", prefix_dirs[auto_tmpdir_metrics_prefix_local], dent->d_name) >= sizeof(path) ) continue;
+                if ( __auto_tmpdir_fs_handoff_usage(path, &bytes, &inodes) == 0 ) {
+                    sample->handoff_bytes += bytes;
+                    sample->handoff_inodes += inodes;
+                }
+            }
+            closedir(dir);
+        }
+    }
+    if ( shared_prefix ) {
+        __auto_tmpdir_fs_metrics_statvfs(sample, auto_tmpdir_metrics_prefix_shared, shared_prefix, prefix_dirs[auto_tmpdir_metrics_prefix_shared], PATH_MAX);
+    }
+    __auto_tmpdir_fs_metrics_statvfs(sample, auto_tmpdir_metrics_prefix_dev_shm, "/dev/shm/", prefix_dirs[auto_tmpdir_metrics_prefix_dev_shm], PATH_MAX);
+}
+
+/**/
+
+/*
+ * Reservations older than this without a state file belong to a prolog that
+ * never finished:
+ */
+#define AUTO_TMPDIR_FS_ADMISSION_STALE_SECONDS  300
+
+/*
+ * Sum the reservations held by other jobs, removing stale ones.  The caller
+ * holds the admission lock.
+ */
+static void
+__auto_tmpdir_fs_admission_reserved(
+    const char              *state_dir,
+    uint32_t                my_job_id,
+    uint64_t                *reserved_mb,
+    uint64_t                *reserved_inodes
+)
+{
+    DIR                     *dir;
+    struct dirent           *dent;
+    time_t                  now = time(NULL);
+
+    *reserved_mb = *reserved_inodes = 0;
+    if ( ! (dir = opendir(state_dir)) ) return;
+    while ( (dent = readdir(dir)) ) {
+        char                path[PATH_MAX];
+        unsigned int        job_id;
+        int                 name_len = 0;
+        unsigned long long  mb, inodes;
+        struct stat         finfo;
+        FILE                *fptr;
+
+        if ( sscanf(dent->d_name, "auto_tmpdir_fs-%u.%n", &job_id, &name_len) != 1 || (name_len == 0) ) continue;
+        if ( strcmp(dent->d_name + name_len, "reserve") != 0 || (job_id == my_job_id) ) continue;
+        if ( snprintf(path, sizeof(path), "%s/%s", state_dir, dent->d_name) >= sizeof(path) ) continue;
+        if ( stat(path, &finfo) != 0 ) continue;
+        if ( now - finfo.st_mtime > AUTO_TMPDIR_FS_ADMISSION_STALE_SECONDS ) {
+            char            state_path[PATH_MAX];
+
+            snprintf(state_path, sizeof(state_path), "%s/auto_tmpdir_fs-%u.cache", state_dir, job_id);
+            if ( access(state_path, F_OK) != 0 ) {
+                slurm_info("auto_tmpdir::__auto_tmpdir_fs_admission_reserved: removing stale reservation for job %u", job_id);
+                unlink(path);
+                continue;
+            }
+        }
+        if ( (fptr = fopen(path, "r")) ) {
+            if ( fscanf(fptr, "%llu %llu", &mb, &inodes) == 2 ) {
+                *reserved_mb += mb;
+                *reserved_inodes += inodes;
+            }
+            fclose(fptr);
+        }
+    }
+    closedir(dir);
+}
+
+/*
+ * Check a request against the filesystem holding prefix.  Reservations only
+ * apply to the node-local prefix (reserved_mb is NULL for the shared one).
+ * On refusal the reason is written to why.
+ */
+static int
+__auto_tmpdir_fs_admission_check(
+    const char              *prefix,
+    uint64_t                request_mb,
+    uint64_t                request_inodes,
+    const uint64_t          *reserved_mb,
+    const uint64_t          *reserved_inodes,
+    char                    *why,
+    size_t                  why_len
+)
+{
+    char                    prefix_dir[PATH_MAX];
+    struct statvfs          fsinfo;
+    uint64_t                avail_mb, total_mb;
+
+    if ( __auto_tmpdir_fs_prefix_statvfs(prefix, prefix_dir, sizeof(prefix_dir), &fsinfo) != 0 ) {
+        snprintf(why, why_len, "unable to statvfs `%s`", prefix_dir);
+        return -1;
+    }
+    avail_mb = ((uint64_t)fsinfo.f_bavail * fsinfo.f_frsize) >> 20;
+    total_mb = ((uint64_t)fsinfo.f_blocks * fsinfo.f_frsize) >> 20;
+    if ( request_mb > avail_mb ) {
+        snprintf(why, why_len, "%llu MB requested, %llu MB free on `%s`", (unsigned long long)request_mb, (unsigned long long)avail_mb, prefix_dir);
+        return -1;
+    }
+    if ( reserved_mb && (request_mb + *reserved_mb > total_mb) ) {
+        snprintf(why, why_len, "%llu MB requested, %llu of %llu MB on `%s` reserved by other jobs", (unsigned long long)request_mb, (unsigned long long)*reserved_mb, (unsigned long long)total_mb, prefix_dir);
+        return -1;
+    }
+    /* Filesystems without a fixed inode table report zero: */
+    if ( request_inodes && fsinfo.f_files ) {
+        if ( request_inodes > fsinfo.f_favail ) {
+            snprintf(why, why_len, "%llu inodes requested, %llu free on `%s`", (unsigned long long)request_inodes, (unsigned long long)fsinfo.f_favail, prefix_dir);
+            return -1;
+        }
+        if ( reserved_inodes && (request_inodes + *reserved_inodes > fsinfo.f_files) ) {
+            snprintf(why, why_len, "%llu inodes requested, %llu of %llu on `%s` reserved by other jobs", (unsigned long long)request_inodes, (unsigned long long)*reserved_inodes, (unsigned long long)fsinfo.f_files, prefix_dir);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int
+auto_tmpdir_fs_admit(
+    spank_t                     spank_ctxt,
+    int                         argc,
+    char*                       argv[],
+    auto_tmpdir_fs_options_t    *options,
+    uint64_t                    request_mb,
+    uint64_t                    request_inodes,
+    uint64_t                    *granted_mb
+)
+{
+    const char                  *local_prefix, *shared_prefix, *state_dir;
+    const char                  *reserve_path = NULL;
+    char                        lock_path[PATH_MAX], why[PATH_MAX + 128];
+    uint64_t                    inodes_per_gb = 0, reserved_mb, reserved_inodes;
+    uint32_t                    job_id = 0;
+    int                         should_reroute = 0, lock_fd, rc = -1, i = 0;
+    FILE                        *fptr;
+
+    *granted_mb = 0;
+    while ( i < argc ) {
+        if ( strncmp(argv[i], "admission_inodes_per_gb=", 24) == 0 ) {
+            char                *end;
+
+            inodes_per_gb = strtoull(argv[i] + 24, &end, 10);
+            if ( *end ) {
+                slurm_error("auto_tmpdir::auto_tmpdir_fs_admit: invalid admission_inodes_per_gb in plugstack configuration (%s)", argv[i] + 24);
+                return -1;
+            }
+        }
+        else if ( strcmp(argv[i], "admission_reroute") == 0 ) {
+            should_reroute = 1;
+        }
+        i++;
+    }
+    if ( ! request_inodes ) request_inodes = (request_mb * inodes_per_gb) / 1024;
+    if ( ! request_mb && ! request_inodes ) {
+        slurm_debug("auto_tmpdir::auto_tmpdir_fs_admit: job made no tmp request, admitted");
+        return 0;
+    }
+
+    __auto_tmpdir_fs_prefixes(argc, argv, &local_prefix, &shared_prefix);
+
+    /* Jobs already on shared storage only need the space to be there: */
+    if ( (*options & auto_tmpdir_fs_options_should_use_shared) == auto_tmpdir_fs_options_should_use_shared ) {
+        if ( ! shared_prefix ) return 0;
+        if ( __auto_tmpdir_fs_admission_check(shared_prefix, request_mb, request_inodes, NULL, NULL, why, sizeof(why)) != 0 ) {
+            slurm_error("auto_tmpdir::auto_tmpdir_fs_admit: refusing job, insufficient shared scratch (%s)", why);
+            return -1;
+        }
+        *granted_mb = request_mb;
+        return 0;
+    }
+    if ( ! local_prefix ) return 0;
+
+    if ( ! (state_dir = __auto_tmpdir_fs_state_dir(argc, argv)) ) return -1;
+    spank_get_item(spank_ctxt, S_JOB_ID, &job_id);
+    if ( snprintf(lock_path, sizeof(lock_path), "%s/auto_tmpdir_admission.lock", state_dir) >= sizeof(lock_path) ) {
+        slurm_error("auto_tmpdir::auto_tmpdir_fs_admit: state_dir path too long (%s)", state_dir);
+        return -1;
+    }
+
+    /*
+     * The lock makes check-and-reserve atomic across concurrent prologs:
+     */
+    if ( (lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0 ) {
+        slurm_error("auto_tmpdir::auto_tmpdir_fs_admit: unable to open `%s` (%m)", lock_path);
+        return -1;
+    }
+    if ( flock(lock_fd, LOCK_EX) != 0 ) {
+        slurm_error("auto_tmpdir::auto_tmpdir_fs_admit: unable to lock `%s` (%m)", lock_path);
+        close(lock_fd);
+        return -1;
+    }
+    __auto_tmpdir_fs_admission_reserved(state_dir, job_id, &reserved_mb, &reserved_inodes);
+    if ( __auto_tmpdir_fs_admission_check(local_prefix, request_mb, request_inodes, &reserved_mb, &reserved_inodes, why, sizeof(why)) != 0 ) {
+        if ( should_reroute && shared_prefix ) {
+            char                why_shared[PATH_MAX + 128];
+
+            if ( __auto_tmpdir_fs_admission_check(shared_prefix, request_mb, request_inodes, NULL, NULL, why_shared, sizeof(why_shared)) == 0 ) {
+                slurm_info("auto_tmpdir::auto_tmpdir_fs_admit: rerouting job %u to shared scratch (%s)", job_id, why);
+                *options |= auto_tmpdir_fs_options_should_use_shared;
+                *granted_mb = request_mb;
+                rc = 0;
+                goto early_exit;
+            }
+            slurm_error("auto_tmpdir::auto_tmpdir_fs_admit: refusing job %u, insufficient local scratch (%s) and shared scratch (%s)", job_id, why, why_shared);
+        } else {
+            slurm_error("auto_tmpdir::auto_tmpdir_fs_admit: refusing job %u, insufficient local scratch (%s)", job_id, why);
+        }
+        goto early_exit;
+    }
+
+    if ( ! (reserve_path = __auto_tmpdir_fs_job_state_file(spank_ctxt, argc, argv, "reserve")) ) goto early_exit;
+    if ( ! (fptr = fopen(reserve_path, "w")) ) {
+        slurm_error("auto_tmpdir::auto_tmpdir_fs_admit: unable to create `%s` (%m)", reserve_path);
+        goto early_exit;
+    }
+    fprintf(fptr, "%llu %llu\n", (unsigned long long)request_mb, (unsigned long long)request_inodes);
+    if ( fclose(fptr) != 0 ) {
+        slurm_error("auto_tmpdir::auto_tmpdir_fs_admit: unable to write `%s` (%m)", reserve_path);
+        unlink(reserve_path);
+        goto early_exit;
+    }
+    slurm_verbose("auto_tmpdir::auto_tmpdir_fs_admit: job %u granted %llu MB, %llu inodes (others hold %llu MB, %llu inodes)",
+            job_id, (unsigned long long)request_mb, (unsigned long long)request_inodes,
+            (unsigned long long)reserved_mb, (unsigned long long)reserved_inodes);
+    *granted_mb = request_mb;
+    rc = 0;
+
+early_exit:
+    if ( reserve_path ) free((void*)reserve_path);
+    close(lock_fd);
+    return rc;
+}
+
+/**/
+
+void
+auto_tmpdir_fs_admit_release(
+    spank_t             spank_ctxt,
+    int                 argc,
+    char*               argv[]
+)
+{
+    const char          *reserve_path = __auto_tmpdir_fs_job_state_file(spank_ctxt, argc, argv, "reserve");
+
+    if ( reserve_path ) {
+        if ( (unlink(reserve_path) != 0) && (errno != ENOENT) ) {
+            slurm_error("auto_tmpdir::auto_tmpdir_fs_admit_release: unable to remove `%s` (%m)", reserve_path);
+        }
+        free((void*)reserve_path);
+    }
+}
+
+/**/
+
+static void
+__auto_tmpdir_fs_ipc_namespace_unpin(
+    const char          *pin_path
+)
+{
+    /*
+     * Detach the bind mount holding the namespace open; the kernel destroys it
+     * (and every IPC object in it) once the last process inside exits:
+     */
+    if ( (umount2(pin_path, MNT_DETACH) != 0) && (errno != EINVAL) && (errno != ENOENT) ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_fs_ipc_namespace_unpin: unable to unmount `%s` (%m)", pin_path);
+    }
+    if ( (unlink(pin_path) != 0) && (errno != ENOENT) ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_fs_ipc_namespace_unpin: unable to remove `%s` (%m)", pin_path);
+    }
+}
+
+int
+auto_tmpdir_fs_ipc_namespace_create(
+    spank_t             spank_ctxt,
+    int                 argc,
+    char*               argv[]
+)
+{
+    const char          *pin_path = __auto_tmpdir_fs_job_state_file(spank_ctxt, argc, argv, "ipc");
+    auto_tmpdir_event_t event;
+    pid_t               child_pid;
+    int                 fd, status, rc = -1;
+
+    if ( ! pin_path ) return -1;
+
+    /* A requeued job's namespace is not carried over to its restart: */
+    __auto_tmpdir_fs_ipc_namespace_unpin(pin_path);
+    if ( (fd = open(pin_path, O_RDONLY | O_CREAT | O_EXCL, 0600)) < 0 ) {
+        slurm_error("auto_tmpdir::auto_tmpdir_fs_ipc_namespace_create: unable to create `%s` (%m)", pin_path);
+        free((void*)pin_path);
+        return -1;
+    }
+    close(fd);
+
+    /*
+     * The namespace is created by a child so that this process stays in the
+     * node's own; bind-mounting the child's namespace file keeps it alive
+     * after the child exits:
+     */
+    auto_tmpdir_event_start(&event, "ipc_namespace", pin_path);
+    if ( (child_pid = fork()) == 0 ) {
+        if ( unshare(CLONE_NEWIPC) != 0 ) {
+            slurm_error("auto_tmpdir::auto_tmpdir_fs_ipc_namespace_create: failed to create new IPC namespace (%m)");
+            _exit(1);
+        }
+        if ( mount("/proc/self/ns/ipc", pin_path, "none", MS_BIND, NULL) != 0 ) {
+            slurm_error("auto_tmpdir::auto_tmpdir_fs_ipc_namespace_create: failed to bind-mount IPC namespace on `%s` (%m)", pin_path);
+            _exit(1);
+        }
+        _exit(0);
+    }
+    if ( child_pid < 0 ) {
+        slurm_error("auto_tmpdir::auto_tmpdir_fs_ipc_namespace_create: unable to fork (%m)");
+    }
+    else if ( (waitpid(child_pid, &status, 0) == child_pid) && WIFEXITED(status) && (WEXITSTATUS(status) == 0) ) {
+        slurm_debug("auto_tmpdir::auto_tmpdir_fs_ipc_namespace_create: IPC namespace pinned at `%s`", pin_path);
+        rc = 0;
+    }
+    auto_tmpdir_event_end(&event, (rc == 0), (rc != 0));
+    if ( rc != 0 ) __auto_tmpdir_fs_ipc_namespace_unpin(pin_path);
+    free((void*)pin_path);
+    return rc;
+}
+
+int
+auto_tmpdir_fs_ipc_namespace_enter(
+    spank_t             spank_ctxt,
+    int                 argc,
+    char*               argv[]
+)
+{
+    const char          *pin_path = __auto_tmpdir_fs_job_state_file(spank_ctxt, argc, argv, "ipc");
+    int                 fd, rc = -1;
+
+    if ( ! pin_path ) return -1;
+    if ( (fd = open(pin_path, O_RDONLY | O_CLOEXEC)) < 0 ) {
+        slurm_error("auto_tmpdir::auto_tmpdir_fs_ipc_namespace_enter: unable to open `%s` (%m)", pin_path);
+    }
+    else {
+        if ( setns(fd, CLONE_NEWIPC) != 0 ) {
+            slurm_error("auto_tmpdir::auto_tmpdir_fs_ipc_namespace_enter: failed to join IPC namespace at `%s` (%m)", pin_path);
+        } else {
+            slurm_debug("auto_tmpdir::auto_tmpdir_fs_ipc_namespace_enter: joined IPC namespace at `%s` (pid %d)", pin_path, getpid());
+            rc = 0;
+        }
+        close(fd);
+    }
+    free((void*)pin_path);
+    return rc;
+}
+
+void
+auto_tmpdir_fs_ipc_namespace_release(
+    spank_t             spank_ctxt,
+    int                 argc,
+    char*               argv[]
+)
+{
+    const char          *pin_path = __auto_tmpdir_fs_job_state_file(spank_ctxt, argc, argv, "ipc");
+
+    if ( pin_path ) {
+        __auto_tmpdir_fs_ipc_namespace_unpin(pin_path);
+        free((void*)pin_path);
+    }
+}
+
+/**/
+
+#ifndef FITRIM
+typedef struct auto_tmpdir_fs_fstrim_range {
+    uint64_t            start, len, minlen;
+} auto_tmpdir_fs_fstrim_range_t;
+#   define FITRIM       _IOWR('X', 121, auto_tmpdir_fs_fstrim_range_t)
+#else
+typedef struct fstrim_range auto_tmpdir_fs_fstrim_range_t;
+#endif
+
+/*
+ * Trim configuration from the plugin arguments; returns 1 if trim_threshold
+ * is set, 0 if not, -1 on a bad value:
+ */
+typedef struct auto_tmpdir_fs_trim_config {
+    uint64_t            threshold, interval, chunk, minlen;
+} auto_tmpdir_fs_trim_config_t;
+
+static int
+__auto_tmpdir_fs_trim_config(
+    int                             argc,
+    char*                           argv[],
+    auto_tmpdir_fs_trim_config_t    *config
+)
+{
+    int                             i = 0, is_enabled = 0;
+
+    config->threshold = 0;
+    config->interval = 60;
+    config->chunk = 1ULL << 30;
+    config->minlen = 0;
+    while ( i < argc ) {
+        if ( strncmp(argv[i], "trim_threshold=", 15) == 0 ) {
+            if ( __auto_tmpdir_fs_parse_size(argv[i] + 15, &config->threshold) != 0 ) {
+                slurm_error("auto_tmpdir::__auto_tmpdir_fs_trim_config: invalid trim_threshold in plugstack configuration (%s)", argv[i] + 15);
+                return -1;
+            }
+            is_enabled = (config->threshold > 0);
+        }
+        else if ( strncmp(argv[i], "trim_interval=", 14) == 0 ) {
+            if ( __auto_tmpdir_fs_parse_count(argv[i] + 14, &config->interval) != 0 ) {
+                slurm_error("auto_tmpdir::__auto_tmpdir_fs_trim_config: invalid trim_interval in plugstack configuration (%s)", argv[i] + 14);
+                return -1;
+            }
+        }
+        else if ( strncmp(argv[i], "trim_chunk=", 11) == 0 ) {
+            if ( (__auto_tmpdir_fs_parse_size(argv[i] + 11, &config->chunk) != 0) || (config->chunk == 0) ) {
+                slurm_error("auto_tmpdir::__auto_tmpdir_fs_trim_config: invalid trim_chunk in plugstack configuration (%s)", argv[i] + 11);
+                return -1;
+            }
+        }
+        else if ( strncmp(argv[i], "trim_minlen=", 12) == 0 ) {
+            if ( __auto_tmpdir_fs_parse_size(argv[i] + 12, &config->minlen) != 0 ) {
+                slurm_error("auto_tmpdir::__auto_tmpdir_fs_trim_config: invalid trim_minlen in plugstack configuration (%s)", argv[i] + 12);
+                return -1;
+            }
+        }
+        i++;
+    }
+    return is_enabled;
+}
+
+/*
+ * Path of one of the node-wide trim files in state_dir:
+ */
+static int
+__auto_tmpdir_fs_trim_path(
+    int                 argc,
+    char*               argv[],
+    const char          *name,
+    char                *path,
+    size_t              path_len
+)
+{
+    const char          *state_dir = __auto_tmpdir_fs_state_dir(argc, argv);
+
+    if ( ! state_dir ) return -1;
+    if ( snprintf(path, path_len, "%s/%s", state_dir, name) >= path_len ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_fs_trim_path: state_dir path too long (%s)", state_dir);
+        return -1;
+    }
+    return 0;
+}
+
+/**/
+
+int
+auto_tmpdir_fs_trim_prolog_enter(
+    int                             argc,
+    char*                           argv[]
+)
+{
+    auto_tmpdir_fs_trim_config_t    config;
+    char                            lock_path[PATH_MAX];
+    int                             fd;
+
+    if ( __auto_tmpdir_fs_trim_config(argc, argv, &config) <= 0 ) return -1;
+    if ( __auto_tmpdir_fs_trim_path(argc, argv, "auto_tmpdir_prolog.lock", lock_path, sizeof(lock_path)) != 0 ) return -1;
+    if ( (fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0 ) {
+        slurm_debug("auto_tmpdir::auto_tmpdir_fs_trim_prolog_enter: unable to open `%s` (%m)", lock_path);
+        return -1;
+    }
+    if ( flock(fd, LOCK_SH) != 0 ) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void
+auto_tmpdir_fs_trim_prolog_exit(
+    int                 fd
+)
+{
+    if ( fd >= 0 ) close(fd);
+}
+
+/**/
+
+/*
+ * Returns non-zero if any prolog on the node holds the prolog lock:
+ */
+static int
+__auto_tmpdir_fs_trim_prolog_running(
+    const char          *lock_path
+)
+{
+    int                 fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    int                 is_running = 1;
+
+    if ( fd >= 0 ) {
+        if ( flock(fd, LOCK_EX | LOCK_NB) == 0 ) is_running = 0;
+        close(fd);
+    }
+    return is_running;
+}
+
+/*
+ * Discard the free blocks of the filesystem holding path, chunk bytes at a
+ * time.  Between chunks the trim waits for any prolog to finish so that
+ * the discards do not compete with job setup.
+ */
+static void
+__auto_tmpdir_fs_trim_run(
+    const char                      *path,
+    const char                      *lock_path,
+    auto_tmpdir_fs_trim_config_t    *config
+)
+{
+    struct statvfs                  fsinfo;
+    uint64_t                        fs_bytes, offset = 0, trimmed = 0;
+    struct timespec                 start, end;
+    int                             fd;
+
+    if ( (fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0 ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_fs_trim_run: unable to open `%s` (%m)", path);
+        return;
+    }
+    if ( fstatvfs(fd, &fsinfo) != 0 ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_fs_trim_run: unable to statvfs `%s` (%m)", path);
+        close(fd);
+        return;
+    }
+    fs_bytes = (uint64_t)fsinfo.f_blocks * fsinfo.f_frsize;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while ( offset < fs_bytes ) {
+        auto_tmpdir_fs_fstrim_range_t   range;
+
+        while ( __auto_tmpdir_fs_trim_prolog_running(lock_path) ) sleep(1);
+        range.start = offset;
+        range.len = config->chunk;
+        range.minlen = config->minlen;
+        if ( ioctl(fd, FITRIM, &range) != 0 ) {
+            if ( (errno == EOPNOTSUPP) || (errno == ENOTTY) ) {
+                slurm_info("auto_tmpdir::__auto_tmpdir_fs_trim_run: filesystem holding `%s` does not support FITRIM", path);
+            } else {
+                slurm_error("auto_tmpdir::__auto_tmpdir_fs_trim_run: FITRIM on `%s` failed at offset %llu (%m)", path, (unsigned long long)offset);
+            }
+            break;
+        }
+        trimmed += range.len;
+        offset += config->chunk;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    close(fd);
+    slurm_info("auto_tmpdir::__auto_tmpdir_fs_trim_run: discarded %llu bytes on the filesystem holding `%s` in %.3f s",
+            (unsigned long long)trimmed, path, (end.tv_sec - start.tv_sec) + 1e-9 * (end.tv_nsec - start.tv_nsec));
+}
+
+/**/
+
+int
+auto_tmpdir_fs_trim(
+    int                             argc,
+    char*                           argv[]
+)
+{
+    auto_tmpdir_fs_trim_config_t    config;
+    const char                      *local_prefix, *shared_prefix;
+    char                            prefix_dir[PATH_MAX], ledger_path[PATH_MAX], lock_path[PATH_MAX];
+    unsigned long long              ledger_dev = 0, ledger_freed = 0;
+    long long                       ledger_last_trim = 0;
+    uint64_t                        freed = 0;
+    struct stat                     finfo;
+    struct statvfs                  fsinfo;
+    time_t                          now = time(NULL);
+    int                             fd, i, should_trim = 0;
+    FILE                            *fptr;
+    pid_t                           child_pid;
+
+    if ( __auto_tmpdir_fs_trim_config(argc, argv, &config) <= 0 ) return 0;
+    __auto_tmpdir_fs_prefixes(argc, argv, &local_prefix, &shared_prefix);
+    if ( ! local_prefix ) return 0;
+    if ( (__auto_tmpdir_fs_prefix_statvfs(local_prefix, prefix_dir, sizeof(prefix_dir), &fsinfo) != 0) || (stat(prefix_dir, &finfo) != 0) ) return 0;
+
+    /* Only removals from the local prefix's filesystem count: */
+    for ( i = 0; i < auto_tmpdir_fs_freed_count; i++ ) {
+        if ( auto_tmpdir_fs_freed[i].dev == finfo.st_dev ) {
+            freed = auto_tmpdir_fs_freed[i].bytes;
+            auto_tmpdir_fs_freed[i].bytes = 0;
+        }
+    }
+
+    if ( (__auto_tmpdir_fs_trim_path(argc, argv, "auto_tmpdir_trim.ledger", ledger_path, sizeof(ledger_path)) != 0)
+            || (__auto_tmpdir_fs_trim_path(argc, argv, "auto_tmpdir_prolog.lock", lock_path, sizeof(lock_path)) != 0) ) return -1;
+    if ( (fd = open(ledger_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0 ) {
+        slurm_error("auto_tmpdir::auto_tmpdir_fs_trim: unable to open `%s` (%m)", ledger_path);
+        return -1;
+    }
+    if ( flock(fd, LOCK_EX) != 0 ) {
+        slurm_error("auto_tmpdir::auto_tmpdir_fs_trim: unable to lock `%s` (%m)", ledger_path);
+        close(fd);
+        return -1;
     }
-    return rc;
-}
 
-#define AUTO_TMPDIR_FS_UNSERIALIZE(FIELD) \
-            in_bytes += read(state_file_fd, (void*)&(FIELD), sizeof(FIELD)); expect_bytes += sizeof(FIELD); \
-            if ( in_bytes != expect_bytes ) { \
-                slurm_error("auto_tmpdir::auto_tmpdir_fs_init_with_file: failed to read %s from `%s` (errno = %d)", #FIELD, filepath, errno); \
-                rc = 1; goto early_exit; \
-            }
-#define AUTO_TMPDIR_FS_UNSERIALIZE_CSTR(FIELD) \
-            in_bytes += read(state_file_fd, (void*)&size_bytes, sizeof(size_bytes)); expect_bytes += sizeof(size_bytes); \
-            if ( in_bytes != expect_bytes ) { \
-                slurm_error("auto_tmpdir::auto_tmpdir_fs_init_with_file: failed to read %s string length from `%s` (errno = %d)", #FIELD, filepath, errno); \
-                rc = 1; goto early_exit; \
-            } \
-            if ( size_bytes ) { \
-                FIELD = malloc(size_bytes + 1); \
-                if ( ! FIELD ) { \
-                    slurm_error("auto_tmpdir::auto_tmpdir_fs_init_with_file: failed to allocate %s string (errno = %d)", #FIELD, errno); \
-                    rc = 1; goto early_exit; \
-                } \
-                in_bytes += read(state_file_fd, (void*)FIELD, size_bytes); expect_bytes += size_bytes; \
-                if ( in_bytes != expect_bytes ) { \
-                    slurm_error("auto_tmpdir::auto_tmpdir_fs_serialize_to_file: failed to write %s string to `%s` (errno = %d)", #FIELD, filepath, errno); \
-                    rc = 1; goto early_exit; \
-                } \
-                ((char*)FIELD)[size_bytes] = '\0'; \
-            } else { \
-                FIELD = NULL; \
+    /* The ledger is "<dev> <bytes freed since last trim> <time of last trim>": */
+    if ( (fptr = fdopen(dup(fd), "r+")) ) {
+        if ( (fscanf(fptr, "%llu %llu %lld", &ledger_dev, &ledger_freed, &ledger_last_trim) != 3) || (ledger_dev != (unsigned long long)finfo.st_dev) ) {
+            ledger_dev = finfo.st_dev;
+            ledger_freed = 0;
+            ledger_last_trim = 0;
+        }
+        ledger_freed += freed;
+        if ( (ledger_freed >= config.threshold) && (now - ledger_last_trim >= (long long)config.interval * 60) ) {
+            if ( __auto_tmpdir_fs_trim_prolog_running(lock_path) ) {
+                slurm_debug("auto_tmpdir::auto_tmpdir_fs_trim: %llu bytes freed on `%s`, trim deferred while a prolog runs", ledger_freed, prefix_dir);
+            } else {
+                should_trim = 1;
+                ledger_freed = 0;
+                ledger_last_trim = now;
             }
+        }
+        rewind(fptr);
+        if ( ftruncate(fileno(fptr), 0) == 0 ) fprintf(fptr, "%llu %llu %lld\n", ledger_dev, ledger_freed, ledger_last_trim);
+        if ( fclose(fptr) != 0 ) slurm_error("auto_tmpdir::auto_tmpdir_fs_trim: unable to write `%s`", ledger_path);
+    }
+    close(fd);
+    if ( ! should_trim ) return 0;
 
+    /*
+     * The trim runs detached so that the epilog isn't held up by it:
+     */
+    slurm_info("auto_tmpdir::auto_tmpdir_fs_trim: starting trim of the filesystem holding `%s`", prefix_dir);
+    child_pid = fork();
+    if ( child_pid < 0 ) {
+        slurm_error("auto_tmpdir::auto_tmpdir_fs_trim: unable to fork (%m)");
+        return -1;
+    }
+    if ( child_pid == 0 ) {
+        setsid();
+        if ( fork() != 0 ) _exit(0);
+        __auto_tmpdir_fs_detach(-1);
+        if ( chdir("/") != 0 ) _exit(1);
+        __auto_tmpdir_fs_trim_run(prefix_dir, lock_path, &config);
+        _exit(0);
+    }
+    waitpid(child_pid, NULL, 0);
+    return 0;
+}
 
-auto_tmpdir_fs_ref
-auto_tmpdir_fs_init_with_file(
-    spank_t                     spank_ctxt,
+/**/
+
+/*
+ * Bring the pool to its configured size:  drop records left from before the
+ * node booted, remove pooled devices that are surplus or no longer match the
+ * configuration, and format new devices until the pool is full.  Only one
+ * refill runs at a time.
+ */
+static void
+__auto_tmpdir_fs_zram_pool_run(
+    auto_tmpdir_fs_zram_pool_t  *pool
+)
+{
+    char                        boot_id[64], algorithm[64], path[PATH_MAX];
+    unsigned long long          disk_size;
+    unsigned int                n_ready = 0, n_added = 0;
+    int                         device, lock_fd;
+    DIR                         *dir;
+    struct dirent               *dent;
+
+    if ( (mkdir(pool->dir, S_IRWXU) != 0) && (errno != EEXIST) ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_fs_zram_pool_run: unable to create `%s` (%m)", pool->dir);
+        return;
+    }
+    if ( snprintf(path, sizeof(path), "%s/.lock", pool->dir) >= sizeof(path) ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_fs_zram_pool_run: pool directory path too long (%s)", pool->dir);
+        return;
+    }
+    if ( (lock_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0 ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_fs_zram_pool_run: unable to open `%s` (%m)", path);
+        return;
+    }
+    if ( (flock(lock_fd, LOCK_EX | LOCK_NB) != 0) || (__auto_tmpdir_fs_boot_id(boot_id, sizeof(boot_id)) != 0) || ! (dir = opendir(pool->dir)) ) {
+        close(lock_fd);
+        return;
+    }
+    while ( (dent = readdir(dir)) ) {
+        if ( strncmp(dent->d_name, "zram", 4) != 0 ) continue;
+        if ( snprintf(path, sizeof(path), "%s/%s", pool->dir, dent->d_name) >= sizeof(path) ) continue;
+        if ( __auto_tmpdir_fs_zram_pool_read(pool, dent->d_name, boot_id, &device, &disk_size, algorithm) != 0 ) {
+            /* From before a reboot, the device number is no longer ours: */
+            unlink(path);
+        }
+        else if ( (n_ready < pool->size) && (disk_size == pool->config.disk_size)
+                    && (! pool->config.algorithm || (strcmp(algorithm, pool->config.algorithm) == 0)) ) {
+            n_ready++;
+        }
+        else if ( unlink(path) == 0 ) {
+            __auto_tmpdir_fs_zram_remove(device);
+        }
+    }
+    closedir(dir);
+    while ( n_ready < pool->size ) {
+        if ( (device = __auto_tmpdir_fs_zram_create(&pool->config)) < 0 ) break;
+        if ( __auto_tmpdir_fs_zram_pool_add(pool, device) != 0 ) {
+            __auto_tmpdir_fs_zram_remove(device);
+            break;
+        }
+        n_ready++;
+        n_added++;
+    }
+    if ( n_added ) slurm_info("auto_tmpdir::__auto_tmpdir_fs_zram_pool_run: formatted %u zram devices, %u of %u in the pool", n_added, n_ready, pool->size);
+
+    /* With the pool no longer configured, nothing is left to look at next time: */
+    if ( ! pool->size ) {
+        if ( snprintf(path, sizeof(path), "%s/.lock", pool->dir) < sizeof(path) ) unlink(path);
+        rmdir(pool->dir);
+    }
+    close(lock_fd);
+}
+
+int
+auto_tmpdir_fs_zram_pool_refill(
     int                         argc,
-    char*                       argv[],
-    auto_tmpdir_fs_options_t    options,
-    const char                  *filepath,
-    int                         remove_state_file
+    char*                       argv[]
 )
 {
-    auto_tmpdir_fs              *new_fs = NULL;
-    int                         state_file_fd, rc = 0;
-    
-    if ( ! filepath ) {
-        filepath = __auto_tmpdir_fs_default_state_file(spank_ctxt, argc, argv);
-        if ( ! filepath ) {
-            slurm_error("auto_tmpdir::auto_tmpdir_fs_init_with_file: unable to get default state file path");
-            return NULL;
+    auto_tmpdir_fs_zram_pool_t  pool;
+    struct stat                 finfo;
+    pid_t                       child_pid;
+
+    if ( __auto_tmpdir_fs_zram_pool_config(argc, argv, &pool) < 0 ) return -1;
+
+    /* A pool left behind by an earlier configuration is emptied, too: */
+    if ( ! pool.size && (stat(pool.dir, &finfo) != 0) ) return 0;
+    if ( pool.size && (__auto_tmpdir_fs_zram_pool_count(&pool) == pool.size) ) return 0;
+
+    /*
+     * Formatting runs detached so that the prolog or epilog isn't held up by it:
+     */
+    child_pid = fork();
+    if ( child_pid < 0 ) {
+        slurm_error("auto_tmpdir::auto_tmpdir_fs_zram_pool_refill: unable to fork (%m)");
+        return -1;
+    }
+    if ( child_pid == 0 ) {
+        setsid();
+        if ( fork() != 0 ) _exit(0);
+
+        /* Don't hold on to locks inherited from the caller (e.g. the prolog lock): */
+        __auto_tmpdir_fs_detach(-1);
+        if ( chdir("/") != 0 ) _exit(1);
+        auto_tmpdir_fs_set_idle_priority();
+        __auto_tmpdir_fs_zram_pool_run(&pool);
+        _exit(0);
+    }
+    waitpid(child_pid, NULL, 0);
+    return 0;
+}
+
+/**/
+
+/*
+ * A state file's zram device number may have been reused by another job
+ * since the node rebooted; only trust it if the device is still mounted on
+ * the bindpoint:
+ */
+static void
+__auto_tmpdir_fs_sweep_check_zram(
+    auto_tmpdir_fs_bindpoint_t  *bindpoint
+)
+{
+    char                        sysfs_path[64], value[32];
+    unsigned int                dev_major, dev_minor;
+    struct stat                 finfo;
+
+    while ( bindpoint ) {
+        if ( bindpoint->backend == auto_tmpdir_fs_backend_zram ) {
+            int                 is_ours = 0;
+
+            snprintf(sysfs_path, sizeof(sysfs_path), "/sys/block/zram%d/dev", bindpoint->device);
+            if ( (bindpoint->device >= 0) && (__auto_tmpdir_fs_sysfs_read(sysfs_path, value, sizeof(value)) == 0)
+                    && (sscanf(value, "%u:%u", &dev_major, &dev_minor) == 2)
+                    && (stat(bindpoint->bind_this_path, &finfo) == 0)
+                    && (major(finfo.st_dev) == dev_major) && (minor(finfo.st_dev) == dev_minor) ) is_ours = 1;
+            if ( ! is_ours ) {
+                bindpoint->backend = auto_tmpdir_fs_backend_dir;
+                bindpoint->device = -1;
+            }
         }
+        bindpoint = bindpoint->link;
     }
-    
-    /* Attempt to open the file: */
-    state_file_fd = open(filepath, O_RDONLY);
-    if ( state_file_fd >= 0 ) {
-        ssize_t     in_bytes = 0, expect_bytes = 0;
-        size_t      size_bytes = 0;
-        
-        new_fs = calloc(1, sizeof(auto_tmpdir_fs));
-        if ( new_fs ) {
-            /* Read the header: */
-            AUTO_TMPDIR_FS_UNSERIALIZE(new_fs->options);
-            AUTO_TMPDIR_FS_UNSERIALIZE_CSTR(new_fs->tmpdir);
-            AUTO_TMPDIR_FS_UNSERIALIZE_CSTR(new_fs->base_dir);
-            AUTO_TMPDIR_FS_UNSERIALIZE_CSTR(new_fs->base_dir_parent);
-            
-            while ( 1 ) {
-                int         is_bind_mounted;
-                ssize_t     initial_in_bytes;
-                
-                /* Try to read an int to see if we have a record present: */
-                initial_in_bytes = read(state_file_fd, &is_bind_mounted, sizeof(is_bind_mounted));
-                if ( initial_in_bytes == 0 ) break;
-                in_bytes += initial_in_bytes; expect_bytes += sizeof(is_bind_mounted);
-                
-                /* Allocate a node: */
-                auto_tmpdir_fs_bindpoint_t  *bindpoint_node = calloc(1, sizeof(auto_tmpdir_fs_bindpoint_t));
-                if ( ! bindpoint_node ) {
-                    slurm_error("auto_tmpdir::auto_tmpdir_fs_init_with_file: failed to allocate auto_tmpdir_fs bindpoint node");
-                    rc = 1; goto early_exit;
+}
+
+/*
+ * Remove the bare <prefix><job-id> directories (no state file left to
+ * describe them) under a prefix whose jobs are no longer active.  With
+ * per_host, only this node's <prefix><job-id>/<hostname> is removed, and
+ * then the job directory if that left it empty.
+ */
+static int
+__auto_tmpdir_fs_sweep_prefix(
+    const char                      *prefix,
+    const char                      *state_dir,
+    int                             per_host,
+    time_t                          not_after,
+    auto_tmpdir_fs_job_is_active_f  is_active,
+    void                            *context
+)
+{
+    char                            prefix_dir[PATH_MAX];
+    const char                      *prefix_base = strrchr(prefix, '/') + 1;
+    size_t                          prefix_base_len = strlen(prefix_base);
+    DIR                             *dir;
+    struct dirent                   *dent;
+    int                             n_swept = 0;
+
+    snprintf(prefix_dir, sizeof(prefix_dir), "%.*s", (int)(prefix_base - prefix), prefix);
+    if ( ! (dir = opendir(prefix_dir)) ) return 0;
+    while ( (dent = readdir(dir)) ) {
+        char                        path[PATH_MAX];
+        unsigned int                job_id;
+        int                         name_len = 0;
+        struct stat                 finfo;
+
+        if ( strncmp(dent->d_name, prefix_base, prefix_base_len) ) continue;
+        if ( ! isdigit(dent->d_name[prefix_base_len]) ) continue;
+        if ( (sscanf(dent->d_name + prefix_base_len, "%u%n", &job_id, &name_len) != 1) || dent->d_name[prefix_base_len + name_len] ) continue;
+        if ( snprintf(path, sizeof(path), "%s%s", prefix_dir, dent->d_name) >= sizeof(path) ) continue;
+        if ( (lstat(path, &finfo) != 0) || ! S_ISDIR(finfo.st_mode) || (finfo.st_mtime >= not_after) ) continue;
+
+        /* Retained hierarchies belong to the reaper, kept ones to the administrator: */
+        if ( state_dir ) {
+            char                    record_path[PATH_MAX];
+
+            snprintf(record_path, sizeof(record_path), "%s/auto_tmpdir_fs-%u.retained", state_dir, job_id);
+            if ( access(record_path, F_OK) == 0 ) continue;
+            snprintf(record_path, sizeof(record_path), "%s/auto_tmpdir_fs-%u.kept", state_dir, job_id);
+            if ( access(record_path, F_OK) == 0 ) continue;
+        }
+        if ( is_active(job_id, context) ) continue;
+
+        if ( per_host ) {
+            const char              *host_path = __auto_tmpdir_fs_path_create(prefix, auto_tmpdir_fs_options_should_use_per_host, job_id);
+
+            if ( host_path ) {
+                if ( lstat(host_path, &finfo) == 0 ) {
+                    slurm_info("auto_tmpdir::auto_tmpdir_fs_sweep_orphans: removing orphaned directory `%s` of job %u", host_path, job_id);
+                    auto_tmpdir_rmdir_recurse(host_path, 0);
+                    n_swept++;
                 }
-                
-                /* Read the rest of the fields: */
-                bindpoint_node->is_bind_mounted = is_bind_mounted;
-                AUTO_TMPDIR_FS_UNSERIALIZE(bindpoint_node->should_always_remove);
-                AUTO_TMPDIR_FS_UNSERIALIZE_CSTR(bindpoint_node->bind_this_path);
-                AUTO_TMPDIR_FS_UNSERIALIZE_CSTR(bindpoint_node->to_this_path);
-                bindpoint_node->link = bindpoint_node->back_link = NULL;
-                
-                if ( ! new_fs->bind_mounts_tail ) new_fs->bind_mounts_tail = bindpoint_node;
-                if ( new_fs->bind_mounts ) new_fs->bind_mounts->back_link = bindpoint_node;
-                bindpoint_node->link = new_fs->bind_mounts;
-                new_fs->bind_mounts = bindpoint_node;
+                free((void*)host_path);
             }
-            
+            rmdir(path);
         } else {
-            slurm_error("auto_tmpdir::auto_tmpdir_fs_init_with_file: failed to allocate auto_tmpdir_fs");
-            goto early_exit;
+            slurm_info("auto_tmpdir::auto_tmpdir_fs_sweep_orphans: removing orphaned directory `%s` of job %u", path, job_id);
+            auto_tmpdir_rmdir_recurse(path, 0);
+            n_swept++;
         }
-        
-early_exit:
-        close(state_file_fd);
-        if ( rc ) {
-            /* Dispose of new_fs: */
-            if ( new_fs ) {
-                auto_tmpdir_fs_bindpoint_t  *bindpoint_node = new_fs->bind_mounts;
-                
-                while ( bindpoint_node ) {
-                    auto_tmpdir_fs_bindpoint_t  *next = bindpoint_node->link;
-                    
-                    if ( bindpoint_node->bind_this_path ) free((void*)bindpoint_node->bind_this_path);
-                    if ( bindpoint_node->to_this_path ) free((void*)bindpoint_node->to_this_path);
-                    free((void*)bindpoint_node);
-                    bindpoint_node = next;
-                }
-                if ( new_fs->tmpdir ) free((void*)new_fs->tmpdir);
-                if ( new_fs->base_dir ) free((void*)new_fs->base_dir);
-                if ( new_fs->base_dir_parent ) free((void*)new_fs->base_dir_parent);
-                free((void*)new_fs);
-                new_fs = NULL;
+    }
+    closedir(dir);
+    return n_swept;
+}
+
+int
+auto_tmpdir_fs_job_is_active_in_list(
+    uint32_t                        job_id,
+    void                            *context
+)
+{
+    job_info_msg_t                  *job_info = (job_info_msg_t*)context;
+    uint32_t                        i;
+
+    for ( i = 0; i < job_info->record_count; i++ ) {
+        if ( job_info->job_array[i].job_id == job_id ) {
+            uint32_t                job_state = job_info->job_array[i].job_state;
+            int                     is_active = 0;
+
+            if ( (job_state & (JOB_COMPLETING | JOB_CONFIGURING)) ) is_active = 1;
+            switch ( job_state & JOB_STATE_BASE ) {
+                case JOB_RUNNING:
+                case JOB_SUSPENDED:
+                    is_active = 1;
+                    break;
             }
+            return is_active;
         }
-    } else {
-        slurm_error("auto_tmpdir::auto_tmpdir_fs_init_with_file: unable to open state file `%s` (errno = %d)", filepath, errno);
     }
-    
-    if ( remove_state_file && filepath ) {
-        unlink(filepath);
+    return 0;
+}
+
+int
+auto_tmpdir_fs_sweep_orphans(
+    int                             argc,
+    char*                           argv[],
+    auto_tmpdir_fs_job_is_active_f  is_active,
+    void                            *context
+)
+{
+    const char                      *local_prefix, *shared_prefix;
+    const char                      *state_dir = __auto_tmpdir_fs_state_dir(argc, argv);
+    const char                      *cache_mount = NULL, *cache_prefix = auto_tmpdir_fs_default_cache_prefix;
+    uint64_t                        grace_minutes = 60;
+    time_t                          now = time(NULL);
+    int                             should_sweep_shared = 0, n_swept = 0, i = 0;
+    DIR                             *dir;
+    struct dirent                   *dent;
+
+    while ( i < argc ) {
+        if ( strncmp(argv[i], "sweep_grace=", 12) == 0 ) {
+            if ( __auto_tmpdir_fs_parse_count(argv[i] + 12, &grace_minutes) != 0 ) {
+                slurm_error("auto_tmpdir::auto_tmpdir_fs_sweep_orphans: invalid sweep_grace in plugstack configuration (%s)", argv[i] + 12);
+                return -1;
+            }
+        }
+        else if ( strcmp(argv[i], "sweep_shared") == 0 ) {
+            should_sweep_shared = 1;
+        }
+        else if ( strncmp(argv[i], "cache_mount=", 12) == 0 ) {
+            cache_mount = argv[i] + 12;
+        }
+        else if ( strncmp(argv[i], "cache_prefix=", 13) == 0 ) {
+            cache_prefix = argv[i] + 13;
+        }
+        i++;
+    }
+    __auto_tmpdir_fs_prefixes(argc, argv, &local_prefix, &shared_prefix);
+
+    /* Release caches still marked in use by jobs whose epilog never ran: */
+    if ( cache_mount && (*cache_prefix == '/') ) __auto_tmpdir_fs_cache_sweep_jobs(cache_prefix, is_active, context);
+
+    /*
+     * Hierarchies with a state file are reconstructed and torn down the same
+     * way the epilog would have:
+     */
+    if ( state_dir && (dir = opendir(state_dir)) ) {
+        while ( (dent = readdir(dir)) ) {
+            unsigned int            job_id;
+            int                     name_len = 0, is_partial;
+            size_t                  suffix_len;
+            char                    path[PATH_MAX];
+            struct stat             finfo;
+            auto_tmpdir_fs_ref      orphan_fs;
+
+            if ( (sscanf(dent->d_name, "auto_tmpdir_fs-%u.%n", &job_id, &name_len) != 1) || (name_len == 0) ) continue;
+
+            /* A state file left half-written (<name>.tmp) by a writer that died before renaming it: */
+            suffix_len = strlen(dent->d_name + name_len);
+            is_partial = (suffix_len > 4) && (strcmp(dent->d_name + name_len + suffix_len - 4, ".tmp") == 0);
+            if ( ! is_partial && strcmp(dent->d_name + name_len, "cache") && strcmp(dent->d_name + name_len, "reserve") && strcmp(dent->d_name + name_len, "failed")
+                    && strcmp(dent->d_name + name_len, "ipc") && strcmp(dent->d_name + name_len, "iostat")
+                    && strcmp(dent->d_name + name_len, "outbox") && strcmp(dent->d_name + name_len, "kept")
+                    && strcmp(dent->d_name + name_len, "async") ) continue;
+            if ( snprintf(path, sizeof(path), "%s/%s", state_dir, dent->d_name) >= sizeof(path) ) continue;
+            if ( (stat(path, &finfo) != 0) || (finfo.st_mtime >= now) ) continue;
+            if ( is_active(job_id, context) ) continue;
+
+            if ( strcmp(dent->d_name + name_len, "ipc") == 0 ) {
+                __auto_tmpdir_fs_ipc_namespace_unpin(path);
+                continue;
+            }
+            if ( strcmp(dent->d_name + name_len, "kept") == 0 ) {
+                if ( ! __auto_tmpdir_fs_kept_is_present(argc, argv, path) ) unlink(path);
+                continue;
+            }
+            if ( strcmp(dent->d_name + name_len, "cache") != 0 ) {
+                unlink(path);
+                continue;
+            }
+            slurm_info("auto_tmpdir::auto_tmpdir_fs_sweep_orphans: removing orphaned hierarchy of job %u", job_id);
+            if ( (orphan_fs = auto_tmpdir_fs_init_with_file(NULL, argc, argv, 0, path, 1)) ) {
+                orphan_fs->handoff_minutes = 0;
+                __auto_tmpdir_fs_sweep_check_zram(orphan_fs->bind_mounts);
+                auto_tmpdir_fs_fini(orphan_fs, 0);
+            } else {
+                unlink(path);
+            }
+            n_swept++;
+        }
+        closedir(dir);
+    }
+
+    /*
+     * Anything left had no state file (e.g. the prolog died before writing
+     * it); only remove it once it has sat untouched for the grace period:
+     */
+    now -= 60 * grace_minutes;
+    if ( local_prefix ) n_swept += __auto_tmpdir_fs_sweep_prefix(local_prefix, state_dir, 0, now, is_active, context);
+    for ( i = 0; i < argc; i++ ) {
+        const char                  *policy_prefix;
+        char                        prefix[PATH_MAX];
+
+        /* Local prefixes chosen by policy rules, too: */
+        if ( (strncmp(argv[i], "policy=", 7) != 0) || ! (policy_prefix = strstr(argv[i], "local_prefix=")) ) continue;
+        if ( (policy_prefix[-1] != ':') && (policy_prefix[-1] != ',') ) continue;
+        policy_prefix += 13;
+        if ( (*policy_prefix != '/') || (strcspn(policy_prefix, ",") >= sizeof(prefix)) ) continue;
+        snprintf(prefix, sizeof(prefix), "%.*s", (int)strcspn(policy_prefix, ","), policy_prefix);
+        if ( ! local_prefix || strcmp(prefix, local_prefix) ) n_swept += __auto_tmpdir_fs_sweep_prefix(prefix, state_dir, 0, now, is_active, context);
+    }
+    if ( auto_tmpdir_fs_dev_shm_prefix && (*auto_tmpdir_fs_dev_shm_prefix == '/') ) {
+        n_swept += __auto_tmpdir_fs_sweep_prefix(auto_tmpdir_fs_dev_shm_prefix, NULL, 0, now, is_active, context);
+    }
+    if ( should_sweep_shared && shared_prefix ) {
+        n_swept += __auto_tmpdir_fs_sweep_prefix(shared_prefix, state_dir, 1, now, is_active, context);
+    }
+    return n_swept;
+}
+
+/**/
+
+#define AUTO_TMPDIR_FS_IOPRIO_WHO_PROCESS   1
+#define AUTO_TMPDIR_FS_IOPRIO_CLASS_IDLE    3
+#define AUTO_TMPDIR_FS_IOPRIO_CLASS_SHIFT   13
+
+void
+auto_tmpdir_fs_set_idle_priority(void)
+{
+    if ( syscall(SYS_ioprio_set, AUTO_TMPDIR_FS_IOPRIO_WHO_PROCESS, 0, AUTO_TMPDIR_FS_IOPRIO_CLASS_IDLE << AUTO_TMPDIR_FS_IOPRIO_CLASS_SHIFT) != 0 ) {
+        slurm_debug("auto_tmpdir::auto_tmpdir_fs_set_idle_priority: unable to set idle I/O priority (%m)");
+    }
+    if ( setpriority(PRIO_PROCESS, 0, 19) != 0 ) {
+        slurm_debug("auto_tmpdir::auto_tmpdir_fs_set_idle_priority: unable to set nice value (%m)");
+    }
+}
+
+/**/
+
+/*
+ * slurmd and slurmstepd log to a file opened for appending; a detached
+ * process has to keep that descriptor or its slurm_*() messages go nowhere:
+ */
+static int
+__auto_tmpdir_fs_is_log_fd(
+    int                 fd
+)
+{
+    int                 flags = fcntl(fd, F_GETFL);
+    struct stat         finfo;
+
+    if ( (flags < 0) || ! (flags & O_APPEND) || ((flags & O_ACCMODE) == O_RDONLY) ) return 0;
+    return (fstat(fd, &finfo) == 0) && S_ISREG(finfo.st_mode);
+}
+
+/*
+ * Cut a forked background process loose from its parent's descriptors:
+ * stdin and stdout go to /dev/null, and everything else is closed so that no
+ * lock (e.g. the prolog lock), socket, or pipe the parent holds is kept alive
+ * by the child.  keep_fd and log files (stderr included) are left open.
+ */
+void
+__auto_tmpdir_fs_detach(
+    int                 keep_fd
+)
+{
+    DIR                 *dir;
+    struct dirent       *dent;
+    int                 null_fd = open("/dev/null", O_RDWR);
+
+    if ( null_fd >= 0 ) {
+        dup2(null_fd, STDIN_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        if ( ! __auto_tmpdir_fs_is_log_fd(STDERR_FILENO) ) dup2(null_fd, STDERR_FILENO);
+        if ( null_fd > STDERR_FILENO ) close(null_fd);
+    }
+    if ( (dir = opendir("/proc/self/fd")) ) {
+        while ( (dent = readdir(dir)) ) {
+            int         fd = atoi(dent->d_name);
+
+            if ( (fd > STDERR_FILENO) && (fd != keep_fd) && (fd != dirfd(dir)) && ! __auto_tmpdir_fs_is_log_fd(fd) ) close(fd);
+        }
+        closedir(dir);
     }
-    
-    return new_fs;
 }
@@ -9,6 +9,7 @@
 #define __AUTO_TMPDIR_FS_UTILS_H__
 
 #include "auto_tmpdir_config.h"
+#include "metrics.h"
 
 /*
  * @enum auto_tmpdir options
@@ -23,12 +24,19 @@
  *     Do not delete directories we create in the epilog
  * @constant auto_tmpdir_fs_options_should_not_map_dev_shm
  *     Do not create a bind-mounted /dev/shm
+ * @constant auto_tmpdir_fs_options_should_use_per_step
+ *     Give each job step its own subdirectory in each bindpoint, removed
+ *     when the step exits
+ * @constant auto_tmpdir_fs_options_should_use_per_task
+ *     Give each task its own subdirectory of TMPDIR
  */
 enum {
     auto_tmpdir_fs_options_should_use_per_host      = 1 << 0,
     auto_tmpdir_fs_options_should_use_shared        = 1 << 1,
     auto_tmpdir_fs_options_should_not_delete        = 1 << 2,
-    auto_tmpdir_fs_options_should_not_map_dev_shm   = 1 << 3
+    auto_tmpdir_fs_options_should_not_map_dev_shm   = 1 << 3,
+    auto_tmpdir_fs_options_should_use_per_step      = 1 << 4,
+    auto_tmpdir_fs_options_should_use_per_task      = 1 << 5
 };
 /*
  * @typedef auto_tmpdir_fs_options_t
@@ -54,6 +62,34 @@ typedef struct auto_tmpdir_fs * auto_tmpdir_fs_ref;
  */
 auto_tmpdir_fs_ref auto_tmpdir_fs_init(spank_t spank_ctxt, int argc, char* argv[], auto_tmpdir_fs_options_t options);
 
+/*
+ * @typedef auto_tmpdir_fs_job_attrs_t
+ *
+ * The properties of a job that policy rules are matched against.  Strings
+ * may be NULL if unknown; mem_mb and tmp_mb are per node.  node_cpus is the
+ * number of CPUs allocated to the job on this node (0 if unknown).
+ */
+typedef struct auto_tmpdir_fs_job_attrs {
+    const char          *partition, *qos, *account;
+    uint32_t            n_nodes, n_cpus, node_cpus;
+    uint64_t            mem_mb, tmp_mb;
+} auto_tmpdir_fs_job_attrs_t;
+
+/*
+ * @function auto_tmpdir_fs_policy_select
+ *
+ * Match the job against the policy=<conditions>:<settings> rules in argv, in
+ * order.  For the first rule that matches, policy_argv is set to a new array
+ * holding argv followed by the rule's settings (so they override the plugin's
+ * own values when passed to auto_tmpdir_fs_init()) and policy_name to the
+ * rule's name; release the array with free() once done with both.  If no
+ * rule matches policy_argc and policy_argv are set to argc and argv.
+ *
+ * Returns the 1-based index of the matching rule, 0 if none matched, or -1
+ * if any rule is malformed.
+ */
+int auto_tmpdir_fs_policy_select(int argc, char* argv[], const auto_tmpdir_fs_job_attrs_t *job, int *policy_argc, char ***policy_argv, const char **policy_name);
+
 /*
  * @function auto_tmpdir_fs_bind_mount
  *
@@ -64,6 +100,50 @@ auto_tmpdir_fs_ref auto_tmpdir_fs_init(spank_t spank_ctxt, int argc, char* argv[
  */
 int auto_tmpdir_fs_bind_mount(auto_tmpdir_fs_ref fs_info);
 
+/*
+ * @function auto_tmpdir_fs_create_step_dirs
+ *
+ * If the per_step_tmpdir option is in effect, create a subdirectory for the
+ * current job step (e.g. step-3, step-batch) in each of the job's scratch
+ * bindpoints and direct auto_tmpdir_fs_get_tmpdir() at the one in TMPDIR.
+ *
+ * Returns 0 on success (or if the option is not in effect).  Any errors will
+ * be logged via slurm_error().
+ */
+int auto_tmpdir_fs_create_step_dirs(auto_tmpdir_fs_ref fs_info, spank_t spank_ctxt);
+
+/*
+ * @function auto_tmpdir_fs_remove_step_dirs
+ *
+ * Remove the subdirectories created by auto_tmpdir_fs_create_step_dirs().
+ *
+ * Returns 0 on success.  Any errors will be logged via slurm_error().
+ */
+int auto_tmpdir_fs_remove_step_dirs(auto_tmpdir_fs_ref fs_info);
+
+/*
+ * @function auto_tmpdir_fs_create_task_dirs
+ *
+ * If the per_task_tmpdir option is in effect, create a task-<local-id>
+ * subdirectory of TMPDIR for each of the step's tasks on this node.  All
+ * directories are created up front so that task launch does no filesystem
+ * work of its own.
+ *
+ * Returns 0 on success (or if the option is not in effect).  Any errors will
+ * be logged via slurm_error().
+ */
+int auto_tmpdir_fs_create_task_dirs(auto_tmpdir_fs_ref fs_info, spank_t spank_ctxt);
+
+/*
+ * @function auto_tmpdir_fs_get_task_tmpdir
+ *
+ * Fill-in buffer with the TMPDIR path for the task with the given local id.
+ *
+ * Returns 0 on success, -1 if no per-task directories were created or the
+ * path does not fit in buffer.
+ */
+int auto_tmpdir_fs_get_task_tmpdir(auto_tmpdir_fs_ref fs_info, uint32_t task_id, char *buffer, size_t buffer_len);
+
 /*
  * @function auto_tmpdir_fs_get_tmpdir
  *
@@ -84,6 +164,168 @@ const char* auto_tmpdir_fs_get_tmpdir(auto_tmpdir_fs_ref fs_info);
  */
 int auto_tmpdir_fs_fini(auto_tmpdir_fs_ref fs_info, int should_dealloc_only);
 
+/*
+ * @function auto_tmpdir_fs_set_archive_path
+ *
+ * Request that the hierarchy rooted at the base directory be written to a
+ * zstd-compressed tar file at archive_path by auto_tmpdir_fs_archive().  A
+ * NULL archive_path removes the request.
+ *
+ * Returns 0 on success.  Any errors will be logged via slurm_error().
+ */
+int auto_tmpdir_fs_set_archive_path(auto_tmpdir_fs_ref fs_info, const char *archive_path);
+
+/*
+ * @function auto_tmpdir_fs_archive
+ *
+ * If an archive path was set on fs_info, stream the hierarchy rooted at the
+ * base directory into a zstd-compressed tar file at that path.  The compressor
+ * runs with the job owner's credentials.
+ *
+ * A successful archive clears the should_not_delete option so that
+ * auto_tmpdir_fs_fini() removes the tree; on failure that option is set so the
+ * tree is kept.
+ *
+ * Returns 0 on success (or if no archive was requested).  Any errors will be
+ * logged via slurm_error().
+ */
+int auto_tmpdir_fs_archive(auto_tmpdir_fs_ref fs_info);
+
+/*
+ * @function auto_tmpdir_fs_set_handoff
+ *
+ * Instead of removing a node-local hierarchy, auto_tmpdir_fs_fini() renames it
+ * aside for handoff_minutes so that the job owner's next job on the node can
+ * adopt it as its own base directory.  Unadopted hierarchies are removed once
+ * the window expires.  A handoff_minutes of zero disables the hand-off.
+ */
+void auto_tmpdir_fs_set_handoff(auto_tmpdir_fs_ref fs_info, uint32_t handoff_minutes);
+
+/*
+ * @function auto_tmpdir_fs_set_granted_mb
+ *
+ * Record the scratch size (in MB) granted to the job by the prolog admission
+ * check so that it is carried to the job steps in the state file.
+ */
+void auto_tmpdir_fs_set_granted_mb(auto_tmpdir_fs_ref fs_info, uint64_t granted_mb);
+
+/*
+ * @function auto_tmpdir_fs_get_granted_mb
+ *
+ * Returns the scratch size (in MB) granted to the job, zero if the job was
+ * not subject to admission control or made no request.
+ */
+uint64_t auto_tmpdir_fs_get_granted_mb(auto_tmpdir_fs_ref fs_info);
+
+/*
+ * @function auto_tmpdir_fs_set_job_cpus
+ *
+ * Record the number of CPUs the job was allocated on this node so that it is
+ * carried to the job steps in the state file.
+ */
+void auto_tmpdir_fs_set_job_cpus(auto_tmpdir_fs_ref fs_info, uint32_t job_cpus);
+
+/*
+ * @function auto_tmpdir_fs_get_job_cpus
+ *
+ * Returns the number of CPUs the job was allocated on this node, zero if
+ * unknown.
+ */
+uint32_t auto_tmpdir_fs_get_job_cpus(auto_tmpdir_fs_ref fs_info);
+
+/*
+ * @function auto_tmpdir_fs_set_policy_name
+ *
+ * Record the name of the policy rule chosen for the job in the prolog so
+ * that it is carried to the job steps and epilog in the state file.
+ *
+ * Returns 0 if successful.
+ */
+int auto_tmpdir_fs_set_policy_name(auto_tmpdir_fs_ref fs_info, const char *policy_name);
+
+/*
+ * @function auto_tmpdir_fs_get_policy_name
+ *
+ * Returns the name of the policy rule chosen for the job, NULL if no rule
+ * applied.
+ */
+const char* auto_tmpdir_fs_get_policy_name(auto_tmpdir_fs_ref fs_info);
+
+/*
+ * @function auto_tmpdir_fs_get_job_id
+ *
+ * Returns the id of the job that owns the hierarchy.
+ */
+uint32_t auto_tmpdir_fs_get_job_id(auto_tmpdir_fs_ref fs_info);
+
+/*
+ * @function auto_tmpdir_fs_get_owner
+ *
+ * Returns the uid of the job's owner.
+ */
+uid_t auto_tmpdir_fs_get_owner(auto_tmpdir_fs_ref fs_info);
+
+/*
+ * @function auto_tmpdir_fs_get_group
+ *
+ * Returns the gid of the job's owner (-1 if the plugin does not set group
+ * ownership).
+ */
+gid_t auto_tmpdir_fs_get_group(auto_tmpdir_fs_ref fs_info);
+
+/*
+ * @function auto_tmpdir_fs_set_no_delete
+ *
+ * Keep the hierarchy when auto_tmpdir_fs_fini() is called, as if
+ * --no-rm-tmpdir had been given (e.g. because data in it could not be saved).
+ */
+void auto_tmpdir_fs_set_no_delete(auto_tmpdir_fs_ref fs_info);
+
+/*
+ * @function auto_tmpdir_fs_get_base_dir
+ *
+ * Returns the directory holding the job's bindpoint directories (NULL if the
+ * hierarchy has no bindpoints other than /dev/shm).
+ */
+const char* auto_tmpdir_fs_get_base_dir(auto_tmpdir_fs_ref fs_info);
+
+/*
+ * @function auto_tmpdir_fs_get_state_dir
+ *
+ * Returns the state_dir configured in the plugin arguments (/tmp by
+ * default) or NULL if the configured value is not an absolute path.
+ */
+const char* auto_tmpdir_fs_get_state_dir(int argc, char* argv[]);
+
+/*
+ * @function auto_tmpdir_fs_get_accounting_path
+ *
+ * Returns the path of the node's accounting file if usage accounting is
+ * enabled, NULL otherwise.  Release the path with free().
+ */
+const char* auto_tmpdir_fs_get_accounting_path(int argc, char* argv[]);
+
+/*
+ * @function auto_tmpdir_fs_get_bindpoint
+ *
+ * Fetch the directory and mountpoint of the bindpoint at index in the
+ * hierarchy's list.  Either pointer may be NULL.
+ *
+ * Returns 0 if successful, -1 if index is past the end of the list.
+ */
+int auto_tmpdir_fs_get_bindpoint(auto_tmpdir_fs_ref fs_info, int index, const char **bind_this_path, const char **to_this_path);
+
+/*
+ * @function auto_tmpdir_fs_get_tmpdir_bindpoint
+ *
+ * Fetch the directory and mountpoint of the bindpoint the job's TMPDIR is
+ * mounted from (ignoring any per-step or per-task subdirectory).  Either
+ * pointer may be NULL.
+ *
+ * Returns 0 if successful, -1 if TMPDIR is not one of the bindpoints.
+ */
+int auto_tmpdir_fs_get_tmpdir_bindpoint(auto_tmpdir_fs_ref fs_info, const char **bind_this_path, const char **to_this_path);
+
 /*
  * @function auto_tmpdir_fs_serialize_to_file
  *
@@ -108,6 +350,242 @@ int auto_tmpdir_fs_serialize_to_file(auto_tmpdir_fs_ref fs_info, spank_t spank_c
  */
 auto_tmpdir_fs_ref auto_tmpdir_fs_init_with_file(spank_t spank_ctxt, int argc, char* argv[], auto_tmpdir_fs_options_t options, const char *filepath, int remove_state_file);
 
+/*
+ * @function auto_tmpdir_fs_async_begin
+ *
+ * Called by the prolog just before it forks an asynchronous setup worker:
+ * creates the job's worker lock file and takes an exclusive lock on it.  The
+ * worker inherits the descriptor and the prolog closes its own copy, so the
+ * lock is released when the worker exits or dies; auto_tmpdir_fs_async_wait()
+ * uses that to stop waiting for a worker that is gone.
+ *
+ * Returns the locked descriptor, or -1 on error (the wait then falls back to
+ * its timeout).
+ */
+int auto_tmpdir_fs_async_begin(spank_t spank_ctxt, int argc, char* argv[]);
+
+/*
+ * @function auto_tmpdir_fs_async_mark_failed
+ *
+ * Called by an asynchronous prolog's setup worker that could not create the
+ * job's hierarchy, so that auto_tmpdir_fs_async_wait() returns at once
+ * rather than waiting out its timeout.
+ */
+void auto_tmpdir_fs_async_mark_failed(spank_t spank_ctxt, int argc, char* argv[]);
+
+/*
+ * @function auto_tmpdir_fs_async_wait
+ *
+ * Wait up to async_prolog_timeout seconds (default 300) for an asynchronous
+ * prolog's setup worker to write the job's state file.
+ *
+ * Returns 0 once the state file is present, EIO if the worker failed, ECHILD
+ * if the worker exited without writing either the state file or its failure
+ * marker (e.g. it was killed), or ETIMEDOUT.
+ */
+int auto_tmpdir_fs_async_wait(spank_t spank_ctxt, int argc, char* argv[]);
+
+/*
+ * @function auto_tmpdir_fs_async_clear
+ *
+ * Remove the job's failure marker and worker lock file (if any) left by an
+ * asynchronous prolog.
+ */
+void auto_tmpdir_fs_async_clear(spank_t spank_ctxt, int argc, char* argv[]);
+
+/*
+ * @function auto_tmpdir_fs_retain
+ *
+ * Retain the base directory hierarchy of a job that is being requeued so a
+ * restart of the job on this node reuses it.  Retention is governed by the
+ * requeue_retain_minutes and requeue_retain_max_bytes plugstack options.  The
+ * hierarchy is recorded in a "retained" state file alongside the job's normal
+ * state file; the other bindpoints (e.g. /dev/shm) are still removed.
+ *
+ * Returns 0 if the hierarchy was retained, in which case fs_info has been
+ * deallocated.  Otherwise fs_info is untouched and should be passed to
+ * auto_tmpdir_fs_fini() as usual.
+ */
+int auto_tmpdir_fs_retain(auto_tmpdir_fs_ref fs_info, spank_t spank_ctxt, int argc, char* argv[]);
+
+/*
+ * @function auto_tmpdir_fs_record_kept
+ *
+ * If the hierarchy is to be left in place by auto_tmpdir_fs_fini() (the job
+ * asked for --no-rm-tmpdir, or its archive or outbox flush failed), record it
+ * in a "kept" state file so that auto_tmpdir_fs_sweep_orphans() leaves it
+ * alone.  Call before auto_tmpdir_fs_fini().
+ *
+ * Returns 0 if nothing needed recording or the record was written.
+ */
+int auto_tmpdir_fs_record_kept(auto_tmpdir_fs_ref fs_info, spank_t spank_ctxt, int argc, char* argv[]);
+
+/*
+ * @function auto_tmpdir_fs_reap_retained
+ *
+ * Remove any retained hierarchies (see auto_tmpdir_fs_retain()) whose
+ * retention period has expired.
+ *
+ * Returns the number of hierarchies removed.
+ */
+int auto_tmpdir_fs_reap_retained(int argc, char* argv[]);
+
+/*
+ * @function auto_tmpdir_fs_metrics_gauges
+ *
+ * Fill-in the node-level gauges of a metrics sample:  the number of job
+ * hierarchies in use, retained, and awaiting hand-off, and the usage of the
+ * filesystems holding the local and shared prefixes and /dev/shm.  The
+ * prefix paths in the sample point to static storage.
+ */
+void auto_tmpdir_fs_metrics_gauges(int argc, char* argv[], auto_tmpdir_metrics_t *sample);
+
+/*
+ * @function auto_tmpdir_fs_admit
+ *
+ * Check the job's tmp request (request_mb, plus request_inodes or an
+ * estimate from admission_inodes_per_gb) against the free space and inodes
+ * of the filesystem holding the local prefix, less what other jobs on the
+ * node have reserved.  If admitted, the request is reserved for the job
+ * until auto_tmpdir_fs_admit_release() is called.  With admission_reroute,
+ * a job that does not fit locally is moved to the shared prefix by setting
+ * auto_tmpdir_fs_options_should_use_shared in options.
+ *
+ * The granted size is returned in granted_mb.
+ *
+ * Returns 0 if the job is admitted.
+ */
+int auto_tmpdir_fs_admit(spank_t spank_ctxt, int argc, char* argv[], auto_tmpdir_fs_options_t *options, uint64_t request_mb, uint64_t request_inodes, uint64_t *granted_mb);
+
+/*
+ * @function auto_tmpdir_fs_admit_release
+ *
+ * Drop the job's reservation, if any.
+ */
+void auto_tmpdir_fs_admit_release(spank_t spank_ctxt, int argc, char* argv[]);
+
+/*
+ * @function auto_tmpdir_fs_ipc_namespace_create
+ *
+ * Create a new IPC namespace for the job and pin it by bind-mounting it on
+ * <state_dir>/auto_tmpdir_fs-<job-id>.ipc, so that all of the job's steps on
+ * the node can join it.
+ *
+ * Returns 0 if successful.
+ */
+int auto_tmpdir_fs_ipc_namespace_create(spank_t spank_ctxt, int argc, char* argv[]);
+
+/*
+ * @function auto_tmpdir_fs_ipc_namespace_enter
+ *
+ * Move the calling process into the job's IPC namespace; processes it forks
+ * afterwards (the step's tasks) inherit it.
+ *
+ * Returns 0 if successful.
+ */
+int auto_tmpdir_fs_ipc_namespace_enter(spank_t spank_ctxt, int argc, char* argv[]);
+
+/*
+ * @function auto_tmpdir_fs_ipc_namespace_release
+ *
+ * Unpin the job's IPC namespace.  The kernel destroys it, along with any
+ * SysV shared memory, semaphores, and message queues left in it, as soon as
+ * the last of the job's processes exits.
+ */
+void auto_tmpdir_fs_ipc_namespace_release(spank_t spank_ctxt, int argc, char* argv[]);
+
+/*
+ * @function auto_tmpdir_fs_trim_prolog_enter
+ *
+ * If trimming is configured (trim_threshold), take a shared lock that marks a
+ * prolog as running on the node so that no trim is started or continued
+ * while it holds the lock.
+ *
+ * Returns the lock's file descriptor, -1 if no lock was taken.
+ */
+int auto_tmpdir_fs_trim_prolog_enter(int argc, char* argv[]);
+
+/*
+ * @function auto_tmpdir_fs_trim_prolog_exit
+ *
+ * Release the lock taken by auto_tmpdir_fs_trim_prolog_enter().
+ */
+void auto_tmpdir_fs_trim_prolog_exit(int fd);
+
+/*
+ * @function auto_tmpdir_fs_trim
+ *
+ * Add the bytes this process has removed from the local prefix's filesystem
+ * to the node's trim ledger.  Once trim_threshold bytes have been freed, at
+ * most every trim_interval minutes and only when no prolog is running, a
+ * detached process issues FITRIM across the filesystem in trim_chunk pieces.
+ *
+ * Returns 0 if successful.
+ */
+int auto_tmpdir_fs_trim(int argc, char* argv[]);
+
+/*
+ * @function auto_tmpdir_fs_zram_pool_refill
+ *
+ * If zram_pool=<N> is configured and fewer than N pre-formatted zram devices
+ * of zram_size bytes are waiting in the node's pool, a detached process at
+ * idle priority hot-adds and formats devices until the pool is full.  The
+ * same process drops records left over from before a reboot and removes
+ * pooled devices that no longer match the configuration (all of them once
+ * zram_pool is removed).
+ *
+ * Returns 0 if successful.
+ */
+int auto_tmpdir_fs_zram_pool_refill(int argc, char* argv[]);
+
+/*
+ * @typedef auto_tmpdir_fs_job_is_active_f
+ *
+ * Callback that returns non-zero if the given job is still running (or may
+ * still be using its directories) and must not be swept.
+ */
+typedef int (*auto_tmpdir_fs_job_is_active_f)(uint32_t job_id, void *context);
+
+/*
+ * @function auto_tmpdir_fs_job_is_active_in_list
+ *
+ * An auto_tmpdir_fs_job_is_active_f for a job list from slurm_load_jobs()
+ * (the context):  running, suspended, configuring, and completing jobs are
+ * active (wherever they are running; see auto_tmpdir_job_nodes_is_active()).
+ */
+int auto_tmpdir_fs_job_is_active_in_list(uint32_t job_id, void *context);
+
+/*
+ * @function auto_tmpdir_fs_sweep_orphans
+ *
+ * Remove the hierarchies left behind by jobs that ended without an epilog
+ * (node crash, slurmd killed).  State files in state_dir whose job is not
+ * active are used to reconstruct and tear down their hierarchies; bare
+ * <prefix><job-id> directories under local_prefix and the /dev/shm prefix
+ * (and this node's per-node directories under shared_prefix with
+ * sweep_shared) are removed once untouched for sweep_grace minutes.
+ * Retained and hand-off hierarchies are left to their own reapers, and kept
+ * hierarchies (see auto_tmpdir_fs_record_kept()) are never removed -- their
+ * records are dropped once the directories are gone.  Stale admission
+ * reservations, failure markers, setup worker locks, half-written state
+ * files, IPC namespace pins, I/O statistics snapshots, and outbox drain
+ * locks are dropped.
+ *
+ * is_active should reflect the job states as of the call:  entries changed
+ * after the sweep starts are never removed.
+ *
+ * Returns the number of hierarchies removed, -1 on a configuration error.
+ */
+int auto_tmpdir_fs_sweep_orphans(int argc, char* argv[], auto_tmpdir_fs_job_is_active_f is_active, void *context);
+
+/*
+ * @function auto_tmpdir_fs_set_idle_priority
+ *
+ * Drop the calling process to the idle I/O scheduling class and the lowest
+ * CPU priority, for background cleanup work.
+ */
+void auto_tmpdir_fs_set_idle_priority(void);
+
 /*
  * @function auto_tmpdir_mkdir_recurse
  *
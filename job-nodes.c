@@ -0,0 +1,163 @@
+/*
+ * job-nodes.c
+ *
+ * Deciding whether a job from slurmctld's job list is active on this node.
+ *
+ */
+
+#include "job-nodes.h"
+
+#include <errno.h>
+#include <stdio.h>
+
+/*
+ * Shared with fs-utils.c:
+ */
+const char* __auto_tmpdir_fs_get_hostname(void);
+
+/*
+ * Append a copy of name to the NULL-terminated list (skipping duplicates).
+ * Returns 0 on success:
+ */
+static int
+__auto_tmpdir_job_nodes_add(
+    auto_tmpdir_job_nodes_t     *job_nodes,
+    int                         *n_names,
+    const char                  *name
+)
+{
+    char                        **names;
+    int                         i;
+
+    for ( i = 0; i < *n_names; i++ ) if ( strcmp(job_nodes->node_names[i], name) == 0 ) return 0;
+    names = realloc(job_nodes->node_names, (*n_names + 2) * sizeof(char*));
+    if ( ! names ) return ENOMEM;
+    job_nodes->node_names = names;
+    if ( ! (names[*n_names] = strdup(name)) ) return ENOMEM;
+    names[++(*n_names)] = NULL;
+    return 0;
+}
+
+/*
+ * Do two host names match once any domain is dropped from each?
+ */
+static int
+__auto_tmpdir_job_nodes_host_matches(
+    const char                  *host,
+    const char                  *short_hostname
+)
+{
+    size_t                      host_len = strcspn(host, ".");
+
+    return (host_len == strlen(short_hostname)) && (strncmp(host, short_hostname, host_len) == 0);
+}
+
+/**/
+
+int
+auto_tmpdir_job_nodes_init(
+    auto_tmpdir_job_nodes_t     *job_nodes,
+    int                         argc,
+    char                        *argv[],
+    job_info_msg_t              *job_info
+)
+{
+    const char                  *node_name;
+    int                         n_names = 0, i;
+
+    job_nodes->job_info = job_info;
+    job_nodes->node_names = NULL;
+
+    for ( i = 0; i < argc; i++ ) {
+        if ( (strncmp(argv[i], "node_name=", 10) == 0) && argv[i][10] ) {
+            if ( __auto_tmpdir_job_nodes_add(job_nodes, &n_names, argv[i] + 10) != 0 ) goto early_exit;
+        }
+    }
+    if ( n_names > 0 ) return n_names;
+
+    /* The prolog, epilog, and their children have the node's name in SLURMD_NODENAME: */
+    if ( (node_name = getenv("SLURMD_NODENAME")) && *node_name ) {
+        if ( __auto_tmpdir_job_nodes_add(job_nodes, &n_names, node_name) != 0 ) goto early_exit;
+        return n_names;
+    }
+
+    /* Otherwise ask slurmctld which nodes are hosted here (there may be several): */
+    {
+        node_info_msg_t         *node_info = NULL;
+        const char              *hostname = __auto_tmpdir_fs_get_hostname();
+        uint32_t                j;
+
+        if ( slurm_load_node(0, &node_info, SHOW_ALL) != SLURM_SUCCESS ) {
+            slurm_info("auto_tmpdir::auto_tmpdir_job_nodes_init: unable to load node info, all jobs in an active state are taken to be active here");
+            return 0;
+        }
+        for ( j = 0; j < node_info->record_count; j++ ) {
+            node_info_t         *node = &node_info->node_array[j];
+
+            if ( ! node->name ) continue;
+            if ( ! __auto_tmpdir_job_nodes_host_matches(node->node_hostname ? node->node_hostname : node->name, hostname) ) continue;
+            if ( __auto_tmpdir_job_nodes_add(job_nodes, &n_names, node->name) != 0 ) {
+                slurm_free_node_info_msg(node_info);
+                goto early_exit;
+            }
+        }
+        slurm_free_node_info_msg(node_info);
+    }
+    if ( n_names == 0 ) slurm_info("auto_tmpdir::auto_tmpdir_job_nodes_init: no node is hosted on `%s` (set node_name=), all jobs in an active state are taken to be active here", __auto_tmpdir_fs_get_hostname());
+    return n_names;
+
+early_exit:
+    slurm_error("auto_tmpdir::auto_tmpdir_job_nodes_init: unable to allocate node names, all jobs in an active state are taken to be active here");
+    auto_tmpdir_job_nodes_fini(job_nodes);
+    return 0;
+}
+
+/**/
+
+void
+auto_tmpdir_job_nodes_fini(
+    auto_tmpdir_job_nodes_t     *job_nodes
+)
+{
+    if ( job_nodes->node_names ) {
+        char                    **names = job_nodes->node_names;
+
+        while ( *names ) free(*names++);
+        free(job_nodes->node_names);
+        job_nodes->node_names = NULL;
+    }
+}
+
+/**/
+
+int
+auto_tmpdir_job_nodes_is_active(
+    uint32_t                    job_id,
+    void                        *context
+)
+{
+    auto_tmpdir_job_nodes_t     *job_nodes = (auto_tmpdir_job_nodes_t*)context;
+    uint32_t                    i;
+
+    if ( ! auto_tmpdir_fs_job_is_active_in_list(job_id, job_nodes->job_info) ) return 0;
+    if ( ! job_nodes->node_names ) return 1;
+
+    for ( i = 0; i < job_nodes->job_info->record_count; i++ ) {
+        if ( job_nodes->job_info->job_array[i].job_id == job_id ) {
+            const char          *nodes = job_nodes->job_info->job_array[i].nodes;
+            void                *node_list;
+            char                **names;
+            int                 is_here = 0;
+
+            /* slurm.h changed hostlist_t from a pointer to a struct type, so the list is held untyped: */
+            if ( ! nodes || ! *nodes ) return 1;
+            if ( ! (node_list = slurm_hostlist_create(nodes)) ) return 1;
+            for ( names = job_nodes->node_names; *names && ! is_here; names++ ) {
+                if ( slurm_hostlist_find(node_list, *names) >= 0 ) is_here = 1;
+            }
+            slurm_hostlist_destroy(node_list);
+            return is_here;
+        }
+    }
+    return 1;
+}
@@ -0,0 +1,55 @@
+/*
+ * job-nodes.h
+ *
+ * Deciding whether a job from slurmctld's job list is active on this node.
+ *
+ */
+
+#ifndef __AUTO_TMPDIR_JOB_NODES_H__
+#define __AUTO_TMPDIR_JOB_NODES_H__
+
+#include "auto_tmpdir_config.h"
+#include "fs-utils.h"
+
+/*
+ * @typedef auto_tmpdir_job_nodes_t
+ *
+ * Context for auto_tmpdir_job_nodes_is_active():  the job list and the Slurm
+ * NodeName(s) this host answers to (NULL-terminated, or NULL if none could be
+ * determined).
+ */
+typedef struct {
+    job_info_msg_t      *job_info;
+    char                **node_names;
+} auto_tmpdir_job_nodes_t;
+
+/*
+ * @function auto_tmpdir_job_nodes_init
+ *
+ * Fill in job_nodes for the given job list.  This host's NodeName(s) are
+ * taken from the node_name=<name> directive(s), else SLURMD_NODENAME, else
+ * the nodes slurmctld reports with this host's name as their NodeHostname.
+ *
+ * Returns the number of node names found.
+ */
+int auto_tmpdir_job_nodes_init(auto_tmpdir_job_nodes_t *job_nodes, int argc, char *argv[], job_info_msg_t *job_info);
+
+/*
+ * @function auto_tmpdir_job_nodes_fini
+ *
+ * Release the node names held by job_nodes (the job list is not released).
+ */
+void auto_tmpdir_job_nodes_fini(auto_tmpdir_job_nodes_t *job_nodes);
+
+/*
+ * @function auto_tmpdir_job_nodes_is_active
+ *
+ * An auto_tmpdir_fs_job_is_active_f (the context is an initialized
+ * auto_tmpdir_job_nodes_t):  a job auto_tmpdir_fs_job_is_active_in_list()
+ * reports as active is active here unless its node list is known not to
+ * include this node.  If this node's name or the job's node list can't be
+ * determined, the job is treated as active.
+ */
+int auto_tmpdir_job_nodes_is_active(uint32_t job_id, void *context);
+
+#endif /* __AUTO_TMPDIR_JOB_NODES_H__ */
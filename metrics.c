@@ -0,0 +1,260 @@
+/*
+ * metrics.c
+ *
+ * Node-level metrics in Prometheus textfile-collector format.
+ *
+ */
+
+#include "metrics.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+/**/
+
+/*
+ * Upper bounds (in seconds) of the latency histogram buckets; the +Inf
+ * bucket is implicit:
+ */
+static const double auto_tmpdir_metrics_buckets[] = { 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60 };
+
+#define AUTO_TMPDIR_METRICS_N_BUCKETS   (sizeof(auto_tmpdir_metrics_buckets) / sizeof(auto_tmpdir_metrics_buckets[0]))
+#define AUTO_TMPDIR_METRICS_STATE_MAGIC 0x41544d31
+
+static const char *auto_tmpdir_metrics_phase_names[auto_tmpdir_metrics_phase_max] = { "prolog", "epilog" };
+static const char *auto_tmpdir_metrics_prefix_names[auto_tmpdir_metrics_prefix_max] = { "local", "shared", "dev_shm" };
+
+/*
+ * Everything that accumulates across jobs, persisted in <path>.state:
+ */
+typedef struct auto_tmpdir_metrics_state {
+    uint32_t            magic, n_buckets;
+    struct {
+        uint64_t        bucket[AUTO_TMPDIR_METRICS_N_BUCKETS + 1];
+        uint64_t        count;
+        double          sum;
+    } latency[auto_tmpdir_metrics_phase_max];
+    uint64_t            cleanup_bytes, cleanup_inodes;
+    double              cleanup_seconds;
+} auto_tmpdir_metrics_state_t;
+
+static struct {
+    uint64_t            bytes, inodes;
+    double              seconds;
+} auto_tmpdir_metrics_cleanup = { 0, 0, 0.0 };
+
+/**/
+
+const char*
+auto_tmpdir_metrics_path(
+    int             argc,
+    char            *argv[]
+)
+{
+    int             i = 0;
+
+    while ( i < argc ) {
+        if ( strncmp(argv[i], "metrics=", 8) == 0 ) {
+            if ( argv[i][8] != '/' ) {
+                slurm_error("auto_tmpdir::auto_tmpdir_metrics_path: invalid metrics in plugstack configuration (%s)", argv[i] + 8);
+                return NULL;
+            }
+            return argv[i] + 8;
+        }
+        i++;
+    }
+    return NULL;
+}
+
+/**/
+
+void
+auto_tmpdir_metrics_note_cleanup(
+    uint64_t        bytes,
+    uint64_t        inodes,
+    double          seconds
+)
+{
+    auto_tmpdir_metrics_cleanup.bytes += bytes;
+    auto_tmpdir_metrics_cleanup.inodes += inodes;
+    auto_tmpdir_metrics_cleanup.seconds += seconds;
+}
+
+/**/
+
+static int
+__auto_tmpdir_metrics_write_prom(
+    FILE                        *fptr,
+    auto_tmpdir_metrics_state_t *state,
+    auto_tmpdir_metrics_t       *sample
+)
+{
+    int                         i, j;
+
+    fprintf(fptr,
+            "# HELP auto_tmpdir_active_hierarchies Job directory hierarchies currently set up on this node.\n"
+            "# TYPE auto_tmpdir_active_hierarchies gauge\n"
+            "auto_tmpdir_active_hierarchies %llu\n",
+            (unsigned long long)sample->active_hierarchies
+        );
+    fprintf(fptr,
+            "# HELP auto_tmpdir_deferred_deletions Job directory hierarchies kept past the end of their job and awaiting reuse or removal.\n"
+            "# TYPE auto_tmpdir_deferred_deletions gauge\n"
+            "auto_tmpdir_deferred_deletions{reason=\"handoff\"} %llu\n"
+            "auto_tmpdir_deferred_deletions{reason=\"retained\"} %llu\n",
+            (unsigned long long)sample->handoff_hierarchies,
+            (unsigned long long)sample->retained_hierarchies
+        );
+    fprintf(fptr,
+            "# HELP auto_tmpdir_deferred_bytes Bytes held by job directory hierarchies awaiting reuse or removal.\n"
+            "# TYPE auto_tmpdir_deferred_bytes gauge\n"
+            "auto_tmpdir_deferred_bytes{reason=\"handoff\"} %llu\n"
+            "# HELP auto_tmpdir_deferred_inodes Inodes held by job directory hierarchies awaiting reuse or removal.\n"
+            "# TYPE auto_tmpdir_deferred_inodes gauge\n"
+            "auto_tmpdir_deferred_inodes{reason=\"handoff\"} %llu\n",
+            (unsigned long long)sample->handoff_bytes,
+            (unsigned long long)sample->handoff_inodes
+        );
+
+#define AUTO_TMPDIR_METRICS_PREFIX_GAUGE(NAME, HELP, FIELD) \
+    fprintf(fptr, "# HELP auto_tmpdir_filesystem_" NAME " " HELP "\n# TYPE auto_tmpdir_filesystem_" NAME " gauge\n"); \
+    for ( i = 0; i < auto_tmpdir_metrics_prefix_max; i++ ) { \
+        if ( sample->prefix[i].path ) fprintf(fptr, "auto_tmpdir_filesystem_" NAME "{prefix=\"%s\",path=\"%s\"} %llu\n", auto_tmpdir_metrics_prefix_names[i], sample->prefix[i].path, (unsigned long long)sample->prefix[i].FIELD); \
+    }
+    AUTO_TMPDIR_METRICS_PREFIX_GAUGE("used_bytes", "Bytes in use on the filesystem holding the prefix.", used_bytes)
+    AUTO_TMPDIR_METRICS_PREFIX_GAUGE("avail_bytes", "Bytes available on the filesystem holding the prefix.", avail_bytes)
+    AUTO_TMPDIR_METRICS_PREFIX_GAUGE("used_inodes", "Inodes in use on the filesystem holding the prefix.", used_inodes)
+    AUTO_TMPDIR_METRICS_PREFIX_GAUGE("avail_inodes", "Inodes available on the filesystem holding the prefix.", avail_inodes)
+#undef AUTO_TMPDIR_METRICS_PREFIX_GAUGE
+
+    for ( i = 0; i < auto_tmpdir_metrics_phase_max; i++ ) {
+        const char      *name = auto_tmpdir_metrics_phase_names[i];
+        uint64_t        cumulative = 0;
+
+        fprintf(fptr,
+                "# HELP auto_tmpdir_%s_duration_seconds Time spent in the auto_tmpdir %s.\n"
+                "# TYPE auto_tmpdir_%s_duration_seconds histogram\n",
+                name, name, name
+            );
+        for ( j = 0; j < AUTO_TMPDIR_METRICS_N_BUCKETS; j++ ) {
+            cumulative += state->latency[i].bucket[j];
+            fprintf(fptr, "auto_tmpdir_%s_duration_seconds_bucket{le=\"%g\"} %llu\n", name, auto_tmpdir_metrics_buckets[j], (unsigned long long)cumulative);
+        }
+        fprintf(fptr,
+                "auto_tmpdir_%s_duration_seconds_bucket{le=\"+Inf\"} %llu\n"
+                "auto_tmpdir_%s_duration_seconds_sum %.6f\n"
+                "auto_tmpdir_%s_duration_seconds_count %llu\n",
+                name, (unsigned long long)state->latency[i].count,
+                name, state->latency[i].sum,
+                name, (unsigned long long)state->latency[i].count
+            );
+    }
+
+    fprintf(fptr,
+            "# HELP auto_tmpdir_cleanup_bytes_total Bytes removed from job directories.\n"
+            "# TYPE auto_tmpdir_cleanup_bytes_total counter\n"
+            "auto_tmpdir_cleanup_bytes_total %llu\n"
+            "# HELP auto_tmpdir_cleanup_inodes_total Files and directories removed from job directories.\n"
+            "# TYPE auto_tmpdir_cleanup_inodes_total counter\n"
+            "auto_tmpdir_cleanup_inodes_total %llu\n"
+            "# HELP auto_tmpdir_cleanup_seconds_total Time spent removing job directories.\n"
+            "# TYPE auto_tmpdir_cleanup_seconds_total counter\n"
+            "auto_tmpdir_cleanup_seconds_total %.6f\n",
+            (unsigned long long)state->cleanup_bytes,
+            (unsigned long long)state->cleanup_inodes,
+            state->cleanup_seconds
+        );
+    return ferror(fptr) ? -1 : 0;
+}
+
+/**/
+
+int
+auto_tmpdir_metrics_update(
+    const char                  *prom_path,
+    auto_tmpdir_metrics_t       *sample
+)
+{
+    auto_tmpdir_metrics_state_t state;
+    char                        state_path[PATH_MAX], tmp_path[PATH_MAX];
+    int                         state_fd, tmp_fd, rc = -1, i;
+    FILE                        *fptr;
+
+    if ( (snprintf(state_path, sizeof(state_path), "%s.state", prom_path) >= sizeof(state_path))
+            || (snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", prom_path, (int)getpid()) >= sizeof(tmp_path)) ) {
+        slurm_error("auto_tmpdir::auto_tmpdir_metrics_update: metrics path too long (%s)", prom_path);
+        return -1;
+    }
+
+    /*
+     * The state file's lock serializes all updates on the node, including the
+     * replacement of the .prom file:
+     */
+    if ( (state_fd = open(state_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0 ) {
+        slurm_error("auto_tmpdir::auto_tmpdir_metrics_update: unable to open `%s` (%m)", state_path);
+        return -1;
+    }
+    if ( flock(state_fd, LOCK_EX) != 0 ) {
+        slurm_error("auto_tmpdir::auto_tmpdir_metrics_update: unable to lock `%s` (%m)", state_path);
+        close(state_fd);
+        return -1;
+    }
+    if ( (pread(state_fd, &state, sizeof(state), 0) != sizeof(state))
+            || (state.magic != AUTO_TMPDIR_METRICS_STATE_MAGIC)
+            || (state.n_buckets != AUTO_TMPDIR_METRICS_N_BUCKETS) ) {
+        memset(&state, 0, sizeof(state));
+        state.magic = AUTO_TMPDIR_METRICS_STATE_MAGIC;
+        state.n_buckets = AUTO_TMPDIR_METRICS_N_BUCKETS;
+    }
+
+    /* Fold in the sample: */
+    if ( (sample->phase >= 0) && (sample->phase < auto_tmpdir_metrics_phase_max) ) {
+        for ( i = 0; i < AUTO_TMPDIR_METRICS_N_BUCKETS; i++ ) if ( sample->duration <= auto_tmpdir_metrics_buckets[i] ) break;
+        state.latency[sample->phase].bucket[i]++;
+        state.latency[sample->phase].count++;
+        state.latency[sample->phase].sum += sample->duration;
+    }
+    state.cleanup_bytes += auto_tmpdir_metrics_cleanup.bytes;
+    state.cleanup_inodes += auto_tmpdir_metrics_cleanup.inodes;
+    state.cleanup_seconds += auto_tmpdir_metrics_cleanup.seconds;
+
+    if ( pwrite(state_fd, &state, sizeof(state), 0) != sizeof(state) ) {
+        slurm_error("auto_tmpdir::auto_tmpdir_metrics_update: unable to write `%s` (%m)", state_path);
+        goto early_exit;
+    }
+    memset(&auto_tmpdir_metrics_cleanup, 0, sizeof(auto_tmpdir_metrics_cleanup));
+
+    /*
+     * Write the new .prom file alongside the old one and rename it into place
+     * so the collector never reads a partial file:
+     */
+    if ( (tmp_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0 ) {
+        slurm_error("auto_tmpdir::auto_tmpdir_metrics_update: unable to create `%s` (%m)", tmp_path);
+        goto early_exit;
+    }
+    fchmod(tmp_fd, 0644);
+    if ( ! (fptr = fdopen(tmp_fd, "w")) ) {
+        close(tmp_fd);
+        unlink(tmp_path);
+        goto early_exit;
+    }
+    i = __auto_tmpdir_metrics_write_prom(fptr, &state, sample);
+    if ( (fclose(fptr) != 0) || (i != 0) ) {
+        slurm_error("auto_tmpdir::auto_tmpdir_metrics_update: unable to write `%s`", tmp_path);
+        unlink(tmp_path);
+        goto early_exit;
+    }
+    if ( rename(tmp_path, prom_path) != 0 ) {
+        slurm_error("auto_tmpdir::auto_tmpdir_metrics_update: unable to rename `%s` to `%s` (%m)", tmp_path, prom_path);
+        unlink(tmp_path);
+        goto early_exit;
+    }
+    rc = 0;
+
+early_exit:
+    close(state_fd);
+    return rc;
+}
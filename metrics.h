@@ -0,0 +1,84 @@
+/*
+ * metrics.h
+ *
+ * Node-level metrics in Prometheus textfile-collector format.
+ *
+ */
+
+#ifndef __AUTO_TMPDIR_METRICS_H__
+#define __AUTO_TMPDIR_METRICS_H__
+
+#include "auto_tmpdir_config.h"
+
+/*
+ * @enum auto_tmpdir_metrics_phase
+ *
+ * The plugin callback whose latency is being reported.
+ */
+enum {
+    auto_tmpdir_metrics_phase_prolog = 0,
+    auto_tmpdir_metrics_phase_epilog,
+    auto_tmpdir_metrics_phase_max
+};
+
+/*
+ * @enum auto_tmpdir_metrics_prefix
+ *
+ * The directory prefixes whose filesystems are reported.
+ */
+enum {
+    auto_tmpdir_metrics_prefix_local = 0,
+    auto_tmpdir_metrics_prefix_shared,
+    auto_tmpdir_metrics_prefix_dev_shm,
+    auto_tmpdir_metrics_prefix_max
+};
+
+/*
+ * @typedef auto_tmpdir_metrics_t
+ *
+ * A sample of the node's state plus the latency of the callback that took
+ * it.  The gauges are filled-in by auto_tmpdir_fs_metrics_gauges().
+ */
+typedef struct auto_tmpdir_metrics {
+    int                 phase;
+    double              duration;
+
+    uint64_t            active_hierarchies;
+    uint64_t            handoff_hierarchies, retained_hierarchies;
+    uint64_t            handoff_bytes, handoff_inodes;
+    struct {
+        const char      *path;
+        uint64_t        used_bytes, avail_bytes;
+        uint64_t        used_inodes, avail_inodes;
+    } prefix[auto_tmpdir_metrics_prefix_max];
+} auto_tmpdir_metrics_t;
+
+/*
+ * @function auto_tmpdir_metrics_path
+ *
+ * Returns the path of the .prom file given by the metrics=<path> option in
+ * the plugin configuration, or NULL if metrics are not enabled.
+ */
+const char* auto_tmpdir_metrics_path(int argc, char *argv[]);
+
+/*
+ * @function auto_tmpdir_metrics_note_cleanup
+ *
+ * Add to this process's tally of bytes and inodes removed and the time spent
+ * removing them; the tally is folded into the cleanup counters by the next
+ * auto_tmpdir_metrics_update().
+ */
+void auto_tmpdir_metrics_note_cleanup(uint64_t bytes, uint64_t inodes, double seconds);
+
+/*
+ * @function auto_tmpdir_metrics_update
+ *
+ * Fold the sample into the histograms and counters persisted alongside the
+ * .prom file (in <path>.state, under an exclusive lock) and atomically
+ * replace the .prom file with the result.
+ *
+ * Returns 0 on success, -1 on error (logged via slurm_error()).
+ */
+int auto_tmpdir_metrics_update(const char *prom_path, auto_tmpdir_metrics_t *sample);
+
+#endif /* __AUTO_TMPDIR_METRICS_H__ */
@@ -0,0 +1,1067 @@
+/*
+ * outbox.c
+ *
+ * Background drain of a job's outbox directory to shared storage.
+ *
+ */
+
+#include "outbox.h"
+#include "event-log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fts.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/*
+ * Shared with fs-utils.c:
+ */
+int __auto_tmpdir_fs_parse_size(const char *str, uint64_t *size);
+int __auto_tmpdir_fs_drop_privileges(uid_t u_owner, gid_t g_owner);
+const char* __auto_tmpdir_fs_get_hostname(void);
+void __auto_tmpdir_fs_detach(int keep_fd);
+
+/*
+ * The outbox is this directory in the TMPDIR bindpoint; the drainer's lock
+ * (holding its pid and, once it exits, its totals) is in state_dir:
+ */
+#define AUTO_TMPDIR_OUTBOX_NAME             "outbox"
+#define AUTO_TMPDIR_OUTBOX_LOCK_FORMAT      "auto_tmpdir_fs-%u.outbox"
+
+#define AUTO_TMPDIR_OUTBOX_DEFAULT_THREADS  4
+#define AUTO_TMPDIR_OUTBOX_MAX_THREADS      64
+#define AUTO_TMPDIR_OUTBOX_DEFAULT_TIMEOUT  300
+
+/*
+ * Bytes handed to each copy_file_range() call, and the buffer used when the
+ * filesystems can't do that (read/write fallback):
+ */
+#define AUTO_TMPDIR_OUTBOX_CHUNK            (8 << 20)
+#define AUTO_TMPDIR_OUTBOX_MIN_CHUNK        (64 << 10)
+#define AUTO_TMPDIR_OUTBOX_BUFFER           (1 << 20)
+
+#define AUTO_TMPDIR_OUTBOX_WATCH_MASK       (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+/*
+ * The outbox* directives:
+ */
+typedef struct auto_tmpdir_outbox_config {
+    const char          *prefix;
+    int                 is_per_node;
+    unsigned int        n_threads;
+    uint64_t            bw;
+    unsigned int        timeout;
+} auto_tmpdir_outbox_config_t;
+
+/*
+ * A file waiting to be copied, relative to the outbox:
+ */
+typedef struct auto_tmpdir_outbox_item {
+    struct auto_tmpdir_outbox_item  *link;
+    char                            rel_path[];
+} auto_tmpdir_outbox_item_t;
+
+/*
+ * The inotify watch on each directory of the outbox:
+ */
+typedef struct auto_tmpdir_outbox_watch {
+    int                 wd;
+    char                *rel_path;
+} auto_tmpdir_outbox_watch_t;
+
+/*
+ * State shared by the event loop and the copy workers:
+ */
+typedef struct auto_tmpdir_outbox_drain {
+    const char                  *outbox_path, *dest_path;
+    int                         inotify_fd;
+    auto_tmpdir_outbox_watch_t  *watches;
+    unsigned int                n_watches, max_watches;
+
+    pthread_mutex_t             lock;
+    pthread_cond_t              has_work;
+    auto_tmpdir_outbox_item_t   *head, *tail;
+    int                         is_closed;
+
+    uint64_t                    bw, bw_next_ns;
+    size_t                      chunk;
+
+    uint64_t                    n_files, n_bytes, n_errors;
+} auto_tmpdir_outbox_drain_t;
+
+typedef struct auto_tmpdir_outbox_worker {
+    pthread_t                   thread;
+    auto_tmpdir_outbox_drain_t  *drain;
+    int                         index;
+} auto_tmpdir_outbox_worker_t;
+
+/**/
+
+static int
+__auto_tmpdir_outbox_config(
+    int                             argc,
+    char                            *argv[],
+    auto_tmpdir_outbox_config_t     *config
+)
+{
+    int                             i;
+
+    memset(config, 0, sizeof(*config));
+    config->n_threads = AUTO_TMPDIR_OUTBOX_DEFAULT_THREADS;
+    config->timeout = AUTO_TMPDIR_OUTBOX_DEFAULT_TIMEOUT;
+    for ( i = 0; i < argc; i++ ) {
+        if ( strncmp(argv[i], "outbox=", 7) == 0 ) {
+            config->prefix = argv[i] + 7;
+            if ( *config->prefix != '/' ) {
+                slurm_error("auto_tmpdir::__auto_tmpdir_outbox_config: invalid outbox in plugstack configuration (%s)", config->prefix);
+                return -1;
+            }
+        }
+        else if ( strcmp(argv[i], "outbox_per_node") == 0 ) {
+            config->is_per_node = 1;
+        }
+        else if ( strncmp(argv[i], "outbox_threads=", 15) == 0 ) {
+            char            *end;
+            unsigned long   n = strtoul(argv[i] + 15, &end, 10);
+
+            if ( (end == argv[i] + 15) || *end || (n < 1) || (n > AUTO_TMPDIR_OUTBOX_MAX_THREADS) ) {
+                slurm_error("auto_tmpdir::__auto_tmpdir_outbox_config: invalid outbox_threads in plugstack configuration (%s)", argv[i] + 15);
+                return -1;
+            }
+            config->n_threads = n;
+        }
+        else if ( strncmp(argv[i], "outbox_bw=", 10) == 0 ) {
+            if ( __auto_tmpdir_fs_parse_size(argv[i] + 10, &config->bw) != 0 ) {
+                slurm_error("auto_tmpdir::__auto_tmpdir_outbox_config: invalid outbox_bw in plugstack configuration (%s)", argv[i] + 10);
+                return -1;
+            }
+        }
+        else if ( strncmp(argv[i], "outbox_timeout=", 15) == 0 ) {
+            char            *end;
+            unsigned long   n = strtoul(argv[i] + 15, &end, 10);
+
+            if ( (end == argv[i] + 15) || *end ) {
+                slurm_error("auto_tmpdir::__auto_tmpdir_outbox_config: invalid outbox_timeout in plugstack configuration (%s)", argv[i] + 15);
+                return -1;
+            }
+            config->timeout = n;
+        }
+    }
+    return 0;
+}
+
+/**/
+
+int
+auto_tmpdir_outbox_is_configured(
+    int                             argc,
+    char                            *argv[]
+)
+{
+    int                             i;
+
+    for ( i = 0; i < argc; i++ ) if ( strncmp(argv[i], "outbox=", 7) == 0 ) return 1;
+    return 0;
+}
+
+/**/
+
+static const char*
+__auto_tmpdir_outbox_path(
+    const char          *dir
+)
+{
+    char                *path = NULL;
+
+    if ( asprintf(&path, "%s/" AUTO_TMPDIR_OUTBOX_NAME, dir) < 0 ) return NULL;
+    return path;
+}
+
+const char*
+auto_tmpdir_outbox_get_path(
+    auto_tmpdir_fs_ref  fs_info
+)
+{
+    const char          *to_this_path;
+
+    if ( auto_tmpdir_fs_get_tmpdir_bindpoint(fs_info, NULL, &to_this_path) != 0 ) return NULL;
+    return __auto_tmpdir_outbox_path(to_this_path);
+}
+
+/**/
+
+const char*
+auto_tmpdir_outbox_get_dest(
+    int                             argc,
+    char                            *argv[],
+    uint32_t                        job_id
+)
+{
+    auto_tmpdir_outbox_config_t     config;
+    char                            *dest_path = NULL;
+    int                             rc;
+
+    if ( (__auto_tmpdir_outbox_config(argc, argv, &config) != 0) || ! config.prefix ) return NULL;
+    if ( config.is_per_node ) {
+        rc = asprintf(&dest_path, "%s%u/%s", config.prefix, job_id, __auto_tmpdir_fs_get_hostname());
+    } else {
+        rc = asprintf(&dest_path, "%s%u", config.prefix, job_id);
+    }
+    return (rc < 0) ? NULL : dest_path;
+}
+
+/**/
+
+static int
+__auto_tmpdir_outbox_lock_path(
+    int                 argc,
+    char                *argv[],
+    uint32_t            job_id,
+    char                *lock_path,
+    size_t              lock_path_len
+)
+{
+    const char          *state_dir = auto_tmpdir_fs_get_state_dir(argc, argv);
+
+    if ( ! state_dir ) return -1;
+    if ( snprintf(lock_path, lock_path_len, "%s/" AUTO_TMPDIR_OUTBOX_LOCK_FORMAT, state_dir, job_id) >= lock_path_len ) return -1;
+    return 0;
+}
+
+/**/
+
+/*
+ * Hidden files are expected to be renamed into place once complete (or are
+ * scratch files that should never leave the node):
+ */
+static int
+__auto_tmpdir_outbox_should_skip(
+    const char          *name
+)
+{
+    return (*name == '.');
+}
+
+/**/
+
+static void
+__auto_tmpdir_outbox_enqueue(
+    auto_tmpdir_outbox_drain_t  *drain,
+    const char                  *rel_path
+)
+{
+    size_t                      rel_path_len = strlen(rel_path);
+    auto_tmpdir_outbox_item_t   *item = (auto_tmpdir_outbox_item_t*)malloc(sizeof(auto_tmpdir_outbox_item_t) + rel_path_len + 1);
+
+    if ( ! item ) {
+        /* The file stays in the outbox for the epilog to drain: */
+        slurm_error("auto_tmpdir::__auto_tmpdir_outbox_enqueue: unable to queue `%s`", rel_path);
+        return;
+    }
+    item->link = NULL;
+    memcpy(item->rel_path, rel_path, rel_path_len + 1);
+    pthread_mutex_lock(&drain->lock);
+    if ( drain->tail ) drain->tail->link = item;
+    else drain->head = item;
+    drain->tail = item;
+    pthread_cond_signal(&drain->has_work);
+    pthread_mutex_unlock(&drain->lock);
+}
+
+/*
+ * Returns the next file to copy, waiting for one if necessary; NULL once the
+ * queue is closed and empty:
+ */
+static auto_tmpdir_outbox_item_t*
+__auto_tmpdir_outbox_dequeue(
+    auto_tmpdir_outbox_drain_t  *drain
+)
+{
+    auto_tmpdir_outbox_item_t   *item;
+
+    pthread_mutex_lock(&drain->lock);
+    while ( ! drain->head && ! drain->is_closed ) pthread_cond_wait(&drain->has_work, &drain->lock);
+    if ( (item = drain->head) ) {
+        if ( ! (drain->head = item->link) ) drain->tail = NULL;
+    }
+    pthread_mutex_unlock(&drain->lock);
+    return item;
+}
+
+/*
+ * No more files will be queued; with should_discard, files not yet started
+ * are dropped (they stay in the outbox):
+ */
+static void
+__auto_tmpdir_outbox_close(
+    auto_tmpdir_outbox_drain_t  *drain,
+    int                         should_discard
+)
+{
+    pthread_mutex_lock(&drain->lock);
+    while ( should_discard && drain->head ) {
+        auto_tmpdir_outbox_item_t   *item = drain->head;
+
+        drain->head = item->link;
+        free((void*)item);
+    }
+    if ( ! drain->head ) drain->tail = NULL;
+    drain->is_closed = 1;
+    pthread_cond_broadcast(&drain->has_work);
+    pthread_mutex_unlock(&drain->lock);
+}
+
+/**/
+
+/*
+ * All workers draw from one token bucket:  reserve n_bytes worth of time and
+ * sleep until the reservation starts.
+ */
+static void
+__auto_tmpdir_outbox_throttle(
+    auto_tmpdir_outbox_drain_t  *drain,
+    size_t                      n_bytes
+)
+{
+    struct timespec             now, at;
+    uint64_t                    now_ns, at_ns;
+
+    if ( ! drain->bw ) return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    now_ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+    pthread_mutex_lock(&drain->lock);
+    if ( drain->bw_next_ns < now_ns ) drain->bw_next_ns = now_ns;
+    at_ns = drain->bw_next_ns;
+    drain->bw_next_ns += (uint64_t)((double)n_bytes * 1e9 / (double)drain->bw);
+    pthread_mutex_unlock(&drain->lock);
+    if ( at_ns > now_ns ) {
+        at.tv_sec = at_ns / 1000000000ULL;
+        at.tv_nsec = at_ns % 1000000000ULL;
+        while ( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at, NULL) == EINTR );
+    }
+}
+
+/**/
+
+static int
+__auto_tmpdir_outbox_write_all(
+    int                 fd,
+    const char          *buffer,
+    size_t              buffer_len,
+    off_t               offset
+)
+{
+    while ( buffer_len ) {
+        ssize_t         n = pwrite(fd, buffer, buffer_len, offset);
+
+        if ( n < 0 ) {
+            if ( errno == EINTR ) continue;
+            return -1;
+        }
+        buffer += n;
+        buffer_len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/*
+ * Copy one file from the outbox to the destination under a temporary name,
+ * rename it into place, and remove the original.  Files still open for
+ * writing, gone already, or modified during the copy are left alone (a later
+ * close will queue them again).
+ *
+ * Returns 0 if the file was drained or skipped, -1 on error.
+ */
+static int
+__auto_tmpdir_outbox_copy(
+    auto_tmpdir_outbox_drain_t  *drain,
+    int                         worker_index,
+    const char                  *rel_path,
+    char                        *buffer
+)
+{
+    const char                  *name = strrchr(rel_path, '/');
+    int                         dir_len, in_fd, out_fd = -1, use_copy_file_range = 1, rc = -1;
+    char                        src_path[PATH_MAX], dst_path[PATH_MAX], tmp_path[PATH_MAX];
+    struct stat                 before, after;
+    off_t                       offset = 0;
+
+    name = name ? (name + 1) : rel_path;
+    dir_len = name - rel_path;
+    if ( (snprintf(src_path, sizeof(src_path), "%s/%s", drain->outbox_path, rel_path) >= sizeof(src_path))
+            || (snprintf(dst_path, sizeof(dst_path), "%s/%s", drain->dest_path, rel_path) >= sizeof(dst_path))
+            || (snprintf(tmp_path, sizeof(tmp_path), "%s/%.*s.%s.outbox-%d", drain->dest_path, dir_len, rel_path, name, worker_index) >= sizeof(tmp_path)) ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_outbox_copy: path too long for `%s`", rel_path);
+        return -1;
+    }
+
+    if ( (in_fd = open(src_path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC)) < 0 ) {
+        if ( errno == ENOENT ) return 0;
+        slurm_error("auto_tmpdir::__auto_tmpdir_outbox_copy: unable to open `%s` (%m)", src_path);
+        return -1;
+    }
+    if ( (fstat(in_fd, &before) != 0) || ! S_ISREG(before.st_mode) ) {
+        close(in_fd);
+        return 0;
+    }
+    /*
+     * A read lease can only be had if no one has the file open for writing
+     * (filesystems without leases skip the check):
+     */
+    if ( fcntl(in_fd, F_SETLEASE, F_RDLCK) == 0 ) {
+        fcntl(in_fd, F_SETLEASE, F_UNLCK);
+    } else if ( errno == EAGAIN ) {
+        close(in_fd);
+        return 0;
+    }
+
+    out_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if ( (out_fd < 0) && (errno == ENOENT) && dir_len ) {
+        /* Mirror the outbox's subdirectories as needed: */
+        char                    dir_path[PATH_MAX];
+
+        snprintf(dir_path, sizeof(dir_path), "%s/%.*s", drain->dest_path, dir_len - 1, rel_path);
+        if ( auto_tmpdir_mkdir_recurse(dir_path, 0700, 0, 0, 0) == 0 ) out_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    }
+    if ( out_fd < 0 ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_outbox_copy: unable to create `%s` (%m)", tmp_path);
+        goto early_exit;
+    }
+
+    while ( offset < before.st_size ) {
+        size_t                  n = ((before.st_size - offset) < drain->chunk) ? (before.st_size - offset) : drain->chunk;
+        ssize_t                 n_copied;
+
+        if ( use_copy_file_range ) {
+            loff_t              in_offset = offset, out_offset = offset;
+
+            __auto_tmpdir_outbox_throttle(drain, n);
+            n_copied = copy_file_range(in_fd, &in_offset, out_fd, &out_offset, n, 0);
+            if ( (n_copied < 0) && ((errno == EXDEV) || (errno == ENOSYS) || (errno == EOPNOTSUPP) || (errno == EINVAL)) ) {
+                /* Filesystems can't copy between themselves, fall back to read/write: */
+                use_copy_file_range = 0;
+                continue;
+            }
+        } else {
+            if ( n > AUTO_TMPDIR_OUTBOX_BUFFER ) n = AUTO_TMPDIR_OUTBOX_BUFFER;
+            __auto_tmpdir_outbox_throttle(drain, n);
+            n_copied = pread(in_fd, buffer, n, offset);
+            if ( (n_copied > 0) && (__auto_tmpdir_outbox_write_all(out_fd, buffer, n_copied, offset) != 0) ) n_copied = -1;
+        }
+        if ( n_copied < 0 ) {
+            if ( errno == EINTR ) continue;
+            slurm_error("auto_tmpdir::__auto_tmpdir_outbox_copy: failed copying `%s` to `%s` (%m)", src_path, tmp_path);
+            goto early_exit;
+        }
+        if ( n_copied == 0 ) break;
+        offset += n_copied;
+    }
+
+    /* The copy replaces the original, so make sure it's on the destination's storage: */
+    {
+        struct timespec         times[2] = { before.st_atim, before.st_mtim };
+
+        fchmod(out_fd, before.st_mode & 0777);
+        futimens(out_fd, times);
+    }
+    if ( (fdatasync(out_fd) != 0) || (close(out_fd) != 0) ) {
+        out_fd = -1;
+        slurm_error("auto_tmpdir::__auto_tmpdir_outbox_copy: failed writing `%s` (%m)", tmp_path);
+        goto early_exit;
+    }
+    out_fd = -1;
+
+    if ( (fstat(in_fd, &after) != 0) || (after.st_size != before.st_size) || (after.st_mtim.tv_sec != before.st_mtim.tv_sec) || (after.st_mtim.tv_nsec != before.st_mtim.tv_nsec) ) {
+        slurm_debug("auto_tmpdir::__auto_tmpdir_outbox_copy: `%s` changed while being copied, leaving it", src_path);
+        unlink(tmp_path);
+        rc = 0;
+        goto early_exit;
+    }
+    if ( rename(tmp_path, dst_path) != 0 ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_outbox_copy: unable to rename `%s` to `%s` (%m)", tmp_path, dst_path);
+        goto early_exit;
+    }
+    /* Only remove the original if it is still the file that was copied: */
+    if ( (lstat(src_path, &after) == 0) && (after.st_dev == before.st_dev) && (after.st_ino == before.st_ino)
+            && (after.st_size == before.st_size) && (after.st_mtim.tv_sec == before.st_mtim.tv_sec) && (after.st_mtim.tv_nsec == before.st_mtim.tv_nsec) ) {
+        unlink(src_path);
+    }
+    pthread_mutex_lock(&drain->lock);
+    drain->n_files++;
+    drain->n_bytes += offset;
+    pthread_mutex_unlock(&drain->lock);
+    rc = 0;
+
+early_exit:
+    if ( out_fd >= 0 ) {
+        close(out_fd);
+        unlink(tmp_path);
+    }
+    close(in_fd);
+    return rc;
+}
+
+/**/
+
+static void*
+__auto_tmpdir_outbox_worker(
+    void                        *context
+)
+{
+    auto_tmpdir_outbox_worker_t *worker = (auto_tmpdir_outbox_worker_t*)context;
+    auto_tmpdir_outbox_drain_t  *drain = worker->drain;
+    auto_tmpdir_outbox_item_t   *item;
+    char                        *buffer = (char*)malloc(AUTO_TMPDIR_OUTBOX_BUFFER);
+
+    while ( (item = __auto_tmpdir_outbox_dequeue(drain)) ) {
+        if ( ! buffer || (__auto_tmpdir_outbox_copy(drain, worker->index, item->rel_path, buffer) != 0) ) {
+            pthread_mutex_lock(&drain->lock);
+            drain->n_errors++;
+            pthread_mutex_unlock(&drain->lock);
+        }
+        free((void*)item);
+    }
+    if ( buffer ) free((void*)buffer);
+    return NULL;
+}
+
+/**/
+
+static void
+__auto_tmpdir_outbox_watch_add(
+    auto_tmpdir_outbox_drain_t  *drain,
+    const char                  *path,
+    const char                  *rel_path
+)
+{
+    int                         wd = inotify_add_watch(drain->inotify_fd, path, AUTO_TMPDIR_OUTBOX_WATCH_MASK);
+    unsigned int                i;
+    char                        *rel_path_copy;
+
+    if ( wd < 0 ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_outbox_watch_add: unable to watch `%s` (%m)", path);
+        return;
+    }
+    if ( ! (rel_path_copy = strdup(rel_path)) ) return;
+
+    /* A directory renamed within the outbox keeps its watch: */
+    for ( i = 0; i < drain->n_watches; i++ ) {
+        if ( drain->watches[i].wd == wd ) {
+            free((void*)drain->watches[i].rel_path);
+            drain->watches[i].rel_path = rel_path_copy;
+            return;
+        }
+    }
+    if ( drain->n_watches == drain->max_watches ) {
+        unsigned int                new_max = drain->max_watches ? (2 * drain->max_watches) : 16;
+        auto_tmpdir_outbox_watch_t  *new_watches = realloc(drain->watches, new_max * sizeof(auto_tmpdir_outbox_watch_t));
+
+        if ( ! new_watches ) {
+            free((void*)rel_path_copy);
+            return;
+        }
+        drain->watches = new_watches;
+        drain->max_watches = new_max;
+    }
+    drain->watches[drain->n_watches].wd = wd;
+    drain->watches[drain->n_watches].rel_path = rel_path_copy;
+    drain->n_watches++;
+}
+
+static int
+__auto_tmpdir_outbox_watch_find(
+    auto_tmpdir_outbox_drain_t  *drain,
+    int                         wd
+)
+{
+    unsigned int                i;
+
+    for ( i = 0; i < drain->n_watches; i++ ) if ( drain->watches[i].wd == wd ) return i;
+    return -1;
+}
+
+/**/
+
+/*
+ * Queue every file under the outbox directory at rel_path ("" for the outbox
+ * itself), watching each directory first when the drain has an inotify
+ * descriptor so that nothing closed during the walk is missed:
+ */
+static void
+__auto_tmpdir_outbox_scan(
+    auto_tmpdir_outbox_drain_t  *drain,
+    const char                  *rel_path
+)
+{
+    size_t                      outbox_path_len = strlen(drain->outbox_path);
+    char                        path[PATH_MAX];
+    char                        *path_argv[2] = { path, NULL };
+    FTS                         *ftsPtr;
+    FTSENT                      *ftsItem;
+
+    if ( snprintf(path, sizeof(path), "%s%s%s", drain->outbox_path, *rel_path ? "/" : "", rel_path) >= sizeof(path) ) return;
+    if ( ! (ftsPtr = fts_open(path_argv, FTS_NOCHDIR | FTS_PHYSICAL | FTS_XDEV, NULL)) ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_outbox_scan: failed to open file traversal context on `%s` (%m)", path);
+        return;
+    }
+    while ( (ftsItem = fts_read(ftsPtr)) ) {
+        const char              *item_rel_path = ftsItem->fts_path + outbox_path_len;
+
+        if ( *item_rel_path == '/' ) item_rel_path++;
+        switch ( ftsItem->fts_info ) {
+            case FTS_D:
+                if ( (ftsItem->fts_level > 0) && __auto_tmpdir_outbox_should_skip(ftsItem->fts_name) ) {
+                    fts_set(ftsPtr, ftsItem, FTS_SKIP);
+                } else if ( drain->inotify_fd >= 0 ) {
+                    __auto_tmpdir_outbox_watch_add(drain, ftsItem->fts_accpath, item_rel_path);
+                }
+                break;
+
+            case FTS_F:
+                if ( ! __auto_tmpdir_outbox_should_skip(ftsItem->fts_name) ) __auto_tmpdir_outbox_enqueue(drain, item_rel_path);
+                break;
+
+            default:
+                break;
+        }
+    }
+    fts_close(ftsPtr);
+}
+
+/**/
+
+/*
+ * Wait for files to be closed in the outbox and queue them until a signal
+ * arrives on signal_fd or the outbox is removed:
+ */
+static void
+__auto_tmpdir_outbox_watch(
+    auto_tmpdir_outbox_drain_t  *drain,
+    int                         signal_fd
+)
+{
+    char                        events[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd               fds[2] = { { drain->inotify_fd, POLLIN, 0 }, { signal_fd, POLLIN, 0 } };
+    int                         root_wd;
+
+    __auto_tmpdir_outbox_scan(drain, "");
+    if ( drain->n_watches == 0 ) return;
+    root_wd = drain->watches[0].wd;
+
+    while ( 1 ) {
+        ssize_t                 n_read;
+        char                    *p;
+
+        if ( poll(fds, 2, -1) < 0 ) {
+            if ( errno == EINTR ) continue;
+            slurm_error("auto_tmpdir::__auto_tmpdir_outbox_watch: poll failed (%m)");
+            return;
+        }
+        if ( fds[1].revents ) return;
+        if ( ! fds[0].revents ) continue;
+
+        if ( (n_read = read(drain->inotify_fd, events, sizeof(events))) <= 0 ) {
+            if ( (n_read < 0) && (errno == EINTR) ) continue;
+            slurm_error("auto_tmpdir::__auto_tmpdir_outbox_watch: failed reading inotify events (%m)");
+            return;
+        }
+        for ( p = events; p < events + n_read; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len ) {
+            const struct inotify_event  *event = (const struct inotify_event*)p;
+            int                         watch_index;
+            char                        rel_path[PATH_MAX];
+
+            if ( event->mask & IN_Q_OVERFLOW ) {
+                /* Events were lost, look at everything again: */
+                slurm_info("auto_tmpdir::__auto_tmpdir_outbox_watch: inotify queue overflowed, rescanning `%s`", drain->outbox_path);
+                __auto_tmpdir_outbox_scan(drain, "");
+                continue;
+            }
+            if ( (watch_index = __auto_tmpdir_outbox_watch_find(drain, event->wd)) < 0 ) continue;
+            if ( event->mask & IN_IGNORED ) {
+                /* The directory is gone; if it's the outbox itself, so is the job's hierarchy: */
+                if ( event->wd == root_wd ) return;
+                free((void*)drain->watches[watch_index].rel_path);
+                drain->watches[watch_index] = drain->watches[--drain->n_watches];
+                continue;
+            }
+            if ( ! event->len || __auto_tmpdir_outbox_should_skip(event->name) ) continue;
+            if ( snprintf(rel_path, sizeof(rel_path), "%s%s%s", drain->watches[watch_index].rel_path,
+                            *drain->watches[watch_index].rel_path ? "/" : "", event->name) >= sizeof(rel_path) ) {
+                continue;
+            }
+            if ( event->mask & IN_ISDIR ) {
+                if ( event->mask & (IN_CREATE | IN_MOVED_TO) ) __auto_tmpdir_outbox_scan(drain, rel_path);
+            } else if ( event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO) ) {
+                __auto_tmpdir_outbox_enqueue(drain, rel_path);
+            }
+        }
+    }
+}
+
+/**/
+
+/*
+ * Drain the outbox with n_threads copy workers.  With an inotify descriptor,
+ * files are drained as they are closed until a signal arrives on signal_fd
+ * (or the outbox is removed) and copies not yet started are abandoned;
+ * otherwise the outbox is drained once, completely.
+ */
+static void
+__auto_tmpdir_outbox_run(
+    auto_tmpdir_outbox_drain_t  *drain,
+    auto_tmpdir_outbox_config_t *config,
+    int                         signal_fd
+)
+{
+    auto_tmpdir_outbox_worker_t workers[AUTO_TMPDIR_OUTBOX_MAX_THREADS];
+    unsigned int                n_workers = 0, i;
+
+    pthread_mutex_init(&drain->lock, NULL);
+    pthread_cond_init(&drain->has_work, NULL);
+    drain->bw = config->bw;
+    drain->chunk = AUTO_TMPDIR_OUTBOX_CHUNK;
+    if ( drain->bw ) {
+        /* Keep each reservation to about an eighth of a second: */
+        drain->chunk = drain->bw / 8;
+        if ( drain->chunk < AUTO_TMPDIR_OUTBOX_MIN_CHUNK ) drain->chunk = AUTO_TMPDIR_OUTBOX_MIN_CHUNK;
+        if ( drain->chunk > AUTO_TMPDIR_OUTBOX_CHUNK ) drain->chunk = AUTO_TMPDIR_OUTBOX_CHUNK;
+    }
+
+    for ( i = 0; i < config->n_threads; i++ ) {
+        workers[n_workers].drain = drain;
+        workers[n_workers].index = i;
+        if ( pthread_create(&workers[n_workers].thread, NULL, __auto_tmpdir_outbox_worker, &workers[n_workers]) == 0 ) n_workers++;
+    }
+    if ( n_workers == 0 ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_outbox_run: unable to start any copy workers");
+        drain->n_errors++;
+    }
+    else if ( drain->inotify_fd >= 0 ) {
+        __auto_tmpdir_outbox_watch(drain, signal_fd);
+        __auto_tmpdir_outbox_close(drain, 1);
+    }
+    else {
+        __auto_tmpdir_outbox_scan(drain, "");
+        __auto_tmpdir_outbox_close(drain, 0);
+    }
+    for ( i = 0; i < n_workers; i++ ) pthread_join(workers[i].thread, NULL);
+    __auto_tmpdir_outbox_close(drain, 1);
+
+    for ( i = 0; i < drain->n_watches; i++ ) free((void*)drain->watches[i].rel_path);
+    if ( drain->watches ) free((void*)drain->watches);
+    drain->watches = NULL;
+    drain->n_watches = drain->max_watches = 0;
+}
+
+/**/
+
+static void
+__auto_tmpdir_outbox_write_status(
+    int                         lock_fd,
+    auto_tmpdir_outbox_drain_t  *drain
+)
+{
+    char                        status[128];
+    int                         n;
+
+    n = snprintf(status, sizeof(status), "%d %llu %llu %llu\n", (int)getpid(),
+                drain ? (unsigned long long)drain->n_files : 0ULL, drain ? (unsigned long long)drain->n_bytes : 0ULL, drain ? (unsigned long long)drain->n_errors : 0ULL);
+    if ( (ftruncate(lock_fd, 0) != 0) || (pwrite(lock_fd, status, n, 0) != n) ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_outbox_write_status: unable to update drainer status (%m)");
+    }
+}
+
+/*
+ * The detached drainer:  hold the lock, drop to the job owner's credentials,
+ * and drain until told to stop.
+ */
+static void
+__auto_tmpdir_outbox_drainer(
+    auto_tmpdir_outbox_config_t *config,
+    const char                  *outbox_path,
+    const char                  *dest_path,
+    int                         lock_fd,
+    uid_t                       u_owner,
+    gid_t                       g_owner
+)
+{
+    auto_tmpdir_outbox_drain_t  drain;
+    sigset_t                    stop_signals;
+    int                         signal_fd;
+
+    /*
+     * Descriptors inherited from the prolog (the trim lock, and output Slurm may
+     * be waiting to see closed) must not be held for the life of the job:
+     */
+    __auto_tmpdir_fs_detach(lock_fd);
+    __auto_tmpdir_outbox_write_status(lock_fd, NULL);
+
+    /* Lease breaks are never waited on, and stop requests arrive via signalfd: */
+    signal(SIGIO, SIG_IGN);
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGTERM);
+    sigaddset(&stop_signals, SIGINT);
+    sigprocmask(SIG_BLOCK, &stop_signals, NULL);
+    if ( (signal_fd = signalfd(-1, &stop_signals, SFD_CLOEXEC)) < 0 ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_outbox_drainer: unable to create signal descriptor (%m)");
+        _exit(1);
+    }
+    if ( __auto_tmpdir_fs_drop_privileges(u_owner, g_owner) != 0 ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_outbox_drainer: unable to drop privileges (%m)");
+        _exit(1);
+    }
+    if ( auto_tmpdir_mkdir_recurse(dest_path, 0700, 0, 0, 0) != 0 ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_outbox_drainer: unable to create `%s` (%m)", dest_path);
+        _exit(1);
+    }
+
+    memset(&drain, 0, sizeof(drain));
+    drain.outbox_path = outbox_path;
+    drain.dest_path = dest_path;
+    if ( (drain.inotify_fd = inotify_init1(IN_CLOEXEC)) < 0 ) {
+        slurm_error("auto_tmpdir::__auto_tmpdir_outbox_drainer: unable to create inotify descriptor (%m)");
+        _exit(1);
+    }
+    __auto_tmpdir_outbox_run(&drain, config, signal_fd);
+    __auto_tmpdir_outbox_write_status(lock_fd, &drain);
+    _exit(0);
+}
+
+/**/
+
+int
+auto_tmpdir_outbox_start(
+    int                             argc,
+    char                            *argv[],
+    auto_tmpdir_fs_ref              fs_info
+)
+{
+    auto_tmpdir_outbox_config_t     config;
+    const char                      *bind_this_path, *outbox_path = NULL, *dest_path = NULL;
+    char                            lock_path[PATH_MAX];
+    uint32_t                        job_id = auto_tmpdir_fs_get_job_id(fs_info);
+    int                             lock_fd = -1, rc = -1;
+    pid_t                           child_pid;
+    auto_tmpdir_event_t             event;
+
+    if ( __auto_tmpdir_outbox_config(argc, argv, &config) != 0 ) return -1;
+    if ( ! config.prefix ) return 0;
+
+    if ( auto_tmpdir_fs_get_tmpdir_bindpoint(fs_info, &bind_this_path, NULL) != 0 ) {
+        slurm_error("auto_tmpdir::auto_tmpdir_outbox_start: TMPDIR is not one of the job's bindpoints");
+        return -1;
+    }
+    if ( ! (outbox_path = __auto_tmpdir_outbox_path(bind_this_path)) || ! (dest_path = auto_tmpdir_outbox_get_dest(argc, argv, job_id)) ) {
+        slurm_error("auto_tmpdir::auto_tmpdir_outbox_start: unable to allocate outbox paths");
+        goto early_exit;
+    }
+    if ( auto_tmpdir_mkdir_recurse(outbox_path, 0700, 1, auto_tmpdir_fs_get_owner(fs_info), auto_tmpdir_fs_get_group(fs_info)) != 0 ) {
+        slurm_error("auto_tmpdir::auto_tmpdir_outbox_start: unable to create `%s`", outbox_path);
+        goto early_exit;
+    }
+    if ( __auto_tmpdir_outbox_lock_path(argc, argv, job_id, lock_path, sizeof(lock_path)) != 0 ) {
+        slurm_error("auto_tmpdir::auto_tmpdir_outbox_start: invalid state_dir in plugstack configuration");
+        goto early_exit;
+    }
+    if ( (lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0 ) {
+        slurm_error("auto_tmpdir::auto_tmpdir_outbox_start: unable to open `%s` (%m)", lock_path);
+        goto early_exit;
+    }
+    if ( flock(lock_fd, LOCK_EX | LOCK_NB) != 0 ) {
+        slurm_info("auto_tmpdir::auto_tmpdir_outbox_start: outbox of job %u is already being drained", job_id);
+        rc = 0;
+        goto early_exit;
+    }
+
+    /*
+     * The lock is inherited by the drainer, so it is held from here until the
+     * drainer exits:
+     */
+    auto_tmpdir_event_start(&event, "outbox_start", outbox_path);
+    if ( (child_pid = fork()) == 0 ) {
+        setsid();
+        if ( fork() != 0 ) _exit(0);
+        __auto_tmpdir_outbox_drainer(&config, outbox_path, dest_path, lock_fd, auto_tmpdir_fs_get_owner(fs_info), auto_tmpdir_fs_get_group(fs_info));
+    }
+    if ( child_pid < 0 ) {
+        slurm_error("auto_tmpdir::auto_tmpdir_outbox_start: unable to fork drainer (%m)");
+    } else {
+        waitpid(child_pid, NULL, 0);
+        slurm_debug("auto_tmpdir::auto_tmpdir_outbox_start: draining `%s` to `%s`", outbox_path, dest_path);
+        rc = 0;
+    }
+    auto_tmpdir_event_end(&event, (rc == 0), (rc != 0));
+
+early_exit:
+    if ( lock_fd >= 0 ) close(lock_fd);
+    if ( outbox_path ) free((void*)outbox_path);
+    if ( dest_path ) free((void*)dest_path);
+    return rc;
+}
+
+/**/
+
+/*
+ * Ask the drainer holding lock_fd to stop and wait (up to timeout seconds)
+ * for it to release the lock:
+ */
+static void
+__auto_tmpdir_outbox_stop(
+    int                 lock_fd,
+    unsigned int        timeout
+)
+{
+    time_t              deadline = time(NULL) + timeout;
+    int                 pid = 0;
+
+    while ( flock(lock_fd, LOCK_EX | LOCK_NB) != 0 ) {
+        if ( errno != EWOULDBLOCK ) return;
+        if ( pid <= 0 ) {
+            char        status[128];
+            ssize_t     n = pread(lock_fd, status, sizeof(status) - 1, 0);
+
+            /* The lock is held, so the pid is the drainer's: */
+            if ( n > 0 ) {
+                status[n] = '\0';
+                if ( (sscanf(status, "%d", &pid) == 1) && (pid > 0) ) kill(pid, SIGTERM);
+            }
+        }
+        if ( time(NULL) >= deadline ) {
+            if ( pid > 0 ) {
+                slurm_error("auto_tmpdir::__auto_tmpdir_outbox_stop: drainer %d did not stop within %u seconds, killing it", pid, timeout);
+                kill(pid, SIGKILL);
+                flock(lock_fd, LOCK_EX);
+            }
+            return;
+        }
+        usleep(100000);
+    }
+}
+
+int
+auto_tmpdir_outbox_flush(
+    int                             argc,
+    char                            *argv[],
+    auto_tmpdir_fs_ref              fs_info
+)
+{
+    auto_tmpdir_outbox_config_t     config;
+    const char                      *bind_this_path, *outbox_path = NULL, *dest_path = NULL;
+    char                            lock_path[PATH_MAX];
+    uint32_t                        job_id = auto_tmpdir_fs_get_job_id(fs_info);
+    unsigned long long              n_files = 0, n_bytes = 0;
+    int                             lock_fd, pipe_fds[2], child_status, rc = -1;
+    pid_t                           child_pid;
+    struct stat                     finfo;
+    auto_tmpdir_event_t             event;
+
+    if ( __auto_tmpdir_outbox_config(argc, argv, &config) != 0 ) return -1;
+    if ( ! config.prefix ) return 0;
+
+    /* Stop the drainer and collect its totals: */
+    if ( (__auto_tmpdir_outbox_lock_path(argc, argv, job_id, lock_path, sizeof(lock_path)) == 0)
+            && ((lock_fd = open(lock_path, O_RDWR | O_CLOEXEC)) >= 0) ) {
+        char                        status[128];
+        ssize_t                     n;
+
+        __auto_tmpdir_outbox_stop(lock_fd, config.timeout);
+        if ( (n = pread(lock_fd, status, sizeof(status) - 1, 0)) > 0 ) {
+            status[n] = '\0';
+            sscanf(status, "%*d %llu %llu", &n_files, &n_bytes);
+        }
+        unlink(lock_path);
+        close(lock_fd);
+    }
+
+    if ( auto_tmpdir_fs_get_tmpdir_bindpoint(fs_info, &bind_this_path, NULL) != 0 ) return 0;
+    if ( ! (outbox_path = __auto_tmpdir_outbox_path(bind_this_path)) || ! (dest_path = auto_tmpdir_outbox_get_dest(argc, argv, job_id)) ) {
+        slurm_error("auto_tmpdir::auto_tmpdir_outbox_flush: unable to allocate outbox paths");
+        goto early_exit;
+    }
+    if ( lstat(outbox_path, &finfo) != 0 ) {
+        rc = 0;
+        goto early_exit;
+    }
+
+    /*
+     * The remainder is copied with the job owner's credentials, so files only
+     * land where the owner could have put them:
+     */
+    if ( pipe2(pipe_fds, O_CLOEXEC) != 0 ) {
+        slurm_error("auto_tmpdir::auto_tmpdir_outbox_flush: unable to create pipe (%m)");
+        goto early_exit;
+    }
+    auto_tmpdir_event_start(&event, "outbox_flush", outbox_path);
+    if ( (child_pid = fork()) == 0 ) {
+        auto_tmpdir_outbox_drain_t  drain;
+        unsigned long long          totals[3];
+
+        close(pipe_fds[0]);
+        signal(SIGIO, SIG_IGN);
+        if ( __auto_tmpdir_fs_drop_privileges(auto_tmpdir_fs_get_owner(fs_info), auto_tmpdir_fs_get_group(fs_info)) != 0 ) _exit(126);
+        if ( auto_tmpdir_mkdir_recurse(dest_path, 0700, 0, 0, 0) != 0 ) {
+            slurm_error("auto_tmpdir::auto_tmpdir_outbox_flush: unable to create `%s` (%m)", dest_path);
+            _exit(1);
+        }
+        memset(&drain, 0, sizeof(drain));
+        drain.outbox_path = outbox_path;
+        drain.dest_path = dest_path;
+        drain.inotify_fd = -1;
+        __auto_tmpdir_outbox_run(&drain, &config, -1);
+        totals[0] = drain.n_files;
+        totals[1] = drain.n_bytes;
+        totals[2] = drain.n_errors;
+        if ( write(pipe_fds[1], totals, sizeof(totals)) != sizeof(totals) ) _exit(1);
+        _exit(drain.n_errors ? 1 : 0);
+    }
+    close(pipe_fds[1]);
+    if ( child_pid < 0 ) {
+        slurm_error("auto_tmpdir::auto_tmpdir_outbox_flush: unable to fork (%m)");
+        close(pipe_fds[0]);
+        auto_tmpdir_event_end(&event, 0, 1);
+        goto keep_hierarchy;
+    } else {
+        unsigned long long          totals[3];
+
+        if ( read(pipe_fds[0], totals, sizeof(totals)) == sizeof(totals) ) {
+            n_files += totals[0];
+            n_bytes += totals[1];
+            auto_tmpdir_event_end(&event, totals[0], totals[2]);
+        } else {
+            auto_tmpdir_event_end(&event, 0, 1);
+        }
+        close(pipe_fds[0]);
+        while ( waitpid(child_pid, &child_status, 0) < 0 ) {
+            if ( errno != EINTR ) {
+                child_status = -1;
+                break;
+            }
+        }
+    }
+    slurm_info("auto_tmpdir::auto_tmpdir_outbox_flush: job %u drained %llu files (%llu bytes) to `%s`", job_id, n_files, n_bytes, dest_path);
+    if ( WIFEXITED(child_status) && (WEXITSTATUS(child_status) == 0) ) {
+        rc = 0;
+        goto early_exit;
+    }
+
+keep_hierarchy:
+    /* Don't lose the job's data if it could not be drained: */
+    slurm_error("auto_tmpdir::auto_tmpdir_outbox_flush: files left in `%s` could not be drained, keeping the job's directories", outbox_path);
+    auto_tmpdir_fs_set_no_delete(fs_info);
+
+early_exit:
+    if ( outbox_path ) free((void*)outbox_path);
+    if ( dest_path ) free((void*)dest_path);
+    return rc;
+}
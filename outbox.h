@@ -0,0 +1,68 @@
+/*
+ * outbox.h
+ *
+ * Background drain of a job's outbox directory to shared storage.
+ *
+ */
+
+#ifndef __AUTO_TMPDIR_OUTBOX_H__
+#define __AUTO_TMPDIR_OUTBOX_H__
+
+#include "auto_tmpdir_config.h"
+#include "fs-utils.h"
+
+/*
+ * @function auto_tmpdir_outbox_is_configured
+ *
+ * Returns non-zero if the outbox=<prefix> directive is present in the plugin
+ * configuration.
+ */
+int auto_tmpdir_outbox_is_configured(int argc, char *argv[]);
+
+/*
+ * @function auto_tmpdir_outbox_get_path
+ *
+ * Returns the path of the job's outbox as seen by its steps (the outbox
+ * directory in the TMPDIR bindpoint), or NULL if TMPDIR is not one of the
+ * hierarchy's bindpoints.  Release the path with free().
+ */
+const char* auto_tmpdir_outbox_get_path(auto_tmpdir_fs_ref fs_info);
+
+/*
+ * @function auto_tmpdir_outbox_get_dest
+ *
+ * Returns the directory on shared storage the job's outbox drains to,
+ * <prefix><job-id> (with /<nodename> appended under outbox_per_node), or
+ * NULL if the outbox is not configured.  Release the path with free().
+ */
+const char* auto_tmpdir_outbox_get_dest(int argc, char *argv[], uint32_t job_id);
+
+/*
+ * @function auto_tmpdir_outbox_start
+ *
+ * Create the job's outbox directory and start a detached drainer that runs
+ * with the job owner's credentials:  each file closed after writing (or
+ * renamed) into the outbox is copied to the destination with
+ * copy_file_range() by a pool of outbox_threads workers, limited to
+ * outbox_bw bytes per second overall, and removed from the outbox once the
+ * copy is in place.  The drainer holds a lock on
+ * <state_dir>/auto_tmpdir_fs-<job-id>.outbox until it exits.
+ *
+ * Returns 0 on success.  Any errors will be logged via slurm_error().
+ */
+int auto_tmpdir_outbox_start(int argc, char *argv[], auto_tmpdir_fs_ref fs_info);
+
+/*
+ * @function auto_tmpdir_outbox_flush
+ *
+ * Stop the job's drainer (waiting up to outbox_timeout seconds for its
+ * copies in progress before killing it) and drain whatever remains in the
+ * outbox.  If files could not be drained, the hierarchy is marked to be
+ * kept when auto_tmpdir_fs_fini() is called.
+ *
+ * Returns 0 if the outbox is empty (or absent) afterwards.  Any errors will
+ * be logged via slurm_error().
+ */
+int auto_tmpdir_outbox_flush(int argc, char *argv[], auto_tmpdir_fs_ref fs_info);
+
+#endif /* __AUTO_TMPDIR_OUTBOX_H__ */